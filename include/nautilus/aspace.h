@@ -63,6 +63,18 @@ typedef struct nk_aspace_protections {
 } nk_aspace_protection_t;
 
 
+// A region can be backed by a pager instead of by a run of
+// physical addresses, in which case pa_start is ignored.  When an
+// access to a not-yet-mapped 4 KB page of the region occurs, the
+// implementation calls fault() with the page-aligned virtual
+// address and gets back the 4 KB physical page to map there.
+// fault() may block, so implementations call it with interrupts
+// enabled if the faulting context had them enabled.
+typedef struct nk_aspace_pager {
+    int   (*fault)(void *state, void *va, int write, void **pa);
+    void  *state;
+} nk_aspace_pager_t;
+
 // Although a region is defined to map a run of virtual addresses
 // to a run of physical addresses, this is an abstraction.
 // An aspace implementation uses this as the header for its
@@ -72,6 +84,7 @@ typedef struct nk_aspace_region {
     void       *pa_start;
     uint64_t    len_bytes;
     nk_aspace_protection_t  protect;
+    nk_aspace_pager_t      *pager;   // null => pa_start backs the region
 } nk_aspace_region_t;
 
 
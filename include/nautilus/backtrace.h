@@ -40,7 +40,8 @@ extern "C" {
 
 struct nk_regs;
 void __do_backtrace(void **, unsigned);
-void nk_dump_mem(void *, ulong_t);
+int  nk_backtrace_collect(void ** fp, void ** out, int max);
+void nk_dump_mem(const void *, ulong_t);
 void nk_stack_dump(ulong_t);
 void nk_print_regs(struct nk_regs * r);
 
@@ -33,6 +33,28 @@ extern "C" {
 
 typedef struct nk_barrier nk_barrier_t;
 
+/*
+ * Barrier algorithms
+ *
+ * CENTRAL        - one shared counter and a sense-reversing release
+ *                  flag.  Cheapest for a handful of threads.
+ * TREE           - combining tree whose leaves hold the threads of a
+ *                  NUMA domain and whose upper levels combine domains.
+ *                  Arrivals and release spinning stay mostly within a
+ *                  domain's caches.
+ * DISSEMINATION  - log2(n) rounds of pairwise signaling, with no
+ *                  shared counter at all.  Requires nk_barrier_wait_id.
+ *
+ * Tree and dissemination barriers are fastest when each thread passes
+ * a stable id in [0, count) to nk_barrier_wait_id, with ids that are
+ * close together running on nearby CPUs (as OpenMP thread numbers do).
+ */
+typedef enum {
+    NK_BARRIER_CENTRAL = 0,
+    NK_BARRIER_TREE,
+    NK_BARRIER_DISSEMINATION,
+} nk_barrier_type_t;
+
 struct nk_barrier {
     spinlock_t lock; /* SLOW */
     
@@ -40,16 +62,22 @@ struct nk_barrier {
     unsigned init_count;
 
     uint8_t  active; /* used for core barriers */
+    uint8_t  type;   /* nk_barrier_type_t */
+    uint8_t  pad0[2];
+
+    void    *impl;   /* tree or dissemination state */
 
-    uint8_t pad[52];
+    uint8_t pad[40];
 
     /* this is on another cache line (Assuming 64b) */
     volatile unsigned notify;
 } __attribute__ ((packed)) __attribute((aligned(64)));
 
 int nk_barrier_init (nk_barrier_t * barrier, uint32_t count);
+int nk_barrier_init_type (nk_barrier_t * barrier, uint32_t count, nk_barrier_type_t type);
 int nk_barrier_destroy (nk_barrier_t * barrier);
 int nk_barrier_wait (nk_barrier_t * barrier);
+int nk_barrier_wait_id (nk_barrier_t * barrier, uint32_t id);
 void nk_barrier_test(void);
 
 /* CORE barriers */
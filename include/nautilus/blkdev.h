@@ -48,6 +48,9 @@ struct nk_block_dev_int {
     int (*get_characteristics)(void *state, struct nk_block_dev_characteristics *c);
     int (*read_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
     int (*write_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
+    // memory-resident devices can return a stable kernel pointer to the
+    // given blocks so that callers can avoid copying them
+    void *(*map_blocks)(void *state, uint64_t blocknum, uint64_t count);
 };
 
 
@@ -83,6 +86,9 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		       void (*callback)(nk_block_dev_status_t status, void *state), 
 		       void *state);
 
+// returns null if the device cannot expose the blocks in memory
+void *nk_block_dev_map(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count);
+
 
 
 #endif
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __BOOTTIME_H__
+#define __BOOTTIME_H__
+
+#include <nautilus/naut_types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Boot phase timing
+//
+// The boot path marks the end of each phase with nk_boot_phase().
+// The time from the previous mark (the first mark only starts the
+// clock) is charged to the named phase.  Marks are raw TSC reads, so
+// this works before any timer is calibrated; they are converted to
+// time when the report is printed.
+//
+#define NK_BOOT_PHASE_MAX 32
+
+void nk_boot_phase(char *name);
+void nk_boot_phase_report(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
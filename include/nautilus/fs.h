@@ -56,6 +56,9 @@ struct nk_fs_int {
     ssize_t  (*read_file)(void *state, void *file, void *dest, off_t offset, size_t n);
     ssize_t  (*write_file)(void *state, void *file, void *src, off_t offset, size_t n);
     void  (*close_file)(void *state, void *file);
+    // optional - kernel pointer to n contiguous bytes of file data
+    // held in memory by the underlying device, or null
+    void *(*map_file)(void *state, void *file, off_t offset, size_t n);
 };
 
 // This is the class for a filesystem.  It should be the first
@@ -118,6 +121,78 @@ ssize_t    nk_fs_read(nk_fs_fd_t fd, void *buf, size_t len);
 ssize_t    nk_fs_write(nk_fs_fd_t fd, void *buf, size_t len);
 int        nk_fs_close(nk_fs_fd_t fd);
 
+//
+// Page cache and memory-mapped files
+//
+// Each open file has a lazily-built cache of its 4 KB pages.  Reads
+// through an fd with a cache are served from it, and writes through
+// the fd update it.  Caches are per open file, so two opens of the same
+// file are not coherent with each other.
+//
+// nk_fs_page_cache_get returns the kernel address of the cached page
+// holding the given file page, filling it from the filesystem if
+// needed.  The page stays valid until the fd is closed and all of its
+// mappings are removed.
+//
+#define NK_FS_PAGE_SIZE 4096UL
+
+void      *nk_fs_page_cache_get(nk_fs_fd_t fd, uint64_t page_num);
+
+// Map a file into the current thread's address space.  Pages are
+// faulted in from the page cache on first touch.  Writable mappings
+// are shared - dirty pages reach the file on nk_fs_msync or
+// nk_fs_munmap.  Offset must be page-aligned.  Requires that the
+// thread is in an address space that supports pager-backed regions.
+#define NK_FS_PROT_READ  1
+#define NK_FS_PROT_WRITE 2
+void      *nk_fs_mmap(nk_fs_fd_t fd, void *addr, size_t len, int prot, off_t offset);
+int        nk_fs_msync(void *addr, size_t len);
+int        nk_fs_munmap(void *addr, size_t len);
+
+// Pointer directly to the file's bytes [offset, offset+len) if they are
+// contiguous in a memory-resident device (e.g., a ramdisk), else null.
+// The memory belongs to the filesystem and must not be written.
+void      *nk_fs_map_direct(nk_fs_fd_t fd, off_t offset, size_t len);
+
+
+//
+// Dentry and inode caches shared by the filesystem drivers
+//
+// The dentry cache maps (fs, parent id, component name) to a child id,
+// where the ids are whatever the driver uses to name its objects
+// (inode numbers for ext2, cluster/entry locations for fat32).  It
+// also records negative entries so that repeated lookups of missing
+// names do not hit the device.  The driver is responsible for
+// invalidating entries when it creates or removes names.
+//
+// The inode cache holds a copy of a driver's on-disk inode (or
+// equivalent) keyed by (fs, id).   It is write-through - the driver
+// updates it whenever it writes the object back.
+//
+#define NK_FS_DCACHE_NAME_LEN  64
+
+#define NK_FS_DCACHE_MISS      0
+#define NK_FS_DCACHE_HIT       1
+#define NK_FS_DCACHE_NEGATIVE  2
+
+int  nk_fs_dcache_lookup(struct nk_fs *fs, uint64_t parent, char *name, uint64_t *child);
+void nk_fs_dcache_insert(struct nk_fs *fs, uint64_t parent, char *name, uint64_t child);
+void nk_fs_dcache_insert_negative(struct nk_fs *fs, uint64_t parent, char *name);
+void nk_fs_dcache_invalidate(struct nk_fs *fs, uint64_t parent, char *name);
+// drop every entry whose parent is the given (e.g., removed) directory
+void nk_fs_dcache_invalidate_dir(struct nk_fs *fs, uint64_t parent);
+
+int  nk_fs_icache_lookup(struct nk_fs *fs, uint64_t id, void *dest, size_t size);
+void nk_fs_icache_insert(struct nk_fs *fs, uint64_t id, void *src, size_t size);
+void nk_fs_icache_invalidate(struct nk_fs *fs, uint64_t id);
+
+// drop everything cached for the filesystem
+void nk_fs_cache_flush(struct nk_fs *fs);
+
+int  nk_fs_cache_init(void);
+int  nk_fs_cache_deinit(void);
+void nk_fs_cache_dump(void);
+
 
 void test_fs(void);
 void init_fs(void);
@@ -27,14 +27,44 @@
 #include <nautilus/list.h>
 #include <nautilus/waitqueue.h>
 
+//
+// A future moves from IN_PROGRESS to DONE exactly once, by a CAS in
+// nk_future_finish().  Waiters spin briefly and then sleep on one of a
+// small set of wait queues shared by all futures (hashed by address),
+// which the finisher wakes only if someone is actually asleep.
+//
+// Callbacks can be attached to a future and are run by the finisher,
+// or immediately if the future is already done.  nk_future_then()
+// and the when_all/when_any combinators are built on them.
+//
+// Free futures are kept in per-CPU pools that only their own CPU
+// touches, with interrupts off, so allocation needs no locks.
+//
+
+struct nk_future;
+
+typedef struct nk_future_cb {
+    struct nk_future_cb *next;
+    // called once, with the completed future's result
+    void (*fn)(struct nk_future_cb *cb, void *result);
+} nk_future_cb_t;
+
 typedef struct nk_future {
     enum {
 	NK_FUTURE_FREE=0,
 	NK_FUTURE_IN_PROGRESS,
-	NK_FUTURE_DONE
+	NK_FUTURE_DONE,
+	NK_FUTURE_FINISHING        // won the race to finish, not yet done
     }                state;
     void            *result;                   
-    nk_wait_queue_t *waitqueue;    // only used if there can be blocking waits
+    nk_future_cb_t * volatile cbs; // run on completion
+    
+    // used when this future is the result of nk_future_then()
+    nk_future_cb_t   then_cb;
+    void          *(*then_fn)(void *result, void *arg);
+    void            *then_arg;
+    uint64_t         then_flags;
+    
     struct list_head node;         // used by allocator when future is free,
                                    // can be used by user otherwise
 } nk_future_t;
@@ -53,12 +83,13 @@ void          nk_future_free(nk_future_t *f);
 
 // user can recycle a future themselves, if they are smarter than
 // the allocator
-// there must be no waiters in the wait queue, nor racing, before this 
+// there must be no waiters nor callbacks, nor racing, before this 
 static inline int nk_future_recycle(nk_future_t *f)
 {
     FU_DEBUG("recycle %p\n",f);
-    f->state = NK_FUTURE_IN_PROGRESS;
     f->result = 0;
+    f->cbs = 0;
+    f->state = NK_FUTURE_IN_PROGRESS;
     return 0;
 }
 
@@ -68,13 +99,14 @@ static inline int nk_future_recycle(nk_future_t *f)
 // > 0 => not done yet
 static inline int nk_future_check(volatile nk_future_t *f, void **result)
 {
-    FU_DEBUG("check %p (%s) state=%d\n",f,f->waitqueue->name,f->state);
+    FU_DEBUG("check %p state=%d\n",f,f->state);
     switch (f->state) {
     case NK_FUTURE_DONE:
 	*result = f->result;
 	return 0;
 	break;
     case NK_FUTURE_IN_PROGRESS:
+    case NK_FUTURE_FINISHING:
 	return 1;
 	break;
     default:
@@ -83,15 +115,26 @@ static inline int nk_future_check(volatile nk_future_t *f, void **result)
     }
 }
 
-static inline void nk_future_finish(nk_future_t *f, void *result)
-{
-    FU_DEBUG("finish %p\n",f);
-    
-    f->result = result;
-    f->state = NK_FUTURE_DONE;
-    // probably barrier here
-    nk_wait_queue_wake_all(f->waitqueue);
-}
+// complete the future, waking its waiters and running its callbacks
+// returns -1 if it was not in progress
+int nk_future_finish(nk_future_t *f, void *result);
+
+// Run cb->fn when the future completes, or now if it already has.
+// The callback runs in the context of whoever finishes the future
+void nk_future_add_callback(nk_future_t *f, nk_future_cb_t *cb);
+
+// Return a future that completes with fn(result of f, arg).  By
+// default fn runs in the finisher's context, so it should be short;
+// with NK_FUTURE_THEN_TASK it is queued as a detached nk_task
+#define NK_FUTURE_THEN_INLINE 0
+#define NK_FUTURE_THEN_TASK   1
+nk_future_t * nk_future_then(nk_future_t *f, void *(*fn)(void *result, void *arg), void *arg, uint64_t flags);
+
+// Return a future that completes once all n futures have (result 0),
+// or once any one has (result is the index of the first to complete).
+// The futures must not be freed before they complete
+nk_future_t * nk_future_when_all(int n, nk_future_t **f);
+nk_future_t * nk_future_when_any(int n, nk_future_t **f);
 
 typedef enum {
     NK_FUTURE_WAIT_SPIN,
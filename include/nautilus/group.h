@@ -81,4 +81,10 @@ int nk_thread_group_delete(nk_thread_group_t *group);
 // return the size of a group
 uint64_t nk_thread_group_get_size(nk_thread_group_t *group);
 
+// sum the per-thread counters (see nk_thread_pmc_read) of the current
+// members that count the same events as the first counting member
+// (others are skipped) - returns the number of counts, or -1 if no
+// member is counting
+int nk_thread_group_pmc_read(nk_thread_group_t *group, uint64_t *counts, int num);
+
 #endif /* _GROUP_H */
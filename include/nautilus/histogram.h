@@ -0,0 +1,156 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <nautilus/naut_types.h>
+#include <nautilus/list.h>
+#include <nautilus/percpu.h>
+#include <nautilus/cpu.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Log-bucketed latency histograms
+//
+// Values below 2^NK_HIST_SUB_BITS get their own bucket.  Above that,
+// each power of two is split into 2^NK_HIST_SUB_BITS equal buckets,
+// so a bucket's width is at most 1/8 of its value.  This covers the
+// whole 64 bit range in a fixed 4 KB per CPU, with no configuration.
+//
+// Each CPU records into its own buckets with atomic adds, so recording
+// is lock-free and safe from interrupt context.  Readers merge the CPUs
+// into a struct nk_hist_data, which can be merged further.
+//
+#define NK_HIST_SUB_BITS  3
+#define NK_HIST_SUB       (1UL << NK_HIST_SUB_BITS)
+#define NK_HIST_BUCKETS   ((64 - NK_HIST_SUB_BITS + 1) * NK_HIST_SUB)
+
+#define NK_HIST_NAME_LEN  32
+
+struct nk_hist_data {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[NK_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct nk_hist {
+    char                 name[NK_HIST_NAME_LEN];
+    uint64_t             flags;
+#define NK_HIST_CYCLES   1     // values are TSC cycles, print them as ns
+    int                  num_cpus;
+    struct nk_hist_data *cpu;  // one per CPU
+    struct list_head     hist_list_node;
+};
+
+
+static inline unsigned
+nk_hist_bucket (uint64_t val)
+{
+    unsigned e;
+
+    if (val < NK_HIST_SUB) {
+        return val;
+    }
+
+    e = 63 - __builtin_clzl(val);
+
+    return (e - NK_HIST_SUB_BITS + 1) * NK_HIST_SUB
+        + ((val >> (e - NK_HIST_SUB_BITS)) & (NK_HIST_SUB - 1));
+}
+
+
+static inline void
+nk_hist_record (struct nk_hist *h, uint64_t val)
+{
+    struct nk_hist_data *d;
+    uint64_t cur;
+
+    if (!h) {
+        return;
+    }
+
+    d = &h->cpu[my_cpu_id()];
+
+    __sync_fetch_and_add(&d->buckets[nk_hist_bucket(val)], 1);
+    __sync_fetch_and_add(&d->count, 1);
+    __sync_fetch_and_add(&d->sum, val);
+
+    while (val < (cur = d->min) && !__sync_bool_compare_and_swap(&d->min, cur, val)) { }
+    while (val > (cur = d->max) && !__sync_bool_compare_and_swap(&d->max, cur, val)) { }
+}
+
+
+// Create and register a histogram.  Must be called after all CPUs are up
+struct nk_hist *nk_hist_create(char *name, uint64_t flags);
+void            nk_hist_destroy(struct nk_hist *h);
+struct nk_hist *nk_hist_find(char *name);
+
+void            nk_hist_clear(struct nk_hist *h);
+
+// Sum all CPUs of h into out (which is first zeroed)
+void            nk_hist_merge(struct nk_hist *h, struct nk_hist_data *out);
+// Add src into dest
+void            nk_hist_add(struct nk_hist_data *dest, struct nk_hist_data *src);
+// Value at the given quantile, expressed as parts per million
+// (e.g., 999000 for p999).  The midpoint of the bucket is returned.
+uint64_t        nk_hist_quantile(struct nk_hist_data *d, uint64_t ppm);
+
+void            nk_hist_dump(struct nk_hist *h);
+void            nk_hist_dump_all(void);
+
+int             nk_hist_init(void);
+
+
+//
+// Probes on kernel hot paths, created by nk_hist_init when profiling
+// is configured in.  All are in TSC cycles.
+//
+extern struct nk_hist *nk_hist_malloc;        // malloc() calls
+extern struct nk_hist *nk_hist_free;          // free() calls
+extern struct nk_hist *nk_hist_irq;           // interrupt handling
+extern struct nk_hist *nk_hist_thr_switch;    // context switch path
+extern struct nk_hist *nk_hist_wakeup;        // awaken to switch-in
+extern struct nk_hist *nk_hist_xcall;         // xcall post to execution
+extern struct nk_hist *nk_hist_blk_read;      // blocking block reads
+extern struct nk_hist *nk_hist_blk_write;     // blocking block writes
+extern struct nk_hist *nk_hist_net_send;      // blocking packet sends
+
+#ifdef NAUT_CONFIG_PROFILE
+#define NK_HIST_PROBE_START(t)    uint64_t t = rdtsc()
+#define NK_HIST_PROBE_END(h, t)   nk_hist_record(h, rdtsc() - (t))
+#else
+#define NK_HIST_PROBE_START(t)
+#define NK_HIST_PROBE_END(h, t)
+#endif
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,6 +23,7 @@
 #ifndef __INSTRUMENT_H__
 #define __INSTRUMENT_H__
 
+#include <nautilus/naut_types.h>
 
 #ifdef __cplusplus 
 extern "C" {
@@ -30,6 +31,11 @@ extern "C" {
 
 #define INSTR_CAL_LOOPS 1000
 
+// slots in each CPU's function table (power of two)
+#define NK_PROFILE_TABLE_SIZE  1024
+// frames tracked per thread; deeper calls are counted but not timed
+#define NK_PROFILE_STACK_DEPTH 64
+
 #ifdef NAUT_CONFIG_PROFILE
 #define NK_PROFILE_ENTRY() nk_profile_func_enter(__func__)
 #define NK_PROFILE_ENTRY_NAME(s) nk_profile_func_enter(#s)
@@ -50,46 +56,54 @@ extern "C" {
 #define NK_FREE_PROF_EXIT() 
 #endif
 
-struct nk_hashtable;
-
-struct malloc_data {
+// Summary of one latency probe.  The full distribution is kept in
+// the matching histogram (see histogram.h).  Times are TSC cycles.
+struct nk_instr_lat {
     uint64_t count;
     uint64_t start_count;
-    uint64_t avg_latency;
-    uint64_t max_latency;
-    uint64_t min_latency;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+    uint64_t min_cycles;
 };
 
-struct free_data {
-    uint64_t count;
-    uint64_t start_count;
-    uint64_t avg_latency;
-    uint64_t max_latency;
-    uint64_t min_latency;
+//
+// Function profiles live in a fixed, per-CPU open-addressing table
+// keyed by an address - the __func__ pointer for the NK_PROFILE_*
+// macros, or the function itself for -finstrument-functions hooks.
+// Slots are claimed with a compare-and-swap so interrupt handlers on
+// the same CPU can insert safely.  All times are in TSC cycles.
+//
+struct nk_profile_func {
+    const void * key;
+    const char * name;      // null for -finstrument-functions entries
+    uint64_t call_count;
+    uint64_t incl_cycles;   // includes profiled callees
+    uint64_t excl_cycles;   // excludes profiled callees
+    uint64_t max_cycles;
+    uint64_t min_cycles;
 };
 
-struct irq_data {
-    uint64_t count;
-    uint64_t start_count;
-    uint64_t avg_latency;
-    uint64_t max_latency;
-    uint64_t min_latency;
+// Each thread keeps a shadow call stack so that exits can be matched
+// to entries and callee time charged back to the caller
+struct nk_profile_frame {
+    const void * key;
+    const char * name;
+    uint64_t start;
+    uint64_t child;         // cycles spent in profiled callees
 };
 
-struct thread_switch_data {
-    uint64_t count;
-    uint64_t start_count;
-    uint64_t avg_latency;
-    uint64_t max_latency;
-    uint64_t min_latency;
+struct nk_profile_stack {
+    int depth;
+    struct nk_profile_frame frames[NK_PROFILE_STACK_DEPTH];
 };
 
 struct nk_instr_data {
-    struct nk_hashtable * func_htable;
-    struct irq_data irqstat;
-    struct malloc_data mallocstat;
-    struct free_data freestat;
-    struct thread_switch_data thr_switch;
+    struct nk_profile_func funcs[NK_PROFILE_TABLE_SIZE];
+    uint64_t func_overflow; // calls dropped because the table was full
+    struct nk_instr_lat irqstat;
+    struct nk_instr_lat mallocstat;
+    struct nk_instr_lat freestat;
+    struct nk_instr_lat thr_switch;
 };
 
 
@@ -110,6 +124,8 @@ void nk_instrument_end(void);
 void nk_instrument_query(void);
 void nk_instrument_clear(void);
 void nk_instrument_calibrate(unsigned loops);
+// print the n functions with the most exclusive time, summed over CPUs
+void nk_instrument_top(unsigned n);
 
 
 #ifdef __cplusplus
@@ -49,5 +49,9 @@ struct nk_link_info {
 int nk_link_prog (struct nk_link_info * linfo, struct nk_prog_info * prog);
 int nk_linker_init (struct naut_info * naut);
 
+// Name of the kernel symbol containing addr, with the symbol's start
+// address in *start, or null if there is no kernel symbol table
+char * nk_link_lookup_addr (uint64_t addr, uint64_t * start);
+
 
 #endif
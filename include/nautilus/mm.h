@@ -66,6 +66,8 @@ ulong_t mm_boot_last_pfn(void);
 int mm_boot_init (ulong_t mbd);
 void mm_boot_kmem_init(void);
 void mm_boot_kmem_cleanup(void);
+// second stage of kmem init, on all CPUs (KMEM_PARALLEL_INIT)
+void mm_boot_kmem_populate(void);
 
 void mm_dump_page_map(void);
 
@@ -0,0 +1,94 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __MUTEX_H__
+#define __MUTEX_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/thread.h>
+#include <nautilus/waitqueue.h>
+
+//
+// Adaptive (spin-then-block) mutex for threads
+//
+// An uncontended lock or unlock is a single atomic on the lock word.
+// A contended locker spins while the owner is running on another CPU,
+// since it will probably release the lock soon, and otherwise parks on
+// the mutex's wait queue.  Unlock only touches the wait queue when
+// the lock word says someone may be parked.
+//
+// Not for use in interrupt context, except for nk_mutex_trylock.
+//
+#define NK_MUTEX_UNLOCKED   0
+#define NK_MUTEX_LOCKED     1
+#define NK_MUTEX_CONTENDED  2   // locked, and there may be sleepers
+
+typedef struct nk_mutex {
+    volatile uint32_t            state;
+    struct nk_thread * volatile  owner;
+    nk_wait_queue_t             *wait_queue;
+} nk_mutex_t;
+
+int  nk_mutex_init(nk_mutex_t *m);
+int  nk_mutex_deinit(nk_mutex_t *m);
+
+void nk_mutex_lock_slow(nk_mutex_t *m);
+void nk_mutex_unlock_slow(nk_mutex_t *m);
+
+static inline void
+nk_mutex_lock (nk_mutex_t *m)
+{
+    if (!__sync_bool_compare_and_swap(&m->state, NK_MUTEX_UNLOCKED, NK_MUTEX_LOCKED)) {
+        nk_mutex_lock_slow(m);
+        return;
+    }
+    m->owner = get_cur_thread();
+}
+
+// returns 0 if we now have the lock
+static inline int
+nk_mutex_trylock (nk_mutex_t *m)
+{
+    if (!__sync_bool_compare_and_swap(&m->state, NK_MUTEX_UNLOCKED, NK_MUTEX_LOCKED)) {
+        return -1;
+    }
+    m->owner = get_cur_thread();
+    return 0;
+}
+
+static inline void
+nk_mutex_unlock (nk_mutex_t *m)
+{
+    m->owner = 0;
+    if (!__sync_bool_compare_and_swap(&m->state, NK_MUTEX_LOCKED, NK_MUTEX_UNLOCKED)) {
+        nk_mutex_unlock_slow(m);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
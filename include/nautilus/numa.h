@@ -66,6 +66,7 @@ struct mem_region {
 
     /* used by the kernel memory allocator */
     struct buddy_mempool * mm_state;
+    uint64_t deferred_pfn;  /* first page not yet handed to it at boot */
 
     struct list_head entry;
 
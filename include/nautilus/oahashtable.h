@@ -0,0 +1,86 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __OAHASHTABLE_H__
+#define __OAHASHTABLE_H__
+
+#include <nautilus/naut_types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Open addressing hash table
+//
+// Entries live inline in a power-of-two array of slots, in groups of
+// 16.  Each slot has a control byte holding 7 bits of its key's hash,
+// or marking it empty or deleted, and a lookup compares a whole
+// group's control bytes with a few SSE2 instructions before touching
+// any keys.  Deletion leaves a tombstone only when the group is full,
+// since a probe stops at a group with an empty slot.
+//
+// The table grows incrementally.  When it passes 7/8 full, a table
+// of twice the size is allocated, and each later update moves a
+// couple of groups from the old table to the new one.  Lookups
+// consult both tables until the move is done, so no operation ever
+// pays for rehashing everything.
+//
+// With NK_OA_HTABLE_CONCURRENT, the table is split into shards by
+// hash, each with its own lock and its own incremental resize, so
+// operations on different shards do not contend.  Otherwise the
+// caller provides any needed synchronization.
+//
+// Keys are opaque addr_t values.  A null hash function hashes the key
+// itself, and a null equality function compares keys directly, which
+// suits integer and pointer keys.
+//
+#define NK_OA_HTABLE_CONCURRENT 0x1
+
+struct nk_oa_htable;
+
+struct nk_oa_htable *nk_oa_htable_create(uint64_t min_size,
+                                         uint_t (*hash_fn)(addr_t key),
+                                         int (*eq_fn)(addr_t key1, addr_t key2),
+                                         int flags);
+void     nk_oa_htable_destroy(struct nk_oa_htable *t);
+
+// inserts, or replaces the value of an existing key
+// 0 => success, -1 => out of memory
+int      nk_oa_htable_insert(struct nk_oa_htable *t, addr_t key, addr_t value);
+// 0 => found, with the value stored in *value if value is not null
+int      nk_oa_htable_search(struct nk_oa_htable *t, addr_t key, addr_t *value);
+int      nk_oa_htable_remove(struct nk_oa_htable *t, addr_t key, addr_t *value);
+uint64_t nk_oa_htable_count(struct nk_oa_htable *t);
+
+// calls fn on every entry until it returns nonzero.  fn must not
+// modify the table.  In concurrent mode, a shard is locked while its
+// entries are visited
+void     nk_oa_htable_iterate(struct nk_oa_htable *t,
+                              int (*fn)(addr_t key, addr_t value, void *state),
+                              void *state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -49,6 +49,9 @@
 
 #define IA32_PMC_BASE         0x0c1
 #define IA32_PERFEVTSEL_BASE  0x186
+#define IA32_PERF_GLOBAL_STATUS   0x38e
+#define IA32_PERF_GLOBAL_CTRL     0x38f
+#define IA32_PERF_GLOBAL_OVF_CTRL 0x390
 #define INTEL_PERF_CTL_MSR_N(n) (IA32_PERFEVTSEL_BASE + (n))
 #define INTEL_PERF_CTR_MSR_N(n) (IA32_PMC_BASE + (n))
 
@@ -79,6 +82,8 @@
 #define AMD_INSTR_FETCH_STALLS   0x05
 #define AMD_BRANCH_MISS_RETIRED  0x06
 #define AMD_INSTR_CACHE_INVALS   0x07
+#define AMD_CPU_CLOCKS           0x08
+#define AMD_INSTR_RETIRED        0x09
 
 
 #define AMD_EXT_CNT_FLAG 0x1
@@ -192,6 +197,9 @@ struct pmc_ops {
     void     (*unbind_ctr)(int slot);
     int      (*init)(struct pmc_info * pmc);
     void     (*event_init)(perf_event_t * event);
+    // overflow interrupt control for the calling CPU's counter
+    void     (*intr_ctr)(perf_event_t * event, int on);
+    void     (*ack_overflow)(perf_event_t * event);
 
     int      (*version)();
     int      (*msr_cnt)();
@@ -236,4 +244,52 @@ void     nk_pmc_write(perf_event_t * event, uint64_t val);
 
 void     nk_pmc_report(void);
 
+// Overflow sampling.  An armed counter raises the LAPIC performance
+// counter interrupt every period events.  These act on the calling
+// CPU's copy of the event's counter only, so to sample everywhere,
+// create (bind) the event once and then arm it on each CPU.  The
+// LAPIC's LVTPC entry is left to the caller.
+int      nk_pmc_sample_arm(perf_event_t * event, uint64_t period);
+// call from the interrupt handler to start the next period
+void     nk_pmc_sample_rearm(perf_event_t * event, uint64_t period);
+void     nk_pmc_sample_disarm(perf_event_t * event);
+
+
+// Per-thread virtualized counters
+//
+// A thread that opts in has its counters loaded when it is switched
+// in and folded into its totals when it is switched out, so the
+// counts cover only the time it actually ran, wherever it ran.
+// Threads counting the same event share one counter slot.  With
+// NK_THREAD_PMC_INHERIT, threads created by the thread count the
+// same events, which is how a group of workers is measured.
+#define NK_THREAD_PMC_MAX      4
+#define NK_THREAD_PMC_INHERIT  1
+
+struct nk_thread;
+
+struct nk_thread_pmc {
+    int            num;
+    int            flags;
+    perf_event_t * events[NK_THREAD_PMC_MAX];
+    uint64_t       counts[NK_THREAD_PMC_MAX];
+};
+
+// Start counting the given events for the calling thread
+int      nk_thread_pmc_enable(uint32_t * event_ids, int num, int flags);
+// Stop counting for the calling thread and discard its counts
+int      nk_thread_pmc_disable(void);
+// Copy up to num counts for the thread into counts, in the order the
+// events were enabled, and return how many were copied (-1 if the
+// thread is not counting).  The event ids and names are copied too,
+// unless those arrays are null.  For a thread running on another CPU,
+// the counts are as of its last switch out.
+int      nk_thread_pmc_read(struct nk_thread * t, uint64_t * counts,
+                            uint32_t * event_ids, const char ** names, int num);
+
+// scheduler and thread lifecycle hooks
+void     nk_thread_pmc_switch(struct nk_thread * from, struct nk_thread * to);
+int      nk_thread_pmc_inherit(struct nk_thread * child, struct nk_thread * parent);
+void     nk_thread_pmc_release(struct nk_thread * t);
+
 #endif /* !__PMC_H__! */
@@ -0,0 +1,116 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __QLOCK_H__
+#define __QLOCK_H__
+
+#include <nautilus/naut_types.h>
+#include <nautilus/list.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Queue locks
+//
+// nk_qlock_t is an MCS lock whose queue nodes come from a small
+// per-CPU pool instead of from the caller.  Waiters spin on their own
+// node, so a contended handoff moves one cache line between the
+// releasing and the acquiring CPU.  Because the node belongs to the
+// CPU, these locks are held with interrupts off, like
+// spin_lock_irq_save(), and up to NK_QLOCK_NEST of them can be held
+// at once on a CPU.
+//
+// nk_cohort_lock_t is a NUMA cohort lock: a global ticket lock plus a
+// per-domain MCS queue.  A releaser with a waiter from its own domain
+// passes both locks to it directly, up to NK_COHORT_HANDOFFS times in
+// a row, so the lock and the data it protects tend to stay within a
+// domain's caches.
+//
+// Either lock can be given a name at init.  With NAUT_CONFIG_LOCK_STATS,
+// named locks keep contention statistics, which the "locks" shell
+// command reports.  The statistics are updated while the lock is held,
+// so they cost no extra atomics.
+//
+#define NK_QLOCK_NEST          4
+#define NK_COHORT_MAX_DOMAINS  8
+#define NK_COHORT_HANDOFFS     64
+#define NK_LOCK_NAME_LEN       32
+
+struct nk_qnode {
+    struct nk_qnode * volatile next;
+    volatile uint32_t          locked;  // 0 = wait, else passed (see qlock.c)
+} __attribute__((aligned(64)));
+
+struct nk_lock_stats {
+    char             name[NK_LOCK_NAME_LEN];
+    struct list_head node;
+    uint64_t         acquisitions;
+    uint64_t         contended;     // acquisitions that had to wait
+    uint64_t         spin_cycles;   // total cycles spent waiting
+    uint64_t         hold_cycles;   // total cycles held
+    uint64_t         max_hold;
+    uint64_t         local_handoffs; // cohort only
+    uint64_t         acquired_at;
+};
+
+typedef struct nk_qlock {
+    struct nk_qnode * volatile  tail;
+    struct nk_qnode            *holder;
+    struct nk_lock_stats       *stats;
+} nk_qlock_t;
+
+struct nk_cohort_local {
+    struct nk_qnode * volatile  tail;
+    uint32_t                    handoffs;
+} __attribute__((aligned(64)));
+
+typedef struct nk_cohort_lock {
+    volatile uint32_t           next_ticket;
+    volatile uint32_t           now_serving;
+    struct nk_qnode            *holder;
+    struct nk_lock_stats       *stats;
+    struct nk_cohort_local      local[NK_COHORT_MAX_DOMAINS];
+} nk_cohort_lock_t;
+
+// name may be null, in which case no statistics are kept
+int     nk_qlock_init(nk_qlock_t *l, char *name);
+void    nk_qlock_deinit(nk_qlock_t *l);
+uint8_t nk_qlock_lock_irq_save(nk_qlock_t *l);
+// returns 0 and sets flags if we now have the lock
+int     nk_qlock_trylock_irq_save(nk_qlock_t *l, uint8_t *flags);
+void    nk_qlock_unlock_irq_restore(nk_qlock_t *l, uint8_t flags);
+
+int     nk_cohort_lock_init(nk_cohort_lock_t *l, char *name);
+void    nk_cohort_lock_deinit(nk_cohort_lock_t *l);
+uint8_t nk_cohort_lock_irq_save(nk_cohort_lock_t *l);
+void    nk_cohort_unlock_irq_restore(nk_cohort_lock_t *l, uint8_t flags);
+
+void    nk_lock_stats_dump(void);
+void    nk_lock_stats_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <nautilus/naut_types.h>
+#include <nautilus/idt.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Statistical sampling profiler
+//
+// Every period events (cycles, retired instructions, or last level
+// cache misses) the performance counter overflow interrupt records the
+// interrupted RIP and a short frame pointer backtrace into a per-CPU
+// ring.  Without usable counters (e.g., QEMU without a vPMU), the APIC
+// timer drives sampling instead, with the period in nanoseconds.
+//
+// Rings never wrap - once a CPU's ring is full, further samples are
+// counted as lost until the profiler is restarted.
+//
+#define NK_SAMPLE_DEPTH   8
+
+typedef enum {
+    NK_SAMPLE_CYCLES = 0,
+    NK_SAMPLE_INSTRUCTIONS,
+    NK_SAMPLE_LLC_MISSES,
+    NK_SAMPLE_TIMER,
+} nk_sample_mode_t;
+
+struct nk_sample {
+    uint64_t rip;
+    uint32_t cpu;
+    uint32_t depth;
+    uint64_t frames[NK_SAMPLE_DEPTH];  // return addresses, innermost first
+};
+
+// period == 0 selects a default for the mode.  Returns the mode
+// actually in use (after any fallback to timer), or -1 on error
+int  nk_sampler_start(nk_sample_mode_t mode, uint64_t period);
+int  nk_sampler_stop(void);
+
+// Print the top n functions by self samples, and optionally the top n
+// by inclusive samples with their hottest callers
+void nk_sampler_report(int n, int callgraph);
+
+// Called from the APIC timer interrupt.  Returns the (possibly
+// shortened) time to the next timer interrupt
+uint64_t nk_sampler_timer_tick(excp_entry_t *excp, uint64_t time_to_next_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
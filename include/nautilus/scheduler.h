@@ -176,6 +176,11 @@ struct nk_thread *nk_sched_reanimate(nk_stack_size_t min_stack_size,
 // return ns
 uint64_t nk_sched_get_realtime();
 
+// the cpu's TSC value and realtime (ns) at the point where the
+// schedulers synchronized their TSCs at startup - a TSC reading on
+// the cpu converts to realtime relative to this pair
+void nk_sched_get_tsc_sync(int cpu, uint64_t *sync_cycles, uint64_t *sync_time);
+
 // Print out threads on cpu
 // -1 => all CPUs
 void nk_sched_dump_threads(int cpu);
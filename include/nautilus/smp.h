@@ -59,13 +59,50 @@ typedef uint32_t cpu_id_t;
 
 
 struct nk_xcall {
-    nk_queue_entry_t xcall_node;
+    struct nk_xcall * volatile next;   // link in target's mailbox
     void * data;
     nk_xcall_func_t fun;
-    uint8_t xcall_done;
+    volatile uint8_t xcall_done;
     uint8_t has_waiter;
+    volatile uint8_t busy;             // no-wait pool slot is in use
+    volatile uint64_t * remaining;     // multicast completion counter
+#ifdef NAUT_CONFIG_PROFILE
+    uint64_t post_tsc;                 // when posted, for the xcall histogram
+#endif
 };
 
+// number of no-wait xcalls a cpu can have outstanding at once
+#define NK_XCALL_NOWAIT_SLOTS 64
+
+#define NK_CPU_MASK_WORDS ((NAUT_CONFIG_MAX_CPUS+63)/64)
+
+typedef struct nk_cpu_mask {
+    uint64_t bits[NK_CPU_MASK_WORDS];
+} nk_cpu_mask_t;
+
+static inline void nk_cpu_mask_zero (nk_cpu_mask_t * m)
+{
+    int i;
+    for (i=0;i<NK_CPU_MASK_WORDS;i++) {
+        m->bits[i] = 0;
+    }
+}
+
+static inline void nk_cpu_mask_set (nk_cpu_mask_t * m, cpu_id_t cpu)
+{
+    m->bits[cpu/64] |= 1ULL << (cpu%64);
+}
+
+static inline void nk_cpu_mask_clear (nk_cpu_mask_t * m, cpu_id_t cpu)
+{
+    m->bits[cpu/64] &= ~(1ULL << (cpu%64));
+}
+
+static inline int nk_cpu_mask_test (nk_cpu_mask_t * m, cpu_id_t cpu)
+{
+    return !!(m->bits[cpu/64] & (1ULL << (cpu%64)));
+}
+
 
 #ifdef NAUT_CONFIG_PROFILE
     struct nk_instr_data;
@@ -113,8 +150,12 @@ struct cpu {
 
     struct nk_sched_percpu_state *sched_state;
 
-    nk_queue_t * xcall_q;
-    struct nk_xcall xcall_nowait_info;
+    // pending xcalls for this cpu, pushed lock-free by senders
+    // and drained completely on each XCALL IPI
+    struct nk_xcall * volatile xcall_mbox;
+    // descriptors for no-wait xcalls sent by this cpu
+    struct nk_xcall xcall_nowait_pool[NK_XCALL_NOWAIT_SLOTS];
+    uint32_t xcall_nowait_next;
 
     ulong_t cpu_khz; 
     
@@ -156,6 +197,10 @@ struct ap_init_area {
 int smp_early_init(struct naut_info * naut);
 int smp_bringup_aps(struct naut_info * naut);
 int smp_xcall(cpu_id_t cpu_id, nk_xcall_func_t fun, void * arg, uint8_t wait);
+// invoke fun(arg) on every cpu in the mask, including the caller's if
+// set, with one IPI per target (or a single broadcast if the mask is
+// everyone else).  With wait, returns when all have finished.
+int smp_xcall_mask(nk_cpu_mask_t * mask, nk_xcall_func_t fun, void * arg, uint8_t wait);
 void smp_ap_entry (struct cpu * core);
 int smp_setup_xcall_bsp (struct cpu * core);
 
@@ -38,6 +38,10 @@ extern "C" {
 #include <nautilus/cachepart.h>
 #include <nautilus/aspace.h>
 
+#ifdef NAUT_CONFIG_PROFILE
+#include <nautilus/instrument.h>
+#endif
+
 typedef uint64_t nk_stack_size_t;
     
 #include <nautilus/scheduler.h>
@@ -121,6 +125,9 @@ void nk_thread_exit(void * retval) __attribute__((noreturn));
 // by the reaper logic in the scheduler
 void nk_thread_destroy(nk_thread_id_t t);
 
+// fill the per-CPU thread caches at boot (NAUT_CONFIG_THREAD_CACHE)
+int nk_thread_cache_init(void);
+
 
 #ifndef __LEGION__
 nk_thread_id_t nk_get_tid(void);
@@ -172,6 +179,7 @@ typedef enum {
 
 
 typedef struct nk_wait_queue nk_wait_queue_t;
+struct nk_thread_pmc;
 
 struct nk_thread {
     uint64_t rsp;                /* +0  SHOULD NOT CHANGE POSITION */
@@ -218,10 +226,17 @@ struct nk_thread {
 
     struct nk_virtual_console *vc;
 
+    struct nk_thread_pmc *pmc;   // per-thread counters, if opted in (see pmc.h)
+    spinlock_t       pmc_lock;   // keeps pmc alive for readers on other CPUs
+
 #ifdef NAUT_CONFIG_GARBAGE_COLLECTION
     void  *gc_state;
 #endif
 
+#ifdef NAUT_CONFIG_PROFILE
+    struct nk_profile_stack prof_stack;
+#endif
+
     char name[MAX_THREAD_NAME];
 
     const void * tls[TLS_MAX_KEYS];
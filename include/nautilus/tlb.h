@@ -0,0 +1,109 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include <nautilus/naut_types.h>
+#include <nautilus/smp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// TLB shootdown for address space implementations
+//
+// An address space implementation embeds a TLB domain, and tells it
+// when threads join and leave (add_thread/remove_thread) and when CPUs
+// switch in and out (switch_to/switch_from).  The domain thus knows
+// which CPUs may hold its translations right now.
+//
+// To change mappings, gather the affected pages into a batch while
+// editing the page tables, and then flush the batch after dropping
+// any locks.  The flush posts one entry per page (or a single "flush
+// everything" entry, past the threshold) onto the invalidation queue
+// of each CPU currently in the domain, kicks the CPUs whose queues
+// were idle with one IPI, and waits for them to drain.  CPUs that
+// have switched out of the domain flush when they next switch in,
+// by way of a generation count.
+//
+// Entries are invalidated with INVPCID when the hardware has it, and
+// otherwise with INVLPG, or a CR3 reload, in the current context.
+//
+#define NK_TLB_BATCH_MAX   64     // pages a batch can name individually
+
+typedef struct nk_tlb_domain {
+    nk_cpu_mask_t     active;      // CPUs currently switched in
+    volatile uint64_t gen;         // batches flushed so far
+    uint64_t          seen_gen[NAUT_CONFIG_MAX_CPUS]; // as of each CPU's last full flush
+    uint64_t          pcid;        // 0 => untagged, every switch flushes
+    uint64_t          num_threads;
+} nk_tlb_domain_t;
+
+typedef struct nk_tlb_batch {
+    nk_tlb_domain_t  *domain;
+    uint32_t          count;       // > NK_TLB_BATCH_MAX => flush everything
+    addr_t            va[NK_TLB_BATCH_MAX];
+} nk_tlb_batch_t;
+
+void nk_tlb_domain_init(nk_tlb_domain_t *d, uint64_t pcid);
+
+void nk_tlb_add_thread(nk_tlb_domain_t *d);
+void nk_tlb_remove_thread(nk_tlb_domain_t *d);
+
+// call with interrupts off before loading the domain's CR3.  Returns
+// nonzero if the load may keep this PCID's TLB entries (CR3 bit 63)
+int  nk_tlb_switch_to(nk_tlb_domain_t *d);
+void nk_tlb_switch_from(nk_tlb_domain_t *d);
+
+static inline void nk_tlb_batch_init(nk_tlb_batch_t *b, nk_tlb_domain_t *d)
+{
+    b->domain = d;
+    b->count = 0;
+}
+
+static inline void nk_tlb_batch_add(nk_tlb_batch_t *b, addr_t va)
+{
+    if (b->count < NK_TLB_BATCH_MAX) {
+	b->va[b->count] = va;
+    }
+    if (b->count <= NK_TLB_BATCH_MAX) {
+	b->count++;
+    }
+}
+
+// Invalidate the batch on every CPU that may hold it, and return once
+// they have.  Must not be called while holding a lock that another
+// CPU could spin on with interrupts off
+int  nk_tlb_batch_flush(nk_tlb_batch_t *b);
+
+// batches larger than this are flushed as a whole context
+void nk_tlb_set_threshold(uint32_t pages);
+
+int  nk_tlb_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
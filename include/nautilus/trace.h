@@ -0,0 +1,111 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <nautilus/naut_types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Binary kernel trace
+//
+// Tracepoints append fixed-size binary records (raw TSC, event, tid,
+// two arguments) to a per-CPU ring.  Each CPU writes only its own ring
+// with interrupts briefly off, so recording takes no locks and no
+// atomics.  Rings overwrite their oldest records when full, so what
+// is kept is the most recent history.  A disabled category costs a
+// load and a branch at the tracepoint.
+//
+// Export converts TSCs to time using each CPU's TSC synchronization
+// point from the scheduler and emits Chrome trace format JSON (viewable
+// in chrome://tracing or Perfetto) to a file or to the console.
+//
+#define NK_TRACE_SCHED   0x01
+#define NK_TRACE_KMEM    0x02
+#define NK_TRACE_IRQ     0x04
+#define NK_TRACE_XCALL   0x08
+#define NK_TRACE_DEV     0x10
+#define NK_TRACE_ALL     0x1f
+
+typedef enum {
+    NK_TRACE_EV_SWITCH = 0,    // a = from tid, b = to tid
+    NK_TRACE_EV_WAKEUP,        // a = tid, b = cpu
+    NK_TRACE_EV_MIGRATE,       // a = tid, b = (from cpu << 32) | to cpu
+    NK_TRACE_EV_MALLOC,        // a = addr, b = size
+    NK_TRACE_EV_FREE,          // a = addr
+    NK_TRACE_EV_IRQ_ENTER,     // a = vector
+    NK_TRACE_EV_IRQ_EXIT,      // a = vector
+    NK_TRACE_EV_XCALL,         // a = function, b = argument
+    NK_TRACE_EV_BLK_DONE,      // a = request, b = status
+    NK_TRACE_EV_NET_DONE,      // a = request, b = status
+    NK_TRACE_EV_MAX
+} nk_trace_event_t;
+
+struct nk_trace_rec {
+    uint64_t tsc;
+    uint32_t event;
+    uint32_t tid;
+    uint64_t a;
+    uint64_t b;
+};
+
+// categories currently being recorded
+extern volatile uint32_t nk_trace_mask;
+
+void nk_trace_record(uint32_t event, uint64_t a, uint64_t b);
+
+#ifdef NAUT_CONFIG_TRACE
+#define NK_TRACE(cat, ev, a, b)                                     \
+    do {                                                            \
+        if (__builtin_expect(nk_trace_mask & (cat), 0)) {           \
+            nk_trace_record(ev, (uint64_t)(a), (uint64_t)(b));      \
+        }                                                           \
+    } while (0)
+#else
+#define NK_TRACE(cat, ev, a, b)
+#endif
+
+// called from the low-level interrupt entry/exit path
+void nk_trace_irq_enter(uint64_t vec);
+void nk_trace_irq_exit(uint64_t vec);
+
+// Start recording the given categories into rings of recs_per_cpu
+// records (rounded up to a power of two, 0 => default).  The rings
+// are allocated on the first start and kept until they are resized.
+int  nk_trace_start(uint32_t mask, uint64_t recs_per_cpu);
+int  nk_trace_stop(void);
+// fails while tracing is running
+int  nk_trace_clear(void);
+
+// Stop recording and write the trace as Chrome trace JSON to the
+// given file, or to the console if path is null
+int  nk_trace_export(char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
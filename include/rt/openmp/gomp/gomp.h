@@ -39,6 +39,28 @@ int nk_openmp_thread_init();
 int nk_openmp_thread_deinit();
 
 
+// Team reductions - every thread of the current team calls this with
+// its contribution in val (at most NK_OMP_REDUCE_MAX bytes), and every
+// thread gets the combined result back in val.  The contributions are
+// combined up a NUMA-shaped tree rather than on one shared line.
+// combine(acc,in) folds in into acc.  Outside of a team, val is
+// left alone.  Returns 0 on success.
+#define NK_OMP_REDUCE_MAX 64
+
+int    nk_openmp_reduce(void *val, unsigned long size, void (*combine)(void *acc, void *in));
+long   nk_openmp_reduce_sum_long(long val);
+double nk_openmp_reduce_sum_double(double val);
+
+
+// Thread placement - these stand in for the OMP_PLACES ("threads",
+// "cores", "sockets") and OMP_PROC_BIND ("false", "true", "master",
+// "close", "spread") environment variables and take the same values.
+// Change them only when no parallel region is running.  The default
+// is close over threads.  Returns 0 on success.
+int nk_openmp_set_places(char *places);
+int nk_openmp_set_proc_bind(char *bind);
+
+
 //
 // publicly visible functions in compliance with OMP standard
 //
@@ -59,11 +81,21 @@ int omp_get_max_threads(void);
 int omp_get_nested(void);
 int omp_get_num_devices(void);
 int omp_get_num_procs(void);
+int omp_get_num_places(void);
+int omp_get_place_num_procs(int place_num);
+void omp_get_place_proc_ids(int place_num, int *ids);
+int omp_get_place_num(void);
 int omp_get_num_teams(void);
 int omp_get_num_threads(void);
 
 typedef int omp_proc_bind_t;
 
+#define omp_proc_bind_false  0
+#define omp_proc_bind_true   1
+#define omp_proc_bind_master 2
+#define omp_proc_bind_close  3
+#define omp_proc_bind_spread 4
+
 omp_proc_bind_t omp_get_proc_bind(void);
 
 typedef int * omp_sched_t;
@@ -61,6 +61,7 @@
 #include <nautilus/fs.h>
 #include <nautilus/loader.h>
 #include <nautilus/shell.h>
+#include <nautilus/histogram.h>
 
 #ifdef NAUT_CONFIG_ENABLE_REMOTE_DEBUGGING 
 #include <nautilus/gdb-stub.h>
@@ -433,6 +434,8 @@ init (unsigned long mbd,
     nk_hpet_init();
 #endif
 
+    nk_hist_init();
+
 #ifdef NAUT_CONFIG_PROFILE
     nk_instrument_init();
 #endif
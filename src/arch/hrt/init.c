@@ -53,6 +53,7 @@
 #include <nautilus/mm.h>
 #include <nautilus/libccompat.h>
 #include <nautilus/barrier.h>
+#include <nautilus/histogram.h>
 #include <arch/hrt/hrt.h>
 
 #include <dev/apic.h>
@@ -267,6 +268,8 @@ hrt_bsp_init (unsigned long mbd,
 
     nk_cpu_topo_discover(naut->sys.cpus[0]);
 
+    nk_hist_init();
+
 #ifdef NAUT_CONFIG_PROFILE
     nk_instrument_init();
 #endif
@@ -396,6 +399,8 @@ default_init (unsigned long mbd,
     nk_hpet_init();
 #endif
 
+    nk_hist_init();
+
 #ifdef NAUT_CONFIG_PROFILE
     nk_instrument_init();
 #endif
@@ -55,6 +55,7 @@
 #include <nautilus/barrier.h>
 #include <nautilus/rwlock.h>
 #include <nautilus/condvar.h>
+#include <nautilus/histogram.h>
 
 #include <dev/apic.h>
 #include <dev/pci.h>
@@ -218,6 +219,8 @@ init (unsigned long mbd, unsigned long magic)
 
     nk_cpu_topo_discover(naut->sys.cpus[naut->sys.bsp_id]);
 
+    nk_hist_init();
+
 #ifdef NAUT_CONFIG_PROFILE
     nk_instrument_init();
 #endif
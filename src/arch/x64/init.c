@@ -65,9 +65,11 @@
 #include <nautilus/loader.h>
 #include <nautilus/linker.h>
 #include <nautilus/shell.h>
+#include <nautilus/histogram.h>
 #include <nautilus/pmc.h>
 #include <nautilus/prog.h>
 #include <nautilus/cmdline.h>
+#include <nautilus/boottime.h>
 #include <test/test.h>
 
 #ifdef NAUT_CONFIG_ASPACES
@@ -297,6 +299,8 @@ init (unsigned long mbd,
     
     nk_low_level_memset(naut, 0, sizeof(struct naut_info));
 
+    nk_boot_phase("entry");
+
     vga_early_init();
 
     // At this point we have VGA output only
@@ -336,6 +340,8 @@ init (unsigned long mbd,
     
     detect_cpu();
 
+    nk_boot_phase("early devices and console");
+
     /* setup the temporary boot-time allocator */
     mm_boot_init(mbd);
 
@@ -353,12 +359,18 @@ init (unsigned long mbd,
      * also initialize the relevant ACPI tables if they exist */
     nk_numa_init();
 
+    nk_boot_phase("memory map, ACPI, NUMA");
+
     /* this will finish up the identity map */
     nk_paging_init(&(naut->sys.mem), mbd);
 
+    nk_boot_phase("identity map");
+
     /* setup the main kernel memory allocator */
     nk_kmem_init();
 
+    nk_boot_phase("kmem zones");
+
     // setup per-core area for BSP
     msr_write(MSR_GS_BASE, (uint64_t)naut->sys.cpus[0]);
 
@@ -366,6 +378,8 @@ init (unsigned long mbd,
      * allocated in the boot mem allocator are kept reserved */
     mm_boot_kmem_init();
 
+    nk_boot_phase("kmem population (boot CPU)");
+
 #ifdef NAUT_CONFIG_ASPACES
     nk_aspace_init();
 #endif
@@ -435,6 +449,8 @@ init (unsigned long mbd,
     nk_hpet_init();
 #endif
 
+    nk_hist_init();
+
 #ifdef NAUT_CONFIG_PROFILE
     nk_instrument_init();
 #endif
@@ -448,8 +464,22 @@ init (unsigned long mbd,
     // vesa_test();
 #endif
 
+    nk_boot_phase("interrupts, timers, scheduler");
+
     smp_bringup_aps(naut);
 
+    nk_boot_phase("AP bringup");
+
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+    mm_boot_kmem_populate();
+
+    nk_boot_phase("kmem population (all CPUs)");
+#endif
+
+    if (nk_thread_cache_init()) {
+        ERROR_PRINT("Could not prewarm thread cache, threads will be allocated on demand\n");
+    }
+
 #ifdef NAUT_CONFIG_ENABLE_MONITOR
     nk_monitor_init();
 #endif
@@ -565,6 +595,10 @@ init (unsigned long mbd,
     nk_watchdog_init(NAUT_CONFIG_WATCHDOG_DEFAULT_TIME_MS * 1000000UL);
 #endif
     
+    nk_boot_phase("devices, filesystems, tests");
+
+    nk_boot_phase_report();
+
     nk_launch_shell("root-shell",0,0,0);
 
     runtime_init();
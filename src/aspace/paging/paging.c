@@ -21,16 +21,24 @@
  *
  * This is free software.  You are permitted to use,
  * redistribute, and modify it as specified in the file "LICENSE.txt".
-xo */
+ */
 
 #include <nautilus/nautilus.h>
 #include <nautilus/spinlock.h>
 #include <nautilus/paging.h>
 #include <nautilus/thread.h>
 #include <nautilus/shell.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/msr.h>
+#include <nautilus/smp.h>
+#include <nautilus/rbtree.h>
+#include <nautilus/tlb.h>
 
 #include <nautilus/aspace.h>
 
+#include "paging_helpers.h"
+
 #ifndef NAUT_CONFIG_DEBUG_ASPACE_PAGING
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...) 
@@ -41,13 +49,679 @@ xo */
 #define INFO(fmt, args...)   INFO_PRINT("aspace-paging: " fmt, ##args)
 
 
-static int get_characteristics(nk_aspace_characteristics_t *c)
+//
+// A paging address space has its own page tables, whose PML4 shares
+// the kernel's identity map with the default page tables (so kernel
+// code, heap, stacks, and device mappings stay visible), and maps its
+// own regions elsewhere.  Regions are kept in a red-black tree by
+// starting address.
+//
+// A region is mapped on demand, at page faults, or all at once when
+// it is added if it is NK_ASPACE_EAGER.  A region backed by physical
+// memory is mapped with the largest page (1 GB, 2 MB, or 4 KB) whose
+// virtual block lies entirely within the region and whose physical
+// address is equally aligned, so aligned regions get large pages
+// without asking.  A region backed by a pager is mapped 4 KB at a time.
+//
+// Each address space gets a PCID when the hardware has them, and
+// switch_to loads CR3 without flushing the TLB unless our mappings
+// have been invalidated since this CPU last loaded them.  Removing or
+// protecting a region collects the affected pages into a TLB shootdown
+// batch (see nautilus/tlb.h) that is flushed once the changes are done.
+//
+
+#define CR3_NOFLUSH        (1ULL<<63)
+#define PAGING_MAX_PCID    4096
+
+struct paging_region {
+    nk_aspace_region_t r;       // copy of the caller's region
+    struct rb_node     node;
+};
+
+typedef struct nk_aspace_paging {
+    nk_aspace_t          *aspace;
+    spinlock_t            lock;
+    ph_cr3e_t             cr3;
+    uint64_t              pcid;        // 0 => none, always flush
+    nk_tlb_domain_t       tlb;         // who may have our translations cached
+    int                   nx;          // no-execute is enabled
+    int                   gb_pages;    // 1 GB pages are supported
+    int                   kernel_slots; // PML4 entries shared with the kernel
+    struct paging_region *kernel;      // the shared identity map
+    struct rb_root        regions;
+    uint64_t              num_regions;
+    nk_aspace_characteristics_t chars;
+
+    // statistics
+    uint64_t              faults;
+    uint64_t              maps[3];     // 4 KB, 2 MB, 1 GB
+    uint64_t              invalidations;
+} nk_aspace_paging_t;
+
+#define LOCK_CONF uint8_t _lock_flags
+#define LOCK(p)   _lock_flags = spin_lock_irq_save(&(p)->lock)
+#define UNLOCK(p) spin_unlock_irq_restore(&(p)->lock, _lock_flags)
+
+
+static spinlock_t pcid_lock;
+static uint64_t   pcid_map[PAGING_MAX_PCID/64];
+
+static int pcid_supported(void)
+{
+    cpuid_ret_t ret;
+    struct cpuid_ecx_flags f;
+
+    cpuid(CPUID_FEATURE_INFO, &ret);
+    f.val = ret.c;
+
+    return f.pcid;
+}
+
+// returns 0 if we should not or cannot use a PCID
+static uint64_t pcid_alloc(void)
+{
+    uint64_t pcid = 0;
+    uint64_t i;
+
+    if (!pcid_supported()) {
+	return 0;
+    }
+
+    spin_lock(&pcid_lock);
+    for (i=1;i<PAGING_MAX_PCID;i++) {
+	if (!(pcid_map[i/64] & (1ULL << (i%64)))) {
+	    pcid_map[i/64] |= 1ULL << (i%64);
+	    pcid = i;
+	    break;
+	}
+    }
+    spin_unlock(&pcid_lock);
+
+    return pcid;
+}
+
+static void pcid_free(uint64_t pcid)
+{
+    if (pcid) {
+	spin_lock(&pcid_lock);
+	pcid_map[pcid/64] &= ~(1ULL << (pcid%64));
+	spin_unlock(&pcid_lock);
+    }
+}
+
+
+static struct paging_region *region_find(nk_aspace_paging_t *p, addr_t va)
+{
+    struct rb_node *n = p->regions.rb_node;
+
+    while (n) {
+	struct paging_region *r = rb_entry(n, struct paging_region, node);
+	if (va < (addr_t)r->r.va_start) {
+	    n = n->rb_left;
+	} else if (va >= (addr_t)r->r.va_start + r->r.len_bytes) {
+	    n = n->rb_right;
+	} else {
+	    return r;
+	}
+    }
+
+    return 0;
+}
+
+// the region exactly matching the caller's description of it
+static struct paging_region *region_exact(nk_aspace_paging_t *p, nk_aspace_region_t *region)
+{
+    struct paging_region *r = region_find(p, (addr_t)region->va_start);
+
+    if (r && r->r.va_start==region->va_start && r->r.len_bytes==region->len_bytes) {
+	return r;
+    }
+    return 0;
+}
+
+// returns -1 if the region overlaps an existing one
+static int region_insert(nk_aspace_paging_t *p, struct paging_region *r)
+{
+    struct rb_node **link = &p->regions.rb_node;
+    struct rb_node *parent = 0;
+    addr_t start = (addr_t)r->r.va_start;
+    addr_t end = start + r->r.len_bytes;
+
+    while (*link) {
+	struct paging_region *cur = rb_entry(*link, struct paging_region, node);
+	parent = *link;
+	if (end <= (addr_t)cur->r.va_start) {
+	    link = &(*link)->rb_left;
+	} else if (start >= (addr_t)cur->r.va_start + cur->r.len_bytes) {
+	    link = &(*link)->rb_right;
+	} else {
+	    return -1;
+	}
+    }
+
+    rb_link_node(&r->node, parent, link);
+    nk_rb_insert_color(&r->node, &p->regions);
+    p->num_regions++;
+
+    return 0;
+}
+
+static void region_erase(nk_aspace_paging_t *p, struct paging_region *r)
+{
+    nk_rb_erase(&r->node, &p->regions);
+    p->num_regions--;
+}
+
+
+static ph_pf_access_t region_access(nk_aspace_paging_t *p, struct paging_region *r)
+{
+    ph_pf_access_t a;
+
+    memset(&a,0,sizeof(a));
+    a.write = !!(r->r.protect.flags & NK_ASPACE_WRITE);
+    // without EFER.NXE, the no-execute bit is reserved
+    a.ifetch = !!(r->r.protect.flags & NK_ASPACE_EXEC) || !p->nx;
+
+    return a;
+}
+
+static int access_ok(nk_aspace_paging_t *p, struct paging_region *r, int write, int ifetch)
+{
+    uint64_t f = r->r.protect.flags;
+
+    return (f & (NK_ASPACE_READ | NK_ASPACE_WRITE | NK_ASPACE_EXEC)) &&
+	(!write || (f & NK_ASPACE_WRITE)) &&
+	(!ifetch || (f & NK_ASPACE_EXEC) || !p->nx);
+}
+
+// the largest page that can map va within the region
+static uint64_t page_size_for(nk_aspace_paging_t *p, struct paging_region *r, addr_t va)
+{
+    uint64_t sizes[2] = { PAGE_SIZE_1GB, PAGE_SIZE_2MB };
+    addr_t start = (addr_t)r->r.va_start;
+    addr_t end = start + r->r.len_bytes;
+    int i;
+
+    if (r->r.pager) {
+	return PAGE_SIZE_4KB;
+    }
+
+    for (i = p->gb_pages ? 0 : 1; i<2; i++) {
+	addr_t base = va & ~(sizes[i]-1);
+	addr_t pa = (addr_t)r->r.pa_start + (base - start);
+	if (base >= start && base + sizes[i] <= end && !(pa & (sizes[i]-1))) {
+	    return sizes[i];
+	}
+    }
+
+    return PAGE_SIZE_4KB;
+}
+
+static int map_page(nk_aspace_paging_t *p, struct paging_region *r, addr_t va, addr_t pa, uint64_t size)
+{
+    if (paging_helper_map(p->cr3, va, pa, size, region_access(p,r))) {
+	ERROR("Failed to map %016lx => %016lx (%lu bytes)\n", va, pa, size);
+	return -1;
+    }
+
+    p->maps[size==PAGE_SIZE_4KB ? 0 : size==PAGE_SIZE_2MB ? 1 : 2]++;
+
+    return 0;
+}
+
+// Map the page containing va, returning the size of the page that
+// now maps it in *size.  A pager may block, so it is called without
+// the lock, and with interrupts on if enable_irq is set (we are in
+// a fault from a context that had them on).
+static int fill(nk_aspace_paging_t *p, addr_t va, int write, int ifetch, int enable_irq, uint64_t *size)
+{
+    struct paging_region *r;
+    nk_aspace_pager_t *pager;
+    addr_t pa;
+    void *ppa;
+    int rc;
+    LOCK_CONF;
+
+    LOCK(p);
+
+    r = region_find(p, va);
+
+    if (!r) {
+	UNLOCK(p);
+	DEBUG("Address %016lx is not in any region\n", va);
+	return -1;
+    }
+
+    if (r==p->kernel) {
+	// the identity map's tables are the kernel's, and a fault in
+	// it is a real fault, not something for us to fill in
+	UNLOCK(p);
+	ERROR("Fault at %016lx in the shared kernel region\n", va);
+	return -1;
+    }
+
+    if (!access_ok(p, r, write, ifetch)) {
+	UNLOCK(p);
+	ERROR("Access (write=%d ifetch=%d) to %016lx violates region protections %lx\n",
+	      write, ifetch, va, r->r.protect.flags);
+	return -1;
+    }
+
+    if (paging_helper_leaf(p->cr3, va, size)) {
+	// another CPU beat us to it, or our TLB entry was stale
+	UNLOCK(p);
+	return 0;
+    }
+
+    if (!r->r.pager) {
+	*size = page_size_for(p, r, va);
+	va &= ~(*size-1);
+	pa = (addr_t)r->r.pa_start + (va - (addr_t)r->r.va_start);
+	rc = map_page(p, r, va, pa, *size);
+	UNLOCK(p);
+	return rc;
+    }
+
+    pager = r->r.pager;
+    va &= ~(PAGE_SIZE_4KB-1);
+    *size = PAGE_SIZE_4KB;
+
+    UNLOCK(p);
+
+    if (enable_irq) {
+	sti();
+    }
+    rc = pager->fault(pager->state, (void*)va, write, &ppa);
+    if (enable_irq) {
+	cli();
+    }
+
+    if (rc) {
+	ERROR("Pager failed for %016lx\n", va);
+	return -1;
+    }
+
+    LOCK(p);
+    // the region may have been removed while the pager ran, in which
+    // case the retried access will fault again and fail
+    if (region_find(p, va)==r && !paging_helper_leaf(p->cr3, va, size)) {
+	*size = PAGE_SIZE_4KB;
+	rc = map_page(p, r, va, (addr_t)ppa, PAGE_SIZE_4KB);
+    }
+    UNLOCK(p);
+
+    return rc;
+}
+
+
+static int remove_region(void *state, nk_aspace_region_t *region);
+
+static int destroy(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    uint64_t *pml4 = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(p->cr3.pml4_base);
+    struct rb_node *n;
+    int i;
+
+    if (p->tlb.num_threads) {
+	ERROR("Cannot destroy address space %s with %lu threads\n", p->aspace->name, p->tlb.num_threads);
+	return -1;
+    }
+
+    while ((n = nk_rb_first(&p->regions))) {
+	struct paging_region *r = rb_entry(n, struct paging_region, node);
+	region_erase(p, r);
+	free(r);
+    }
+
+    // the kernel's tables are not ours to free
+    for (i=0;i<p->kernel_slots;i++) {
+	pml4[i] = 0;
+    }
+    paging_helper_free(p->cr3, 0);
+
+    pcid_free(p->pcid);
+
+    nk_aspace_unregister(p->aspace);
+
+    free(p);
+
+    return 0;
+}
+
+static int add_thread(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+
+    nk_tlb_add_thread(&p->tlb);
+
+    DEBUG("Add thread %lu to %s\n", get_cur_thread()->tid, p->aspace->name);
+
+    return 0;
+}
+
+static int remove_thread(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+
+    nk_tlb_remove_thread(&p->tlb);
+
+    DEBUG("Remove thread %lu from %s\n", get_cur_thread()->tid, p->aspace->name);
+
+    return 0;
+}
+
+static int add_region(void *state, nk_aspace_region_t *region)
 {
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    struct paging_region *r;
+    addr_t va, end;
+    uint64_t size;
+    LOCK_CONF;
+
+    if (((addr_t)region->va_start | region->len_bytes) & (PAGE_SIZE_4KB-1) ||
+	(!region->pager && ((addr_t)region->pa_start & (PAGE_SIZE_4KB-1))) ||
+	!region->len_bytes) {
+	ERROR("Region %p+%lx is not 4 KB aligned\n", region->va_start, region->len_bytes);
+	return -1;
+    }
+
+    r = (struct paging_region *)malloc(sizeof(*r));
+    if (!r) {
+	ERROR("Cannot allocate region\n");
+	return -1;
+    }
+    memset(r,0,sizeof(*r));
+    r->r = *region;
+
+    LOCK(p);
+    if (region_insert(p, r)) {
+	UNLOCK(p);
+	ERROR("Region %p+%lx overlaps an existing region\n", region->va_start, region->len_bytes);
+	free(r);
+	return -1;
+    }
+    UNLOCK(p);
+
+    if (region->protect.flags & NK_ASPACE_EAGER) {
+	end = (addr_t)region->va_start + region->len_bytes;
+	for (va = (addr_t)region->va_start; va < end; va = (va & ~(size-1)) + size) {
+	    if (fill(p, va, 0, 0, 0, &size)) {
+		ERROR("Cannot eagerly map region %p+%lx\n", region->va_start, region->len_bytes);
+		remove_region(p, region);
+		return -1;
+	    }
+	}
+    }
+
+    DEBUG("Added region %p+%lx => %p (flags %lx)\n", region->va_start, region->len_bytes,
+	  region->pa_start, region->protect.flags);
+
+    return 0;
+}
+
+static int remove_region(void *state, nk_aspace_region_t *region)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    struct paging_region *r;
+    nk_tlb_batch_t b;
+    addr_t va, end;
+    uint64_t *e, size;
+    LOCK_CONF;
+
+    nk_tlb_batch_init(&b, &p->tlb);
+
+    LOCK(p);
+
+    r = region_exact(p, region);
+    if (!r || r==p->kernel) {
+	UNLOCK(p);
+	ERROR("Cannot remove region %p+%lx\n", region->va_start, region->len_bytes);
+	return -1;
+    }
+
+    region_erase(p, r);
+
+    end = (addr_t)r->r.va_start + r->r.len_bytes;
+    for (va = (addr_t)r->r.va_start; va < end; va = (va & ~(size-1)) + size) {
+	if ((e = paging_helper_leaf(p->cr3, va, &size))) {
+	    *e = 0;
+	    nk_tlb_batch_add(&b, va);
+	}
+    }
+
+    UNLOCK(p);
+
+    if (b.count) {
+	p->invalidations++;
+	nk_tlb_batch_flush(&b);
+    }
+
+    free(r);
+
+    return 0;
+}
+
+static int protect_region(void *state, nk_aspace_region_t *region, nk_aspace_protection_t *prot)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    struct paging_region *r;
+    nk_tlb_batch_t b;
+    ph_pf_access_t a;
+    addr_t va, end;
+    uint64_t *e, size;
+    LOCK_CONF;
+
+    nk_tlb_batch_init(&b, &p->tlb);
+
+    LOCK(p);
+
+    r = region_exact(p, region);
+    if (!r || r==p->kernel) {
+	UNLOCK(p);
+	ERROR("Cannot protect region %p+%lx\n", region->va_start, region->len_bytes);
+	return -1;
+    }
+
+    r->r.protect = *prot;
+    a = region_access(p, r);
+
+    end = (addr_t)r->r.va_start + r->r.len_bytes;
+    for (va = (addr_t)r->r.va_start; va < end; va = (va & ~(size-1)) + size) {
+	if ((e = paging_helper_leaf(p->cr3, va, &size))) {
+	    uint64_t old = *e;
+	    paging_helper_set_permissions(e, a);
+	    if (*e != old) {
+		nk_tlb_batch_add(&b, va);
+	    }
+	}
+    }
+
+    UNLOCK(p);
+
+    if (b.count) {
+	p->invalidations++;
+	nk_tlb_batch_flush(&b);
+    }
+
+    return 0;
+}
+
+static int move_region(void *state, nk_aspace_region_t *cur_region, nk_aspace_region_t *new_region)
+{
+    ERROR("Cannot move regions in a paging address space\n");
     return -1;
 }
 
+static int switch_from(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+
+    nk_tlb_switch_from(&p->tlb);
+
+    return 0;
+}
+
+static int switch_to(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    uint64_t cr3 = PAGE_NUM_TO_ADDR_4KB(p->cr3.pml4_base);
+    int keep = nk_tlb_switch_to(&p->tlb);
+
+    if (p->pcid) {
+	if (!(read_cr4() & CR4_PCIDE)) {
+	    // current CR3 is the base's, whose PCID bits are zero
+	    write_cr4(read_cr4() | CR4_PCIDE);
+	}
+	cr3 |= p->pcid | (keep ? CR3_NOFLUSH : 0);
+    }
+
+    DEBUG("Switching to %s (cr3=%016lx)\n", p->aspace->name, cr3);
+
+    write_cr3(cr3);
+
+    return 0;
+}
+
+static int exception(void *state, excp_entry_t *exp, excp_vec_t vec)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    addr_t va = read_cr2();
+    uint64_t size;
+
+    if (vec != PF_EXCP) {
+	return -1;
+    }
+
+    p->faults++;
+
+    DEBUG("Page fault at %016lx (error %lx) on thread %lu\n", va, exp->error_code, get_cur_thread()->tid);
+
+    return fill(p, va, !!(exp->error_code & 2), !!(exp->error_code & 16),
+		!!(exp->rflags & RFLAGS_IF), &size);
+}
+
+static int print(void *state, int detailed)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    struct rb_node *n;
+    LOCK_CONF;
+
+    nk_vc_printf("%s Paging Address Space [granularity 0x%lx alignment 0x%lx]\n"
+		 "   CR3: %016lx  PCID: %lu  threads: %lu  regions: %lu\n"
+		 "   faults: %lu  mapped 4K/2M/1G: %lu/%lu/%lu  invalidations: %lu\n",
+		 p->aspace->name, p->chars.granularity, p->chars.alignment,
+		 p->cr3.val, p->pcid, p->tlb.num_threads, p->num_regions,
+		 p->faults, p->maps[0], p->maps[1], p->maps[2], p->invalidations);
+
+    if (detailed) {
+	LOCK(p);
+	for (n = nk_rb_first(&p->regions); n; n = nk_rb_next(n)) {
+	    struct paging_region *r = rb_entry(n, struct paging_region, node);
+	    nk_vc_printf("   Region: %016lx - %016lx => %016lx %c%c%c%s%s\n",
+			 (uint64_t)r->r.va_start, (uint64_t)r->r.va_start + r->r.len_bytes,
+			 (uint64_t)r->r.pa_start,
+			 r->r.protect.flags & NK_ASPACE_READ ? 'r' : '-',
+			 r->r.protect.flags & NK_ASPACE_WRITE ? 'w' : '-',
+			 r->r.protect.flags & NK_ASPACE_EXEC ? 'x' : '-',
+			 r->r.protect.flags & NK_ASPACE_EAGER ? " eager" : "",
+			 r==p->kernel ? " kernel" : r->r.pager ? " pager" : "");
+	}
+	UNLOCK(p);
+    }
+
+    return 0;
+}
+
+static nk_aspace_interface_t paging_interface = {
+    .destroy = destroy,
+    .add_thread = add_thread,
+    .remove_thread = remove_thread,
+    .add_region = add_region,
+    .remove_region = remove_region,
+    .protect_region = protect_region,
+    .move_region = move_region,
+    .switch_from = switch_from,
+    .switch_to = switch_to,
+    .exception = exception,
+    .print = print
+};
+
+
+static int get_characteristics(nk_aspace_characteristics_t *c)
+{
+    c->granularity = PAGE_SIZE_4KB;
+    c->alignment = PAGE_SIZE_4KB;
+    return 0;
+}
+
 static struct nk_aspace *create(char *name, nk_aspace_characteristics_t *c)
 {
+    nk_aspace_paging_t *p;
+    uint64_t *kpml4 = (uint64_t *)nk_paging_default_cr3();
+    uint64_t *pml4;
+    int i;
+
+    p = (nk_aspace_paging_t *)malloc(sizeof(*p));
+    if (!p) {
+	ERROR("Cannot allocate paging address space\n");
+	return 0;
+    }
+    memset(p,0,sizeof(*p));
+
+    spinlock_init(&p->lock);
+    p->regions = RB_ROOT;
+    get_characteristics(&p->chars);
+    p->nx = !!(msr_read(IA32_MSR_EFER) & EFER_NXE);
+    p->gb_pages = nk_paging_default_page_size()==PAGE_SIZE_1GB;
+
+    if (paging_helper_create(&p->cr3)) {
+	ERROR("Cannot create page tables\n");
+	free(p);
+	return 0;
+    }
+
+    // share the kernel's top-level entries, and with them the identity
+    // map and any device mappings added to it later
+    pml4 = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(p->cr3.pml4_base);
+    for (i=0;i<NUM_PML4E_ENTRIES;i++) {
+	if (kpml4[i] & PH_PRESENT) {
+	    pml4[i] = kpml4[i];
+	    p->kernel_slots = i+1;
+	}
+    }
+
+    p->kernel = (struct paging_region *)malloc(sizeof(struct paging_region));
+    if (!p->kernel) {
+	ERROR("Cannot allocate kernel region\n");
+	goto out_bad;
+    }
+    memset(p->kernel,0,sizeof(struct paging_region));
+    p->kernel->r.len_bytes = (uint64_t)p->kernel_slots << 39;
+    p->kernel->r.protect.flags = NK_ASPACE_READ | NK_ASPACE_WRITE | NK_ASPACE_EXEC | NK_ASPACE_PIN | NK_ASPACE_KERN;
+    region_insert(p, p->kernel);
+
+    p->pcid = pcid_alloc();
+    nk_tlb_domain_init(&p->tlb, p->pcid);
+
+    p->aspace = nk_aspace_register(name, NK_ASPACE_HOOK_PF, &paging_interface, p);
+    if (!p->aspace) {
+	ERROR("Unable to register paging address space %s\n", name);
+	pcid_free(p->pcid);
+	goto out_bad;
+    }
+
+    DEBUG("Created paging address space %s (cr3=%016lx pcid=%lu)\n", name, p->cr3.val, p->pcid);
+
+    return p->aspace;
+
+ out_bad:
+    free(p->kernel);
+    for (i=0;i<p->kernel_slots;i++) {
+	pml4[i] = 0;
+    }
+    paging_helper_free(p->cr3, 0);
+    free(p);
     return 0;
 }
 
@@ -61,3 +735,84 @@ static nk_aspace_impl_t paging = {
 nk_aspace_register_impl(paging);
 
 
+//
+// Exercise an address space: alias some memory at two places, one
+// eagerly mapped and one on demand, write through one and read
+// through the other, and then tear it all down
+//
+#define TEST_VA   0x200000000000UL
+#define TEST_LEN  (4*PAGE_SIZE_2MB)
+
+static int handle_pagingtest(char *buf, void *priv)
+{
+    nk_thread_t *t = get_cur_thread();
+    nk_aspace_t *orig = t->aspace ? t->aspace : nk_aspace_find("base");
+    nk_aspace_characteristics_t c;
+    nk_aspace_region_t r1, r2;
+    nk_aspace_t *as;
+    uint64_t *w, *rd;
+    uint64_t i, bad = 0;
+    void *mem;
+
+    if (nk_aspace_query("paging", &c)) {
+	nk_vc_printf("Paging address spaces are not available\n");
+	return 0;
+    }
+
+    mem = malloc(TEST_LEN);  // naturally aligned, so 2 MB pages apply
+    as = nk_aspace_create("paging", "pagingtest", &c);
+
+    if (!mem || !as) {
+	nk_vc_printf("Cannot allocate memory or address space\n");
+	free(mem);
+	return 0;
+    }
+
+    r1.va_start = (void*)TEST_VA;
+    r1.pa_start = mem;
+    r1.len_bytes = TEST_LEN;
+    r1.protect.flags = NK_ASPACE_READ | NK_ASPACE_WRITE | NK_ASPACE_EAGER;
+    r1.pager = 0;
+
+    r2 = r1;
+    r2.va_start = (void*)(TEST_VA + PAGE_SIZE_1GB);
+    r2.protect.flags = NK_ASPACE_READ;
+
+    if (nk_aspace_add_region(as, &r1) || nk_aspace_add_region(as, &r2)) {
+	nk_vc_printf("Cannot add regions\n");
+	goto out;
+    }
+
+    nk_aspace_move_thread(as);
+
+    w = (uint64_t *)r1.va_start;
+    rd = (uint64_t *)r2.va_start;
+    for (i=0;i<TEST_LEN/sizeof(uint64_t);i+=512) {
+	w[i] = i ^ 0xdeadbeef;
+    }
+    for (i=0;i<TEST_LEN/sizeof(uint64_t);i+=512) {
+	bad += rd[i] != (i ^ 0xdeadbeef);
+    }
+
+    r1.protect.flags = NK_ASPACE_READ;
+    nk_aspace_protect(as, &r1, &r1.protect);
+    nk_aspace_remove_region(as, &r2);
+
+    nk_aspace_move_thread(orig);
+
+    nk_aspace_dump_aspaces(1);
+
+    nk_vc_printf("pagingtest: %s (%lu mismatches)\n", bad ? "FAILED" : "passed", bad);
+
+ out:
+    nk_aspace_destroy(as);
+    free(mem);
+    return 0;
+}
+
+static struct shell_cmd_impl pagingtest_impl = {
+    .cmd      = "pagingtest",
+    .help_str = "pagingtest",
+    .handler  = handle_pagingtest,
+};
+nk_register_shell_cmd(pagingtest_impl);
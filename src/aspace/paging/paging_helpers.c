@@ -68,10 +68,11 @@ int paging_helper_free(ph_cr3e_t cr3, int free_data)
 	if (pml4[i].present) {
 	    ph_pdpe_t *pdpe = (ph_pdpe_t *)PAGE_NUM_TO_ADDR_4KB(pml4[i].pdp_base);
 	    for (j=0;j<NUM_PDPE_ENTRIES;j++) {
-		if (pdpe[j].present) {
+		// 1 GB and 2 MB leaves have no tables below them
+		if (pdpe[j].present && !PH_IS_LARGE(pdpe[j].val)) {
 		    ph_pde_t *pde = (ph_pde_t *)PAGE_NUM_TO_ADDR_4KB(pdpe[j].pd_base);
 		    for (k=0;k<NUM_PDE_ENTRIES;k++) {
-			if (pde[k].present) {
+			if (pde[k].present && !PH_IS_LARGE(pde[k].val)) {
 			    ph_pte_t *pte = (ph_pte_t *)PAGE_NUM_TO_ADDR_4KB(pde[k].pt_base);
 			    if (free_data) { 
 				for (l=0;l<NUM_PTE_ENTRIES;l++) {
@@ -234,3 +235,118 @@ int paging_helper_drill(ph_cr3e_t cr3, addr_t vaddr, addr_t paddr, ph_pf_access_
 	return paging_helper_drill(cr3,vaddr,paddr,access_type);
     }
 }
+
+
+// is every entry of a table not present?
+static int table_empty(uint64_t *table)
+{
+    int i;
+
+    for (i=0;i<512;i++) {
+	if (table[i] & 1) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+// the next level table under entry, allocating it if needed, or null
+// if there is a leaf in the way or we cannot allocate
+static uint64_t *next_table(uint64_t *entry)
+{
+    uint64_t *table;
+
+    if (*entry & 1) {
+	if (PH_IS_LARGE(*entry)) {
+	    return 0;
+	}
+	return (uint64_t *)PAGE_NUM_TO_ADDR_4KB(((ph_pte_t *)entry)->page_base);
+    }
+
+    table = (uint64_t *)ALLOC_PHYSICAL_PAGE();
+    if (!table) {
+	ERROR("Cannot allocate page table\n");
+	return 0;
+    }
+    memset(table,0,PAGE_SIZE_4KB);
+
+    // intermediate entries allow everything, so the leaf alone
+    // controls access
+    *entry = (addr_t)table | PH_PRESENT | PH_WRITABLE;
+
+    return table;
+}
+
+// install a leaf in the given entry, replacing an empty table
+// there if needed
+static int set_leaf(uint64_t *entry, uint64_t val)
+{
+    if ((*entry & 1) && !PH_IS_LARGE(*entry) && (val & PH_LARGE)) {
+	uint64_t *table = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(((ph_pte_t *)entry)->page_base);
+	if (!table_empty(table)) {
+	    return 1;
+	}
+	*entry = 0;
+	FREE_PHYSICAL_PAGE(table);
+    }
+    *entry = val;
+    return 0;
+}
+
+int paging_helper_map(ph_cr3e_t cr3, addr_t vaddr, addr_t paddr, uint64_t page_size, ph_pf_access_t access_type)
+{
+    uint64_t *pml4 = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(cr3.pml4_base);
+    uint64_t *pdp, *pd, *pt;
+    uint64_t leaf = PH_PRESENT | paddr;
+
+    perm_set(&leaf,access_type);
+
+    if (!(pdp = next_table(&pml4[ADDR_TO_PML4_INDEX(vaddr)]))) {
+	return -1;
+    }
+    if (page_size == PAGE_SIZE_1GB) {
+	return set_leaf(&pdp[ADDR_TO_PDP_INDEX(vaddr)], leaf | PH_LARGE);
+    }
+    if (PH_IS_LARGE(pdp[ADDR_TO_PDP_INDEX(vaddr)])) {
+	return 1;
+    }
+    if (!(pd = next_table(&pdp[ADDR_TO_PDP_INDEX(vaddr)]))) {
+	return -1;
+    }
+    if (page_size == PAGE_SIZE_2MB) {
+	return set_leaf(&pd[ADDR_TO_PD_INDEX(vaddr)], leaf | PH_LARGE);
+    }
+    if (PH_IS_LARGE(pd[ADDR_TO_PD_INDEX(vaddr)])) {
+	return 1;
+    }
+    if (!(pt = next_table(&pd[ADDR_TO_PD_INDEX(vaddr)]))) {
+	return -1;
+    }
+    pt[ADDR_TO_PT_INDEX(vaddr)] = leaf;
+    return 0;
+}
+
+uint64_t *paging_helper_leaf(ph_cr3e_t cr3, addr_t vaddr, uint64_t *page_size)
+{
+    uint64_t *pml4 = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(cr3.pml4_base);
+    uint64_t *e = &pml4[ADDR_TO_PML4_INDEX(vaddr)];
+    uint64_t size = PAGE_SIZE_1GB * 512;
+    int level;
+
+    for (level=0; level<4; level++) {
+	if (!(*e & 1)) {
+	    *page_size = size;
+	    return 0;
+	}
+	if (level==3 || (level>0 && PH_IS_LARGE(*e))) {
+	    *page_size = size;
+	    return e;
+	}
+	size >>= 9;
+	e = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(((ph_pte_t *)e)->page_base) + ((vaddr >> (39 - 9*(level+1))) & 0x1ff);
+    }
+
+    // not reached
+    *page_size = PAGE_SIZE_4KB;
+    return 0;
+}
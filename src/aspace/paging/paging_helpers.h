@@ -219,6 +219,14 @@ typedef ph_pf_error_t ph_pf_access_t;
 
 
 
+// raw entry bits, common to all levels
+#define PH_PRESENT   0x1ULL
+#define PH_WRITABLE  0x2ULL
+#define PH_LARGE     0x80ULL  // PDPE => 1 GB page, PDE => 2 MB page
+#define PH_NX        (1ULL<<63)
+#define PH_IS_LARGE(e) (((e) & PH_LARGE)!=0)
+
+
 // create a new page table hierarchy, returning a cr3e
 // this simply creates an empty PML4T
 int paging_helper_create(ph_cr3e_t *cr3);
@@ -242,6 +250,18 @@ int paging_helper_walk(ph_cr3e_t cr3, addr_t vaddr, ph_pf_access_t access_type,
 // build a path through the PT hierarchy to enable an access of the given type
 int paging_helper_drill(ph_cr3e_t cr3, addr_t vaddr, addr_t paddr, ph_pf_access_t access_type);
 
+// map vaddr to paddr with one page of page_size (4 KB, 2 MB, or 1 GB),
+// building tables as needed.  Both addresses must be aligned to
+// page_size.  Returns 0 on success, -1 on error, and 1 if the
+// mapping at that size is blocked by a different-size mapping
+int paging_helper_map(ph_cr3e_t cr3, addr_t vaddr, addr_t paddr, uint64_t page_size, ph_pf_access_t access_type);
+
+// find the leaf entry (PTE, or large PDE/PDPE) that maps vaddr,
+// setting *page_size to the size of the page it maps.  If vaddr is
+// not mapped, returns null and sets *page_size to the size of the
+// unmapped area around vaddr at the level the walk stopped
+uint64_t *paging_helper_leaf(ph_cr3e_t cr3, addr_t vaddr, uint64_t *page_size);
+
 
 
 #endif
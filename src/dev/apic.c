@@ -38,6 +38,10 @@
 
 #include <dev/gpio.h>
 
+#ifdef NAUT_CONFIG_SAMPLING_PROFILER
+#include <nautilus/sampler.h>
+#endif
+
 #ifndef NAUT_CONFIG_DEBUG_APIC
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...)
@@ -1364,6 +1368,11 @@ static int apic_timer_handler(excp_entry_t * excp, excp_vec_t vec, void *state)
     // note that currently all cores see the events
     time_to_next_ns = nk_timer_handler();
 
+#ifdef NAUT_CONFIG_SAMPLING_PROFILER
+    // timer-driven sampling when there are no usable perf counters
+    time_to_next_ns = nk_sampler_timer_tick(excp, time_to_next_ns);
+#endif
+
     // note that the low-level interrupt handler code in excp_early.S
     // takes care of invoking the scheduler if needed, and the scheduler
     // will in turn change the time after we leave - it may set the
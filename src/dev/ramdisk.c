@@ -110,11 +110,29 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 
 
 
+static void *map_blocks(void *state, uint64_t blocknum, uint64_t count)
+{
+    struct ramdisk_state *s = (struct ramdisk_state *)state;
+
+    DEBUG("map_blocks on device %s starting at %lu for %lu blocks\n",
+	  s->blkdev->dev.name, blocknum, count);
+
+    // the image never moves, so no lock is needed to hand it out
+    if (blocknum+count >= s->num_blocks) { 
+	ERROR("Illegal map past end of disk\n");
+	return 0;
+    }
+
+    return s->data+blocknum*s->block_size;
+}
+
+
 static struct nk_block_dev_int inter = 
 {
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .map_blocks = map_blocks,
 };
 
 static int discover_ramdisks()
@@ -27,6 +27,8 @@
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
 #include <nautilus/fs.h>
+#include <nautilus/task.h>
+#include <nautilus/scheduler.h>
 
 #include <fs/ext2/ext2.h>
 #include "ext2fs.h"
@@ -48,11 +50,45 @@
 #endif
 
 
+struct ext2_extent {
+    uint32_t start;
+    uint32_t len;
+};
+
+// in-memory copy of a block group's metadata, built when the
+// filesystem is attached and kept write-through afterwards
+struct ext2_group_info {
+    struct ext2_group_desc desc;
+    uint8_t               *block_bitmap;
+    uint8_t               *inode_bitmap;
+    struct ext2_extent    *free;        // free extents, sorted by start
+    uint32_t               num_free;
+    uint32_t               max_free;
+};
+
+#define EXT2_PREALLOC_WINDOWS 16
+#define EXT2_PREALLOC_BLOCKS  64
+
+struct ext2_prealloc {
+    uint32_t inode;       // 0 => slot unused
+    uint32_t logical;     // logical block the window serves next
+    uint32_t start;       // next reserved physical block
+    uint32_t len;         // reserved blocks left
+    uint64_t last_use;
+};
+
 struct ext2_state {
     struct nk_block_dev_characteristics chars; 
     struct nk_block_dev *dev;
     struct nk_fs        *fs;
     struct ext2_super_block super;
+
+    uint32_t                num_groups;
+    struct ext2_group_info *groups;    // null => go to the device
+
+    spinlock_t              alloc_lock;
+    struct ext2_prealloc    prealloc[EXT2_PREALLOC_WINDOWS];
+    uint64_t                prealloc_clock;
 };
 
 #include "ext2_access.c"
@@ -94,6 +130,8 @@ static void ext2_close(void *state, void *file)
 
     DEBUG("closing inode %u\n",(uint32_t)(uint64_t)file);
 
+    prealloc_release(fs,(uint32_t)(uint64_t)file);
+
     // ideally FS would track this here so that we can handle multiple
     // opens, locking, etc correctly, but that's outside of scope for now
 
@@ -375,73 +413,99 @@ static int map_logical_to_physical_get_put(struct ext2_state *fs, uint32_t inode
     map_logical_to_physical_get_put(fs,inode_num,inode,logical_block,&physical_block,1)
 
 
-static int ext2_truncate(void *state, void *file, off_t len)
+// Change the size of the file.  When growing, blocks are allocated
+// in runs and zeroed, except for those lying entirely within
+// [keep_start,keep_end), which the caller is about to overwrite.
+static int resize_file(struct ext2_state *fs, uint32_t inode_num, struct ext2_inode *inode,
+		       off_t len, off_t keep_start, off_t keep_end)
 { 
-    struct ext2_state *fs = (struct ext2_state *)state;
     uint64_t block_size = get_block_size(fs);
-    uint32_t inode_num = (uint32_t)(uint64_t)file;
     uint32_t phys;
 
-    struct ext2_inode inode;   
-
     size_t file_size_bytes, file_size_blocks;
     size_t new_file_size_bytes, new_file_size_blocks;
     
-    DEBUG("truncating inode %u to %lu bytes\n", inode_num, len);
-     
-    if (read_inode(fs,inode_num,&inode)) { 
-	ERROR("Failed to read inode %u\n",inode_num);
-	return -1;
-    }
+    DEBUG("resizing inode %u to %lu bytes\n", inode_num, len);
 
-    file_size_bytes = get_file_size(fs,&inode);
+    file_size_bytes = get_file_size(fs,inode);
     file_size_blocks = CEIL_DIV(file_size_bytes,block_size);
     new_file_size_bytes = len;
     new_file_size_blocks = CEIL_DIV(new_file_size_bytes,block_size);
 
     if (new_file_size_blocks < file_size_blocks) { 
-	// shrink
+	// shrink, freeing physically contiguous blocks together
 	uint64_t block;
+	uint32_t run_start=0, run_len=0;
+
+	prealloc_release(fs,inode_num);
+
 	for (block=new_file_size_blocks;block<file_size_blocks;block++) { 
-	    if (map_logical_to_physical_get(fs,inode_num,&inode,block,&phys)) { 
-		ERROR("Unable to map logical block %lu to physical block in truncation\n");
+	    if (map_logical_to_physical_get(fs,inode_num,inode,block,&phys)) { 
+		ERROR("Unable to map logical block %lu to physical block in truncation\n",block);
 		return -1;
 	    } 
-	    if (free_block(fs,phys)) { 
-		ERROR("Unable to free block in truncation\n");
+	    if (run_len && phys==run_start+run_len) {
+		run_len++;
+		continue;
+	    }
+	    if (run_len && free_block_run(fs,run_start,run_len)) { 
+		ERROR("Unable to free blocks in truncation\n");
 		return -1;
 	    }
+	    run_start = phys;
+	    run_len = 1;
+	}
+	if (run_len && free_block_run(fs,run_start,run_len)) { 
+	    ERROR("Unable to free blocks in truncation\n");
+	    return -1;
 	}
     } else if (new_file_size_blocks > file_size_blocks) {
 	// grow
 	uint64_t block;
 	uint8_t buf[block_size];
 	memset(buf,0,sizeof(buf));
-	for (block=file_size_blocks;block<new_file_size_blocks;block++) { 
-	    if (alloc_block(fs,&phys)) { 
-		ERROR("Unable to allocate block in truncation\n");
+	for (block=file_size_blocks;block<new_file_size_blocks;) { 
+	    uint32_t goal, start, got, i;
+
+	    // try to continue where the file leaves off
+	    if (block && !map_logical_to_physical_get(fs,inode_num,inode,block-1,&goal) && goal) {
+		goal++;
+	    } else {
+		goal = group_first_block(&fs->super,(inode_num-1)/inodes_per_group(&fs->super));
+	    }
+
+	    if (alloc_file_blocks(fs,inode_num,block,goal,new_file_size_blocks-block,&start,&got)) { 
+		ERROR("Unable to allocate blocks in truncation\n");
 		// should unwind previous allocations here...
 		return -1;
 	    }
-	    if (map_logical_to_physical_put(fs,inode_num,&inode,block,phys)) { 
-		ERROR("Unable to create mapping of logical block %lu to physical block %lu in truncation\n", block, phys);
-		// should unwind here
-		return -1;
-	    } 
-	    // zero block
-	    if (write_block(fs,phys,buf)) { 
-		ERROR("Unable to zero block on expansion\n");
-		return -1;
+
+	    for (i=0;i<got;i++,block++) {
+		phys = start + i;
+		if (map_logical_to_physical_put(fs,inode_num,inode,block,phys)) { 
+		    ERROR("Unable to create mapping of logical block %lu to physical block %u in truncation\n", block, phys);
+		    // should unwind here
+		    return -1;
+		} 
+		if (block*block_size>=keep_start && (block+1)*block_size<=keep_end) {
+		    // will be completely overwritten
+		    continue;
+		}
+		// zero block
+		if (write_block(fs,phys,buf)) { 
+		    ERROR("Unable to zero block on expansion\n");
+		    return -1;
+		}
 	    }
 	}
     } else {
 	// same size in terms of blocks
     }
 
-    set_file_size(fs, &inode, new_file_size_bytes);
-    inode.i_blocks = new_file_size_blocks;
+    set_file_size(fs, inode, new_file_size_bytes);
+    inode->i_blocks = new_file_size_blocks;
 
-    if (write_inode(fs,inode_num,&inode)) { 
+    if (write_inode(fs,inode_num,inode)) { 
 	ERROR("Failed to update inode with new sizes\n");
 	return -1;
     }
@@ -449,6 +513,22 @@ static int ext2_truncate(void *state, void *file, off_t len)
     return 0;
 
 }
+
+static int ext2_truncate(void *state, void *file, off_t len)
+{ 
+    struct ext2_state *fs = (struct ext2_state *)state;
+    uint32_t inode_num = (uint32_t)(uint64_t)file;
+    struct ext2_inode inode;   
+    
+    DEBUG("truncating inode %u to %lu bytes\n", inode_num, len);
+     
+    if (read_inode(fs,inode_num,&inode)) { 
+	ERROR("Failed to read inode %u\n",inode_num);
+	return -1;
+    }
+
+    return resize_file(fs,inode_num,&inode,len,0,0);
+}
  
 static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t offset, size_t num_bytes, int write)
 {
@@ -470,34 +550,24 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 
     //num_bytes = MIN(block_size*NUM_DATA_BLOCKS)-offset, num_bytes);
 
-    if (offset>=file_size_bytes) {
-	if (!write) {
-	    // handle read past end of file	
-	    DEBUG("Reading starts past end of file\n");
-	    return 0;
-	} else {
-	    // expand and zero fill if needed
-	    DEBUG("Writing starts past end of file - expanding and retrying\n");
-	    if (ext2_truncate(fs,file,offset+num_bytes-1)) { 
-		ERROR("file expansion failed\n");
-		return -1;
-	    } else {
-		return ext2_read_write(state, file, srcdest, offset, num_bytes, write);
-	    }
+    if (write && offset+num_bytes > file_size_bytes) { 
+	// expand in place, leaving the part we will write unzeroed
+	DEBUG("Writing continues past end of file - expanding\n");
+	if (resize_file(fs,inode_num,&inode,offset+num_bytes,offset,offset+num_bytes)) { 
+	    ERROR("file expansion failed\n");
+	    return -1;
 	}
+	file_size_bytes = offset+num_bytes;
+	file_size_blocks = CEIL_DIV(file_size_bytes,block_size);
     }
 
-    if (write) { 
-	if (offset+num_bytes > file_size_bytes) { 
-	    DEBUG("Writing continues past end of file - expanding and retrying\n");
-	    if (ext2_truncate(fs,file,offset+num_bytes-1)) { 
-		ERROR("file expansion failed\n");
-		return -1;
-	    } else {
-		return ext2_read_write(state, file, srcdest, offset, num_bytes, write);
-	    }
-	}
-    } else {
+    if (offset>=file_size_bytes) {
+	// handle read past end of file	
+	DEBUG("Reading starts past end of file\n");
+	return 0;
+    }
+
+    if (!write) {
 	num_bytes = MIN(file_size_bytes-offset,num_bytes);
     }
 
@@ -618,6 +688,53 @@ static ssize_t ext2_write(void *state, void *file, void *srcdest, off_t offset,
     return ext2_read_write(state,file,srcdest,offset,num_bytes,1);
 }
 
+// direct access to file data is possible only if the blocks holding
+// it are physically contiguous and the device can map them
+static void *ext2_map(void *state, void *file, off_t offset, size_t num_bytes)
+{
+    struct ext2_state *fs = (struct ext2_state *)state;
+    uint64_t block_size = get_block_size(fs);
+    uint32_t inode_num = (uint32_t)(uint64_t)file;
+    struct ext2_inode inode;
+    uint32_t first_logical, last_logical, cur, first_physical=0, physical;
+
+    if (!num_bytes) {
+	return 0;
+    }
+
+    if (read_inode(fs,inode_num,&inode)) { 
+	ERROR("Failed to read inode %u\n",inode_num);
+	return 0;
+    }
+
+    if (offset+num_bytes > get_file_size(fs,&inode)) {
+	DEBUG("Map extends past end of file\n");
+	return 0;
+    }
+
+    first_logical = FLOOR_DIV(offset,block_size);
+    last_logical = FLOOR_DIV(offset+num_bytes-1,block_size);
+
+    for (cur=first_logical;cur<=last_logical;cur++) {
+	if (map_logical_to_physical_get(fs,inode_num,&inode,cur,&physical)) { 
+	    ERROR("Unable to map logical block %u\n", cur);
+	    return 0;
+	}
+	if (cur==first_logical) {
+	    first_physical = physical;
+	} else if (physical != first_physical + (cur-first_logical)) {
+	    DEBUG("Inode %u is not contiguous at logical block %u\n",inode_num,cur);
+	    return 0;
+	}
+    }
+
+    void *p = nk_block_dev_map(fs->dev,
+			       FLOOR_DIV(first_physical*block_size,fs->chars.block_size),
+			       FLOOR_DIV((last_logical-first_logical+1)*block_size,fs->chars.block_size));
+
+    return p ? p + offset%block_size : 0;
+}
+
 
 /*
 static uint16_t dentry_find_len(struct ext2_dir_entry_2 *dentry) 
@@ -747,7 +864,8 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 	
     // reached end of line...
     if (op!=PUT) { 
-	return -1;
+	// not found - distinguished from failure so lookups can cache it
+	return 1;
     }
     
     // We are now in an add, so we need allocate new block and put
@@ -1128,9 +1246,15 @@ static void *ext2_create(void *state, char *path, int dir)
 
     if (write_inode(fs, inode_num, &newinode)) {
 	ERROR("Cannot write new inode\n");
+	dentry_remove(fs, dir_num, inode_num);
+	free_inode(fs,inode_num);
+	nk_fs_dcache_invalidate(fs->fs, dir_num, name);
 	free_split_path(parts,num_parts);
 	return 0;
     }
+
+    // replaces any negative entry for the name
+    nk_fs_dcache_insert(fs->fs, dir_num, name, inode_num);
     
     free_split_path(parts,num_parts);
 
@@ -1224,9 +1348,13 @@ int ext2_remove(void *state, char *path)
     // remove dentry 
     if (dentry_remove(fs, dir_num, inum)) { 
 	ERROR("Failed to remove directory entry\n");
+	free_split_path(parts,num_parts);
 	return -1;
     }
 
+    nk_fs_dcache_insert_negative(fs->fs, dir_num, name);
+    free_split_path(parts,num_parts);
+
     // truncate file
     if (ext2_truncate(fs, (void*)(uint64_t)inum, 0)) {
 	ERROR("Failed to truncate file during removal\n");
@@ -1238,6 +1366,10 @@ int ext2_remove(void *state, char *path)
 	return -1;
     }
 
+    nk_fs_icache_invalidate(fs->fs, inum);
+    // the inode number will be reused, so nothing may stay cached under it
+    nk_fs_dcache_invalidate_dir(fs->fs, inum);
+
     return 0;
 }
 
@@ -1283,8 +1415,234 @@ static struct nk_fs_int ext2_inter = {
     .close_file = ext2_close,
     .read_file = ext2_read,
     .write_file = ext2_write,
+    .map_file = ext2_map,
+};
+
+
+//
+// Attach-time scan
+//
+// Each block group's bitmaps and inode table are independent, so the
+// groups are split across tasks that read them concurrently, keeping
+// several device requests in flight.  The result is the in-memory group
+// table (descriptors and bitmaps) and an inode cache warmed with up to
+// SCAN_ICACHE_WARM_MAX inodes.
+//
+
+#define SCAN_TASKS_PER_CPU 4
+
+// most inodes the scan will put into the (shared, bounded) inode cache
+#define SCAN_ICACHE_WARM_MAX 1024
+
+struct scan_work {
+    struct nk_task         *task;      // null => run by the scanner itself
+    struct ext2_state      *fs;
+    struct ext2_group_info *groups;
+    uint32_t                first, stride;
+    sint64_t               *warm_left; // shared by all tasks of the scan
+    uint64_t                inodes_used;
+    uint64_t                blocks_free;
 };
 
+static int scan_group(struct ext2_state *fs, struct ext2_group_info *g, uint32_t gi,
+		      uint64_t *inodes_used, uint64_t *blocks_free, sint64_t *warm_left)
+{
+    uint32_t block_size = get_block_size(fs);
+    uint32_t ipg = inodes_per_group(&fs->super);
+    uint32_t itable_blocks = CEIL_DIV(ipg*sizeof(struct ext2_inode),block_size);
+    struct ext2_inode *itable;
+    uint32_t i;
+
+    g->block_bitmap = malloc(block_size);
+    g->inode_bitmap = malloc(block_size);
+
+    if (!g->block_bitmap || !g->inode_bitmap) {
+	ERROR("Cannot allocate bitmaps for group %u\n",gi);
+	return -1;
+    }
+
+    if (read_block(fs,g->desc.bg_block_bitmap,g->block_bitmap) ||
+	read_block(fs,g->desc.bg_inode_bitmap,g->inode_bitmap)) {
+	ERROR("Cannot read bitmaps for group %u\n",gi);
+	return -1;
+    }
+
+    if (extent_map_build(fs,g,gi)) {
+	ERROR("Cannot build free extent map for group %u\n",gi);
+	return -1;
+    }
+
+    for (i=0;i<g->num_free;i++) {
+	*blocks_free += g->free[i].len;
+    }
+
+    for (i=0;i<ipg;i++) {
+	if (g->inode_bitmap[i/8] & (1<<(i%8))) {
+	    (*inodes_used)++;
+	}
+    }
+
+    if (*(volatile sint64_t *)warm_left<=0) {
+	// cache is warm enough, skip reading the inode table
+	return 0;
+    }
+
+    itable = malloc(itable_blocks*block_size);
+
+    if (!itable) {
+	ERROR("Cannot allocate inode table buffer for group %u\n",gi);
+	return -1;
+    }
+
+    if (read_blocks(fs,g->desc.bg_inode_table,itable_blocks,itable)) {
+	ERROR("Cannot read inode table for group %u\n",gi);
+	free(itable);
+	return -1;
+    }
+
+    for (i=0;i<ipg;i++) {
+	if (g->inode_bitmap[i/8] & (1<<(i%8))) {
+	    if (__sync_fetch_and_sub(warm_left,1)<=0) {
+		break;
+	    }
+	    // inode numbers start at 1
+	    nk_fs_icache_insert(fs->fs,gi*ipg+i+1,&itable[i],sizeof(struct ext2_inode));
+	}
+    }
+
+    free(itable);
+
+    return 0;
+}
+
+static void *scan_task(void *in)
+{
+    struct scan_work *w = (struct scan_work *)in;
+    uint32_t gi;
+
+    for (gi=w->first;gi<w->fs->num_groups;gi+=w->stride) {
+	if (scan_group(w->fs,&w->groups[gi],gi,&w->inodes_used,&w->blocks_free,w->warm_left)) {
+	    return (void*)-1;
+	}
+    }
+
+    return 0;
+}
+
+static void free_groups(struct ext2_group_info *groups, uint32_t num_groups)
+{
+    uint32_t i;
+
+    for (i=0;i<num_groups;i++) {
+	if (groups[i].block_bitmap) { free(groups[i].block_bitmap); }
+	if (groups[i].inode_bitmap) { free(groups[i].inode_bitmap); }
+	if (groups[i].free) { free(groups[i].free); }
+    }
+    free(groups);
+}
+
+static int scan_fs(struct ext2_state *fs)
+{
+    uint32_t block_size = get_block_size(fs);
+    uint32_t num_groups = CEIL_DIV(fs->super.s_inodes_count,inodes_per_group(&fs->super));
+    uint32_t desc_per_block = block_size/sizeof(struct ext2_group_desc);
+    uint32_t desc_blocks = CEIL_DIV(num_groups,desc_per_block);
+    uint32_t desc_start = FLOOR_DIV(SUPERBLOCK_OFFSET+SUPERBLOCK_SIZE,block_size);
+    struct ext2_group_desc *descs = 0;
+    struct ext2_group_info *groups = 0;
+    struct scan_work *work = 0;
+    uint32_t num_tasks, i;
+    uint64_t inodes_used=0, blocks_free=0;
+    sint64_t warm_left = SCAN_ICACHE_WARM_MAX;
+    uint64_t start = nk_sched_get_realtime();
+    int rc = 0;
+
+    fs->num_groups = num_groups;
+
+    groups = malloc(num_groups*sizeof(*groups));
+    descs = malloc(desc_blocks*block_size);
+
+    if (!groups || !descs) {
+	ERROR("Cannot allocate group table for %u groups\n",num_groups);
+	goto out_bad;
+    }
+
+    memset(groups,0,num_groups*sizeof(*groups));
+
+    // the descriptor table itself is small and read in one request
+    if (read_blocks(fs,desc_start,desc_blocks,descs)) {
+	ERROR("Cannot read group descriptor table\n");
+	goto out_bad;
+    }
+
+    for (i=0;i<num_groups;i++) {
+	groups[i].desc = descs[i];
+    }
+
+    free(descs);
+    descs = 0;
+
+    num_tasks = MIN(num_groups, nk_get_num_cpus()*SCAN_TASKS_PER_CPU);
+
+    work = malloc(num_tasks*sizeof(*work));
+
+    if (!work) {
+	ERROR("Cannot allocate scan work\n");
+	goto out_bad;
+    }
+
+    memset(work,0,num_tasks*sizeof(*work));
+
+    for (i=0;i<num_tasks;i++) {
+	work[i].fs = fs;
+	work[i].groups = groups;
+	work[i].first = i;
+	work[i].stride = num_tasks;
+	work[i].warm_left = &warm_left;
+#ifdef NAUT_CONFIG_EXT2_PARALLEL_SCAN
+	work[i].task = nk_task_produce(-1,0,scan_task,&work[i],0);
+#endif
+	if (!work[i].task) {
+	    // do it ourselves
+	    rc |= scan_task(&work[i])!=0;
+	}
+    }
+
+    for (i=0;i<num_tasks;i++) {
+	void *out = 0;
+	if (work[i].task) {
+	    if (nk_task_wait(work[i].task,&out,0)) {
+		ERROR("Failed to wait on scan task %u\n",i);
+		rc = 1;
+	    }
+	    rc |= out!=0;
+	}
+	inodes_used += work[i].inodes_used;
+	blocks_free += work[i].blocks_free;
+    }
+
+    if (rc) {
+	ERROR("Scan of block groups failed\n");
+	goto out_bad;
+    }
+
+    free(work);
+
+    fs->groups = groups;
+
+    INFO("scanned %u block groups of %s with %u tasks in %lu ns (%lu inodes in use, %lu blocks free)\n",
+	 num_groups, fs->fs->name, num_tasks, nk_sched_get_realtime()-start, inodes_used, blocks_free);
+
+    return 0;
+
+ out_bad:
+    if (descs) { free(descs); }
+    if (work) { free(work); }
+    if (groups) { free_groups(groups,num_groups); }
+    fs->num_groups = 0;
+    return -1;
+}
+
 
 int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 {
@@ -1304,6 +1662,7 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 
     memset(s,0,sizeof(*s));
 
+    spinlock_init(&s->alloc_lock);
     s->dev = dev;
     
     if (nk_block_dev_get_characteristics(dev,&s->chars)) { 
@@ -1330,6 +1689,11 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 	return -1;
     }
 
+    // without the group table, we simply go to the device on every access
+    if (scan_fs(s)) {
+	ERROR("Unable to scan filesystem %s, continuing without in-memory metadata\n", fsname);
+    }
+
     INFO("filesystem %s on device %s is attached (%s)\n", fsname, devname, readonly ?  "readonly" : "read/write");
     
     return 0;
@@ -1341,6 +1705,11 @@ int nk_fs_ext2_detach(char *fsname)
     if (!fs) { 
 	return -1;
     } else {
+	struct ext2_state *s = (struct ext2_state *)fs->state;
+	if (s->groups) {
+	    free_groups(s->groups,s->num_groups);
+	    s->groups = 0;
+	}
 	return nk_fs_unregister(fs);
     }
 }
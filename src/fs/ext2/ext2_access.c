@@ -133,6 +133,24 @@ static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *sr
 #define read_block(fs,block_num,dest)  read_write_block(fs,block_num,dest,0)
 #define write_block(fs,block_num,src)  read_write_block(fs,block_num,src,1)
 
+// bulk read of consecutive blocks in a single device request
+static int read_blocks(struct ext2_state *fs, uint32_t block_num, uint32_t count, void *dest)
+{
+    uint32_t block_size = get_block_size(fs);
+    uint64_t dev_offset = FLOOR_DIV((uint64_t)block_num*block_size,fs->chars.block_size);
+    uint64_t dev_num    = FLOOR_DIV((uint64_t)count*block_size,fs->chars.block_size);
+
+    DEBUG("reading blocks [%u,%u) on fs %s / dev %s\n",
+	  block_num, block_num+count, fs->fs->name, fs->dev->dev.name);
+
+    if (nk_block_dev_read(fs->dev,dev_offset,dev_num,dest,NK_DEV_REQ_BLOCKING,0,0)) { 
+	ERROR("Failed to read blocks [%u,%u) due to device error\n",block_num,block_num+count);
+	return -1;
+    }
+
+    return 0;
+}
+
 
 #define blocks_per_group(sb) ((sb)->s_blocks_per_group)
 #define inodes_per_group(sb) ((sb)->s_inodes_per_group)
@@ -160,6 +178,11 @@ static int read_write_block_group(struct ext2_state* fs, uint32_t block_group_nu
 
     DEBUG("%sing block group descriptor %u (block_num=%u) on fs %s\n",
 	  rw[write], block_group_num, block_num, fs->fs->name);
+
+    if (!write && fs->groups && block_group_num<fs->num_groups) {
+	*srcdest = fs->groups[block_group_num].desc;
+	return 0;
+    }
     
     uint8_t buf[block_size];
     struct ext2_group_desc *d = (struct ext2_group_desc *)buf;
@@ -175,6 +198,10 @@ static int read_write_block_group(struct ext2_state* fs, uint32_t block_group_nu
 	    ERROR("Cannot write block group\n");
 	    return -1;
 	} else {
+	    // the cached copy follows the device only once it has succeeded
+	    if (fs->groups && block_group_num<fs->num_groups) {
+		fs->groups[block_group_num].desc = *srcdest;
+	    }
 	    return 0;
 	}
 	// TODO: update shadow copies
@@ -199,6 +226,12 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
 
     write &= 0x1;
 
+    if (!write && fs->fs && 
+	nk_fs_icache_lookup(fs->fs,inode_num,srcdest,sizeof(*srcdest))==NK_FS_DCACHE_HIT) {
+	DEBUG("inode %u found in inode cache\n", inode_num);
+	return 0;
+    }
+
     if (read_block_group(fs,inode_num/inodes_per_group(&fs->super),&bg)) { 
 	ERROR("Cannot read block group\n");
 	return -1;
@@ -224,14 +257,21 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
 	inode_table[inode_offset] = *srcdest;
 	if (write_block(fs,inode_block,buf)) { 
 	    ERROR("Cannot write inode block\n");
+	    if (fs->fs) { 
+		nk_fs_icache_invalidate(fs->fs,inode_num);
+	    }
 	    return -1;
-	} else {
-	    return 0;
 	}
     } else {
 	*srcdest = inode_table[inode_offset];
-	return 0;
     }
+
+    // inode cache is write-through
+    if (fs->fs) { 
+	nk_fs_icache_insert(fs->fs,inode_num,srcdest,sizeof(*srcdest));
+    }
+
+    return 0;
 }
 
 #define read_inode(fs,inode_num,dest)  read_write_inode(fs,inode_num,dest,0)
@@ -310,17 +350,37 @@ static uint32_t get_inode_num_from_dir(struct ext2_state *fs,
     struct ext2_dir_entry_2 dentry;
     uint32_t inum;
 
+    uint64_t cached;
+    int rc;
+
     DEBUG("get_inode_num_from_dir on %s, inode_num=%u, dir=%p, search=%s\n",
 	  fs->fs->name,inode_num,dir,name);
 
+    switch (nk_fs_dcache_lookup(fs->fs,inode_num,name,&cached)) {
+    case NK_FS_DCACHE_HIT:
+	return (uint32_t)cached;
+    case NK_FS_DCACHE_NEGATIVE:
+	DEBUG("%s is a cached negative entry\n",name);
+	return 0;
+    default:
+	break;
+    }
+
     strcpy(dentry.name,name);
     dentry.name_len=strlen(name);
     dentry.rec_len=EXT2_DIR_REC_LEN(dentry.name_len);
     
-    if (dentry_get_put_del(fs,inode_num,dir,&dentry,GET)) { 
+    rc = dentry_get_put_del(fs,inode_num,dir,&dentry,GET);
+
+    if (rc<0) { 
 	ERROR("Failed to get directory entry for %s\n",name);
 	return 0;
+    } else if (rc>0) {
+	DEBUG("No directory entry for %s\n",name);
+	nk_fs_dcache_insert_negative(fs->fs,inode_num,name);
+	return 0;
     } else {
+	nk_fs_dcache_insert(fs->fs,inode_num,name,dentry.inode);
 	return dentry.inode;
     }
 
@@ -418,7 +478,7 @@ static uint32_t get_inode_num_by_path(struct ext2_state *fs, char *path)
 	DEBUG("Considering part %s\n",cur_part);
 	new_inode_num = get_inode_num_from_dir(fs, cur_inode_num, &cur_inode, cur_part);
 	if (!new_inode_num) {
-	    ERROR("Finished search and did not find element %s\n",cur_part);
+	    DEBUG("Finished search and did not find element %s\n",cur_part);
 	    free_split_path(parts,num_parts);
 	    return 0;
 	}
@@ -451,7 +511,8 @@ static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
     free &= 0x1;
 
     if (free) { 
-	bg_start = bg_end = (*num-1)/inodes_per_group(&fs->super);
+	bg_start = (*num-1)/inodes_per_group(&fs->super);
+	bg_end = bg_start + 1;
     } else {
 	bg_start = 0;
 	bg_end = num_block_groups(&fs->super);
@@ -464,7 +525,9 @@ static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
 	    return -1;
 	}
 	
-	if (read_block(fs,bg.bg_inode_bitmap,buf)) { 
+	if (fs->groups) {
+	    memcpy(buf,fs->groups[bgi].inode_bitmap,block_size);
+	} else if (read_block(fs,bg.bg_inode_bitmap,buf)) { 
 	    ERROR("Failed to read inode bitmap in inode %s\n", af[free]);
 	    return -1;
 	}
@@ -480,6 +543,7 @@ static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
 	    byte = actual/8;
 	    bit = actual%8;
 	    buf[byte] &= ~(0x1<<bit);
+	    goto out_good;
 	} else {
 	    for (byte=0; byte<block_size; byte++) {
 		cur_byte = buf[byte];
@@ -504,6 +568,10 @@ static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
 	ERROR("Failed to write inode bitmap in inode %s\n", af[free]);
 	return -1;
     }
+
+    if (fs->groups) {
+	memcpy(fs->groups[bgi].inode_bitmap,buf,block_size);
+    }
     
     return 0;
 }
@@ -512,6 +580,13 @@ static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
 #define free_inode(fs,num) alloc_free_inode(fs,&(num),1)
 
 
+// bit i of group g's block bitmap describes this block
+#define group_first_block(sb,g)  ((sb)->s_first_data_block + (g)*blocks_per_group(sb))
+#define block_group(sb,b)        (((b) - (sb)->s_first_data_block)/blocks_per_group(sb))
+#define block_index(sb,b)        (((b) - (sb)->s_first_data_block)%blocks_per_group(sb))
+
+// Allocate or free a single block using only the on-disk bitmaps
+// this is used if the in-memory maps are not available
 static int alloc_free_block(struct ext2_state *fs, uint32_t *num, int free)
 {
     char *af[2] = { "alloc", "free" };
@@ -524,7 +599,8 @@ static int alloc_free_block(struct ext2_state *fs, uint32_t *num, int free)
     free &= 0x1;
 
     if (free) { 
-	bg_start = bg_end = *num/blocks_per_group(&fs->super);
+	bg_start = block_group(&fs->super,*num);
+	bg_end = bg_start + 1;
     } else {
 	bg_start = 0;
 	bg_end = num_block_groups(&fs->super);
@@ -548,28 +624,29 @@ static int alloc_free_block(struct ext2_state *fs, uint32_t *num, int free)
     
 	if (free) { 
 	    uint32_t actual;
-	    actual = *num;  // inode numbers start with 0 
-	    actual %= blocks_per_group(&fs->super); // we want index in this group
+	    actual = block_index(&fs->super,*num); // we want index in this group
 	    byte = actual/8;
 	    bit = actual%8;
 	    buf[byte] &= ~(0x1<<bit);
+	    goto out_good;
 	} else {
-	    for (byte=0; byte<block_size; byte++) {
+	    for (byte=0; byte<blocks_per_group(&fs->super)/8; byte++) {
 		cur_byte = buf[byte];
 		for (bit=0; bit < 8; bit++, cur_byte>>=1) {
 		    if (!(cur_byte & 0x01)) {
 			buf[byte] |= (0x1 << bit);
-			*num = byte*8 + bit ; //first block number is 0
-			*num += bgi*blocks_per_group(&fs->super); // we want block index on whole volume
+			*num = group_first_block(&fs->super,bgi) + byte*8 + bit; // we want block index on whole volume
 			goto out_good;
 		    }
 		}
 	    }
-	    // if we got here, we could not find anything...
-	    *num=0;
-	    return -1;
+	    // nothing in this group, try the next one
 	}
     }
+
+    // if we got here, we could not find anything...
+    *num=0;
+    return -1;
     
  out_good:
 
@@ -581,5 +658,469 @@ static int alloc_free_block(struct ext2_state *fs, uint32_t *num, int free)
     return 0;
 }
 
-#define alloc_block(fs,num) alloc_free_block(fs,num,0)
-#define free_block(fs,num) alloc_free_block(fs,&(num),1)
+
+//
+// In-memory free-extent maps
+//
+// Each group keeps its free space as a sorted array of extents, built
+// from the block bitmap when the filesystem is attached.  Blocks are
+// taken from these maps in runs, and only then marked in the bitmap.
+// A run can also be reserved for an inode's preallocation window, in
+// which case it is missing from the maps but still free on disk until
+// the inode actually uses it.  alloc_lock covers the maps, the
+// in-memory bitmaps, and the windows.
+//
+// Since alloc_lock is held with interrupts off, a map is never grown
+// under it.  An operation that finds no room for another extent fails
+// without changing anything and names the group, and the caller grows
+// that group's map with extent_grow() and tries again.
+//
+
+// caller must have checked for room
+static void extent_insert(struct ext2_group_info *g, uint32_t pos, uint32_t start, uint32_t len)
+{
+    memmove(&g->free[pos+1],&g->free[pos],(g->num_free-pos)*sizeof(*g->free));
+    g->free[pos].start = start;
+    g->free[pos].len = len;
+    g->num_free++;
+}
+
+// make room for at least one more extent in a group's map
+// alloc_lock must NOT be held
+static int extent_grow(struct ext2_state *fs, struct ext2_group_info *g)
+{
+    struct ext2_extent *e;
+    uint32_t n;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&fs->alloc_lock);
+    n = g->max_free ? 2*g->max_free : 16;
+    spin_unlock_irq_restore(&fs->alloc_lock,flags);
+
+    e = malloc(n*sizeof(*e));
+    if (!e) {
+	ERROR("Cannot expand free extent map\n");
+	return -1;
+    }
+
+    flags = spin_lock_irq_save(&fs->alloc_lock);
+    if (g->max_free<n) {
+	// still needed - swap in the new array
+	struct ext2_extent *old = g->free;
+	if (old) {
+	    memcpy(e,old,g->num_free*sizeof(*e));
+	}
+	g->free = e;
+	g->max_free = n;
+	e = old;
+    }
+    spin_unlock_irq_restore(&fs->alloc_lock,flags);
+
+    if (e) {
+	free(e);
+    }
+
+    return 0;
+}
+
+static void extent_delete(struct ext2_group_info *g, uint32_t pos)
+{
+    memmove(&g->free[pos],&g->free[pos+1],(g->num_free-pos-1)*sizeof(*g->free));
+    g->num_free--;
+}
+
+// build a group's map from its bitmap, before the group is in use
+static int extent_map_build(struct ext2_state *fs, struct ext2_group_info *g, uint32_t gi)
+{
+    uint32_t first = group_first_block(&fs->super,gi);
+    uint32_t n = MIN(blocks_per_group(&fs->super), fs->super.s_blocks_count - first);
+    uint32_t i, run, count;
+
+    // size the map for the extents present plus some headroom
+    for (i=0,run=0,count=0;i<=n;i++) {
+	if (i<n && !(g->block_bitmap[i/8] & (1<<(i%8)))) {
+	    run++;
+	} else if (run) {
+	    count++;
+	    run = 0;
+	}
+    }
+
+    g->max_free = count + 16;
+    g->free = malloc(g->max_free*sizeof(*g->free));
+
+    if (!g->free) {
+	ERROR("Cannot allocate free extent map\n");
+	g->max_free = 0;
+	return -1;
+    }
+
+    for (i=0,run=0;i<=n;i++) {
+	if (i<n && !(g->block_bitmap[i/8] & (1<<(i%8)))) {
+	    run++;
+	} else if (run) {
+	    extent_insert(g,g->num_free,first+i-run,run);
+	    run = 0;
+	}
+    }
+
+    return 0;
+}
+
+// Take up to want blocks from a single free extent, preferring one
+// that starts at goal, then one large enough that follows it, then
+// the largest in the group.  Groups are searched starting with goal's.
+// Fails with *grow set if splitting an extent needs room in the map.
+// alloc_lock must be held
+static int extent_take(struct ext2_state *fs, uint32_t goal, uint32_t want, uint32_t *start, uint32_t *got,
+		       struct ext2_group_info **grow)
+{
+    uint32_t g0 = goal>=fs->super.s_first_data_block ? block_group(&fs->super,goal) : 0;
+    uint32_t k, i;
+
+    if (g0>=fs->num_groups) {
+	g0 = 0;
+    }
+
+    for (k=0;k<fs->num_groups;k++) {
+	struct ext2_group_info *g = &fs->groups[(g0+k)%fs->num_groups];
+	int after = -1, fit = -1, largest = -1, best;
+
+	for (i=0;i<g->num_free;i++) {
+	    struct ext2_extent *e = &g->free[i];
+	    if (!k && goal>=e->start && goal<e->start+e->len) {
+		// goal is free - take from it, splitting the extent if needed
+		if (goal!=e->start && goal+want<e->start+e->len && g->num_free==g->max_free) {
+		    *grow = g;
+		    return -1;
+		}
+		*start = goal;
+		*got = MIN(want, e->start+e->len-goal);
+		if (goal==e->start) {
+		    e->start += *got;
+		    e->len -= *got;
+		    if (!e->len) {
+			extent_delete(g,i);
+		    }
+		} else {
+		    uint32_t tail_start = goal + *got;
+		    uint32_t tail_len = e->start + e->len - tail_start;
+		    e->len = goal - e->start;
+		    if (tail_len) {
+			extent_insert(g,i+1,tail_start,tail_len);
+		    }
+		}
+		return 0;
+	    }
+	    if (!k && after<0 && e->start>goal && e->len>=want) {
+		after = i;
+	    }
+	    if (fit<0 && e->len>=want) {
+		fit = i;
+	    }
+	    if (largest<0 || e->len>g->free[largest].len) {
+		largest = i;
+	    }
+	}
+
+	best = after>=0 ? after : fit>=0 ? fit : largest;
+
+	if (best>=0) {
+	    struct ext2_extent *e = &g->free[best];
+	    *start = e->start;
+	    *got = MIN(want,e->len);
+	    e->start += *got;
+	    e->len -= *got;
+	    if (!e->len) {
+		extent_delete(g,best);
+	    }
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+// give a run back to the map, merging with neighbors
+// Fails with *grow set if the map has no room for a new extent.
+// alloc_lock must be held
+static int extent_give(struct ext2_state *fs, uint32_t start, uint32_t len, struct ext2_group_info **grow)
+{
+    struct ext2_group_info *g = &fs->groups[block_group(&fs->super,start)];
+    uint32_t i;
+
+    for (i=0;i<g->num_free && g->free[i].start<start;i++) {
+    }
+
+    if (i>0 && g->free[i-1].start+g->free[i-1].len==start) {
+	g->free[i-1].len += len;
+	if (i<g->num_free && start+len==g->free[i].start) {
+	    g->free[i-1].len += g->free[i].len;
+	    extent_delete(g,i);
+	}
+	return 0;
+    }
+
+    if (i<g->num_free && start+len==g->free[i].start) {
+	g->free[i].start = start;
+	g->free[i].len += len;
+	return 0;
+    }
+
+    if (g->num_free==g->max_free) {
+	*grow = g;
+	return -1;
+    }
+
+    extent_insert(g,i,start,len);
+    return 0;
+}
+
+// mark a run (within one group) used or free in the bitmap and
+// write the bitmap block back
+static int mark_blocks(struct ext2_state *fs, uint32_t start, uint32_t len, int used)
+{
+    uint32_t gi = block_group(&fs->super,start);
+    struct ext2_group_info *g = &fs->groups[gi];
+    uint32_t block_size = get_block_size(fs);
+    uint8_t buf[block_size];
+    uint32_t i;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&fs->alloc_lock);
+    for (i=block_index(&fs->super,start);i<block_index(&fs->super,start)+len;i++) {
+	if (used) {
+	    g->block_bitmap[i/8] |= (1<<(i%8));
+	} else {
+	    g->block_bitmap[i/8] &= ~(1<<(i%8));
+	}
+    }
+    memcpy(buf,g->block_bitmap,block_size);
+    spin_unlock_irq_restore(&fs->alloc_lock,flags);
+
+    if (write_block(fs,g->desc.bg_block_bitmap,buf)) { 
+	ERROR("Failed to write block bitmap of group %u\n",gi);
+	return -1;
+    }
+
+    return 0;
+}
+
+// allocate a run of up to want blocks, as close to goal as possible
+static int alloc_block_run(struct ext2_state *fs, uint32_t goal, uint32_t want, uint32_t *start, uint32_t *got)
+{
+    struct ext2_group_info *grow;
+    uint8_t flags;
+    int rc;
+
+    if (!fs->groups) {
+	*got = 1;
+	return alloc_free_block(fs,start,0);
+    }
+
+    do {
+	grow = 0;
+	flags = spin_lock_irq_save(&fs->alloc_lock);
+	rc = extent_take(fs,goal,want,start,got,&grow);
+	spin_unlock_irq_restore(&fs->alloc_lock,flags);
+    } while (rc && grow && !extent_grow(fs,grow));
+
+    if (rc) {
+	ERROR("No free blocks\n");
+	return -1;
+    }
+
+    DEBUG("allocated blocks [%u,%u) for goal %u\n",*start,*start+*got,goal);
+
+    return mark_blocks(fs,*start,*got,1);
+}
+
+// free a run of blocks, which may span groups
+static int free_block_run(struct ext2_state *fs, uint32_t start, uint32_t len)
+{
+    struct ext2_group_info *grow;
+    uint8_t flags;
+    int rc;
+
+    DEBUG("freeing blocks [%u,%u)\n",start,start+len);
+
+    if (!fs->groups) {
+	uint32_t i;
+	for (i=start;i<start+len;i++) {
+	    if (alloc_free_block(fs,&i,1)) {
+		return -1;
+	    }
+	}
+	return 0;
+    }
+
+    while (len) {
+	uint32_t n = MIN(len, blocks_per_group(&fs->super) - block_index(&fs->super,start));
+	if (mark_blocks(fs,start,n,0)) {
+	    return -1;
+	}
+	do {
+	    grow = 0;
+	    flags = spin_lock_irq_save(&fs->alloc_lock);
+	    rc = extent_give(fs,start,n,&grow);
+	    spin_unlock_irq_restore(&fs->alloc_lock,flags);
+	} while (rc && grow && !extent_grow(fs,grow));
+	if (rc) {
+	    // free on disk, but lost to the map until the next attach
+	    ERROR("Cannot return blocks [%u,%u) to free map\n",start,start+n);
+	}
+	start += n;
+	len -= n;
+    }
+
+    return 0;
+}
+
+static int alloc_one_block(struct ext2_state *fs, uint32_t *num)
+{
+    uint32_t got;
+    return alloc_block_run(fs,0,1,num,&got);
+}
+
+#define alloc_block(fs,num) alloc_one_block(fs,num)
+#define free_block(fs,num) free_block_run(fs,num,1)
+
+
+//
+// Per-inode preallocation windows
+//
+// A streaming writer's next blocks are reserved (taken from the free
+// maps, but not marked on disk) so that successive appends get
+// physically contiguous blocks even if other files are growing at the
+// same time.  A window serves only the logical block right after the
+// last one it handed out.  Unused blocks go back to the free maps
+// when the file is closed or shrunk, or when the slot is reused.
+//
+
+static struct ext2_prealloc *prealloc_find(struct ext2_state *fs, uint32_t inode_num)
+{
+    int i;
+    for (i=0;i<EXT2_PREALLOC_WINDOWS;i++) {
+	if (fs->prealloc[i].inode==inode_num) {
+	    return &fs->prealloc[i];
+	}
+    }
+    return 0;
+}
+
+// on failure, *grow is set and the window is left intact
+// alloc_lock must be held
+static int prealloc_release_locked(struct ext2_state *fs, struct ext2_prealloc *p,
+				   struct ext2_group_info **grow)
+{
+    if (p->len) {
+	DEBUG("releasing window [%u,%u) of inode %u\n",p->start,p->start+p->len,p->inode);
+	if (extent_give(fs,p->start,p->len,grow)) {
+	    return -1;
+	}
+    }
+    memset(p,0,sizeof(*p));
+    return 0;
+}
+
+static void prealloc_release(struct ext2_state *fs, uint32_t inode_num)
+{
+    struct ext2_group_info *grow;
+    struct ext2_prealloc *p;
+    uint8_t flags;
+    int rc;
+
+    if (!fs->groups) {
+	return;
+    }
+
+    do {
+	grow = 0;
+	rc = 0;
+	flags = spin_lock_irq_save(&fs->alloc_lock);
+	if ((p = prealloc_find(fs,inode_num))) {
+	    rc = prealloc_release_locked(fs,p,&grow);
+	}
+	spin_unlock_irq_restore(&fs->alloc_lock,flags);
+    } while (rc && grow && !extent_grow(fs,grow));
+}
+
+// Allocate up to want blocks to back the inode's logical blocks starting
+// at logical, using the inode's window if it lines up, and otherwise
+// opening a new window near goal
+static int alloc_file_blocks(struct ext2_state *fs, uint32_t inode_num, uint32_t logical, uint32_t goal,
+			     uint32_t want, uint32_t *start, uint32_t *got)
+{
+    struct ext2_group_info *grow;
+    struct ext2_prealloc *p;
+    uint32_t run_start, run_len;
+    uint8_t flags;
+    int i;
+
+    if (!fs->groups) {
+	return alloc_block_run(fs,goal,want,start,got);
+    }
+
+ retry:
+    grow = 0;
+
+    flags = spin_lock_irq_save(&fs->alloc_lock);
+
+    p = prealloc_find(fs,inode_num);
+
+    if (p && !(p->len && p->logical==logical)) {
+	// not sequential - drop the window
+	if (prealloc_release_locked(fs,p,&grow)) {
+	    goto out_grow;
+	}
+	p = 0;
+    }
+
+    if (!p) {
+	// claim a slot, evicting the least recently used window
+	p = &fs->prealloc[0];
+	for (i=1;i<EXT2_PREALLOC_WINDOWS;i++) {
+	    if (fs->prealloc[i].last_use < p->last_use) {
+		p = &fs->prealloc[i];
+	    }
+	}
+	if (prealloc_release_locked(fs,p,&grow)) {
+	    goto out_grow;
+	}
+	// cover this request and leave a full window after it
+	if (extent_take(fs,goal,MIN(want+EXT2_PREALLOC_BLOCKS,blocks_per_group(&fs->super)),
+			&run_start,&run_len,&grow)) {
+	    if (grow) {
+		goto out_grow;
+	    }
+	    spin_unlock_irq_restore(&fs->alloc_lock,flags);
+	    ERROR("No free blocks\n");
+	    return -1;
+	}
+	p->inode = inode_num;
+	p->logical = logical;
+	p->start = run_start;
+	p->len = run_len;
+    }
+
+    *start = p->start;
+    *got = MIN(want,p->len);
+    p->start += *got;
+    p->len -= *got;
+    p->logical += *got;
+    p->last_use = ++fs->prealloc_clock;
+
+    spin_unlock_irq_restore(&fs->alloc_lock,flags);
+
+    DEBUG("inode %u logical %u gets blocks [%u,%u), %u left in window\n",
+	  inode_num,logical,*start,*start+*got,p->len);
+
+    return mark_blocks(fs,*start,*got,1);
+
+ out_grow:
+    spin_unlock_irq_restore(&fs->alloc_lock,flags);
+    if (extent_grow(fs,grow)) {
+	return -1;
+    }
+    goto retry;
+}
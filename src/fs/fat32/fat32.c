@@ -37,6 +37,49 @@
 
 static int fat32_exists(void *state, char *path);
 
+// Drop the cached lookups of the last component of an (upper case)
+// path, under each of the keys path_lookup() may have used for it
+static void forget_name(struct fat32_state *fs, char *path)
+{
+    int num_parts;
+    char **parts = split_path(path, &num_parts);
+    char dir_path[strlen(path)+1];
+    char *slash;
+    uint32_t dir_cluster_num;
+    uint32_t parent;
+    dir_entry dir_ent;
+
+    if (!num_parts) {
+	free_split_path(parts,num_parts);
+	return;
+    }
+
+    strcpy(dir_path, path);
+    slash = strrchr(dir_path, '/');
+    if (slash) {
+	*slash = 0;
+    } else {
+	dir_path[0] = 0;
+    }
+
+    if (!dir_path[0]) {
+	parent = fs->bootrecord.rootdir_cluster;
+    } else if (path_lookup(fs, dir_path, &dir_cluster_num, &dir_ent, 1) != -1) {
+	parent = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);
+    } else {
+	// cannot find the parent to key on
+	nk_fs_cache_flush(fs->fs);
+	free_split_path(parts,num_parts);
+	return;
+    }
+
+    nk_fs_dcache_invalidate(fs->fs, parent, parts[num_parts-1]);
+    nk_fs_dcache_invalidate(fs->fs, parent | DCACHE_DIR_KEY, parts[num_parts-1]);
+    nk_fs_dcache_invalidate(fs->fs, parent | DCACHE_FILE_KEY, parts[num_parts-1]);
+
+    free_split_path(parts,num_parts);
+}
+
 static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t offset, size_t num_bytes, int write)
 {
     char *rw[2] = {"read","write"};
@@ -210,6 +253,9 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
             uint32_t new_file_size = offset + num_bytes; 
             dir_buf[dir_num].size = new_file_size; 
 
+            // cached copy of the directory entry is now stale
+            nk_fs_icache_invalidate(fs->fs, DENTRY_LOC(dir_cluster_num, dir_num));
+
             if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, dir_buf, NK_DEV_REQ_BLOCKING,0,0)) {
                 ERROR("Failed to write block.\n");
 		// unwind... 
@@ -427,13 +473,20 @@ static void *fat32_create(void *state, char *path, int isdir)
 
 static void *fat32_create_file(void *state, char *path)
 {
-    return fat32_create(state, path, 0);
+    void *f = fat32_create(state, path, 0);
+
+    // the name may be cached as a negative entry
+    forget_name((struct fat32_state *)state, path);
+
+    return f;
 }
 
 static int fat32_create_dir(void *state, char *path)
 {
     void *f = fat32_create(state,path,1);
 
+    forget_name((struct fat32_state *)state, path);
+
     if (!f) {
         return -1;
     } else {
@@ -489,6 +542,16 @@ int fat32_remove(void *state, char *path)
 	return -1;
     }
 
+    forget_name(fs, path);
+    nk_fs_icache_invalidate(fs->fs, DENTRY_LOC(dir_cluster_num, dir_num));
+    if (dir_ent.attri.each_att.dir) {
+	// its cluster may be reused, so drop whatever was found in it
+	uint32_t dir_cluster = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);
+	nk_fs_dcache_invalidate_dir(fs->fs, dir_cluster);
+	nk_fs_dcache_invalidate_dir(fs->fs, dir_cluster | DCACHE_DIR_KEY);
+	nk_fs_dcache_invalidate_dir(fs->fs, dir_cluster | DCACHE_FILE_KEY);
+    }
+
     //remove the directory entry
     dir_entry full_dirs[FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry))];
     if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
@@ -624,6 +687,8 @@ static int fat32_truncate(void *state, void *file, off_t len)
     }
     full_dirs[dir_num].size = (uint32_t) new_file_size; 
 
+    nk_fs_icache_invalidate(fs->fs, DENTRY_LOC(dir_cluster_num, dir_num));
+
     if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
 	ERROR("Failed to write block\n");
 	return -1;
@@ -257,8 +257,25 @@ static char* toUpperCase(char* s)
     return s;
 }
 
+// dentry cache keys for the final component of a lookup are tagged
+// so that directory-style and file-style parses of a name do not collide
+#define DCACHE_DIR_KEY         (1UL<<63)
+#define DCACHE_FILE_KEY        (1UL<<62)
+// dentry cache value / inode cache key for a directory entry
+#define DENTRY_LOC(cluster,index)  ((((uint64_t)(cluster))<<32) | (uint32_t)(index))
+#define DENTRY_LOC_CLUSTER(loc)    ((uint32_t)((loc)>>32))
+#define DENTRY_LOC_INDEX(loc)      ((int)((loc) & 0xffffffff))
+
 static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_cluster_num, dir_entry* file_entry, int is_dir)
 {
+    uint32_t local_dir_cluster_num;
+    uint32_t parent_cluster_num;
+    uint64_t cached;
+
+    if (!dir_cluster_num) {
+	dir_cluster_num = &local_dir_cluster_num;
+    }
+
     // if look for root
     if (path[0] == 0) {
 	DEBUG("path_lookup: path is emtpy, trying to loop up root directory");
@@ -287,6 +304,13 @@ static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_clu
 	int dir_len = strlen(dir_name);
 	DEBUG("dir_len is %d\n", dir_len);
 	DEBUG("dir_name is %s\n", dir_name);
+	if (nk_fs_dcache_lookup(state->fs, *dir_cluster_num, dir_name, &cached) == NK_FS_DCACHE_HIT) {
+	    DEBUG("directory %s found in dentry cache\n", dir_name);
+	    *dir_cluster_num = (uint32_t)cached;
+	    dir_sector = get_sector_num(*dir_cluster_num, state);
+	    continue;
+	}
+	parent_cluster_num = *dir_cluster_num;
 	while(! (*dir_cluster_num >= EOC_MIN && *dir_cluster_num <= EOC_MAX) ){
 	    if (nk_block_dev_read(state->dev, dir_sector, clu_per_sec, dir_data, NK_DEV_REQ_BLOCKING,0,0)) { 
 		ERROR("Failed to read block\n");
@@ -327,6 +351,7 @@ static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_clu
 	    free_split_path(parts, num_parts);
 	    return -1;
 	} else {
+	    nk_fs_dcache_insert(state->fs, parent_cluster_num, dir_name, *dir_cluster_num);
 	    found = 0;
 	}
     }
@@ -348,6 +373,27 @@ static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_clu
     }
     
     DEBUG("read file name is %s, ext is %s, ext_size is %d\n", file_name, file_ext, ext_size);
+
+    parent_cluster_num = *dir_cluster_num;
+    uint64_t key = parent_cluster_num | (is_dir ? DCACHE_DIR_KEY : DCACHE_FILE_KEY);
+
+    switch (nk_fs_dcache_lookup(state->fs, key, parts[num_parts-1], &cached)) {
+    case NK_FS_DCACHE_HIT:
+	if (nk_fs_icache_lookup(state->fs, cached, file_entry, sizeof(dir_entry)) == NK_FS_DCACHE_HIT) {
+	    DEBUG("%s found in dentry cache\n", parts[num_parts-1]);
+	    *dir_cluster_num = DENTRY_LOC_CLUSTER(cached);
+	    free_split_path(parts, num_parts);
+	    return DENTRY_LOC_INDEX(cached);
+	}
+	break;
+    case NK_FS_DCACHE_NEGATIVE:
+	DEBUG("%s is a cached negative entry\n", parts[num_parts-1]);
+	free_split_path(parts, num_parts);
+	return -1;
+    default:
+	break;
+    }
+
     while(! (*dir_cluster_num >= EOC_MIN && *dir_cluster_num <= EOC_MAX) ){
 	if (nk_block_dev_read(state->dev, dir_sector, clu_per_sec, dir_data, NK_DEV_REQ_BLOCKING,0,0) ) {
 	    ERROR("Failed to read block\n");
@@ -366,6 +412,8 @@ static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_clu
 		    DEBUG("cluster num is %d\n", cluster_num);	
 		    //debug_print_file(state, cluster_num, root_data[i].size);
 		    *file_entry = data;
+		    nk_fs_dcache_insert(state->fs, key, parts[num_parts-1], DENTRY_LOC(*dir_cluster_num,i));
+		    nk_fs_icache_insert(state->fs, DENTRY_LOC(*dir_cluster_num,i), &data, sizeof(dir_entry));
 		    free_split_path(parts, num_parts);
 		    return i; //return the position of file in the directory
 		} else {
@@ -374,6 +422,8 @@ static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_clu
 			uint32_t cluster_num = DECODE_CLUSTER(data.high_cluster, data.low_cluster);
 			DEBUG("cluster num is %d\n", cluster_num);	
 			//debug_print_file(state, cluster_num, root_data[i].size);
+			nk_fs_dcache_insert(state->fs, key, parts[num_parts-1], DENTRY_LOC(*dir_cluster_num,i));
+			nk_fs_icache_insert(state->fs, DENTRY_LOC(*dir_cluster_num,i), &data, sizeof(dir_entry));
 			free_split_path(parts, num_parts);
 			return i; //return the position of file in the directory
 		    }
@@ -390,6 +440,7 @@ static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_clu
 	dir_sector = get_sector_num(*dir_cluster_num, state);
     }
     
+    nk_fs_dcache_insert_negative(state->fs, key, parts[num_parts-1]);
     free_split_path(parts, num_parts);
     return -1; //cannot find file
 }
@@ -29,6 +29,7 @@
 #include <nautilus/idt.h>
 
 #include <nautilus/aspace.h>
+#include <nautilus/tlb.h>
 
 #ifndef NAUT_CONFIG_DEBUG_ASPACES
 #undef DEBUG_PRINT
@@ -269,7 +270,7 @@ int  nk_aspace_remove_region(nk_aspace_t *aspace, nk_aspace_region_t *region)
     BOILERPLATE_LEAVE(aspace,remove_region,region);
 }
 
-int  nk_aspace_protect_region(nk_aspace_t *aspace, nk_aspace_region_t *region, nk_aspace_protection_t *prot)
+int  nk_aspace_protect(nk_aspace_t *aspace, nk_aspace_region_t *region, nk_aspace_protection_t *prot)
 {
     BOILERPLATE_LEAVE(aspace,protect_region,region,prot);
 }
@@ -287,6 +288,11 @@ int nk_aspace_exception(excp_entry_t *entry, excp_vec_t vec, void *priv_data)
     struct cpu *cpu  = get_cpu();
     nk_aspace_t *cur = cpu->cur_aspace;
 
+    if (!cur) {
+	// early boot, before any address space is current
+	return -1;
+    }
+
     if (vec==PF_EXCP) {
 	if (cur->flags & NK_ASPACE_HOOK_PF) {
 	    return cur->interface->exception(cur->state,entry,vec);
@@ -317,6 +323,8 @@ int nk_aspace_init()
     INIT_LIST_HEAD(&aspace_list);
     spinlock_init(&state_lock);
 
+    nk_tlb_init();
+
     nk_aspace_base_init();
 
     return 0;
@@ -24,6 +24,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/cpu.h>
 #include <nautilus/thread.h>
+#include <nautilus/backtrace.h>
 
 extern int printk (const char * fmt, ...);
 
@@ -41,6 +42,39 @@ __do_backtrace (void ** fp, unsigned depth)
 }
 
 
+/*
+ * Collect up to max return addresses by walking the frame pointer
+ * chain starting at fp, without printing.  The walk stops at the first
+ * frame that is not in memory or that does not move up the stack, so
+ * this is safe to use on an interrupted context.  Returns the number
+ * of addresses collected.
+ */
+int
+nk_backtrace_collect (void ** fp, void ** out, int max)
+{
+    int n = 0;
+
+    while (n < max && fp && !((uint64_t)fp & 0x7) && IN_PHYS_MEM(fp + 1)) {
+        void ** next = (void **)*fp;
+        void * ret = *(fp + 1);
+
+        if (!IS_VALID(ret)) {
+            break;
+        }
+
+        out[n++] = ret;
+
+        if (next <= fp) {
+            break;
+        }
+
+        fp = next;
+    }
+
+    return n;
+}
+
+
 /*
  * dump memory in 16 byte chunks
  */
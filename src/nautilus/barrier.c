@@ -28,6 +28,8 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/thread.h>
 #include <nautilus/mm.h>
+#include <nautilus/numa.h>
+#include <nautilus/shell.h>
 
 
 #ifndef NAUT_CONFIG_DEBUG_BARRIER
@@ -61,21 +63,206 @@ barrier_xcall_handler (void * arg)
 
 
 /*
- * nk_barrier_init
+ * Combining tree
  *
- * initialize a thread barrier. This 
- * version is more or less a POSIX barrier
+ * A thread arrives at its leaf.  The last arriver at a node resets it
+ * and continues to the parent, while the others spin on the node's
+ * sense.  The last arriver at the root has completed the barrier, and
+ * it and every other winner release the nodes they won, top down.
+ */
+#define TREE_MAX_DEPTH   32
+#define TREE_MAX_FANIN   16
+
+struct barrier_node {
+    volatile uint32_t     arrived;
+    uint32_t              expected;
+    volatile uint32_t     sense;
+    struct barrier_node  *parent;
+} __attribute__((aligned(64)));
+
+struct barrier_slot {
+    uint32_t              sense;     // tree: the sense of this id's next episode
+    uint32_t              parity;    // dissemination
+    volatile uint32_t     flags[2][TREE_MAX_DEPTH];  // dissemination
+} __attribute__((aligned(64)));
+
+struct barrier_impl {
+    volatile uint64_t     ticket __attribute__((aligned(64)));  // ids for nk_barrier_wait, never wraps
+    uint32_t              fanin;      // leaf fan-in
+    uint32_t              rounds;     // dissemination rounds
+    struct barrier_node  *nodes;      // leaves first, root last
+    struct barrier_slot  *slots;      // one per id
+};
+
+
+static unsigned
+clamp_fanin (unsigned f)
+{
+    return f < 2 ? 2 : f > TREE_MAX_FANIN ? TREE_MAX_FANIN : f;
+}
+
+
+// the leaves are sized to the CPUs of one NUMA domain, and the upper
+// levels to the number of domains
+static void
+topo_fanin (unsigned *leaf, unsigned *upper)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    unsigned domains = nk_get_num_domains();
+    unsigned i, local = 0;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (sys->cpus[i]->domain == sys->cpus[0]->domain) {
+            local++;
+        }
+    }
+
+    *leaf = clamp_fanin(local);
+    *upper = clamp_fanin(domains > 1 ? domains : 4);
+}
+
+
+static int
+tree_init (struct barrier_impl *impl, uint32_t count)
+{
+    unsigned leaf, upper;
+    unsigned total = 0, n, f, level_start, i;
+
+    topo_fanin(&leaf, &upper);
+
+    // count the nodes
+    for (n = count, f = leaf; ; f = upper) {
+        n = (n + f - 1) / f;
+        total += n;
+        if (n == 1) {
+            break;
+        }
+    }
+
+    impl->nodes = malloc(sizeof(struct barrier_node) * total);
+    if (!impl->nodes) {
+        return -1;
+    }
+    memset(impl->nodes, 0, sizeof(struct barrier_node) * total);
+
+    impl->fanin = leaf;
+
+    // fill in each level's expected counts and parents
+    level_start = 0;
+    for (n = count, f = leaf; ; f = upper) {
+        unsigned m = (n + f - 1) / f;
+        for (i = 0; i < m; i++) {
+            struct barrier_node *node = &impl->nodes[level_start + i];
+            node->expected = (i == m - 1) ? n - i * f : f;
+            node->parent = m == 1 ? 0 : &impl->nodes[level_start + m + i / upper];
+        }
+        level_start += m;
+        n = m;
+        if (m == 1) {
+            break;
+        }
+    }
+
+    DEBUG_PRINT("Tree barrier for %u threads: leaf fan-in %u, upper fan-in %u, %u nodes\n",
+                count, leaf, upper, total);
+
+    return 0;
+}
+
+
+static int
+tree_wait (struct barrier_impl *impl, uint32_t id)
+{
+    struct barrier_slot *slot = &impl->slots[id];
+    struct barrier_node *won[TREE_MAX_DEPTH];
+    struct barrier_node *node = &impl->nodes[id / impl->fanin];
+    uint32_t sense = !slot->sense;
+    int depth = 0;
+
+    slot->sense = sense;
+
+    while (node) {
+        if (__sync_fetch_and_add(&node->arrived, 1) != node->expected - 1) {
+            BARRIER_WHILE(node->sense != sense);
+            break;
+        }
+        // nobody arrives here again until we release it
+        node->arrived = 0;
+        won[depth++] = node;
+        node = node->parent;
+    }
+
+    while (depth > 0) {
+        won[--depth]->sense = sense;
+    }
+
+    return node ? 0 : NK_BARRIER_LAST;
+}
+
+
+/*
+ * Dissemination (Hensgen, Finkel, and Manber)
+ *
+ * In round r, thread i signals thread (i + 2^r) mod n and waits to be
+ * signaled by thread (i - 2^r) mod n.  Flags alternate between two
+ * sets, and the expected value flips every other episode, so flags
+ * never need resetting.
+ */
+static int
+diss_init (struct barrier_impl *impl, uint32_t count)
+{
+    uint32_t i;
+
+    for (impl->rounds = 0; (1UL << impl->rounds) < count; impl->rounds++) { }
+
+    for (i = 0; i < count; i++) {
+        impl->slots[i].sense = 1;
+    }
+
+    return 0;
+}
+
+
+static int
+diss_wait (struct barrier_impl *impl, uint32_t count, uint32_t id)
+{
+    struct barrier_slot *slot = &impl->slots[id];
+    uint32_t parity = slot->parity;
+    uint32_t sense = slot->sense;
+    uint32_t r;
+
+    for (r = 0; r < impl->rounds; r++) {
+        struct barrier_slot *partner = &impl->slots[(id + (1U << r)) % count];
+        partner->flags[parity][r] = sense;
+        BARRIER_WHILE(slot->flags[parity][r] != sense);
+    }
+
+    if (parity) {
+        slot->sense = !sense;
+    }
+    slot->parity = !parity;
+
+    return id == 0 ? NK_BARRIER_LAST : 0;
+}
+
+
+/*
+ * nk_barrier_init_type
+ *
+ * initialize a thread barrier using the given algorithm
  *
  * @barrier: the barrier to initialize
  * @count: the number of participants
+ * @type: the algorithm
  *
  * returns 0 on succes, -EINVAL on error
  *
  */
 int 
-nk_barrier_init (nk_barrier_t * barrier, uint32_t count) 
+nk_barrier_init_type (nk_barrier_t * barrier, uint32_t count, nk_barrier_type_t type)
 {
-    int ret = 0;
+    struct barrier_impl *impl;
+
     memset(barrier, 0, sizeof(nk_barrier_t));
     barrier->lock = 0;
 
@@ -84,15 +271,62 @@ nk_barrier_init (nk_barrier_t * barrier, uint32_t count)
         return -EINVAL;
     }
 
-
-    DEBUG_PRINT("Initializing barier, barrier at %p, count=%u\n", (void*)barrier, count);
+    DEBUG_PRINT("Initializing barier, barrier at %p, count=%u type=%d\n", (void*)barrier, count, type);
     barrier->init_count = count;
     barrier->remaining  = count;
+    barrier->type       = type;
+
+    if (type == NK_BARRIER_CENTRAL) {
+        return 0;
+    }
+
+    impl = malloc(sizeof(*impl));
+    if (!impl) {
+        ERROR_PRINT("Cannot allocate barrier state\n");
+        return -EINVAL;
+    }
+    memset(impl, 0, sizeof(*impl));
+
+    impl->slots = malloc(sizeof(struct barrier_slot) * count);
+    if (!impl->slots) {
+        ERROR_PRINT("Cannot allocate barrier slots\n");
+        free(impl);
+        return -EINVAL;
+    }
+    memset(impl->slots, 0, sizeof(struct barrier_slot) * count);
+
+    if ((type == NK_BARRIER_TREE ? tree_init(impl, count) : diss_init(impl, count))) {
+        ERROR_PRINT("Cannot allocate barrier state\n");
+        free(impl->slots);
+        free(impl);
+        return -EINVAL;
+    }
+
+    barrier->impl = impl;
 
     return 0;
 }
 
 
+/*
+ * nk_barrier_init
+ *
+ * initialize a thread barrier. This 
+ * version is more or less a POSIX barrier
+ *
+ * @barrier: the barrier to initialize
+ * @count: the number of participants
+ *
+ * returns 0 on succes, -EINVAL on error
+ *
+ */
+int 
+nk_barrier_init (nk_barrier_t * barrier, uint32_t count) 
+{
+    return nk_barrier_init_type(barrier, count, NK_BARRIER_CENTRAL);
+}
+
+
 /*
  * nk_barrier_destroy
  *
@@ -106,6 +340,7 @@ nk_barrier_init (nk_barrier_t * barrier, uint32_t count)
 int 
 nk_barrier_destroy (nk_barrier_t * barrier)
 {
+    struct barrier_impl *impl;
     int res;
 
     if (!barrier) {
@@ -125,49 +360,100 @@ nk_barrier_destroy (nk_barrier_t * barrier)
     }
     bspin_unlock(&barrier->lock);
 
+    if (!res && (impl = barrier->impl)) {
+        free(impl->nodes);
+        free(impl->slots);
+        free(impl);
+        barrier->impl = 0;
+    }
+
     return res;
 }
 
 
 /*
- * nk_barrier_wait
+ * nk_barrier_wait_id
  *
- * wait at a thread barrier
+ * wait at a thread barrier as participant id
  *
  * @barrier: the barrier to wait at
+ * @id: this thread's id, in [0, count) and unique among
+ *      the participants
  *
- * returns 0 to all threads but the last. The last thread
- * out of the barrier will return NK_BARRIER_LAST. This
- * is useful for having one thread in charge of cleaning 
- * the barrier up. Again, similar to POSIX
+ * returns 0 to all threads but one, which gets NK_BARRIER_LAST.
+ * For central and tree barriers this is the last to arrive, for
+ * dissemination barriers it is id 0.
  *
  */
 int 
-nk_barrier_wait (nk_barrier_t * barrier) 
+nk_barrier_wait_id (nk_barrier_t * barrier, uint32_t id) 
 {
     int res = 0;
 
-    DEBUG_PRINT("Thread (%p) entering barrier (%p)\n", (void*)get_cur_thread(), (void*)barrier);
-
-    bspin_lock(&barrier->lock);
-
-    if (--barrier->remaining == 0) {
-        res = NK_BARRIER_LAST;
-        atomic_cmpswap(barrier->notify, 0, 1);
-    } else {
-        bspin_unlock(&barrier->lock);
-        BARRIER_WHILE(barrier->notify != 1);
+    DEBUG_PRINT("Thread (%p) entering barrier (%p) as %u\n", (void*)get_cur_thread(), (void*)barrier, id);
+
+    switch (barrier->type) {
+    case NK_BARRIER_TREE:
+        res = tree_wait(barrier->impl, id);
+        break;
+    case NK_BARRIER_DISSEMINATION:
+        res = diss_wait(barrier->impl, barrier->init_count, id);
+        break;
+    default: {
+        // sense reversal - the sense cannot flip between our read
+        // and our arrival, since it takes our arrival to flip it
+        unsigned sense = barrier->notify;
+        if (__sync_sub_and_fetch(&barrier->remaining, 1) == 0) {
+            barrier->remaining = barrier->init_count;
+            __sync_synchronize();
+            barrier->notify = !sense;
+            res = NK_BARRIER_LAST;
+        } else {
+            BARRIER_WHILE(barrier->notify == sense);
+        }
+        break;
+    }
     }
 
     DEBUG_PRINT("Thread (%p) exiting barrier (%p)\n", (void*)get_cur_thread(), (void*)barrier);
     
-    register unsigned init_count = barrier->init_count;
+    return res;
+}
 
-    if (atomic_inc_val(barrier->remaining) == init_count) {
-        bspin_unlock(&barrier->lock);
+
+/*
+ * nk_barrier_wait
+ *
+ * wait at a thread barrier
+ *
+ * @barrier: the barrier to wait at
+ *
+ * returns 0 to all threads but the last. The last thread
+ * out of the barrier will return NK_BARRIER_LAST. This
+ * is useful for having one thread in charge of cleaning 
+ * the barrier up. Again, similar to POSIX
+ *
+ * Tree barriers hand out ids in arrival order, which costs a
+ * shared increment.  Dissemination barriers need nk_barrier_wait_id.
+ *
+ */
+int 
+nk_barrier_wait (nk_barrier_t * barrier) 
+{
+    struct barrier_impl *impl = barrier->impl;
+
+    switch (barrier->type) {
+    case NK_BARRIER_TREE:
+        // an episode's count tickets are all taken before any thread
+        // can leave it, so ticket mod count is unique per episode (the
+        // ticket is 64 bits so that a wrap cannot split an episode)
+        return nk_barrier_wait_id(barrier, __sync_fetch_and_add(&impl->ticket, 1) % barrier->init_count);
+    case NK_BARRIER_DISSEMINATION:
+        ERROR_PRINT("Dissemination barrier (%p) requires ids\n", (void*)barrier);
+        return -EINVAL;
+    default:
+        return nk_barrier_wait_id(barrier, 0);
     }
-    
-    return res;
 }
 
 
@@ -225,24 +511,22 @@ nk_core_barrier_raise (void)
         // decrement the waiting count
         atomic_dec(barrier->remaining);
 
-        cpu_id_t me = my_cpu_id();
+        nk_cpu_mask_t others;
 
-        // force other cores to wait at the barrier
+        nk_cpu_mask_zero(&others);
         for (i = 0; i < per_cpu_get(system)->num_cpus; i++) {
+            nk_cpu_mask_set(&others, i);
+        }
+        nk_cpu_mask_clear(&others, my_cpu_id());
 
-            if (i == me) {
-                continue;
-            }
-
-            if (smp_xcall(i,
-                        barrier_xcall_handler,
-                        NULL, // no need for args
-                        0)    // blocking would be catastrophic here
-                    != 0) {
-                ERROR_PRINT("Could not force cpu %u to wait at barrier\n", i);
-                return -EINVAL;
-            }
-
+        // force other cores to wait at the barrier
+        if (smp_xcall_mask(&others,
+                           barrier_xcall_handler,
+                           NULL, // no need for args
+                           0)    // blocking would be catastrophic here
+                != 0) {
+            ERROR_PRINT("Could not force other cpus to wait at barrier\n");
+            return -EINVAL;
         }
 
     } else {
@@ -348,50 +632,143 @@ nk_core_barrier_arrive (void)
 
 /***** BARRIER TESTS ******/
 
+struct bench_arg {
+    nk_barrier_t *barrier;
+    volatile int *go;      // 1 => run, -1 => not everyone started, quit
+    uint32_t      id;
+    uint64_t      iters;
+    uint64_t      cycles;
+};
+
+
 static void
-barrier_func1 (void * in, void ** out)
+bench_thread (void * in, void ** out)
 {
-    nk_barrier_t * b = (nk_barrier_t *)in;
-    nk_barrier_wait(b);
+    struct bench_arg *a = (struct bench_arg *)in;
+    uint64_t i, start;
+
+    // the barrier only completes if every thread got started
+    while (!*a->go) {
+        nk_yield();
+    }
+
+    if (*a->go < 0) {
+        return;
+    }
+
+    // line everyone up before timing
+    nk_barrier_wait_id(a->barrier, a->id);
+
+    start = rdtsc();
+    for (i = 0; i < a->iters; i++) {
+        nk_barrier_wait_id(a->barrier, a->id);
+    }
+    a->cycles = rdtsc() - start;
 }
 
 
-static void
-barrier_func2 (void * in, void ** out)
+// cycles per barrier episode with n threads bound to cpus 0..n-1
+static uint64_t
+bench_one (nk_barrier_type_t type, uint32_t n, uint64_t iters)
 {
-    uint64_t n = 100;
-    nk_barrier_t * b = (nk_barrier_t *)in;
-    while (--n) {
-        io_delay();
+    nk_barrier_t *b = malloc(sizeof(nk_barrier_t));
+    struct bench_arg *args = malloc(sizeof(struct bench_arg) * n);
+    nk_thread_id_t *tids = malloc(sizeof(nk_thread_id_t) * n);
+    uint64_t cycles = 0;
+    volatile int go = 0;
+    uint32_t i, started;
+
+    if (!b || !args || !tids || nk_barrier_init_type(b, n, type)) {
+        ERROR_PRINT("could not set up barrier benchmark\n");
+        goto out;
+    }
+
+    for (started = 0; started < n; started++) {
+        args[started].barrier = b;
+        args[started].go = &go;
+        args[started].id = started;
+        args[started].iters = iters;
+        args[started].cycles = 0;
+        if (nk_thread_start(bench_thread, &args[started], 0, 0, TSTACK_DEFAULT, &tids[started], started)) {
+            ERROR_PRINT("could not start benchmark thread on cpu %u\n", started);
+            break;
+        }
+    }
+
+    go = started == n ? 1 : -1;
+
+    for (i = 0; i < started; i++) {
+        nk_join(tids[i], 0);
+    }
+
+    if (started == n) {
+        for (i = 0; i < n; i++) {
+            if (args[i].cycles > cycles) {
+                cycles = args[i].cycles;
+            }
+        }
+        cycles /= iters;
     }
 
-    nk_barrier_wait(b);
+    nk_barrier_destroy(b);
+
+ out:
+    free(tids);
+    free(args);
+    free(b);
+    return cycles;
 }
 
 
-/* 
- *
- * NOTE: this test assumes that there are at least 3 CPUs on 
- * the machine
- *
+/*
+ * Scaling benchmark: cycles per barrier for each algorithm with
+ * 1, 2, 4, ... and all CPUs participating, one thread per CPU.
+ * A stalled barrier will hang here, so this doubles as a test.
  */
-void nk_barrier_test(void)
+static void
+barrier_bench (uint64_t iters)
 {
-    nk_barrier_t * b;
-    b = malloc(sizeof(nk_barrier_t));
-    if (!b) {
-        ERROR_PRINT("could not allocate barrier\n");
-        return;
+    uint32_t num_cpus = per_cpu_get(system)->num_cpus;
+    uint32_t n;
+
+    nk_vc_printf("%6s %12s %12s %12s   (cycles/barrier, %lu iterations)\n",
+                 "cpus", "central", "tree", "dissem", iters);
+
+    for (n = 1; n <= num_cpus; n = (n == num_cpus || 2 * n <= num_cpus) ? 2 * n : num_cpus) {
+        nk_vc_printf("%6u %12lu %12lu %12lu\n", n,
+                     bench_one(NK_BARRIER_CENTRAL, n, iters),
+                     bench_one(NK_BARRIER_TREE, n, iters),
+                     bench_one(NK_BARRIER_DISSEMINATION, n, iters));
     }
+}
 
-    nk_barrier_init(b, 3);
-    nk_thread_start(barrier_func1, b, NULL, 1, TSTACK_DEFAULT, NULL, 1);
-    nk_thread_start(barrier_func2, b, NULL, 1, TSTACK_DEFAULT, NULL, 2);
 
-    nk_barrier_wait(b);
+void nk_barrier_test(void)
+{
+    barrier_bench(10000);
+}
 
-    printk("Barrier test successful\n");
-    nk_barrier_destroy(b);
-    free(b);
+
+static int
+handle_barriertest (char * buf, void * priv)
+{
+    uint64_t iters = 10000;
+
+    sscanf(buf, "barriertest %lu", &iters);
+
+    if (!iters) {
+        iters = 1;
+    }
+
+    barrier_bench(iters);
+
+    return 0;
 }
 
+
+static struct shell_cmd_impl barriertest_impl = {
+    .cmd      = "barriertest",
+    .help_str = "barriertest [iterations]",
+    .handler  = handle_barriertest,
+};
+nk_register_shell_cmd(barriertest_impl);
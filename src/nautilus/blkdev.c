@@ -25,6 +25,8 @@
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
 #include <nautilus/shell.h>
+#include <nautilus/histogram.h>
+#include <nautilus/trace.h>
 
 #ifndef NAUT_CONFIG_DEBUG_BLKDEV
 #undef DEBUG_PRINT
@@ -102,6 +104,7 @@ static void generic_write_callback(nk_block_dev_status_t status, void *context)
 {
     struct op *o = (struct op*) context;
     DEBUG("generic write callback (status = 0x%lx) for %p\n",status,context);
+    NK_TRACE(NK_TRACE_DEV, NK_TRACE_EV_BLK_DONE, context, status);
     o->status = status;
     o->completed = 1;
     nk_dev_signal((struct nk_dev *)o->dev);
@@ -111,6 +114,7 @@ static void generic_read_callback(nk_block_dev_status_t status, void *context)
 {
     struct op *o = (struct op*) context;
     DEBUG("generic read callback (status = 0x%lx) for %p\n", status, context);
+    NK_TRACE(NK_TRACE_DEV, NK_TRACE_EV_BLK_DONE, context, status);
     o->status = status;
     o->completed = 1;
     nk_dev_signal((struct nk_dev *)o->dev);
@@ -164,6 +168,7 @@ int nk_block_dev_read(struct nk_block_dev *dev,
 		    return 0;
 		}
 	    } else {
+		NK_HIST_PROBE_START(start);
 		if (di->read_blocks(d->state,blocknum,count,dest,generic_read_callback,(void*)&o)) {
 		    ERROR("failed to start up readblocks\n");
 		    return -1;
@@ -172,6 +177,7 @@ int nk_block_dev_read(struct nk_block_dev *dev,
 		    while (!o.completed) { 
 			nk_dev_wait((struct nk_dev *)d,generic_cond_check,(void*)&o);
 		    }
+		    NK_HIST_PROBE_END(nk_hist_blk_read, start);
 		    return 0;
 		}
 	    }
@@ -225,7 +231,8 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		    return 0;
 		}
 	    } else {
-		if (di->write_blocks(d->state,blocknum,count,src,generic_read_callback,(void*)&o)) {
+		NK_HIST_PROBE_START(start);
+		if (di->write_blocks(d->state,blocknum,count,src,generic_write_callback,(void*)&o)) {
 		    ERROR("failed to start up writeblocks\n");
 		    return -1;
  		} else {
@@ -233,6 +240,7 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		    while (!o.completed) { 
 			nk_dev_wait((struct nk_dev *)d, generic_cond_check, (void*)&o);
 		    }
+		    NK_HIST_PROBE_END(nk_hist_blk_write, start);
 		    return 0;
 		}
 	    }
@@ -301,3 +309,19 @@ static struct shell_cmd_impl blktest_impl = {
     .handler  = handle_blktest,
 };
 nk_register_shell_cmd(blktest_impl);
+
+
+void *nk_block_dev_map(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+
+    DEBUG("map %s (start=%lu, count=%lu)\n", d->name,blocknum,count);
+
+    if (!di->map_blocks) {
+	DEBUG("mapblocks not possible\n");
+	return 0;
+    }
+
+    return di->map_blocks(d->state,blocknum,count);
+}
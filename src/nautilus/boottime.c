@@ -0,0 +1,88 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/shell.h>
+#include <nautilus/boottime.h>
+#include <dev/apic.h>
+
+struct boot_phase {
+    char     *name;
+    uint64_t  tsc;
+};
+
+// written only by the boot CPU, before anything else could read it
+static struct boot_phase phases[NK_BOOT_PHASE_MAX];
+static int               num_phases;
+
+void nk_boot_phase(char *name)
+{
+    if (num_phases < NK_BOOT_PHASE_MAX) {
+	phases[num_phases].name = name;
+	phases[num_phases].tsc = rdtsc();
+	num_phases++;
+    }
+}
+
+void nk_boot_phase_report(void)
+{
+    struct apic_dev *apic = per_cpu_get(apic);
+    uint64_t cpu = apic ? apic->cycles_per_us : 0;
+    uint64_t total, d;
+    int i;
+
+    if (num_phases < 2) {
+	return;
+    }
+
+    total = phases[num_phases-1].tsc - phases[0].tsc;
+    total = total ? total : 1;
+
+    nk_vc_printf("Boot phases (%s):\n", cpu ? "ms" : "Mcycles");
+    for (i=1;i<num_phases;i++) {
+	d = phases[i].tsc - phases[i-1].tsc;
+	nk_vc_printf("  %-28s %8lu.%03lu  %3lu%%\n", phases[i].name,
+		     cpu ? d/cpu/1000 : d/1000000,
+		     cpu ? (d/cpu)%1000 : (d/1000)%1000,
+		     d*100/total);
+    }
+    nk_vc_printf("  %-28s %8lu.%03lu\n", "total",
+		 cpu ? total/cpu/1000 : total/1000000,
+		 cpu ? (total/cpu)%1000 : (total/1000)%1000);
+}
+
+
+static int
+handle_boottime (char * buf, void * priv)
+{
+    nk_boot_phase_report();
+    return 0;
+}
+
+static struct shell_cmd_impl boottime_impl = {
+    .cmd      = "boottime",
+    .help_str = "boottime",
+    .handler  = handle_boottime,
+};
+nk_register_shell_cmd(boottime_impl);
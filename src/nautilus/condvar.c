@@ -39,6 +39,29 @@
 
 static uint64_t count=0;
 
+// A waiter spins this long for a signal before sleeping, which
+// covers signals that arrive while it is still descheduling
+#define CONDVAR_SPIN_CYCLES 4000
+
+struct condvar_wait {
+    nk_condvar_t       *c;
+    unsigned long long  seq;
+    unsigned            bc;
+};
+
+// nonzero once there may be a wakeup for us - the caller rechecks
+// under the condvar lock
+static int
+condvar_woken (void *state)
+{
+    struct condvar_wait *w = (struct condvar_wait *)state;
+    nk_condvar_t *c = w->c;
+    unsigned long long val = *(volatile unsigned long long*)&(c->wakeup_seq);
+
+    return w->bc != *(volatile unsigned*)&(c->bcast_seq) ||
+        (val != w->seq && val != *(volatile unsigned long long*)&(c->woken_seq));
+}
+
 int
 nk_condvar_init (nk_condvar_t * c)
 {
@@ -87,30 +110,43 @@ nk_condvar_wait (nk_condvar_t * c, NK_LOCK_T * l)
 
     NK_LOCK(&c->lock);
 
-    /* now we can unlock the mutex and go to sleep */
-    NK_UNLOCK(l);
-
+    // we are counted before the mutex is released, so a signaler
+    // that holds the mutex will never miss us in its lockless check
     ++c->nwaiters;
     ++c->main_seq;
 
+    /* now we can unlock the mutex and go to sleep */
+    NK_UNLOCK(l);
+
     unsigned long long val;
-    unsigned long long seq;
-    unsigned bc = *(volatile unsigned*)&(c->bcast_seq);
-    val = seq = c->wakeup_seq;
+    struct condvar_wait w = { .c = c };
+    w.bc = *(volatile unsigned*)&(c->bcast_seq);
+    val = w.seq = c->wakeup_seq;
 
     do {
 
         NK_UNLOCK(&c->lock);
-        nk_wait_queue_sleep(c->wait_queue);
+
+        uint64_t start = rdtsc();
+        while (!condvar_woken(&w)) {
+            if (rdtsc() - start > CONDVAR_SPIN_CYCLES) {
+                // the condition is checked again under the wait queue lock,
+                // so a signal between our check and our sleep is not lost
+                nk_wait_queue_sleep_extended(c->wait_queue, condvar_woken, &w);
+                break;
+            }
+            __asm__ __volatile__ ("pause" : : : "memory");
+        }
+
         NK_LOCK(&c->lock);
 
-        if (bc != *(volatile unsigned*)&(c->bcast_seq)) {
+        if (w.bc != *(volatile unsigned*)&(c->bcast_seq)) {
             goto bcout;
         }
 
         val = *(volatile unsigned long long*)&(c->wakeup_seq);
 
-    } while (val == seq || val == *(volatile unsigned long long*)&(c->woken_seq));
+    } while (val == w.seq || val == *(volatile unsigned long long*)&(c->woken_seq));
 
     ++c->woken_seq;
 
@@ -134,6 +170,12 @@ nk_condvar_signal (nk_condvar_t * c)
 {
     NK_PROFILE_ENTRY();
 
+    // uncontended fast path - nobody is waiting, so leave the lock alone
+    if (*(volatile unsigned long long*)&(c->main_seq) == *(volatile unsigned long long*)&(c->wakeup_seq)) {
+        NK_PROFILE_EXIT();
+        return 0;
+    }
+
     NK_LOCK(&c->lock);
 
     // do we have anyone to signal?
@@ -158,6 +200,12 @@ nk_condvar_bcast (nk_condvar_t * c)
 {
     NK_PROFILE_ENTRY();
 
+    // uncontended fast path, as in signal
+    if (*(volatile unsigned long long*)&(c->main_seq) == *(volatile unsigned long long*)&(c->wakeup_seq)) {
+        NK_PROFILE_EXIT();
+        return 0;
+    }
+
     NK_LOCK(&c->lock);
 
     // do we have anyone to wakeup?
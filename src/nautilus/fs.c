@@ -28,6 +28,8 @@
 #include <nautilus/testfs.h>
 #include <nautilus/shell.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/thread.h>
+#include <nautilus/aspace.h>
 
 #define INFO(fmt, args...)  INFO_PRINT("fs: " fmt, ##args)
 #define DEBUG(fmt, args...) DEBUG_PRINT("fs: " fmt, ##args)
@@ -51,6 +53,13 @@
 //typedef enum {EXT2}      nk_fs_type_t;
 //typedef enum {BLOCK,NET} nk_fs_media_t;
 
+struct page_cache {
+    spinlock_t lock;
+    uint64_t   num_pages;  // size of the arrays below
+    void     **pages;      // null => not yet read
+    uint8_t   *dirty;
+};
+
 struct nk_fs_open_file_state {
     spinlock_t lock;
 
@@ -61,12 +70,33 @@ struct nk_fs_open_file_state {
     
     size_t   position;
     int      flags;
+
+    int      refcount;     // open + one per mapping
+    int      num_mappings;
+    struct page_cache *cache;
+};
+
+struct fs_mapping {
+    struct list_head    mapping_node;
+    nk_fs_fd_t          fd;
+    nk_aspace_t        *aspace;
+    nk_aspace_region_t  region;
+    nk_aspace_pager_t   pager;
+    off_t               offset;
+    int                 prot;
 };
 
 
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
 static spinlock_t state_lock;
 static struct list_head fs_list;
 static struct list_head open_files;
+static struct list_head mappings;
+
+// virtual addresses handed out for mappings without a requested address
+#define MMAP_BASE  0x100000000000UL
+static uint64_t next_mmap_va = MMAP_BASE;
 
 static void map_over_open_files(void (*callback)(nk_fs_fd_t)) 
 {
@@ -187,7 +217,11 @@ int nk_fs_init(void)
 {
     INIT_LIST_HEAD(&fs_list);
     INIT_LIST_HEAD(&open_files);
+    INIT_LIST_HEAD(&mappings);
     spinlock_init(&state_lock);
+    if (nk_fs_cache_init()) {
+	ERROR("Cannot initialize dentry/inode caches, continuing without them\n");
+    }
     INFO("inited\n");
     return 0;
 }
@@ -201,6 +235,7 @@ int nk_deinit_fs(void)
     if (!list_empty(&fs_list)) {
 	ERROR("registered filesystems remain\n");
     }
+    nk_fs_cache_deinit();
     spinlock_deinit(&state_lock);
     INFO("deinited\n");
     return 0;
@@ -241,6 +276,7 @@ int            nk_fs_unregister(struct nk_fs *f)
     STATE_LOCK();
     list_del(&f->fs_list_node);
     STATE_UNLOCK();
+    nk_fs_cache_flush(f);
     INFO("Unregistered filesystem %s\n",f->name);
     free(f);
     return 0;
@@ -362,6 +398,7 @@ nk_fs_fd_t nk_fs_open(char *path, int flags, int mode)
     spinlock_init(&fd->lock);
     fd->fs = fs;
     fd->flags = flags;
+    fd->refcount = 1;
 
     if (exists(fs,path)) {
 	DEBUG("path %s exists\n", path);
@@ -403,6 +440,19 @@ nk_fs_fd_t nk_fs_open(char *path, int flags, int mode)
     return fd;
 }
 
+static void page_cache_free(struct page_cache *c);
+
+static void fd_put(nk_fs_fd_t fd)
+{
+    if (__sync_fetch_and_sub(&fd->refcount,1)==1) {
+	DEBUG("freeing open file state %p\n",fd);
+	if (fd->cache) {
+	    page_cache_free(fd->cache);
+	}
+	free(fd);
+    }
+}
+
 int nk_fs_close(nk_fs_fd_t fd) 
 {
     STATE_LOCK_CONF;
@@ -411,11 +461,16 @@ int nk_fs_close(nk_fs_fd_t fd)
     list_del(&fd->file_node);
     STATE_UNLOCK();
 
-    free(fd);
+    // mappings keep the file state alive until they are removed
+    fd_put(fd);
     
     return 0;
 }
 
+static ssize_t page_cache_read(nk_fs_fd_t fd, char *buf, size_t num_bytes);
+static void    page_cache_update(nk_fs_fd_t fd, off_t offset, char *buf, size_t num_bytes);
+static void    page_cache_truncate(nk_fs_fd_t fd, off_t len);
+
 ssize_t nk_fs_read(nk_fs_fd_t fd, void *buf, size_t num_bytes) 
 {
     FILE_LOCK_CONF;
@@ -428,7 +483,7 @@ ssize_t nk_fs_read(nk_fs_fd_t fd, void *buf, size_t num_bytes)
     }
 
     FILE_LOCK(fd);
-    ssize_t n = file_read(fd, buf, num_bytes);
+    ssize_t n = fd->cache ? page_cache_read(fd, buf, num_bytes) : file_read(fd, buf, num_bytes);
     if (n>=0) {fd->position += n; }
     FILE_UNLOCK(fd);
 
@@ -454,7 +509,10 @@ ssize_t nk_fs_write(nk_fs_fd_t fd, void *buf, size_t num_bytes)
     }
 
     FILE_LOCK(fd);
-    ssize_t n = file_read(fd, buf, num_bytes);
+    ssize_t n = file_write(fd, buf, num_bytes);
+    if (n>0 && fd->cache) {
+	page_cache_update(fd, fd->position, buf, n);
+    }
     if (n>=0) {fd->position += n; }
     FILE_UNLOCK(fd);
 
@@ -473,8 +531,16 @@ int nk_fs_ftruncate(nk_fs_fd_t fd, off_t len)
 	return -1;
     }
 
+    if (fd->num_mappings) {
+	ERROR("Cannot truncate a file that is mapped\n");
+	return -1;
+    }
+
     FILE_LOCK(fd);
     rc = file_trunc(fd,len);
+    if (!rc && fd->cache) {
+	page_cache_truncate(fd,len);
+    }
     FILE_UNLOCK(fd);
     return rc;
 }
@@ -524,6 +590,554 @@ ssize_t nk_fs_tell(nk_fs_fd_t fd)
 }
 
 
+//
+// Page cache
+//
+
+static struct page_cache *page_cache_create(void)
+{
+    struct page_cache *c = malloc(sizeof(*c));
+
+    if (!c) {
+	ERROR("Cannot allocate page cache\n");
+	return 0;
+    }
+    memset(c,0,sizeof(*c));
+    spinlock_init(&c->lock);
+    return c;
+}
+
+static void page_cache_free(struct page_cache *c)
+{
+    uint64_t i;
+
+    for (i=0;i<c->num_pages;i++) {
+	if (c->pages[i]) {
+	    free(c->pages[i]);
+	}
+    }
+    if (c->pages) {
+	free(c->pages);
+	free(c->dirty);
+    }
+    spinlock_deinit(&c->lock);
+    free(c);
+}
+
+// make room for page_num - the cache lock must not be held, since we
+// allocate without it and then retry if someone else grew it first
+static int page_cache_grow(struct page_cache *c, uint64_t page_num)
+{
+    uint64_t n, old;
+    void **pages, **old_pages;
+    uint8_t *dirty, *old_dirty;
+    uint8_t flags;
+
+    while (1) {
+	flags = spin_lock_irq_save(&c->lock);
+	old = c->num_pages;
+	spin_unlock_irq_restore(&c->lock,flags);
+
+	if (page_num<old) {
+	    return 0;
+	}
+
+	n = old ? old : 16;
+	while (n<=page_num) {
+	    n *= 2;
+	}
+
+	pages = malloc(n*sizeof(void*));
+	dirty = malloc(n);
+
+	if (!pages || !dirty) {
+	    ERROR("Cannot expand page cache to %lu pages\n",n);
+	    if (pages) { free(pages); }
+	    if (dirty) { free(dirty); }
+	    return -1;
+	}
+
+	memset(pages,0,n*sizeof(void*));
+	memset(dirty,0,n);
+
+	flags = spin_lock_irq_save(&c->lock);
+	if (c->num_pages!=old) {
+	    spin_unlock_irq_restore(&c->lock,flags);
+	    free(pages);
+	    free(dirty);
+	    continue;
+	}
+
+	if (c->pages) {
+	    memcpy(pages,c->pages,c->num_pages*sizeof(void*));
+	    memcpy(dirty,c->dirty,c->num_pages);
+	}
+
+	old_pages = c->pages;
+	old_dirty = c->dirty;
+	c->pages = pages;
+	c->dirty = dirty;
+	c->num_pages = n;
+	spin_unlock_irq_restore(&c->lock,flags);
+
+	if (old_pages) {
+	    free(old_pages);
+	    free(old_dirty);
+	}
+
+	return 0;
+    }
+}
+
+static void *page_cache_lookup(nk_fs_fd_t fd, uint64_t page_num, int write)
+{
+    struct page_cache *c;
+    void *page, *new_page;
+    uint8_t flags;
+    ssize_t n;
+
+    if (!fd->cache) {
+	c = page_cache_create();
+	if (!c) {
+	    return 0;
+	}
+	if (!__sync_bool_compare_and_swap(&fd->cache,0,c)) {
+	    page_cache_free(c);
+	}
+    }
+
+    c = fd->cache;
+
+    flags = spin_lock_irq_save(&c->lock);
+    if (page_num<c->num_pages && c->pages[page_num]) {
+	page = c->pages[page_num];
+	c->dirty[page_num] |= write;
+	spin_unlock_irq_restore(&c->lock,flags);
+	return page;
+    }
+    spin_unlock_irq_restore(&c->lock,flags);
+
+    // miss - fill a new page from the filesystem without holding the lock
+
+    new_page = malloc(NK_FS_PAGE_SIZE);
+    if (!new_page) {
+	ERROR("Cannot allocate page for page cache\n");
+	return 0;
+    }
+
+    if ((addr_t)new_page & (NK_FS_PAGE_SIZE-1)) {
+	ERROR("Page cache page %p is not page-aligned\n",new_page);
+	free(new_page);
+	return 0;
+    }
+
+    memset(new_page,0,NK_FS_PAGE_SIZE);
+
+    if (fd->fs->interface && fd->fs->interface->read_file) {
+	n = fd->fs->interface->read_file(fd->fs->state, fd->file, new_page,
+					 page_num*NK_FS_PAGE_SIZE, NK_FS_PAGE_SIZE);
+	if (n<0) {
+	    ERROR("Failed to fill page %lu of file %p\n",page_num,fd->file);
+	    free(new_page);
+	    return 0;
+	}
+	// anything past EOF stays zero
+    }
+
+    if (page_cache_grow(c,page_num)) {
+	free(new_page);
+	return 0;
+    }
+
+    flags = spin_lock_irq_save(&c->lock);
+    if (c->pages[page_num]) {
+	// someone else filled it first
+	page = c->pages[page_num];
+    } else {
+	page = c->pages[page_num] = new_page;
+	new_page = 0;
+    }
+    c->dirty[page_num] |= write;
+    spin_unlock_irq_restore(&c->lock,flags);
+
+    if (new_page) {
+	free(new_page);
+    }
+
+    DEBUG("page cache fill of page %lu of file %p => %p\n",page_num,fd->file,page);
+
+    return page;
+}
+
+void *nk_fs_page_cache_get(nk_fs_fd_t fd, uint64_t page_num)
+{
+    if (FS_FD_ERR(fd)) {
+	return 0;
+    }
+    return page_cache_lookup(fd,page_num,0);
+}
+
+// file lock must be held
+static ssize_t page_cache_read(nk_fs_fd_t fd, char *buf, size_t num_bytes)
+{
+    struct nk_fs_stat st;
+    size_t done = 0;
+
+    if (file_stat(fd->fs,fd->file,&st)) {
+	ERROR("Cannot stat file\n");
+	return -1;
+    }
+
+    if (fd->position>=st.st_size) {
+	return 0;
+    }
+
+    num_bytes = MIN(num_bytes, st.st_size - fd->position);
+
+    while (done<num_bytes) {
+	uint64_t off = fd->position + done;
+	uint64_t page_off = off % NK_FS_PAGE_SIZE;
+	uint64_t n = MIN(num_bytes-done, NK_FS_PAGE_SIZE-page_off);
+	char *page = page_cache_lookup(fd, off/NK_FS_PAGE_SIZE, 0);
+	if (!page) {
+	    return done ? done : -1;
+	}
+	memcpy(buf+done, page+page_off, n);
+	done += n;
+    }
+
+    return done;
+}
+
+// copy a completed write into any pages already in the cache
+static void page_cache_update(nk_fs_fd_t fd, off_t offset, char *buf, size_t num_bytes)
+{
+    struct page_cache *c = fd->cache;
+    size_t done = 0;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&c->lock);
+    while (done<num_bytes) {
+	uint64_t off = offset + done;
+	uint64_t page_num = off / NK_FS_PAGE_SIZE;
+	uint64_t page_off = off % NK_FS_PAGE_SIZE;
+	uint64_t n = MIN(num_bytes-done, NK_FS_PAGE_SIZE-page_off);
+	if (page_num<c->num_pages && c->pages[page_num]) {
+	    memcpy((char*)c->pages[page_num]+page_off, buf+done, n);
+	}
+	done += n;
+    }
+    spin_unlock_irq_restore(&c->lock,flags);
+}
+
+// zero cached data past the new end of file, so that growing the file
+// again reads zeros as it would from the filesystem
+static void page_cache_truncate(nk_fs_fd_t fd, off_t len)
+{
+    struct page_cache *c = fd->cache;
+    uint64_t i;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&c->lock);
+    for (i=len/NK_FS_PAGE_SIZE;i<c->num_pages;i++) {
+	if (c->pages[i]) {
+	    uint64_t start = i*NK_FS_PAGE_SIZE < len ? len % NK_FS_PAGE_SIZE : 0;
+	    memset((char*)c->pages[i]+start,0,NK_FS_PAGE_SIZE-start);
+	    c->dirty[i] = 0;
+	}
+    }
+    spin_unlock_irq_restore(&c->lock,flags);
+}
+
+// state lock must be held
+static int page_mapped_writable(nk_fs_fd_t fd, uint64_t page_num)
+{
+    struct fs_mapping *m;
+
+    list_for_each_entry(m,&mappings,mapping_node) {
+	if (m->fd==fd && (m->prot & NK_FS_PROT_WRITE) &&
+	    page_num>=m->offset/NK_FS_PAGE_SIZE &&
+	    page_num<=(m->offset+m->region.len_bytes-1)/NK_FS_PAGE_SIZE) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+// write dirty pages in [first,last] back to the file, but not past EOF
+//
+// A page that is still mapped writable somewhere can be stored to
+// without faulting again, so it stays dirty after being written
+static int page_cache_writeback(nk_fs_fd_t fd, uint64_t first, uint64_t last)
+{
+    STATE_LOCK_CONF;
+    struct page_cache *c = fd->cache;
+    struct nk_fs_stat st;
+    uint64_t i;
+    uint8_t flags;
+    int rc = 0;
+
+    if (!c) {
+	return 0;
+    }
+
+    if (!fd->fs->interface || !fd->fs->interface->write_file) {
+	ERROR("Filesystem cannot write back pages\n");
+	return -1;
+    }
+
+    if (file_stat(fd->fs,fd->file,&st)) {
+	ERROR("Cannot stat file for writeback\n");
+	return -1;
+    }
+
+    for (i=first;i<=last && i<c->num_pages;i++) {
+	uint64_t off = i*NK_FS_PAGE_SIZE;
+	int dirty;
+	void *page;
+
+	STATE_LOCK();
+	flags = spin_lock_irq_save(&c->lock);
+	dirty = c->dirty[i];
+	page = c->pages[i];
+	if (!page_mapped_writable(fd,i)) {
+	    c->dirty[i] = 0;
+	}
+	spin_unlock_irq_restore(&c->lock,flags);
+	STATE_UNLOCK();
+
+	if (!dirty || !page || off>=st.st_size) {
+	    continue;
+	}
+
+	if (fd->fs->interface->write_file(fd->fs->state, fd->file, page, off,
+					  MIN(NK_FS_PAGE_SIZE, st.st_size-off))<0) {
+	    ERROR("Failed to write back page %lu of file %p\n",i,fd->file);
+	    flags = spin_lock_irq_save(&c->lock);
+	    c->dirty[i] = 1;
+	    spin_unlock_irq_restore(&c->lock,flags);
+	    rc = -1;
+	}
+    }
+
+    return rc;
+}
+
+
+void *nk_fs_map_direct(nk_fs_fd_t fd, off_t offset, size_t len)
+{
+    if (FS_FD_ERR(fd) || !fd->fs->interface || !fd->fs->interface->map_file) {
+	return 0;
+    }
+    return fd->fs->interface->map_file(fd->fs->state, fd->file, offset, len);
+}
+
+
+//
+// Memory-mapped files
+//
+
+static int mapping_fault(void *state, void *va, int write, void **pa)
+{
+    struct fs_mapping *m = (struct fs_mapping *)state;
+    uint64_t off;
+    void *page;
+
+    if (write && !(m->prot & NK_FS_PROT_WRITE)) {
+	ERROR("Write to read-only mapping at %p\n",va);
+	return -1;
+    }
+
+    off = m->offset + ((addr_t)va - (addr_t)m->region.va_start);
+
+    // once a writable page is mapped, later writes do not fault, so
+    // treat it as dirty from the start
+    page = page_cache_lookup(m->fd, off/NK_FS_PAGE_SIZE,
+			     write || (m->prot & NK_FS_PROT_WRITE));
+
+    if (!page) {
+	return -1;
+    }
+
+    *pa = page;
+
+    return 0;
+}
+
+static struct fs_mapping *find_mapping(void *addr)
+{
+    struct fs_mapping *m;
+
+    list_for_each_entry(m,&mappings,mapping_node) {
+	if ((addr_t)addr>=(addr_t)m->region.va_start &&
+	    (addr_t)addr<(addr_t)m->region.va_start+m->region.len_bytes) {
+	    return m;
+	}
+    }
+    return 0;
+}
+
+void *nk_fs_mmap(nk_fs_fd_t fd, void *addr, size_t len, int prot, off_t offset)
+{
+#ifndef NAUT_CONFIG_ASPACES
+    ERROR("Memory-mapped files require address space support\n");
+    return 0;
+#else
+    STATE_LOCK_CONF;
+    nk_thread_t *t = get_cur_thread();
+    struct fs_mapping *m;
+
+    DEBUG("mmap fd %p addr %p len %lu prot %x offset %lu\n",fd,addr,len,prot,offset);
+
+    if (FS_FD_ERR(fd) || !len) {
+	ERROR("Bad arguments to mmap\n");
+	return 0;
+    }
+
+    if (offset % NK_FS_PAGE_SIZE || (addr_t)addr % NK_FS_PAGE_SIZE) {
+	ERROR("mmap offset and address must be page-aligned\n");
+	return 0;
+    }
+
+    if (((prot & NK_FS_PROT_READ) && !(fd->flags & O_RDONLY)) ||
+	((prot & NK_FS_PROT_WRITE) && (!(fd->flags & O_WRONLY) || (fd->fs->flags & NK_FS_READONLY)))) {
+	ERROR("mmap protections %x not allowed by file\n",prot);
+	return 0;
+    }
+
+    if (!t->aspace) {
+	ERROR("Thread is in the default address space, which cannot map files\n");
+	return 0;
+    }
+
+    m = malloc(sizeof(*m));
+    if (!m) {
+	ERROR("Cannot allocate mapping\n");
+	return 0;
+    }
+    memset(m,0,sizeof(*m));
+
+    len = (len + NK_FS_PAGE_SIZE - 1) & ~(NK_FS_PAGE_SIZE-1);
+
+    m->fd = fd;
+    m->aspace = t->aspace;
+    m->offset = offset;
+    m->prot = prot;
+    m->pager.fault = mapping_fault;
+    m->pager.state = m;
+
+    STATE_LOCK();
+    if (!addr) {
+	addr = (void*)next_mmap_va;
+	// leave an unmapped guard page between mappings
+	next_mmap_va += len + NK_FS_PAGE_SIZE;
+    }
+    STATE_UNLOCK();
+
+    m->region.va_start = addr;
+    m->region.pa_start = 0;
+    m->region.len_bytes = len;
+    m->region.protect.flags = ((prot & NK_FS_PROT_READ) ? NK_ASPACE_READ : 0) |
+	((prot & NK_FS_PROT_WRITE) ? NK_ASPACE_WRITE : 0);
+    m->region.pager = &m->pager;
+
+    __sync_fetch_and_add(&fd->refcount,1);
+    __sync_fetch_and_add(&fd->num_mappings,1);
+
+    if (nk_aspace_add_region(m->aspace,&m->region)) {
+	ERROR("Address space %s cannot add region for mapping\n",m->aspace->name);
+	__sync_fetch_and_sub(&fd->num_mappings,1);
+	fd_put(fd);
+	free(m);
+	return 0;
+    }
+
+    STATE_LOCK();
+    list_add(&m->mapping_node,&mappings);
+    STATE_UNLOCK();
+
+    DEBUG("mapped fd %p at %p (%lu bytes)\n",fd,addr,len);
+
+    return addr;
+#endif
+}
+
+int nk_fs_msync(void *addr, size_t len)
+{
+    STATE_LOCK_CONF;
+    struct fs_mapping *m;
+    uint64_t start, end;
+
+    STATE_LOCK();
+    m = find_mapping(addr);
+    STATE_UNLOCK();
+
+    if (!m) {
+	ERROR("msync of unmapped address %p\n",addr);
+	return -1;
+    }
+
+    if (!(m->prot & NK_FS_PROT_WRITE)) {
+	return 0;
+    }
+
+    len = MIN(len, (addr_t)m->region.va_start + m->region.len_bytes - (addr_t)addr);
+
+    start = m->offset + ((addr_t)addr - (addr_t)m->region.va_start);
+    end = start + len - 1;
+
+    return page_cache_writeback(m->fd, start/NK_FS_PAGE_SIZE, end/NK_FS_PAGE_SIZE);
+}
+
+int nk_fs_munmap(void *addr, size_t len)
+{
+#ifndef NAUT_CONFIG_ASPACES
+    return -1;
+#else
+    STATE_LOCK_CONF;
+    struct fs_mapping *m;
+    int rc = 0;
+
+    STATE_LOCK();
+    m = find_mapping(addr);
+    if (m && m->region.va_start!=addr) {
+	m = 0;
+    }
+    if (m) {
+	list_del(&m->mapping_node);
+    }
+    STATE_UNLOCK();
+
+    if (!m) {
+	ERROR("munmap of %p, which is not the start of a mapping\n",addr);
+	return -1;
+    }
+
+    if (len && len<m->region.len_bytes) {
+	ERROR("Partial munmap is not supported, unmapping all of %p\n",addr);
+    }
+
+    // unmap first, so that no store can land after the writeback
+    if (nk_aspace_remove_region(m->aspace,&m->region)) {
+	ERROR("Failed to remove region for mapping at %p\n",addr);
+	rc = -1;
+    }
+
+    if ((m->prot & NK_FS_PROT_WRITE) &&
+	page_cache_writeback(m->fd, m->offset/NK_FS_PAGE_SIZE,
+			     (m->offset+m->region.len_bytes-1)/NK_FS_PAGE_SIZE)) {
+	rc = -1;
+    }
+
+    __sync_fetch_and_sub(&m->fd->num_mappings,1);
+    fd_put(m->fd);
+    free(m);
+
+    return rc;
+#endif
+}
+
+
 void nk_fs_dump_filesystems()
 {
     STATE_LOCK_CONF;
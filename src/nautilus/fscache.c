@@ -0,0 +1,526 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+/*
+ * Dentry and inode caches for the filesystem layer
+ *
+ * Both caches are fixed-size hash tables of chained entries with
+ * a global LRU list used for eviction once the entry limit is
+ * reached.   Entries are keyed by the filesystem they belong to,
+ * so one instance serves all attached filesystems.
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/fs.h>
+#include <nautilus/hashtable.h>
+#include <nautilus/shell.h>
+
+#define INFO(fmt, args...)  INFO_PRINT("fscache: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("fscache: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("fscache: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_DEBUG_FILESYSTEM
+#undef DEBUG
+#define DEBUG(fmt, args...)
+#endif
+
+#define CACHE_LOCK_CONF uint8_t _cache_lock_flags
+#define CACHE_LOCK(c) _cache_lock_flags = spin_lock_irq_save(&(c)->lock)
+#define CACHE_UNLOCK(c) spin_unlock_irq_restore(&(c)->lock, _cache_lock_flags);
+
+#define DCACHE_HASH_BITS   10
+#define DCACHE_MAX_ENTRIES 4096
+#define ICACHE_HASH_BITS   10
+#define ICACHE_MAX_ENTRIES 4096
+
+struct cache {
+    spinlock_t        lock;
+    struct list_head *buckets;
+    uint_t            hash_bits;
+    struct list_head  lru;          // most recently used at head
+    uint64_t          count;
+    uint64_t          max;
+    uint64_t          hits;
+    uint64_t          negative_hits;
+    uint64_t          misses;
+    uint64_t          evictions;
+};
+
+struct dcache_entry {
+    struct list_head  hash_node;
+    struct list_head  lru_node;
+    struct nk_fs     *fs;
+    uint64_t          parent;
+    uint64_t          child;
+    int               negative;
+    char              name[NK_FS_DCACHE_NAME_LEN];
+};
+
+struct icache_entry {
+    struct list_head  hash_node;
+    struct list_head  lru_node;
+    struct nk_fs     *fs;
+    uint64_t          id;
+    size_t            size;
+    uint8_t           data[0];
+};
+
+static struct cache dcache;
+static struct cache icache;
+
+
+static int cache_init(struct cache *c, uint_t hash_bits, uint64_t max)
+{
+    uint64_t i;
+    uint64_t n = 1UL << hash_bits;
+
+    memset(c,0,sizeof(*c));
+
+    c->buckets = malloc(n*sizeof(struct list_head));
+    if (!c->buckets) {
+	ERROR("Cannot allocate cache buckets\n");
+	return -1;
+    }
+    for (i=0;i<n;i++) {
+	INIT_LIST_HEAD(&c->buckets[i]);
+    }
+    INIT_LIST_HEAD(&c->lru);
+    spinlock_init(&c->lock);
+    c->hash_bits = hash_bits;
+    c->max = max;
+    return 0;
+}
+
+static inline uint64_t dcache_hash(struct nk_fs *fs, uint64_t parent, char *name)
+{
+    ulong_t h = nk_hash_buffer((uchar_t*)name, strlen(name));
+    h ^= nk_hash_long(parent ^ (ulong_t)fs, 32);
+    return nk_hash_long(h, dcache.hash_bits);
+}
+
+static inline uint64_t icache_hash(struct nk_fs *fs, uint64_t id)
+{
+    return nk_hash_long(id ^ (ulong_t)fs, icache.hash_bits);
+}
+
+// dcache lock must be held
+static struct dcache_entry *__dcache_find(struct nk_fs *fs, uint64_t parent, char *name)
+{
+    struct dcache_entry *e;
+    struct list_head *b = &dcache.buckets[dcache_hash(fs,parent,name)];
+
+    list_for_each_entry(e,b,hash_node) {
+	if (e->fs==fs && e->parent==parent && !strcmp(e->name,name)) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+// icache lock must be held
+static struct icache_entry *__icache_find(struct nk_fs *fs, uint64_t id)
+{
+    struct icache_entry *e;
+    struct list_head *b = &icache.buckets[icache_hash(fs,id)];
+
+    list_for_each_entry(e,b,hash_node) {
+	if (e->fs==fs && e->id==id) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+int nk_fs_dcache_lookup(struct nk_fs *fs, uint64_t parent, char *name, uint64_t *child)
+{
+    CACHE_LOCK_CONF;
+    struct dcache_entry *e;
+    int rc;
+
+    if (!dcache.buckets || strlen(name)>=NK_FS_DCACHE_NAME_LEN) {
+	return NK_FS_DCACHE_MISS;
+    }
+
+    CACHE_LOCK(&dcache);
+    e = __dcache_find(fs,parent,name);
+    if (!e) {
+	dcache.misses++;
+	rc = NK_FS_DCACHE_MISS;
+    } else {
+	list_move(&e->lru_node,&dcache.lru);
+	if (e->negative) {
+	    dcache.negative_hits++;
+	    rc = NK_FS_DCACHE_NEGATIVE;
+	} else {
+	    dcache.hits++;
+	    *child = e->child;
+	    rc = NK_FS_DCACHE_HIT;
+	}
+    }
+    CACHE_UNLOCK(&dcache);
+
+    DEBUG("lookup %s:%lu/%s => %s\n", fs->name, parent, name,
+	  rc==NK_FS_DCACHE_HIT ? "hit" : rc==NK_FS_DCACHE_NEGATIVE ? "negative" : "miss");
+
+    return rc;
+}
+
+static void dcache_insert(struct nk_fs *fs, uint64_t parent, char *name, uint64_t child, int negative)
+{
+    CACHE_LOCK_CONF;
+    struct dcache_entry *e, *victim=0;
+
+    if (!dcache.buckets || strlen(name)>=NK_FS_DCACHE_NAME_LEN) {
+	return;
+    }
+
+    CACHE_LOCK(&dcache);
+    e = __dcache_find(fs,parent,name);
+    if (!e) {
+	if (dcache.count>=dcache.max) {
+	    // recycle the least recently used entry
+	    e = list_entry(dcache.lru.prev,struct dcache_entry,lru_node);
+	    list_del(&e->hash_node);
+	    list_del(&e->lru_node);
+	    dcache.count--;
+	    dcache.evictions++;
+	} else {
+	    CACHE_UNLOCK(&dcache);
+	    victim = malloc(sizeof(*victim));
+	    if (!victim) {
+		ERROR("Cannot allocate dentry cache entry\n");
+		return;
+	    }
+	    CACHE_LOCK(&dcache);
+	    // someone may have raced us in
+	    e = __dcache_find(fs,parent,name);
+	    if (e) {
+		goto update;
+	    }
+	    e = victim;
+	    victim = 0;
+	}
+	e->fs = fs;
+	e->parent = parent;
+	strcpy(e->name,name);
+	list_add(&e->hash_node,&dcache.buckets[dcache_hash(fs,parent,name)]);
+	list_add(&e->lru_node,&dcache.lru);
+	dcache.count++;
+    }
+ update:
+    e->child = negative ? 0 : child;
+    e->negative = negative;
+    list_move(&e->lru_node,&dcache.lru);
+    CACHE_UNLOCK(&dcache);
+
+    if (victim) {
+	free(victim);
+    }
+}
+
+void nk_fs_dcache_insert(struct nk_fs *fs, uint64_t parent, char *name, uint64_t child)
+{
+    DEBUG("insert %s:%lu/%s => %lu\n", fs->name, parent, name, child);
+    dcache_insert(fs,parent,name,child,0);
+}
+
+void nk_fs_dcache_insert_negative(struct nk_fs *fs, uint64_t parent, char *name)
+{
+    DEBUG("insert %s:%lu/%s => negative\n", fs->name, parent, name);
+    dcache_insert(fs,parent,name,0,1);
+}
+
+void nk_fs_dcache_invalidate(struct nk_fs *fs, uint64_t parent, char *name)
+{
+    CACHE_LOCK_CONF;
+    struct dcache_entry *e;
+
+    if (!dcache.buckets || strlen(name)>=NK_FS_DCACHE_NAME_LEN) {
+	return;
+    }
+
+    DEBUG("invalidate %s:%lu/%s\n", fs->name, parent, name);
+
+    CACHE_LOCK(&dcache);
+    e = __dcache_find(fs,parent,name);
+    if (e) {
+	list_del(&e->hash_node);
+	list_del(&e->lru_node);
+	dcache.count--;
+    }
+    CACHE_UNLOCK(&dcache);
+
+    if (e) {
+	free(e);
+    }
+}
+
+void nk_fs_dcache_invalidate_dir(struct nk_fs *fs, uint64_t parent)
+{
+    CACHE_LOCK_CONF;
+    struct dcache_entry *e, *n;
+    struct list_head dfree;
+
+    if (!dcache.buckets) {
+	return;
+    }
+
+    DEBUG("invalidate %s:%lu/*\n", fs->name, parent);
+
+    INIT_LIST_HEAD(&dfree);
+
+    CACHE_LOCK(&dcache);
+    list_for_each_entry_safe(e,n,&dcache.lru,lru_node) {
+	if (e->fs==fs && e->parent==parent) {
+	    list_del(&e->hash_node);
+	    list_move(&e->lru_node,&dfree);
+	    dcache.count--;
+	}
+    }
+    CACHE_UNLOCK(&dcache);
+
+    list_for_each_entry_safe(e,n,&dfree,lru_node) {
+	list_del(&e->lru_node);
+	free(e);
+    }
+}
+
+int nk_fs_icache_lookup(struct nk_fs *fs, uint64_t id, void *dest, size_t size)
+{
+    CACHE_LOCK_CONF;
+    struct icache_entry *e;
+    int rc = NK_FS_DCACHE_MISS;
+
+    if (!icache.buckets) {
+	return NK_FS_DCACHE_MISS;
+    }
+
+    CACHE_LOCK(&icache);
+    e = __icache_find(fs,id);
+    if (e && e->size==size) {
+	memcpy(dest,e->data,size);
+	list_move(&e->lru_node,&icache.lru);
+	icache.hits++;
+	rc = NK_FS_DCACHE_HIT;
+    } else {
+	icache.misses++;
+    }
+    CACHE_UNLOCK(&icache);
+
+    return rc;
+}
+
+void nk_fs_icache_insert(struct nk_fs *fs, uint64_t id, void *src, size_t size)
+{
+    CACHE_LOCK_CONF;
+    struct icache_entry *e, *n=0;
+
+    if (!icache.buckets) {
+	return;
+    }
+
+    CACHE_LOCK(&icache);
+    e = __icache_find(fs,id);
+    if (e && e->size==size) {
+	memcpy(e->data,src,size);
+	list_move(&e->lru_node,&icache.lru);
+	CACHE_UNLOCK(&icache);
+	return;
+    }
+    if (e) {
+	// size changed, which should not happen, but handle it anyway
+	list_del(&e->hash_node);
+	list_del(&e->lru_node);
+	icache.count--;
+    } else if (icache.count>=icache.max) {
+	e = list_entry(icache.lru.prev,struct icache_entry,lru_node);
+	list_del(&e->hash_node);
+	list_del(&e->lru_node);
+	icache.count--;
+	icache.evictions++;
+    }
+    CACHE_UNLOCK(&icache);
+
+    if (e) {
+	free(e);
+    }
+
+    n = malloc(sizeof(*n)+size);
+    if (!n) {
+	ERROR("Cannot allocate inode cache entry\n");
+	return;
+    }
+    n->fs = fs;
+    n->id = id;
+    n->size = size;
+    memcpy(n->data,src,size);
+
+    CACHE_LOCK(&icache);
+    e = __icache_find(fs,id);
+    if (e) {
+	// raced with another insert - the caller's copy is the newest
+	list_del(&e->hash_node);
+	list_del(&e->lru_node);
+	icache.count--;
+    }
+    list_add(&n->hash_node,&icache.buckets[icache_hash(fs,id)]);
+    list_add(&n->lru_node,&icache.lru);
+    icache.count++;
+    CACHE_UNLOCK(&icache);
+
+    if (e) {
+	free(e);
+    }
+}
+
+void nk_fs_icache_invalidate(struct nk_fs *fs, uint64_t id)
+{
+    CACHE_LOCK_CONF;
+    struct icache_entry *e;
+
+    if (!icache.buckets) {
+	return;
+    }
+
+    CACHE_LOCK(&icache);
+    e = __icache_find(fs,id);
+    if (e) {
+	list_del(&e->hash_node);
+	list_del(&e->lru_node);
+	icache.count--;
+    }
+    CACHE_UNLOCK(&icache);
+
+    if (e) {
+	free(e);
+    }
+}
+
+void nk_fs_cache_flush(struct nk_fs *fs)
+{
+    CACHE_LOCK_CONF;
+    struct dcache_entry *de, *dn;
+    struct icache_entry *ie, *in;
+    struct list_head dfree, ifree;
+
+    INIT_LIST_HEAD(&dfree);
+    INIT_LIST_HEAD(&ifree);
+
+    if (dcache.buckets) {
+	CACHE_LOCK(&dcache);
+	list_for_each_entry_safe(de,dn,&dcache.lru,lru_node) {
+	    if (!fs || de->fs==fs) {
+		list_del(&de->hash_node);
+		list_move(&de->lru_node,&dfree);
+		dcache.count--;
+	    }
+	}
+	CACHE_UNLOCK(&dcache);
+    }
+
+    if (icache.buckets) {
+	CACHE_LOCK(&icache);
+	list_for_each_entry_safe(ie,in,&icache.lru,lru_node) {
+	    if (!fs || ie->fs==fs) {
+		list_del(&ie->hash_node);
+		list_move(&ie->lru_node,&ifree);
+		icache.count--;
+	    }
+	}
+	CACHE_UNLOCK(&icache);
+    }
+
+    list_for_each_entry_safe(de,dn,&dfree,lru_node) {
+	list_del(&de->lru_node);
+	free(de);
+    }
+    list_for_each_entry_safe(ie,in,&ifree,lru_node) {
+	list_del(&ie->lru_node);
+	free(ie);
+    }
+
+    DEBUG("flushed caches for %s\n", fs ? fs->name : "all filesystems");
+}
+
+int nk_fs_cache_init(void)
+{
+    if (cache_init(&dcache,DCACHE_HASH_BITS,DCACHE_MAX_ENTRIES)) {
+	ERROR("Failed to initialize dentry cache\n");
+	return -1;
+    }
+    if (cache_init(&icache,ICACHE_HASH_BITS,ICACHE_MAX_ENTRIES)) {
+	ERROR("Failed to initialize inode cache\n");
+	free(dcache.buckets);
+	dcache.buckets = 0;
+	return -1;
+    }
+    INFO("inited (%lu dentries, %lu inodes max)\n", dcache.max, icache.max);
+    return 0;
+}
+
+int nk_fs_cache_deinit(void)
+{
+    nk_fs_cache_flush(0);
+    free(dcache.buckets);
+    dcache.buckets = 0;
+    spinlock_deinit(&dcache.lock);
+    free(icache.buckets);
+    icache.buckets = 0;
+    spinlock_deinit(&icache.lock);
+    INFO("deinited\n");
+    return 0;
+}
+
+static void cache_dump(char *name, struct cache *c)
+{
+    nk_vc_printf("%s: %lu/%lu entries, %lu hits, %lu negative hits, %lu misses, %lu evictions\n",
+		 name, c->count, c->max, c->hits, c->negative_hits, c->misses, c->evictions);
+}
+
+void nk_fs_cache_dump(void)
+{
+    cache_dump("dcache",&dcache);
+    cache_dump("icache",&icache);
+}
+
+static int
+handle_fscache (char * buf, void * priv)
+{
+    char what[32];
+
+    if (sscanf(buf,"fscache %s", what)==1 && !strcmp(what,"flush")) {
+	nk_fs_cache_flush(0);
+	nk_vc_printf("flushed\n");
+	return 0;
+    }
+
+    nk_fs_cache_dump();
+    return 0;
+}
+
+static struct shell_cmd_impl fscache_impl = {
+    .cmd      = "fscache",
+    .help_str = "fscache [flush]",
+    .handler  = handle_fscache,
+};
+nk_register_shell_cmd(fscache_impl);
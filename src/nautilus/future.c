@@ -22,107 +22,310 @@
  */
 
 #include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/task.h>
 #include <nautilus/future.h>
 
-#define NUM_SEED_FUTURES NAUT_CONFIG_MAX_CPUS
+// futures placed in each CPU's pool at init
+#define NUM_SEED_FUTURES 16
 
-static spinlock_t state_lock;
+// beyond this, freed futures go back to the heap
+#define POOL_MAX_FUTURES 256
 
-// number of the next future
-static uint64_t         future_num=0;
+// blocking waits spin this long before sleeping
+#define SPIN_CYCLES      20000
 
-// number of available  futures in the pool
-// ideally will be per-cpu
-static uint64_t         future_free_count=0;
-static struct list_head future_free_list;
+// sleeping waiters share these, hashed by future
+#define NUM_WAIT_QUEUES  16
 
-#define STATE_LOCK_CONF uint8_t _state_lock_flags
-#define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&state_lock)
-#define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
+// cbs of a future whose callbacks have been run
+#define CBS_CLOSED ((nk_future_cb_t *)1)
 
+// Each CPU's free futures.  Only the CPU itself touches its pool,
+// with interrupts off, so there is no lock
+static struct future_pool {
+    struct list_head free;
+    uint64_t         count;
+} __attribute__((aligned(64))) pools[NAUT_CONFIG_MAX_CPUS];
 
-// must be called with state lock held, or on init
-// does explicit allocation but does not
-static nk_future_t * _nk_future_alloc()
+static nk_wait_queue_t *wait_queues[NUM_WAIT_QUEUES];
+
+// threads asleep (or about to be) on each queue, kept apart from the
+// futures, which the finisher must not touch once they are done
+static volatile uint32_t wait_waiters[NUM_WAIT_QUEUES];
+
+static inline int wait_index_of(nk_future_t *f)
 {
-    char buf[NK_WAIT_QUEUE_NAME_LEN];
+    return ((addr_t)f >> 6) % NUM_WAIT_QUEUES;
+}
 
-    snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"future%lu",future_num++);
 
-    FU_DEBUG("base alloc wq name %s\n",buf);
-    
-    nk_wait_queue_t *wq = nk_wait_queue_create(buf);
-    if (!wq) {
-	FU_ERROR("failed to allocate wq\n");
-	return 0;
-    }
-    
+static nk_future_t * _nk_future_alloc()
+{
     nk_future_t *f = malloc(sizeof(*f));
 
     if (!f) {
 	FU_ERROR("Failed to allocate future\n");
-	free(wq);
 	return 0;
     }
 
     memset(f,0,sizeof(*f));
 
-    f->waitqueue = wq;
-
     INIT_LIST_HEAD(&f->node);
 
-    f->state = NK_FUTURE_IN_PROGRESS;
-
-    FU_DEBUG("allocation returns %p (%s)\n",f,f->waitqueue->name);
+    FU_DEBUG("allocation returns %p\n",f);
     
     return f;
 }
 
 nk_future_t * nk_future_alloc()
 {
-    STATE_LOCK_CONF;
+    struct future_pool *p;
+    nk_future_t *f = 0;
+    uint8_t flags;
 
     FU_DEBUG("alloc\n");
-    
-    STATE_LOCK();
 
-    if (list_empty(&future_free_list)) {
-	STATE_UNLOCK();
-	return _nk_future_alloc();
+    flags = irq_disable_save();
+    p = &pools[my_cpu_id()];
+    if (!list_empty(&p->free)) {
+	f = list_first_entry(&p->free, struct nk_future, node);
+	list_del_init(&f->node);
+	p->count--;
     }
+    irq_enable_restore(flags);
 
-    nk_future_t *f = list_first_entry(&future_free_list, struct nk_future, node);
-    list_del_init(&f->node);
-    future_free_count--;
-
-    STATE_UNLOCK();
+    if (!f && !(f = _nk_future_alloc())) {
+	return 0;
+    }
 
-    f->state = NK_FUTURE_IN_PROGRESS;
+    nk_future_recycle(f);
 
-    FU_DEBUG("fast alloc returns %p (%s)\n",f, f->waitqueue->name);
+    FU_DEBUG("alloc returns %p\n",f);
     
     return f;
 }
 	
 
 //
-// Note that this never shrinks the pool
+// The future goes to the pool of the CPU freeing it
 //
 void nk_future_free(nk_future_t *f)
 {
-    STATE_LOCK_CONF;
+    struct future_pool *p;
+    uint8_t flags;
 
     f->state = NK_FUTURE_FREE;
     f->result = 0;
-    
-    STATE_LOCK();
-    
-    list_add(&f->node,&future_free_list);
-    future_free_count++;
 
-    STATE_UNLOCK();
+    flags = irq_disable_save();
+    p = &pools[my_cpu_id()];
+    if (p->count < POOL_MAX_FUTURES) {
+	list_add(&f->node,&p->free);
+	p->count++;
+	f = 0;
+    }
+    irq_enable_restore(flags);
+
+    if (f) {
+	free(f);
+    }
+}
+
+
+int nk_future_finish(nk_future_t *f, void *result)
+{
+    int w = wait_index_of(f);
+    nk_future_cb_t *cb, *rev, *next;
+
+    if (!__sync_bool_compare_and_swap(&f->state, NK_FUTURE_IN_PROGRESS, NK_FUTURE_FINISHING)) {
+	FU_ERROR("finish of future %p in state %d\n", f, f->state);
+	return -1;
+    }
+
+    FU_DEBUG("finish %p\n",f);
+
+    f->result = result;
+
+    // close the callback list before anyone can see us done, since
+    // a waiter may free the future as soon as it is
+    cb = __sync_lock_test_and_set(&f->cbs, CBS_CLOSED);
+
+    __sync_synchronize();
+    f->state = NK_FUTURE_DONE;
+    __sync_synchronize();
+
+    // a waiter either is counted here or sees us done before sleeping,
+    // and it may have freed the future by now
+    if (wait_waiters[w]) {
+	nk_wait_queue_wake_all(wait_queues[w]);
+    }
+
+    // run in the order added
+    for (rev = 0; cb; cb = next) {
+	next = cb->next;
+	cb->next = rev;
+	rev = cb;
+    }
+    for (cb = rev; cb; cb = next) {
+	next = cb->next;
+	cb->fn(cb, result);
+    }
+
+    return 0;
+}
+
+void nk_future_add_callback(nk_future_t *f, nk_future_cb_t *cb)
+{
+    nk_future_cb_t *head;
+
+    do {
+	head = f->cbs;
+	if (head == CBS_CLOSED) {
+	    cb->fn(cb, f->result);
+	    return;
+	}
+	cb->next = head;
+    } while (!__sync_bool_compare_and_swap(&f->cbs, head, cb));
+}
+
+
+static void *then_task(void *in)
+{
+    nk_future_t *g = (nk_future_t *)in;
+
+    nk_future_finish(g, g->then_fn(g->result, g->then_arg));
+
+    return 0;
+}
+
+static void then_cb(nk_future_cb_t *cb, void *result)
+{
+    nk_future_t *g = container_of(cb, nk_future_t, then_cb);
+
+    if (g->then_flags & NK_FUTURE_THEN_TASK) {
+	// g is in progress, so its result field is ours until then
+	g->result = result;
+	if (nk_task_produce(-1, 0, then_task, g, NK_TASK_DETACHED)) {
+	    return;
+	}
+	FU_WARN("cannot queue continuation of %p, running it here\n", g);
+    }
+
+    nk_future_finish(g, g->then_fn(result, g->then_arg));
+}
+
+nk_future_t * nk_future_then(nk_future_t *f, void *(*fn)(void *result, void *arg), void *arg, uint64_t flags)
+{
+    nk_future_t *g = nk_future_alloc();
+
+    if (!g) {
+	return 0;
+    }
+
+    g->then_fn = fn;
+    g->then_arg = arg;
+    g->then_flags = flags;
+    g->then_cb.fn = then_cb;
+
+    nk_future_add_callback(f, &g->then_cb);
+
+    return g;
+}
+
+
+// state shared by the callbacks of a when_all/when_any
+struct future_join {
+    volatile int  remaining;  // callbacks yet to run, last one frees
+    volatile int  fired;      // when_any has completed
+    nk_future_t  *out;
+    struct join_cb {
+	nk_future_cb_t      cb;
+	struct future_join *j;
+	int                 index;
+    } cbs[0];
+};
+
+static void all_cb(nk_future_cb_t *cb, void *result)
+{
+    struct future_join *j = container_of(cb, struct join_cb, cb)->j;
+
+    if (!__sync_sub_and_fetch(&j->remaining, 1)) {
+	nk_future_t *out = j->out;
+	free(j);
+	nk_future_finish(out, 0);
+    }
+}
+
+static void any_cb(nk_future_cb_t *cb, void *result)
+{
+    struct join_cb *jc = container_of(cb, struct join_cb, cb);
+    struct future_join *j = jc->j;
+
+    if (__sync_bool_compare_and_swap(&j->fired, 0, 1)) {
+	nk_future_finish(j->out, (void*)(uint64_t)jc->index);
+    }
+
+    if (!__sync_sub_and_fetch(&j->remaining, 1)) {
+	free(j);
+    }
 }
 
+static nk_future_t * join(int n, nk_future_t **f, void (*fn)(nk_future_cb_t *, void *))
+{
+    struct future_join *j;
+    nk_future_t *out;
+    int i;
+
+    if (!(out = nk_future_alloc())) {
+	return 0;
+    }
+
+    if (!n) {
+	nk_future_finish(out, 0);
+	return out;
+    }
+
+    j = malloc(sizeof(*j) + n*sizeof(struct join_cb));
+    if (!j) {
+	FU_ERROR("cannot allocate join of %d futures\n", n);
+	nk_future_free(out);
+	return 0;
+    }
+
+    j->remaining = n;
+    j->fired = 0;
+    j->out = out;
+
+    for (i=0;i<n;i++) {
+	j->cbs[i].cb.fn = fn;
+	j->cbs[i].j = j;
+	j->cbs[i].index = i;
+    }
+
+    // j may be gone once the last callback is added
+    for (i=0;i<n;i++) {
+	nk_future_add_callback(f[i], &j->cbs[i].cb);
+    }
+
+    return out;
+}
+
+nk_future_t * nk_future_when_all(int n, nk_future_t **f)
+{
+    return join(n, f, all_cb);
+}
+
+nk_future_t * nk_future_when_any(int n, nk_future_t **f)
+{
+    if (n < 1) {
+	FU_ERROR("when_any of no futures\n");
+	return 0;
+    }
+    return join(n, f, any_cb);
+}
+
+
 static int cond_check(void *s)
 {
     void *result_temp;
@@ -131,30 +334,59 @@ static int cond_check(void *s)
 
 int nk_future_wait_block(nk_future_t *f, void **result)
 {
+    uint64_t start = rdtsc();
     int rc;
-    FU_DEBUG("start blocking wait on %p (%s)\n",f,f->waitqueue->name);
-    while ((rc=nk_future_check(f,result))==1) {
-	nk_wait_queue_sleep_extended(f->waitqueue,cond_check,f);
+
+    FU_DEBUG("start blocking wait on %p\n",f);
+
+    // most futures finish soon, and sleeping costs far more
+    while ((rc=nk_future_check(f,result))==1 && rdtsc()-start < SPIN_CYCLES) {
+	asm volatile ("pause");
     }
-    FU_DEBUG("end blocking wait on %p (%s) rc = %d result = %p\n",f,f->waitqueue->name,rc, *result);
+
+    if (rc==1) {
+	int w = wait_index_of(f);
+	__sync_fetch_and_add(&wait_waiters[w],1);
+	while ((rc=nk_future_check(f,result))==1) {
+	    nk_wait_queue_sleep_extended(wait_queues[w],cond_check,f);
+	}
+	__sync_fetch_and_sub(&wait_waiters[w],1);
+    }
+
+    FU_DEBUG("end blocking wait on %p rc = %d result = %p\n",f,rc, *result);
     return rc;
 }
 
 
-// ideally this would create a per-cpu pool, but for
-// now we create one global pool
 int nk_future_init()
 {
-    int i;
-    INIT_LIST_HEAD(&future_free_list);
-    spinlock_init(&state_lock);
-    // seed the pool
-    for (i=0;i<NUM_SEED_FUTURES;i++) {
-	nk_future_t *f = _nk_future_alloc();
-	f->state=NK_FUTURE_FREE;
-	list_add(&f->node,&future_free_list);
-    }
-    FU_INFO("inited (seeded pool with %d futures)\n", i);
+    char buf[NK_WAIT_QUEUE_NAME_LEN];
+    int i, j;
+
+    for (i=0;i<NUM_WAIT_QUEUES;i++) {
+	snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"future%d",i);
+	if (!(wait_queues[i] = nk_wait_queue_create(buf))) {
+	    FU_ERROR("failed to allocate wait queue %d\n",i);
+	    return -1;
+	}
+    }
+
+    // seed the pools
+    for (i=0;i<NAUT_CONFIG_MAX_CPUS;i++) {
+	INIT_LIST_HEAD(&pools[i].free);
+	if (i < nk_get_num_cpus()) {
+	    for (j=0;j<NUM_SEED_FUTURES;j++) {
+		nk_future_t *f = _nk_future_alloc();
+		if (!f) {
+		    break;
+		}
+		list_add(&f->node,&pools[i].free);
+		pools[i].count++;
+	    }
+	}
+    }
+
+    FU_INFO("inited (seeded pools with %d futures per cpu)\n", NUM_SEED_FUTURES);
 
     return 0;
 }
@@ -27,6 +27,7 @@
 #include <nautilus/thread.h>
 #include <nautilus/atomic.h>
 #include <nautilus/list.h>
+#include <nautilus/pmc.h>
 
 #include <nautilus/group.h>
 #include <nautilus/group_sched.h>
@@ -558,3 +559,44 @@ uint64_t
 nk_thread_group_get_size(nk_thread_group_t *group) {
   return group->group_size;
 }
+
+// sum the per-thread counters of the current members
+int
+nk_thread_group_pmc_read(nk_thread_group_t *group, uint64_t *counts, int num) {
+  uint64_t member_counts[NK_THREAD_PMC_MAX];
+  uint32_t ids[NK_THREAD_PMC_MAX], member_ids[NK_THREAD_PMC_MAX];
+  group_member_t *member;
+  int i, cpu, n, max = -1;
+
+  if (num > NK_THREAD_PMC_MAX) {
+    num = NK_THREAD_PMC_MAX;
+  }
+
+  memset(counts, 0, sizeof(uint64_t) * num);
+
+  spin_lock(&group->group_lock);
+
+  for (cpu = 0; cpu < MAX_CPU_NUM; cpu++) {
+    list_for_each_entry(member, &group->group_member_array[cpu], group_member_node) {
+      n = nk_thread_pmc_read(member->thread, member_counts, member_ids, 0, num);
+      if (n < 0) {
+        continue;
+      }
+      if (max < 0) {
+        // the first counting member decides what is being summed
+        max = n;
+        memcpy(ids, member_ids, sizeof(uint32_t) * n);
+      } else if (n != max || memcmp(ids, member_ids, sizeof(uint32_t) * n)) {
+        // counting something else - adding it in would be meaningless
+        continue;
+      }
+      for (i = 0; i < n; i++) {
+        counts[i] += member_counts[i];
+      }
+    }
+  }
+
+  spin_unlock(&group->group_lock);
+
+  return max;
+}
@@ -0,0 +1,376 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/mm.h>
+#include <nautilus/shell.h>
+#include <nautilus/histogram.h>
+
+#define INFO(fmt, args...)  INFO_PRINT("hist: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("hist: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("hist: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_DEBUG_PROFILE
+#undef DEBUG
+#define DEBUG(fmt, args...)
+#endif
+
+static spinlock_t hist_lock;
+static LIST_HEAD(hist_list);
+
+#define STATE_LOCK_CONF uint8_t _state_lock_flags
+#define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&hist_lock)
+#define STATE_UNLOCK() spin_unlock_irq_restore(&hist_lock, _state_lock_flags)
+
+struct nk_hist *nk_hist_malloc;
+struct nk_hist *nk_hist_free;
+struct nk_hist *nk_hist_irq;
+struct nk_hist *nk_hist_thr_switch;
+struct nk_hist *nk_hist_wakeup;
+struct nk_hist *nk_hist_xcall;
+struct nk_hist *nk_hist_blk_read;
+struct nk_hist *nk_hist_blk_write;
+struct nk_hist *nk_hist_net_send;
+
+
+static void
+data_reset (struct nk_hist_data *d)
+{
+    memset(d, 0, sizeof(*d));
+    d->min = -1UL;
+}
+
+
+struct nk_hist *
+nk_hist_create (char *name, uint64_t flags)
+{
+    STATE_LOCK_CONF;
+    struct nk_hist *h;
+    int num_cpus = nk_get_nautilus_info()->sys.num_cpus;
+    int i;
+
+    h = malloc(sizeof(*h));
+    if (!h) {
+        ERROR("Cannot allocate histogram %s\n", name);
+        return 0;
+    }
+    memset(h, 0, sizeof(*h));
+
+    h->cpu = malloc(sizeof(struct nk_hist_data) * num_cpus);
+    if (!h->cpu) {
+        ERROR("Cannot allocate per-cpu data for histogram %s\n", name);
+        free(h);
+        return 0;
+    }
+
+    strncpy(h->name, name, NK_HIST_NAME_LEN);
+    h->name[NK_HIST_NAME_LEN - 1] = 0;
+    h->flags = flags;
+    h->num_cpus = num_cpus;
+
+    for (i = 0; i < num_cpus; i++) {
+        data_reset(&h->cpu[i]);
+    }
+
+    STATE_LOCK();
+    list_add_tail(&h->hist_list_node, &hist_list);
+    STATE_UNLOCK();
+
+    DEBUG("created histogram %s\n", h->name);
+
+    return h;
+}
+
+
+void
+nk_hist_destroy (struct nk_hist *h)
+{
+    STATE_LOCK_CONF;
+
+    STATE_LOCK();
+    list_del(&h->hist_list_node);
+    STATE_UNLOCK();
+
+    free(h->cpu);
+    free(h);
+}
+
+
+struct nk_hist *
+nk_hist_find (char *name)
+{
+    STATE_LOCK_CONF;
+    struct nk_hist *h, *found = 0;
+
+    STATE_LOCK();
+    list_for_each_entry(h, &hist_list, hist_list_node) {
+        if (!strncasecmp(h->name, name, NK_HIST_NAME_LEN)) {
+            found = h;
+            break;
+        }
+    }
+    STATE_UNLOCK();
+
+    return found;
+}
+
+
+// Racy with respect to concurrent recording, which at worst leaves a
+// few samples from before the clear
+void
+nk_hist_clear (struct nk_hist *h)
+{
+    int i;
+
+    for (i = 0; i < h->num_cpus; i++) {
+        data_reset(&h->cpu[i]);
+    }
+}
+
+
+void
+nk_hist_add (struct nk_hist_data *dest, struct nk_hist_data *src)
+{
+    int i;
+
+    dest->count += src->count;
+    dest->sum += src->sum;
+    if (src->min < dest->min) {
+        dest->min = src->min;
+    }
+    if (src->max > dest->max) {
+        dest->max = src->max;
+    }
+    for (i = 0; i < NK_HIST_BUCKETS; i++) {
+        dest->buckets[i] += src->buckets[i];
+    }
+}
+
+
+void
+nk_hist_merge (struct nk_hist *h, struct nk_hist_data *out)
+{
+    int i;
+
+    data_reset(out);
+
+    for (i = 0; i < h->num_cpus; i++) {
+        nk_hist_add(out, &h->cpu[i]);
+    }
+}
+
+
+static uint64_t
+bucket_low (unsigned b)
+{
+    unsigned e;
+
+    if (b < NK_HIST_SUB) {
+        return b;
+    }
+
+    e = b / NK_HIST_SUB - 1 + NK_HIST_SUB_BITS;
+
+    return (NK_HIST_SUB + b % NK_HIST_SUB) << (e - NK_HIST_SUB_BITS);
+}
+
+
+static uint64_t
+bucket_mid (unsigned b)
+{
+    if (b < NK_HIST_SUB) {
+        return b;
+    }
+
+    return bucket_low(b) + ((1UL << (b / NK_HIST_SUB - 1)) >> 1);
+}
+
+
+uint64_t
+nk_hist_quantile (struct nk_hist_data *d, uint64_t ppm)
+{
+    uint64_t target, seen = 0;
+    unsigned b;
+
+    if (!d->count) {
+        return 0;
+    }
+
+    // rank of the sample we want, rounding up
+    target = (d->count * ppm + 999999) / 1000000;
+    if (!target) {
+        target = 1;
+    }
+
+    for (b = 0; b < NK_HIST_BUCKETS; b++) {
+        seen += d->buckets[b];
+        if (seen >= target) {
+            uint64_t v = bucket_mid(b);
+            // the true extremes are known exactly
+            if (v < d->min) {
+                v = d->min;
+            }
+            if (v > d->max) {
+                v = d->max;
+            }
+            return v;
+        }
+    }
+
+    return d->max;
+}
+
+
+static uint64_t
+to_ns (struct nk_hist *h, uint64_t val)
+{
+    uint64_t khz = nk_get_nautilus_info()->sys.cpus[0]->cpu_khz;
+
+    if (!(h->flags & NK_HIST_CYCLES) || !khz) {
+        return val;
+    }
+
+    return (val / khz) * 1000000UL + ((val % khz) * 1000000UL) / khz;
+}
+
+
+void
+nk_hist_dump (struct nk_hist *h)
+{
+    struct nk_hist_data *d = malloc(sizeof(*d));
+
+    if (!d) {
+        ERROR("Cannot allocate space to merge histogram %s\n", h->name);
+        return;
+    }
+
+    nk_hist_merge(h, d);
+
+    if (!d->count) {
+        nk_vc_printf("%-16s %12lu\n", h->name, 0UL);
+    } else {
+        nk_vc_printf("%-16s %12lu %10lu %10lu %10lu %10lu %10lu %10lu\n",
+                     h->name,
+                     d->count,
+                     to_ns(h, d->sum / d->count),
+                     to_ns(h, d->min),
+                     to_ns(h, nk_hist_quantile(d, 500000)),
+                     to_ns(h, nk_hist_quantile(d, 990000)),
+                     to_ns(h, nk_hist_quantile(d, 999000)),
+                     to_ns(h, d->max));
+    }
+
+    free(d);
+}
+
+
+void
+nk_hist_dump_all (void)
+{
+    struct nk_hist *h;
+
+    nk_vc_printf("%-16s %12s %10s %10s %10s %10s %10s %10s\n",
+                 "probe", "count", "mean", "min", "p50", "p99", "p999", "max");
+
+    // histograms are only destroyed by their owners, so we do not
+    // hold the lock (and keep interrupts off) while printing
+    list_for_each_entry(h, &hist_list, hist_list_node) {
+        nk_hist_dump(h);
+    }
+}
+
+
+int
+nk_hist_init (void)
+{
+    spinlock_init(&hist_lock);
+
+#ifdef NAUT_CONFIG_PROFILE
+    nk_hist_malloc     = nk_hist_create("malloc", NK_HIST_CYCLES);
+    nk_hist_free       = nk_hist_create("free", NK_HIST_CYCLES);
+    nk_hist_irq        = nk_hist_create("irq", NK_HIST_CYCLES);
+    nk_hist_thr_switch = nk_hist_create("thread-switch", NK_HIST_CYCLES);
+    nk_hist_wakeup     = nk_hist_create("wakeup", NK_HIST_CYCLES);
+    nk_hist_xcall      = nk_hist_create("xcall", NK_HIST_CYCLES);
+    nk_hist_blk_read   = nk_hist_create("blk-read", NK_HIST_CYCLES);
+    nk_hist_blk_write  = nk_hist_create("blk-write", NK_HIST_CYCLES);
+    nk_hist_net_send   = nk_hist_create("net-send", NK_HIST_CYCLES);
+#endif
+
+    INFO("inited\n");
+
+    return 0;
+}
+
+
+static int
+handle_hist (char * buf, void * priv)
+{
+    char what[NK_HIST_NAME_LEN];
+    char name[NK_HIST_NAME_LEN];
+    struct nk_hist *h;
+    int n;
+
+    n = sscanf(buf, "hist %31s %31s", what, name);
+
+    if (n <= 0) {
+        nk_hist_dump_all();
+        return 0;
+    }
+
+    if (!strcmp(what, "clear")) {
+        if (n == 2) {
+            if (!(h = nk_hist_find(name))) {
+                nk_vc_printf("no histogram named %s\n", name);
+                return 0;
+            }
+            nk_hist_clear(h);
+        } else {
+            list_for_each_entry(h, &hist_list, hist_list_node) {
+                nk_hist_clear(h);
+            }
+        }
+        return 0;
+    }
+
+    if (!(h = nk_hist_find(what))) {
+        nk_vc_printf("no histogram named %s\n", what);
+        return 0;
+    }
+
+    nk_vc_printf("%-16s %12s %10s %10s %10s %10s %10s %10s\n",
+                 "probe", "count", "mean", "min", "p50", "p99", "p999", "max");
+    nk_hist_dump(h);
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl hist_impl = {
+    .cmd      = "hist",
+    .help_str = "hist [name | clear [name]]  (latencies in ns)",
+    .handler  = handle_hist,
+};
+nk_register_shell_cmd(hist_impl);
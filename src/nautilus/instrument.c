@@ -22,7 +22,8 @@
  */
 #include <nautilus/nautilus.h>
 #include <nautilus/printk.h>
-#include <nautilus/hashtable.h>
+#include <nautilus/cpu.h>
+#include <nautilus/thread.h>
 #include <nautilus/naut_string.h>
 #include <nautilus/percpu.h>
 #include <nautilus/atomic.h>
@@ -32,6 +33,7 @@
 #include <nautilus/irq.h>
 
 #include <nautilus/instrument.h>
+#include <nautilus/histogram.h>
 
 
 #define INFO(fmt, args...) INFO_PRINT("instrument: " fmt, ##args)
@@ -45,33 +47,20 @@
 
 
 static uint8_t instr_active = 0;
+// calibrations in progress, which turn on function profiling (only)
+static volatile uint32_t instr_calibrating = 0;
 static uint64_t instr_start_count = 0;
 static uint64_t instr_end_count = 0;
 
-struct func_data {
-    uint64_t call_count;
-    uint64_t avg_nsec;
-    uint64_t max_nsec;
-    uint64_t min_nsec;
-    uint64_t start_count;
-    uint64_t total_count;
-};
-
+// cost of one profiled entry/exit pair, charged back to the caller
+static uint64_t instr_overhead = 0;
 
-static unsigned 
-instr_hash_fn(addr_t key) {
-    char * name = (char *)key;
-    return nk_hash_buffer((uint8_t *)name, strlen(name));
-}
+// the profiling hooks must not themselves be instrumented
+#define NO_INSTR __attribute__((no_instrument_function))
 
+#define COMPILER_BARRIER() asm volatile("" ::: "memory")
 
-static int 
-instr_eq_fn (addr_t key1, addr_t key2) {
-    char * name1 = (char *)key1;
-    char * name2 = (char *)key2;
-
-    return (strcmp(name1, name2) == 0);
-}
+#define PROFILE_HASH(k) ((((uint64_t)(k)) * 0x9e3779b97f4a7c15UL) >> 32)
 
 
 static void 
@@ -83,80 +72,204 @@ instr_calibrate (void)
 }
 
 
-void 
-nk_profile_func_enter (const char  *func)
+static uint64_t
+cycles_to_ns (uint64_t cycles)
 {
-    struct func_data * new = NULL;
-    struct timespec ts;
+    uint64_t khz = nk_get_nautilus_info()->sys.cpus[0]->cpu_khz;
 
-    if (!instr_active) {
-        return;
+    if (!khz) {
+        return cycles;
     }
 
-    if (!(per_cpu_get(instr_data)->func_htable)) {
-        return;
+    return (cycles / khz) * 1000000UL + ((cycles % khz) * 1000000UL) / khz;
+}
+
+
+static NO_INSTR struct nk_profile_func *
+profile_lookup (struct nk_profile_func *table, uint64_t size, const void *key, const char *name)
+{
+    uint64_t h = PROFILE_HASH(key);
+    uint64_t i;
+
+    for (i = 0; i < size; i++) {
+        struct nk_profile_func *f = &table[(h + i) & (size - 1)];
+        const void *cur = f->key;
+
+        if (cur == key) {
+            return f;
+        }
+        if (!cur) {
+            if (__sync_bool_compare_and_swap(&f->key, 0, key)) {
+                f->name = name;
+                return f;
+            }
+            if (f->key == key) {
+                return f;
+            }
+        }
     }
 
-    new = (struct func_data*)nk_htable_search(per_cpu_get(instr_data)->func_htable, (addr_t)(func));
+    return NULL;
+}
 
-    if (!new) {
 
-        new = malloc(sizeof(struct func_data));
-        memset(new, 0, sizeof(struct func_data));
+static inline NO_INSTR void
+profile_enter (const void *key, const char *name)
+{
+    struct nk_thread *t;
+    struct nk_profile_stack *s;
+    int d;
 
-        new->call_count  = 1;
-        new->min_nsec = ULONG_MAX;
+    if (!instr_active && !instr_calibrating) {
+        return;
+    }
 
-        nk_htable_insert(per_cpu_get(instr_data)->func_htable, (addr_t)func, (addr_t)new);
-    } else {
-        new->call_count++;
+    t = get_cur_thread();
+    if (!t) {
+        return;
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    new->start_count = ts.tv_sec * 1000000000 + ts.tv_nsec;
+    s = &t->prof_stack;
+    d = s->depth;
+
+    // claim the frame before filling it in, so that a profiled
+    // interrupt handler running on this thread pushes above it
+    s->depth = d + 1;
+    COMPILER_BARRIER();
+
+    if (d < NK_PROFILE_STACK_DEPTH) {
+        s->frames[d].key   = key;
+        s->frames[d].name  = name;
+        s->frames[d].child = 0;
+        s->frames[d].start = rdtsc();
+    }
 }
 
 
-void 
-nk_profile_func_exit (const char *func)
+static inline NO_INSTR void
+profile_exit (const void *key)
 {
-    struct timespec te;
-    struct func_data * data = NULL;
-    uint64_t end;
-    uint64_t time;
-
-    if (!instr_active) {
+    uint64_t end = rdtsc();
+    struct nk_thread *t;
+    struct nk_profile_stack *s;
+    struct nk_instr_data *data;
+    struct nk_profile_func *f;
+    const char *name;
+    uint64_t incl, excl;
+    int d;
+
+    // frames left behind when profiling stops are discarded by the
+    // search below once it resumes
+    if (!instr_active && !instr_calibrating) {
         return;
     }
 
-    if (!(per_cpu_get(instr_data)->func_htable)) {
+    t = get_cur_thread();
+    if (!t) {
         return;
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &te);
+    s = &t->prof_stack;
+    d = s->depth;
 
-    data = (struct func_data*)nk_htable_search(per_cpu_get(instr_data)->func_htable, (addr_t)func);
+    if (d <= 0) {
+        return;
+    }
 
-    if (!data) {
+    if (d > NK_PROFILE_STACK_DEPTH) {
+        s->depth = d - 1;
         return;
-    } else {
-        end = 1000000000 * te.tv_sec + te.tv_nsec;
-        if (end < data->start_count) {
+    }
+
+    // Find our frame.  It is normally on top, but frames left behind
+    // by calls that never exited (longjmp, thread exit, profiling
+    // turned on mid-call) are discarded here.  An exit without a
+    // matching entry is ignored.
+    while (s->frames[d - 1].key != key) {
+        if (--d == 0) {
             return;
         }
-        time = end - data->start_count;
-        data->total_count += time;
-        if (time < data->min_nsec) {
-            data->min_nsec = time;
-        }
-        if (time > data->max_nsec) {
-            data->max_nsec = time;
-        }
-        data->avg_nsec = (((data->avg_nsec * (data->call_count - 1)) + time )/ data->call_count);
+    }
+
+    incl = end - s->frames[d - 1].start;
+    excl = incl > s->frames[d - 1].child ? incl - s->frames[d - 1].child : 0;
+    name = s->frames[d - 1].name;
+
+    if (d > 1) {
+        s->frames[d - 2].child += incl + instr_overhead;
+    }
+
+    COMPILER_BARRIER();
+    s->depth = d - 1;
+
+    data = per_cpu_get(instr_data);
+    if (!data) {
+        return;
+    }
+
+    f = profile_lookup(data->funcs, NK_PROFILE_TABLE_SIZE, key, name);
+    if (!f) {
+        data->func_overflow++;
+        return;
+    }
+
+    f->call_count++;
+    f->incl_cycles += incl;
+    f->excl_cycles += excl;
+    if (incl > f->max_cycles) {
+        f->max_cycles = incl;
+    }
+    if (incl < f->min_cycles) {
+        f->min_cycles = incl;
     }
 }
 
 
+void 
+nk_profile_func_enter (const char  *func)
+{
+    profile_enter(func, func);
+}
+
+
+void 
+nk_profile_func_exit (const char *func)
+{
+    profile_exit(func);
+}
+
+
+#ifdef NAUT_CONFIG_PROFILE_INSTRUMENT_FUNCTIONS
+// Hooks emitted by -finstrument-functions.  These are keyed by
+// function address, which query and top print for lookup with nm
+NO_INSTR void
+__cyg_profile_func_enter (void *fn, void *call_site)
+{
+    profile_enter(fn, NULL);
+}
+
+
+NO_INSTR void
+__cyg_profile_func_exit (void *fn, void *call_site)
+{
+    profile_exit(fn);
+}
+#endif
+
+
+static void
+func_table_reset (struct nk_instr_data *data)
+{
+    int i;
+
+    memset(data->funcs, 0, sizeof(data->funcs));
+    for (i = 0; i < NK_PROFILE_TABLE_SIZE; i++) {
+        data->funcs[i].min_cycles = ULONG_MAX;
+    }
+    data->func_overflow = 0;
+}
+
+
 void 
 nk_instrument_clear (void) 
 {
@@ -176,53 +289,36 @@ nk_instrument_clear (void)
         }
 
 	if (!this_cpu->instr_data) { 
-	    // first time
-
-	    this_cpu->instr_data = malloc(sizeof(struct nk_instr_data));
-	    memset(this_cpu->instr_data, 0, sizeof(struct nk_instr_data));
-	    this_cpu->instr_data->mallocstat.min_latency = ULONG_MAX;
-	    this_cpu->instr_data->freestat.min_latency = ULONG_MAX;
-	    this_cpu->instr_data->irqstat.min_latency    = ULONG_MAX;
-	    this_cpu->instr_data->thr_switch.min_latency = ULONG_MAX;
-
-	    this_cpu->instr_data->func_htable = nk_create_htable(0, instr_hash_fn, instr_eq_fn);
-	    if (!this_cpu->instr_data->func_htable) {
-		ERROR("Could not create instrumentation hash table for core %u\n",
-		      i);
+	    // first time - the function table is preallocated here so
+	    // that the profiling path never allocates
+	    this_cpu->instr_data = malloc_specific(sizeof(struct nk_instr_data), i);
+	    if (!this_cpu->instr_data) {
+		ERROR("Could not allocate instrumentation data for core %u\n", i);
 		spin_unlock_irq_restore(&this_cpu->lock, flags2);
 		return;
 	    }
-	    
+	    memset(this_cpu->instr_data, 0, sizeof(struct nk_instr_data));
 	} else {
 	    // reinit
-	    memset(&this_cpu->instr_data->mallocstat, 0, sizeof(struct malloc_data));
-	    memset(&this_cpu->instr_data->freestat, 0, sizeof(struct free_data));
-	    memset(&this_cpu->instr_data->irqstat,0,sizeof(struct irq_data));
-	    memset(&this_cpu->instr_data->thr_switch,0,sizeof(struct thread_switch_data));
-	    this_cpu->instr_data->mallocstat.min_latency = ULONG_MAX;
-	    this_cpu->instr_data->freestat.min_latency = ULONG_MAX;
-	    this_cpu->instr_data->irqstat.min_latency    = ULONG_MAX;
-	    this_cpu->instr_data->thr_switch.min_latency = ULONG_MAX;
-	    
-	    // blow away htable and delete values (keys are just func addresses, so not freed)
-	    nk_free_htable(this_cpu->instr_data->func_htable, 1, 0);
-
-	    this_cpu->instr_data->func_htable = nk_create_htable(0, instr_hash_fn, instr_eq_fn);
-
-	    if (!this_cpu->instr_data->func_htable) {
-		ERROR("Could not create instrumentation hash table for core %u\n",
-		      i);
-		spin_unlock_irq_restore(&this_cpu->lock, flags2);
-		return;
-	    }
+	    memset(&this_cpu->instr_data->mallocstat, 0, sizeof(struct nk_instr_lat));
+	    memset(&this_cpu->instr_data->freestat, 0, sizeof(struct nk_instr_lat));
+	    memset(&this_cpu->instr_data->irqstat,0,sizeof(struct nk_instr_lat));
+	    memset(&this_cpu->instr_data->thr_switch,0,sizeof(struct nk_instr_lat));
 	}
+
+	this_cpu->instr_data->mallocstat.min_cycles = ULONG_MAX;
+	this_cpu->instr_data->freestat.min_cycles = ULONG_MAX;
+	this_cpu->instr_data->irqstat.min_cycles = ULONG_MAX;
+	this_cpu->instr_data->thr_switch.min_cycles = ULONG_MAX;
+
+	func_table_reset(this_cpu->instr_data);
+
 	spin_unlock_irq_restore(&this_cpu->lock, flags2);
     }
 
     irq_enable_restore(flags);
 }
 
-/* TODO: calibrate and subtract the overhead of instrumentation */
 void 
 nk_instrument_init (void) 
 {
@@ -233,304 +329,348 @@ nk_instrument_init (void)
 void
 nk_instrument_start (void)
 {
-    struct timespec ts;
     DEBUG("Beginning Instrumentation\n");
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    instr_start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    instr_start_count = rdtsc();
+    instr_end_count = 0;
     atomic_cmpswap(instr_active, 0, 1);
 }
 
 void 
 nk_instrument_end (void) 
 {
-    struct timespec te;
-    clock_gettime(CLOCK_MONOTONIC, &te);
-    instr_end_count = 1000000000 * te.tv_sec + te.tv_nsec;
+    instr_end_count = rdtsc();
     DEBUG("Deactivating instrumentation\n");
     atomic_cmpswap(instr_active, 1, 0);
 }
 
-void
-nk_malloc_enter (void)
+static inline void
+lat_enter (struct nk_instr_lat *l)
 {
-    struct malloc_data * md = NULL;
-    struct timespec ts;
+    l->count++;
+    l->start_count = rdtsc();
+}
 
-    if (!instr_active) {
+
+static inline void
+lat_exit (struct nk_instr_lat *l, struct nk_hist *h)
+{
+    uint64_t end = rdtsc();
+    uint64_t time;
+
+    if (!l->count || end < l->start_count) {
         return;
     }
 
-    md = &(per_cpu_get(instr_data)->mallocstat);
-    md->count++;
+    time = end - l->start_count;
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
+    l->total_cycles += time;
+    if (time < l->min_cycles) {
+        l->min_cycles = time;
+    }
+    if (time > l->max_cycles) {
+        l->max_cycles = time;
+    }
 
-    md->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    nk_hist_record(h, time);
 }
 
+
 void
-nk_malloc_exit (void)
+nk_malloc_enter (void)
 {
-    struct malloc_data * md = NULL;
-    struct timespec te;
-    uint64_t end;
-    uint64_t time;
-
     if (!instr_active) {
         return;
     }
 
-    md = &(per_cpu_get(instr_data)->mallocstat);
-    
-    clock_gettime(CLOCK_MONOTONIC, &te);
+    lat_enter(&per_cpu_get(instr_data)->mallocstat);
+}
 
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
-    if (end < md->start_count) {
+void
+nk_malloc_exit (void)
+{
+    if (!instr_active) {
         return;
     }
-    time = end - md->start_count;
-    if (time < md->min_latency) {
-        md->min_latency = time;
-    }
-    if (time > md->max_latency) {
-        md->max_latency = time;
-    }
-    md->avg_latency = (((md->avg_latency * (md->count - 1)) + time)/ md->count);
+
+    lat_exit(&per_cpu_get(instr_data)->mallocstat, nk_hist_malloc);
 }
 
 void
 nk_free_enter (void)
 {
-    struct free_data * md = NULL;
-    struct timespec ts;
-
     if (!instr_active) {
         return;
     }
 
-    md = &(per_cpu_get(instr_data)->freestat);
-    md->count++;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    md->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    lat_enter(&per_cpu_get(instr_data)->freestat);
 }
 
 void
 nk_free_exit (void)
 {
-    struct free_data * md = NULL;
-    struct timespec te;
-    uint64_t end;
-    uint64_t time;
-
     if (!instr_active) {
         return;
     }
 
-    md = &(per_cpu_get(instr_data)->freestat);
-    
-    clock_gettime(CLOCK_MONOTONIC, &te);
-
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
-    if (end < md->start_count) {
-        return;
-    }
-    time = end - md->start_count;
-    if (time < md->min_latency) {
-        md->min_latency = time;
-    }
-    if (time > md->max_latency) {
-        md->max_latency = time;
-    }
-    md->avg_latency = (((md->avg_latency * (md->count - 1)) + time)/ md->count);
+    lat_exit(&per_cpu_get(instr_data)->freestat, nk_hist_free);
 }
 
 
 void
 nk_irq_prof_enter (void)
 {
-    struct irq_data * irq = NULL;
-    struct timespec ts;
-
     if (!instr_active) {
         return;
     }
 
-    irq = &(per_cpu_get(instr_data)->irqstat);
-    irq->count++;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    irq->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    lat_enter(&per_cpu_get(instr_data)->irqstat);
 }
 
 
 void
 nk_irq_prof_exit (void)
 {
-    struct irq_data * irq = NULL;
-    struct timespec te;
-    uint64_t end;
-    uint64_t time;
-
     if (!instr_active) {
         return;
     }
 
-    irq = &(per_cpu_get(instr_data)->irqstat);
-    
-    clock_gettime(CLOCK_MONOTONIC, &te);
-
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
-    if (end < irq->start_count) {
-        return;
-    }
-    time = end - irq->start_count;
-    if (time < irq->min_latency) {
-        irq->min_latency = time;
-    }
-    if (time > irq->max_latency) {
-        irq->max_latency = time;
-    }
-    irq->avg_latency = (((irq->avg_latency * (irq->count - 1)) + time)/ irq->count);
+    lat_exit(&per_cpu_get(instr_data)->irqstat, nk_hist_irq);
 }
 
 
 void
 nk_thr_switch_prof_enter (void)
 {
-    struct thread_switch_data * thr = NULL;
-    struct timespec ts;
-
     if (!instr_active) {
         return;
     }
 
-    thr = &(per_cpu_get(instr_data)->thr_switch);
-    thr->count++;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    thr->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    lat_enter(&per_cpu_get(instr_data)->thr_switch);
 }
 
 
 void
 nk_thr_switch_prof_exit (void)
 {
-    struct thread_switch_data * thr = NULL;
-    struct timespec te;
-    uint64_t end;
-    uint64_t time;
-
     if (!instr_active) {
         return;
     }
 
-    thr = &(per_cpu_get(instr_data)->thr_switch);
+    lat_exit(&per_cpu_get(instr_data)->thr_switch, nk_hist_thr_switch);
+}
 
-    if (thr->count == 0) {
-        return;
+
+static uint64_t
+instr_window (void)
+{
+    uint64_t end = instr_end_count ? instr_end_count : rdtsc();
+
+    return end > instr_start_count ? end - instr_start_count : 1;
+}
+
+
+static void
+format_func (char *buf, size_t len, struct nk_profile_func *f, uint64_t window)
+{
+    char addr[20];
+    const char *name = f->name;
+
+    if (!name) {
+        snprintf(addr, sizeof(addr), "%p", f->key);
+        name = addr;
     }
-    
-    clock_gettime(CLOCK_MONOTONIC, &te);
 
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
-    if (end < thr->start_count) {
+    snprintf(buf, len, "\t%3lu.%02lu%% Func: %s\n\tCount: %16lu Incl: %16lunsec Excl: %16lunsec Lat - Avg: %16lunsec Max: %16lunsec Min: %16lunsec\n",
+       (f->excl_cycles * 100) / window,
+       ((f->excl_cycles * 10000) / window) % 100,
+       name,
+       f->call_count,
+       cycles_to_ns(f->incl_cycles),
+       cycles_to_ns(f->excl_cycles),
+       cycles_to_ns(f->incl_cycles / f->call_count),
+       cycles_to_ns(f->max_cycles),
+       cycles_to_ns(f->min_cycles));
+}
+
+
+static void
+print_lat (char *what, int cpu, struct nk_instr_lat *l)
+{
+    printk("%s Stats for Core %u:\n", what, cpu);
+    if (!l->count) {
+        printk("\tCount: %16lu\n", 0UL);
         return;
     }
-    time = end - thr->start_count;
-    if (time < thr->min_latency) {
-        thr->min_latency = time;
-    }
-    if (time > thr->max_latency) {
-        thr->max_latency = time;
-    }
-    thr->avg_latency = (((thr->avg_latency * (thr->count - 1)) + time)/ thr->count);
+    printk("\tCount: %16lu Lat - Avg: %16lunsec Max: %16lunsec Min: %16lunsec\n",
+           l->count,
+           cycles_to_ns(l->total_cycles / l->count),
+           cycles_to_ns(l->max_cycles),
+           cycles_to_ns(l->min_cycles));
 }
 
 
 void 
 nk_instrument_query (void)
 {
-    int i;
+    int i, j;
+    uint64_t window = instr_window();
+    char buf[256];
 
     printk("Dumping instrumentation data...\n");
+    printk("Profiled call overhead: %lu cycles\n", instr_overhead);
     for (i = 0; i < nk_get_nautilus_info()->sys.num_cpus; i++) {
         struct cpu * this_cpu = nk_get_nautilus_info()->sys.cpus[i];
 
-
-        printk("Function Table Stats for Core %u:\n", i);
-        struct nk_hashtable_iter * iter = nk_create_htable_iter(this_cpu->instr_data->func_htable);
-        if (!iter) {
-            ERROR("Could not iterate over function htable on core %u\n", i);
+        if (!this_cpu->instr_data) {
             continue;
         }
 
-        do {
-            char * func = (void*)nk_htable_get_iter_key(iter);
-            struct func_data * data = (struct func_data*)nk_htable_get_iter_value(iter);
-
-            uint64_t total_nsec = (instr_end_count - instr_start_count);
-
-            if (data->call_count > 0) {
-                printk("\t%lu.%lu\% Func: %s\n\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n", 
-                        data->total_count / total_nsec,
-                        data->total_count % total_nsec,
-                        func,
-                        data->call_count,
-                        data->avg_nsec,
-                        data->max_nsec,
-                        data->min_nsec);
+        printk("Function Table Stats for Core %u:\n", i);
+
+        for (j = 0; j < NK_PROFILE_TABLE_SIZE; j++) {
+            struct nk_profile_func * f = &this_cpu->instr_data->funcs[j];
+            if (f->key && f->call_count > 0) {
+                format_func(buf, sizeof(buf), f, window);
+                printk("%s", buf);
             }
+        }
 
+        if (this_cpu->instr_data->func_overflow) {
+            printk("\t%lu calls not recorded (function table full)\n",
+                   this_cpu->instr_data->func_overflow);
+        }
 
-        } while (nk_htable_iter_advance(iter) != 0);
+        print_lat("Malloc", i, &this_cpu->instr_data->mallocstat);
+        print_lat("Free", i, &this_cpu->instr_data->freestat);
+        print_lat("IRQ", i, &this_cpu->instr_data->irqstat);
+        print_lat("Thread Switch", i, &this_cpu->instr_data->thr_switch);
+    }
+}
+
+
+// Merge the per-CPU tables and print the n functions with the most
+// exclusive time.  Merging happens in a scratch table so the per-CPU
+// tables are not disturbed
+void
+nk_instrument_top (unsigned n)
+{
+    struct sys_info *sys = &nk_get_nautilus_info()->sys;
+    uint64_t size = NK_PROFILE_TABLE_SIZE * 4;
+    uint64_t window = instr_window();
+    struct nk_profile_func *merged;
+    struct nk_profile_func **top;
+    uint64_t dropped = 0;
+    unsigned count = 0;
+    uint64_t i;
+    unsigned j, k;
+    int c;
+    char buf[256];
+
+    if (!n) {
+        return;
+    }
 
-        printk("Malloc Stats for Core %u:\n", i);
+    merged = malloc(sizeof(*merged) * size);
+    top = malloc(sizeof(*top) * n);
 
-        /* print malloc data */
-        printk("\tCount: %16u Lat - Avg: %16llunsec, Max: %16llunsec Min: %16llunsec\n", 
-                this_cpu->instr_data->mallocstat.count,
-                this_cpu->instr_data->mallocstat.avg_latency,
-                this_cpu->instr_data->mallocstat.max_latency,
-                this_cpu->instr_data->mallocstat.min_latency);
+    if (!merged || !top) {
+        ERROR("Could not allocate space to merge function tables\n");
+        free(merged);
+        free(top);
+        return;
+    }
 
-        printk("Free Stats for Core %u:\n", i);
+    memset(merged, 0, sizeof(*merged) * size);
+    for (i = 0; i < size; i++) {
+        merged[i].min_cycles = ULONG_MAX;
+    }
 
-        /* print free data */
-        printk("\tCount: %16u Lat - Avg: %16llunsec, Max: %16llunsec Min: %16llunsec\n", 
-                this_cpu->instr_data->freestat.count,
-                this_cpu->instr_data->freestat.avg_latency,
-                this_cpu->instr_data->freestat.max_latency,
-                this_cpu->instr_data->freestat.min_latency);
+    for (c = 0; c < sys->num_cpus; c++) {
+        struct nk_instr_data *data = sys->cpus[c]->instr_data;
+        if (!data) {
+            continue;
+        }
+        dropped += data->func_overflow;
+        for (j = 0; j < NK_PROFILE_TABLE_SIZE; j++) {
+            struct nk_profile_func *src = &data->funcs[j];
+            struct nk_profile_func *dst;
+            if (!src->key || !src->call_count) {
+                continue;
+            }
+            dst = profile_lookup(merged, size, src->key, src->name);
+            if (!dst) {
+                dropped += src->call_count;
+                continue;
+            }
+            dst->call_count  += src->call_count;
+            dst->incl_cycles += src->incl_cycles;
+            dst->excl_cycles += src->excl_cycles;
+            if (src->max_cycles > dst->max_cycles) {
+                dst->max_cycles = src->max_cycles;
+            }
+            if (src->min_cycles < dst->min_cycles) {
+                dst->min_cycles = src->min_cycles;
+            }
+        }
+    }
 
-        printk("IRQ Stats for Core %u:\n", i);
-        printk("\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n", 
-                this_cpu->instr_data->irqstat.count,
-                this_cpu->instr_data->irqstat.avg_latency,
-                this_cpu->instr_data->irqstat.max_latency,
-                this_cpu->instr_data->irqstat.min_latency);
-        printk("Thread Switch Stats for Core %u:\n", i);
-        printk("\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n", 
-                
-                this_cpu->instr_data->thr_switch.count,
-                this_cpu->instr_data->thr_switch.avg_latency,
-                this_cpu->instr_data->thr_switch.max_latency,
-                this_cpu->instr_data->thr_switch.min_latency);
+    // keep the n hottest in descending order of exclusive time
+    for (i = 0; i < size; i++) {
+        if (!merged[i].key) {
+            continue;
+        }
+        if (count == n && merged[i].excl_cycles <= top[n - 1]->excl_cycles) {
+            continue;
+        }
+        k = count < n ? count++ : n - 1;
+        while (k > 0 && top[k - 1]->excl_cycles < merged[i].excl_cycles) {
+            top[k] = top[k - 1];
+            k--;
+        }
+        top[k] = &merged[i];
+    }
 
+    nk_vc_printf("Top %u functions by exclusive time (overhead %lu cycles/call):\n",
+                 count, instr_overhead);
+    for (j = 0; j < count; j++) {
+        format_func(buf, sizeof(buf), top[j], window);
+        nk_vc_printf("%s", buf);
     }
+    if (dropped) {
+        nk_vc_printf("%lu calls not recorded (function table full)\n", dropped);
+    }
+
+    free(top);
+    free(merged);
 }
 
 
 void
 nk_instrument_calibrate (unsigned loops)
 {
+    uint64_t start, end;
     int i; 
+
+    if (!loops) {
+        return;
+    }
+
+    instr_overhead = 0;
+
+    // the hooks must actually run for the loop to measure them
+    __sync_fetch_and_add(&instr_calibrating, 1);
+
+    start = rdtsc();
     for (i = 0; i < loops; i++) {
         instr_calibrate();
     }
+    end = rdtsc();
+
+    __sync_fetch_and_sub(&instr_calibrating, 1);
+
+    instr_overhead = (end - start) / loops;
+
+    INFO("profiled call overhead is %lu cycles\n", instr_overhead);
 }
 
 
@@ -538,8 +678,9 @@ static int
 handle_shell_instr (char * buf, void * priv)
 {
     char what[80];
+    unsigned n = 10;
 
-    if (sscanf(buf,"inst%s* %s", what)==1) { 
+    if (sscanf(buf,"instr %79s %u", what, &n)>=1) { 
         if (!strncasecmp(what,"sta",3)) {
             nk_vc_printf("starting instrumentation\n");
             nk_instrument_start();
@@ -556,6 +697,9 @@ handle_shell_instr (char * buf, void * priv)
             nk_vc_printf("querying instrumentation\n");
             nk_instrument_query();
             return 0;
+        } else if (!strncasecmp(what,"t",1)) {
+            nk_instrument_top(n);
+            return 0;
         } 
     }
 
@@ -567,7 +711,7 @@ handle_shell_instr (char * buf, void * priv)
 
 static struct shell_cmd_impl instr_impl = {
     .cmd      = "instr",
-    .help_str = "instrument start|end/stop|clear|query",
+    .help_str = "instr start|end/stop|clear|query|top [n]",
     .handler  = handle_shell_instr,
 };
 nk_register_shell_cmd(instr_impl);
@@ -260,3 +260,106 @@ nk_linker_init (struct naut_info * naut)
 
     return 0;
 }
+
+
+/*
+ * Address to symbol lookup, used to symbolize profiles.  The symbol
+ * table is not in address order, so the first lookup builds a sorted
+ * index of it
+ */
+static symentry_t * sym_index = NULL;
+
+
+static void
+sym_sift_down (symentry_t * a, uint32_t root, uint32_t n)
+{
+    while (2*root + 1 < n) {
+        uint32_t child = 2*root + 1;
+        symentry_t tmp;
+
+        if (child + 1 < n && a[child + 1].value > a[child].value) {
+            child++;
+        }
+        if (a[root].value >= a[child].value) {
+            return;
+        }
+        tmp = a[root];
+        a[root] = a[child];
+        a[child] = tmp;
+        root = child;
+    }
+}
+
+
+static symentry_t *
+sym_index_build (struct nk_link_info * linfo)
+{
+    uint32_t n = linfo->symtab.sym_count;
+    symentry_t * a;
+    symentry_t tmp;
+    uint32_t i;
+
+    a = malloc(sizeof(symentry_t) * n);
+    if (!a) {
+        ERROR("Could not allocate symbol index\n");
+        return NULL;
+    }
+    memcpy(a, linfo->symtab.entries, sizeof(symentry_t) * n);
+
+    // heapsort by address
+    for (i = n/2; i > 0; i--) {
+        sym_sift_down(a, i - 1, n);
+    }
+    for (i = n; i > 1; i--) {
+        tmp = a[0];
+        a[0] = a[i - 1];
+        a[i - 1] = tmp;
+        sym_sift_down(a, 0, i - 1);
+    }
+
+    if (!__sync_bool_compare_and_swap(&sym_index, NULL, a)) {
+        // someone else got there first
+        free(a);
+    }
+
+    return sym_index;
+}
+
+
+char *
+nk_link_lookup_addr (uint64_t addr, uint64_t * start)
+{
+    struct nk_link_info * linfo = nk_get_nautilus_info()->sys.linker_info;
+    symentry_t * a = sym_index;
+    uint32_t lo, hi;
+
+    if (!linfo || !linfo->ready || !linfo->symtab.sym_count) {
+        return NULL;
+    }
+
+    if (!a && !(a = sym_index_build(linfo))) {
+        return NULL;
+    }
+
+    if (addr < a[0].value) {
+        return NULL;
+    }
+
+    // last entry with value <= addr
+    lo = 0;
+    hi = linfo->symtab.sym_count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo)/2;
+        if (a[mid].value <= addr) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (start) {
+        *start = a[lo].value;
+    }
+
+    return &linfo->symtab.strtab[a[lo].offset];
+}
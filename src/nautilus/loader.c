@@ -26,6 +26,10 @@
 #include <nautilus/loader.h>
 #include <nautilus/fs.h>
 #include <nautilus/shell.h>
+#include <nautilus/elf.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/aspace.h>
 
 #ifndef NAUT_CONFIG_DEBUG_LOADER
 #undef DEBUG_PRINT
@@ -40,6 +44,24 @@ struct nk_exec {
     void      *blob;          // where we loaded it
     uint64_t   blob_size;     // extent in memory
     uint64_t   entry_offset;  // where to start executing in it
+
+    // if the blob is mapped into an address space instead of being
+    // a copy, its read-only prefix comes straight from the ramdisk
+    // image or the page cache and only the remainder is copied
+    nk_aspace_t        *aspace;      // null => blob is a malloc'd copy
+    nk_aspace_region_t  ro_region;
+    nk_aspace_region_t  rw_region;
+    nk_aspace_pager_t   pager;
+    nk_fs_fd_t          fd;          // open while the page cache backs ro_region
+    void               *rw;          // backing memory for rw_region
+};
+
+// nanoseconds spent in each phase of a load
+struct load_times {
+    uint64_t open;     // open and read of headers
+    uint64_t alloc;    // allocation of blob / regions
+    uint64_t copy;     // bringing in file contents
+    uint64_t bss;      // clearing bss
 };
 
 
@@ -353,15 +375,173 @@ parse_multiboot_header (void *data, uint64_t size, mb_data_t *mb)
 
 #define MB_LOAD (2*PAGE_SIZE_4KB)
 
+#define ALIGN_UP(x) (((x) % PAGE_SIZE_4KB) ? PAGE_SIZE_4KB*(1 + (x)/PAGE_SIZE_4KB) : (x))
+#define ALIGN_DOWN(x) (PAGE_SIZE_4KB*((x)/PAGE_SIZE_4KB))
+
+// Blob offset at which the first writable segment starts, based on
+// the ELF program headers, which must lie in the first MB_LOAD bytes.
+// Everything before it can be shared with the image.
+static uint64_t find_ro_len(void *data, uint64_t file_bytes)
+{
+    Elf64_Ehdr *eh = (Elf64_Ehdr *)data;
+    Elf64_Phdr *ph;
+    uint64_t ro_end = MB_LOAD + file_bytes;
+    int i;
+
+    if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS]!=ELFCLASS64) {
+	DEBUG("No ELF64 header, so nothing can be shared\n");
+	return 0;
+    }
+
+    // only the first MB_LOAD bytes of the file were read into data
+    if (eh->e_phoff > MB_LOAD ||
+	eh->e_phnum*sizeof(Elf64_Phdr) > MB_LOAD - eh->e_phoff) {
+	DEBUG("Program headers not in first %lu bytes\n", MB_LOAD);
+	return 0;
+    }
+
+    ph = (Elf64_Phdr *)(data + eh->e_phoff);
+
+    for (i=0;i<eh->e_phnum;i++) {
+	if (ph[i].p_type==PT_LOAD && (ph[i].p_flags & PF_W) && ph[i].p_offset<ro_end) {
+	    ro_end = ph[i].p_offset;
+	}
+    }
+
+    if (ro_end < MB_LOAD) {
+	return 0;
+    }
+
+    return ALIGN_DOWN(ro_end - MB_LOAD);
+}
+
+
+#ifdef NAUT_CONFIG_ASPACES
+
+// executables mapped into an aspace are placed in this window
+#define EXEC_MAP_BASE 0x180000000000UL
+#define EXEC_MAP_ALIGN (2*1024*1024UL)
+static uint64_t next_exec_va = EXEC_MAP_BASE;
+
+static int exec_fault(void *state, void *va, int write, void **pa)
+{
+    struct nk_exec *e = (struct nk_exec *)state;
+    uint64_t off = (addr_t)va - (addr_t)e->ro_region.va_start;
+
+    if (write) {
+	ERROR("Write to read-only part of executable at %p\n",va);
+	return -1;
+    }
+
+    *pa = nk_fs_page_cache_get(e->fd, (MB_LOAD + off)/PAGE_SIZE_4KB);
+
+    return *pa ? 0 : -1;
+}
+
+// Map the read-only prefix of the blob directly from the image (or
+// fault it in from the page cache), and copy in only the writable data
+// that follows it.  bss is cleared by the caller through e->blob.
+static int map_exec(struct nk_exec *e, nk_fs_fd_t fd, uint64_t ro_len, uint64_t file_bytes,
+		    struct load_times *times)
+{
+    nk_thread_t *t = get_cur_thread();
+    uint64_t rw_len = e->blob_size - ro_len;
+    uint64_t rw_file_bytes = file_bytes > ro_len ? file_bytes - ro_len : 0;
+    uint64_t start;
+    void *src;
+    void *va;
+
+    start = nk_sched_get_realtime();
+
+    va = (void*)__sync_fetch_and_add(&next_exec_va, ALIGN_UP(e->blob_size) + EXEC_MAP_ALIGN);
+    va = (void*)(((addr_t)va + EXEC_MAP_ALIGN - 1) & ~(EXEC_MAP_ALIGN-1));
+
+    if (rw_len && !(e->rw = malloc(rw_len))) {
+	ERROR("Cannot allocate writable part of executable\n");
+	return -1;
+    }
+
+    times->alloc = nk_sched_get_realtime() - start;
+    start = nk_sched_get_realtime();
+
+    e->ro_region.va_start = va;
+    e->ro_region.len_bytes = ro_len;
+    e->ro_region.protect.flags = NK_ASPACE_READ | NK_ASPACE_EXEC;
+
+    src = nk_fs_map_direct(fd, MB_LOAD, ro_len);
+
+    if (src && !((addr_t)src % PAGE_SIZE_4KB)) {
+	DEBUG("Mapping %lu bytes of text directly from %p\n", ro_len, src);
+	e->ro_region.pa_start = src;
+    } else {
+	DEBUG("Mapping %lu bytes of text from page cache\n", ro_len);
+	e->pager.fault = exec_fault;
+	e->pager.state = e;
+	e->ro_region.pager = &e->pager;
+	e->fd = fd;
+    }
+
+    if (rw_file_bytes) {
+	src = nk_fs_map_direct(fd, MB_LOAD + ro_len, rw_file_bytes);
+	if (src) {
+	    memcpy(e->rw, src, rw_file_bytes);
+	} else if (nk_fs_seek(fd, MB_LOAD + ro_len, 0)<0 ||
+		   nk_fs_read(fd, e->rw, rw_file_bytes)!=rw_file_bytes) {
+	    ERROR("Unable to read writable part of executable\n");
+	    goto out_bad;
+	}
+    }
+
+    times->copy = nk_sched_get_realtime() - start;
+
+    if (nk_aspace_add_region(t->aspace, &e->ro_region)) {
+	ERROR("Cannot map text of executable\n");
+	goto out_bad;
+    }
+
+    if (rw_len) {
+	e->rw_region.va_start = va + ro_len;
+	e->rw_region.pa_start = e->rw;
+	e->rw_region.len_bytes = rw_len;
+	e->rw_region.protect.flags = NK_ASPACE_READ | NK_ASPACE_WRITE | NK_ASPACE_EXEC | NK_ASPACE_EAGER;
+
+	if (nk_aspace_add_region(t->aspace, &e->rw_region)) {
+	    ERROR("Cannot map data of executable\n");
+	    nk_aspace_remove_region(t->aspace, &e->ro_region);
+	    goto out_bad;
+	}
+    }
+
+    e->aspace = t->aspace;
+    e->blob = va;
+
+    return 0;
+
+ out_bad:
+    if (e->rw) { free(e->rw); e->rw = 0; }
+    e->fd = 0;
+    return -1;
+}
+
+#endif
+
+
 // load executable from file, do not run
 struct nk_exec *nk_load_exec(char *path)
 {
     nk_fs_fd_t fd=FS_BAD_FD;
     void *page = 0;
     struct nk_exec *e = 0;
+    struct nk_fs_stat st;
+    struct load_times times;
+    uint64_t start;
      
     DEBUG("Loading executable at path %s\n", path);
 
+    memset(&times,0,sizeof(times));
+
+    start = nk_sched_get_realtime();
+
     if (!(page = malloc(MB_LOAD))) { 
         ERROR("Failed to allocate temporary space for loading file %s\n",path);
         goto out_bad;
@@ -379,6 +559,11 @@ struct nk_exec *nk_load_exec(char *path)
         goto out_bad;
     }
 
+    if (nk_fs_fstat(fd,&st)) {
+        ERROR("Could not stat %s\n", path);
+        goto out_bad;
+    }
+
     // the MB header should be in the first 2 pages by construction
 
     mb_data_t m;
@@ -403,7 +588,7 @@ struct nk_exec *nk_load_exec(char *path)
     }
     
     uint64_t load_start, load_end, bss_end;
-    uint64_t blob_size;
+    uint64_t blob_size, file_bytes, ro_len;
 
     // although these are target addresses, we assume 
     // we can use them as offsets as well.   The next page we load
@@ -412,12 +597,18 @@ struct nk_exec *nk_load_exec(char *path)
     load_end = m.addr->load_end_addr;
     bss_end = m.addr->bss_end_addr;
 
-#define ALIGN_UP(x) (((x) % PAGE_SIZE_4KB) ? PAGE_SIZE_4KB*(1 + (x)/PAGE_SIZE_4KB) : (x))
-
     blob_size = ALIGN_UP(bss_end - load_start + 1);
 
-    DEBUG("Load continuing... start=0x%lx, end=0x%lx, bss_end=0x%lx, blob_size=0x%lx\n",
-	  load_start, load_end, bss_end, blob_size);
+    // bytes of the blob that actually come from the file
+    file_bytes = st.st_size > MB_LOAD ? st.st_size - MB_LOAD : 0;
+    if (file_bytes > blob_size) {
+        file_bytes = blob_size;
+    }
+
+    ro_len = find_ro_len(page, file_bytes);
+
+    DEBUG("Load continuing... start=0x%lx, end=0x%lx, bss_end=0x%lx, blob_size=0x%lx, ro_len=0x%lx\n",
+	  load_start, load_end, bss_end, blob_size, ro_len);
     
 
     e = malloc(sizeof(struct nk_exec));
@@ -429,44 +620,82 @@ struct nk_exec *nk_load_exec(char *path)
 
     memset(e,0,sizeof(*e));
 
-    e->blob = malloc(blob_size);
-
-    if (!e->blob) { 
-        ERROR("Cannot allocate executable blob for %s\n",path);
-        goto out_bad;
-    }
-    
     e->blob_size = blob_size;
     e->entry_offset = m.entry->entry_addr - PAGE_SIZE_4KB; 
-    
-    // now copy it to memory
-    ssize_t n;
-    
-    
-    if ((n = nk_fs_read(fd,e->blob,e->blob_size))<0) {
-        ERROR("Unable to read blob from %s\n", path);
-        goto out_bad;
+
+    times.open = nk_sched_get_realtime() - start;
+
+#ifdef NAUT_CONFIG_ASPACES
+    if (get_cur_thread()->aspace && ro_len) {
+        if (map_exec(e, fd, ro_len, file_bytes, &times)) {
+            ERROR("Cannot map %s into address space\n", path);
+            goto out_bad;
+        }
     }
+#endif
+
+    if (!e->aspace) {
+        void *src;
+
+        start = nk_sched_get_realtime();
+
+        e->blob = malloc(blob_size);
+
+        if (!e->blob) { 
+            ERROR("Cannot allocate executable blob for %s\n",path);
+            goto out_bad;
+        }
 
-    DEBUG("Tried to read 0x%lx byte blob, got 0x%lx bytes\n", e->blob_size, n);
+        times.alloc = nk_sched_get_realtime() - start;
+        start = nk_sched_get_realtime();
+
+        // a memory-resident image needs only one copy, otherwise
+        // go through the filesystem
+        if ((src = nk_fs_map_direct(fd, MB_LOAD, file_bytes))) {
+            DEBUG("Copying 0x%lx byte blob directly from %p\n", file_bytes, src);
+            memcpy(e->blob, src, file_bytes);
+        } else {
+            ssize_t n;
+    
+            if ((n = nk_fs_read(fd,e->blob,e->blob_size))<0) {
+                ERROR("Unable to read blob from %s\n", path);
+                goto out_bad;
+            }
+
+            DEBUG("Tried to read 0x%lx byte blob, got 0x%lx bytes\n", e->blob_size, n);
+        }
+
+        times.copy = nk_sched_get_realtime() - start;
+    }
     
     DEBUG("Successfully loaded executable %s\n",path);
 
+    start = nk_sched_get_realtime();
+
     memset(e->blob+(load_end-load_start),0,bss_end-load_end);
 
+    times.bss = nk_sched_get_realtime() - start;
+
     DEBUG("Cleared BSS\n");
 
-    nk_fs_close(fd);
-    DEBUG("file closed\n");
+    // the page cache of the fd may be backing the text
+    if (!e->fd) {
+        nk_fs_close(fd);
+        DEBUG("file closed\n");
+    }
     free(page);
 
+    INFO("Loaded %s (%lu bytes, %lu shared) in %lu ns: open %lu, alloc %lu, copy %lu, bss %lu\n",
+         path, blob_size, e->aspace ? ro_len : 0,
+         times.open + times.alloc + times.copy + times.bss,
+         times.open, times.alloc, times.copy, times.bss);
+
     return e;
 	
  out_bad:
     if (!FS_FD_ERR(fd)) { nk_fs_close(fd); }
     if (page) { free(page); }
-    if (e && e->blob) { free(e->blob); }
-    if (e) { free(e); }
+    if (e) { nk_unload_exec(e); }
 
     return 0;
 }
@@ -499,6 +728,13 @@ nk_start_exec (struct nk_exec *exec, void *in, void **out)
         return -1;
     }
 
+#ifdef NAUT_CONFIG_ASPACES
+    if (exec->aspace && get_cur_thread()->aspace!=exec->aspace) {
+        ERROR("Exec from a different address space than it was loaded in\n");
+        return -1;
+    }
+#endif
+
     start = exec->blob + exec->entry_offset;
 
     DEBUG("Starting executable %p loaded at address %p with entry address %p and arguments %p and %p\n", exec, exec->blob, start, in, out);
@@ -514,12 +750,26 @@ nk_start_exec (struct nk_exec *exec, void *in, void **out)
 int 
 nk_unload_exec (struct nk_exec *exec)
 {
-    if (exec && exec->blob) {
-        free(exec->blob);
+    if (!exec) {
+        return 0;
     }
-    if (exec) { 
-        free(exec);
+#ifdef NAUT_CONFIG_ASPACES
+    if (exec->aspace) {
+        nk_aspace_remove_region(exec->aspace, &exec->ro_region);
+        if (exec->rw) {
+            nk_aspace_remove_region(exec->aspace, &exec->rw_region);
+            free(exec->rw);
+        }
+        if (exec->fd) {
+            nk_fs_close(exec->fd);
+        }
+        exec->blob = 0;
+    }
+#endif
+    if (exec->blob) {
+        free(exec->blob);
     }
+    free(exec);
     return 0;
 }
 
@@ -27,6 +27,7 @@
 #include <nautilus/mb_utils.h>
 #include <nautilus/multiboot2.h>
 #include <nautilus/macros.h>
+#include <nautilus/thread.h>
 #include <lib/bitmap.h>
 
 #define CACHE_LINE_SIZE_DEFAULT 64
@@ -466,49 +467,71 @@ mm_boot_free (void *addr, ulong_t size)
 }
 
 
-/* add the unused pages to this mem region's mem-pool */
+/* hand a run of free pages to this mem region's mem-pool in one go */
 static ulong_t
-add_free_pages (struct mem_region * region) 
+add_free_run (struct mem_region * region, ulong_t pfn, ulong_t npages)
+{
+    if (npages) {
+#ifdef NAUT_CONFIG_KMEM_ZERO_AT_BOOT
+        memset((void*)pa_to_va(pfn << PAGE_SHIFT), 0, npages << PAGE_SHIFT);
+#endif
+        kmem_add_memory(region, pfn << PAGE_SHIFT, npages << PAGE_SHIFT);
+    }
+    return npages;
+}
+
+
+/* add the unused pages in [start_pfn, end_pfn) to this mem region's mem-pool */
+static ulong_t
+add_free_pages (struct mem_region * region, ulong_t start_pfn, ulong_t end_pfn)
 {
     ulong_t count = 0;
     ulong_t * pm  = bootmem.page_map;
-    ulong_t addr, i, m;
+    ulong_t run = start_pfn;  /* first page of the current run of free pages */
+    ulong_t len = 0;          /* pages in it */
+    ulong_t addr, i;
 
     ASSERT(region);
-
-    ulong_t start_pfn = region->base_addr >> PAGE_SHIFT;
-    ulong_t end_pfn   = (region->base_addr + region->len) >> PAGE_SHIFT;
-
     ASSERT(end_pfn < bootmem.npages);
 
     for (i = start_pfn; i < end_pfn; ) {
 
-        ulong_t v = ~pm[i/BITS_PER_LONG];
-       
-
-        /* we have free pages in this index */
-        if (v) {
-            addr = start_pfn << PAGE_SHIFT;
-            for (m = 1; m && i < end_pfn; m <<= 1, addr += PAGE_SIZE, i++) {
-                if (v & m) {
-		    if (is_usable_ram(addr,PAGE_SIZE)) { 
-			kmem_add_memory(region, addr, PAGE_SIZE);
-			++count;
-		    } else {
-			ERROR_PRINT("Skipping addition of memory at %p (%p bytes) - Likely memory map / SRAT mismatch\n",addr,PAGE_SIZE);
-		    }
-                } 
-            }
-        } else {
+        /* skip over words with no free pages */
+        if (!(i % BITS_PER_LONG) && !~pm[i/BITS_PER_LONG]) {
+            count += add_free_run(region, run, len);
+            len = 0;
             i += BITS_PER_LONG;
+            continue;
         }
-        start_pfn += BITS_PER_LONG;
+
+        if (!test_bit(i, pm)) {
+            addr = i << PAGE_SHIFT;
+            if (is_usable_ram(addr,PAGE_SIZE)) { 
+                if (!len) {
+                    run = i;
+                }
+                len++;
+                i++;
+                continue;
+            } else {
+                ERROR_PRINT("Skipping addition of memory at %p (%p bytes) - Likely memory map / SRAT mismatch\n",addr,PAGE_SIZE);
+            }
+        }
+
+        count += add_free_run(region, run, len);
+        len = 0;
+        i++;
     }
 
+    count += add_free_run(region, run, len);
+
     return count*PAGE_SIZE;
 }
 
 
+/* regions with pages left for mm_boot_kmem_populate() */
+static unsigned deferred_regions = 0;
+
 /*
  * this makes the transfer to the kmem allocator, 
  * we won't be using the boot bitmap allocator anymore
@@ -529,11 +552,27 @@ mm_boot_kmem_init (void)
         struct mem_region * region = NULL;
         unsigned j = 0;
         list_for_each_entry(region, &(loc->domains[i]->regions), entry) {
-            ulong_t added = add_free_pages(region);
-            BMM_PRINT("    [Domain %02u : Region %02u] (%0lu.%02lu MB)\n", 
+            ulong_t start_pfn = region->base_addr >> PAGE_SHIFT;
+            ulong_t end_pfn   = (region->base_addr + region->len) >> PAGE_SHIFT;
+            ulong_t added;
+
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+            /* enough to finish booting on, the APs will add the rest */
+            ulong_t boot_pfns = ((ulong_t)NAUT_CONFIG_KMEM_BOOT_RESERVE_MB << 20) >> PAGE_SHIFT;
+            boot_pfns = boot_pfns ? boot_pfns : 1;
+            if (end_pfn - start_pfn > boot_pfns) {
+                end_pfn = start_pfn + boot_pfns;
+                deferred_regions++;
+            }
+#endif
+            region->deferred_pfn = end_pfn;
+
+            added = add_free_pages(region, start_pfn, end_pfn);
+            BMM_PRINT("    [Domain %02u : Region %02u] (%0lu.%02lu MB)%s\n", 
                     i, j,
                     added / 1000000,
-                    added % 1000000);
+                    added % 1000000,
+                    end_pfn < (region->base_addr + region->len) >> PAGE_SHIFT ? " (rest deferred)" : "");
             count += added;
             j++;
         }
@@ -550,21 +589,149 @@ mm_boot_kmem_init (void)
 
 }
 
-void 
-mm_boot_kmem_cleanup (void)
-{
-    ulong_t count = 0;
-
-    BMM_PRINT("Reclaiming boot sections and data:\n");
 
+/* the boot page map itself, once nothing needs it */
+static ulong_t
+reclaim_page_map (void)
+{
     BMM_PRINT("    [Boot alloc. page map] (%0lu.%02lu MB)\n", bootmem.pm_len/1000000, bootmem.pm_len%1000000);
     if (is_usable_ram(va_to_pa((ulong_t)bootmem.page_map),bootmem.pm_len)) {
 	kmem_add_memory(kmem_get_region_by_addr(va_to_pa((ulong_t)bootmem.page_map)),
 			va_to_pa((ulong_t)bootmem.page_map), 
 			bootmem.pm_len);
-	count += bootmem.pm_len;
+	return bootmem.pm_len;
     } else {
 	ERROR_PRINT("Skipping reclaim of boot page map as memory is not usable: %p (%p bytes) - Likely memory map / SRAT mismatch\n",va_to_pa((ulong_t)bootmem.page_map),bootmem.pm_len);
+	return 0;
+    }
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+struct populate_work {
+    struct mem_region * region;
+    ulong_t start_pfn;
+    ulong_t end_pfn;
+    ulong_t added;
+};
+
+static void
+populate_slice (void * in, void ** out)
+{
+    struct populate_work * w = (struct populate_work *)in;
+
+    w->added = add_free_pages(w->region, w->start_pfn, w->end_pfn);
+}
+
+/*
+ * Second stage of the transfer to the kmem allocator, once the APs
+ * are up.  The pages mm_boot_kmem_init() deferred are split among the
+ * CPUs of each region's NUMA domain, which zero them (if configured)
+ * and add them to the region's buddy pool in parallel, touching only
+ * memory local to themselves.
+ */
+void
+mm_boot_kmem_populate (void)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    struct nk_locality_info * loc = &(sys->locality_info);
+    struct populate_work * work;
+    nk_thread_id_t * tids;
+    unsigned i, j, k, n = 0, max = 0;
+    ulong_t count = 0;
+
+    if (!deferred_regions) {
+        return;
+    }
+
+    /* at most one slice per CPU per deferred region */
+    max = deferred_regions * sys->num_cpus;
+    work = malloc(max * sizeof(struct populate_work));
+    tids = malloc(max * sizeof(nk_thread_id_t));
+    if (!work || !tids) {
+        panic("Cannot allocate boot memory population state\n");
+    }
+
+    for (i = 0; i < loc->num_domains; i++) {
+        struct numa_domain * dom = loc->domains[i];
+        struct mem_region * region = NULL;
+        unsigned ncpus = 0;
+
+        for (k = 0; k < sys->num_cpus; k++) {
+            ncpus += sys->cpus[k]->domain == dom;
+        }
+
+        list_for_each_entry(region, &dom->regions, entry) {
+            ulong_t start = region->deferred_pfn;
+            ulong_t end   = (region->base_addr + region->len) >> PAGE_SHIFT;
+            ulong_t slice;
+            int cpu = -1;  /* memory-only domains go to anyone */
+
+            if (start >= end) {
+                continue;
+            }
+
+            /* whole bitmap words per slice */
+            slice = (end - start + (ncpus ? ncpus : 1) - 1) / (ncpus ? ncpus : 1);
+            slice = (slice + BITS_PER_LONG - 1) & ~(BITS_PER_LONG - 1UL);
+
+            while (start < end) {
+
+                if (ncpus) {
+                    /* next CPU of this domain */
+                    do {
+                        cpu = (cpu + 1) % sys->num_cpus;
+                    } while (sys->cpus[cpu]->domain != dom);
+                }
+
+                work[n].region    = region;
+                work[n].start_pfn = start;
+                work[n].end_pfn   = (end - start > slice) ? start + slice : end;
+                work[n].added     = 0;
+                start = work[n].end_pfn;
+
+                if (nk_thread_start(populate_slice, &work[n], 0, 0, TSTACK_DEFAULT, &tids[n], cpu)) {
+                    BMM_WARN("Cannot start populate thread on CPU %d, doing it here\n", cpu);
+                    populate_slice(&work[n], 0);
+                    tids[n] = 0;
+                }
+                n++;
+            }
+
+            region->deferred_pfn = end;
+        }
+    }
+
+    for (j = 0; j < n; j++) {
+        if (tids[j]) {
+            nk_join(tids[j], 0);
+        }
+        count += work[j].added;
+    }
+
+    deferred_regions = 0;
+
+    BMM_PRINT("Added deferred memory to the kernel memory pool on %u threads:\n", n);
+    count += reclaim_page_map();
+    BMM_PRINT("    =======\n");
+    BMM_PRINT("    [TOTAL] (%lu.%lu MB)\n", count/1000000, count%1000000);
+
+    free(tids);
+    free(work);
+}
+#endif
+
+
+void 
+mm_boot_kmem_cleanup (void)
+{
+    ulong_t count = 0;
+
+    BMM_PRINT("Reclaiming boot sections and data:\n");
+
+    /* the deferred pages are still found through the page map */
+    if (!deferred_regions) {
+        count += reclaim_page_map();
     }
 
 
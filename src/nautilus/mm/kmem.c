@@ -36,6 +36,7 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/percpu.h>
 #include <nautilus/shell.h>
+#include <nautilus/trace.h>
 
 #include <dev/gpio.h>
 
@@ -326,26 +327,40 @@ kmem_add_memory (struct mem_region * mem,
      * Memory is added to it via buddy_free().
      * buddy_free() will panic if there are any problems with the args.
      * However, buddy_free() does expect chunks of memory aligned
-     * to their size, which we manufacture out of the memory given.
+     * to their size within the pool, so we carve the memory given
+     * into the largest such chunks, and hand all of them over while
+     * holding the lock once.
      * buddy_free() will coalesce these chunks as appropriate
      */
 
-    uint64_t max_chunk_size = base_addr ? 1ULL << __builtin_ctzl(base_addr) : size;
-    uint64_t chunk_size = max_chunk_size < size ? max_chunk_size : size;
-    uint64_t chunk_order = ilog2(chunk_size); // floor
-    uint64_t num_chunks = size/chunk_size; // floor
-    void *addr=(void*)pa_to_va(base_addr);
-    uint64_t i;
+    struct buddy_mempool *mp = mem->mm_state;
+    ulong_t min = 1UL << mp->min_order;
+    ulong_t start = (ulong_t)pa_to_va(base_addr) - mp->base_addr; // pool-relative
+    ulong_t end = start + size;
+    ulong_t added = 0;
+    ulong_t order;
+
+    start = (start + min - 1) & ~(min - 1);
+    end &= ~(min - 1);
 
-    KMEM_DEBUG("Add Memory to region %p base_addr=0x%llx size=0x%llx chunk_size=0x%llx, chunk_order=0x%llx, num_chunks=0x%llx, addr=%p\n",
-	       mem,base_addr,size,chunk_size,chunk_order,num_chunks,addr);
+    KMEM_DEBUG("Add Memory to region %p base_addr=0x%llx size=0x%llx => pool offsets [0x%lx, 0x%lx)\n",
+	       mem,base_addr,size,start,end);
     
-    for (i=0;i<num_chunks;i++) { 
-	buddy_free(mem->mm_state, addr+i*chunk_size, chunk_order);
+    /* memory may be added while others allocate (parallel boot) */
+    uint8_t flags = spin_lock_irq_save(&mp->lock);
+    while (start < end) {
+	order = ilog2(end - start); // floor
+	if (start && __builtin_ctzl(start) < order) {
+	    order = __builtin_ctzl(start);
+	}
+	buddy_free(mp, (void*)(mp->base_addr + start), order);
+	start += 1UL << order;
+	added += 1UL << order;
     }
+    spin_unlock_irq_restore(&mp->lock, flags);
 
     /* Update statistics */
-    kmem_bytes_managed += chunk_size*num_chunks;
+    __sync_fetch_and_add(&kmem_bytes_managed, added);
 }
 
 void *boot_mm_get_cur_top();
@@ -579,6 +594,8 @@ _kmem_malloc (size_t size, int cpu, int zero)
     }
 
     KMEM_DEBUG("malloc succeeded: size %lu order %lu -> 0x%lx\n",size, order, block);
+
+    NK_TRACE(NK_TRACE_KMEM, NK_TRACE_EV_MALLOC, block, size);
  
     if (zero) { 
 	memset(block,0,1ULL << hdr->order);
@@ -679,6 +696,7 @@ kmem_free (void * addr)
     buddy_free(zone, addr, order);
     spin_unlock_irq_restore(&zone->lock, flags);
     KMEM_DEBUG("free succeeded: addr=0x%lx order=%lu\n",addr,order);
+    NK_TRACE(NK_TRACE_KMEM, NK_TRACE_EV_FREE, addr, 1UL << order);
     block_hash_free_entry(hdr);
 
 #if SANITY_CHECK_PER_OP
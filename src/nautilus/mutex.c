@@ -0,0 +1,147 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/errno.h>
+#include <nautilus/mutex.h>
+
+#ifndef NAUT_CONFIG_DEBUG_SYNCH
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("mutex: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("mutex: " fmt, ##args)
+
+// Upper bound on spinning for a running owner before we park anyway.
+// This is on the order of a context switch out and back in.
+#define MUTEX_SPIN_CYCLES 20000
+
+static uint64_t count=0;
+
+
+int
+nk_mutex_init (nk_mutex_t *m)
+{
+    char buf[NK_WAIT_QUEUE_NAME_LEN];
+
+    memset(m, 0, sizeof(*m));
+
+    snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"mutex%lu-wait",__sync_fetch_and_add(&count,1));
+    m->wait_queue = nk_wait_queue_create(buf);
+    if (!m->wait_queue) {
+        ERROR("Could not create wait queue for mutex\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+
+int
+nk_mutex_deinit (nk_mutex_t *m)
+{
+    if (m->state != NK_MUTEX_UNLOCKED) {
+        ERROR("Mutex %p is still held\n", m);
+        return -EINVAL;
+    }
+
+    nk_wait_queue_destroy(m->wait_queue);
+    memset(m, 0, sizeof(*m));
+
+    return 0;
+}
+
+
+// The owner is worth spinning for only if it is the thread currently
+// on some other CPU.  A stale owner may have exited and been freed by
+// the time we look at it, but thread structures stay mapped, so the
+// worst case is a wrong guess.
+static int
+owner_running (nk_mutex_t *m)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    nk_thread_t *o = m->owner;
+    int cpu;
+
+    if (!o) {
+        // just acquired or just released
+        return 1;
+    }
+
+    cpu = o->current_cpu;
+
+    return cpu >= 0 && cpu < sys->num_cpus && cpu != my_cpu_id() &&
+        sys->cpus[cpu]->cur_thread == o;
+}
+
+
+static int
+mutex_check (void *state)
+{
+    nk_mutex_t *m = (nk_mutex_t *)state;
+
+    return m->state != NK_MUTEX_CONTENDED;
+}
+
+
+void
+nk_mutex_lock_slow (nk_mutex_t *m)
+{
+    uint64_t start = rdtsc();
+    uint32_t c;
+
+    DEBUG("contended lock of %p\n", m);
+
+    // spin phase - the owner is making progress elsewhere
+    while ((c = m->state) != NK_MUTEX_UNLOCKED || 
+           !__sync_bool_compare_and_swap(&m->state, NK_MUTEX_UNLOCKED, NK_MUTEX_LOCKED)) {
+        if (c == NK_MUTEX_CONTENDED || !owner_running(m) || rdtsc() - start > MUTEX_SPIN_CYCLES) {
+            goto park;
+        }
+        __asm__ __volatile__ ("pause" : : : "memory");
+    }
+
+    m->owner = get_cur_thread();
+    return;
+
+ park:
+    // from here on we claim the lock as contended, since we cannot
+    // know whether we are the last sleeper when we get it
+    while ((c = __sync_lock_test_and_set(&m->state, NK_MUTEX_CONTENDED)) != NK_MUTEX_UNLOCKED) {
+        nk_wait_queue_sleep_extended(m->wait_queue, mutex_check, m);
+    }
+
+    m->owner = get_cur_thread();
+}
+
+
+void
+nk_mutex_unlock_slow (nk_mutex_t *m)
+{
+    // the state is contended, so a sleeper may need waking
+    m->state = NK_MUTEX_UNLOCKED;
+    __sync_synchronize();
+    nk_wait_queue_wake_one(m->wait_queue);
+}
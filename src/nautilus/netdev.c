@@ -24,6 +24,8 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/dev.h>
 #include <nautilus/netdev.h>
+#include <nautilus/histogram.h>
+#include <nautilus/trace.h>
 
 #ifndef NAUT_CONFIG_DEBUG_NETDEV
 #undef DEBUG_PRINT
@@ -102,6 +104,7 @@ static void generic_send_callback(nk_net_dev_status_t status, void *context)
 {
     struct op *o = (struct op*) context;
     DEBUG("generic send callback (status = 0x%lx) for %p\n",status,context);
+    NK_TRACE(NK_TRACE_DEV, NK_TRACE_EV_NET_DONE, context, status);
     o->status = status;
     o->completed = 1;
     nk_dev_signal((struct nk_dev *)o->dev);
@@ -111,6 +114,7 @@ static void generic_receive_callback(nk_net_dev_status_t status, void *context)
 {
     struct op *o = (struct op*) context;
     DEBUG("generic receive callback (status = 0x%lx) for %p\n", status, context);
+    NK_TRACE(NK_TRACE_DEV, NK_TRACE_EV_NET_DONE, context, status);
     o->status = status;
     o->completed = 1;
     nk_dev_signal((struct nk_dev *)o->dev);
@@ -163,6 +167,7 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
 		    return 0;
 		}
 	    } else {
+		NK_HIST_PROBE_START(start);
 		if (di->post_send(d->state,src,len,generic_send_callback,(void*)&o)) { 
 		    ERROR("Failed to launch send\n");
 		    return -1;
@@ -172,6 +177,7 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
 			nk_dev_wait((struct nk_dev *)dev, generic_cond_check, (void*)&o);
 		    }
 		    DEBUG("Packet launch completed\n");
+		    NK_HIST_PROBE_END(nk_hist_net_send, start);
 		    return o.status;
 		}
 	    }
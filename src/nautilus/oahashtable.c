@@ -0,0 +1,658 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/mm.h>
+#include <nautilus/shell.h>
+#include <nautilus/hashtable.h>
+#include <nautilus/oahashtable.h>
+
+#define ERROR(fmt, args...) ERROR_PRINT("oahtable: " fmt, ##args)
+
+#define GROUP          16
+#define CTRL_EMPTY     ((schar_t)0x80)
+#define CTRL_DELETED   ((schar_t)0xfe)
+// full slots hold the low 7 bits of the hash (0..127)
+
+#define SHARDS         16   // concurrent mode
+#define MIGRATE_GROUPS 2    // groups moved per update during a resize
+
+typedef char v16qi __attribute__((vector_size(16)));
+
+struct slot {
+    addr_t key;
+    addr_t value;
+};
+
+struct table {
+    uint64_t     ngroups;  // power of two, 0 => no table
+    uint64_t     used;
+    uint64_t     tombs;
+    schar_t      *ctrl;
+    struct slot *slots;
+};
+
+struct shard {
+    spinlock_t   lock;
+    struct table cur;
+    struct table old;      // being moved into cur
+    uint64_t     migrate_next;
+} __attribute__((aligned(64)));
+
+struct nk_oa_htable {
+    uint_t     (*hash_fn)(addr_t key);
+    int        (*eq_fn)(addr_t key1, addr_t key2);
+    int          flags;
+    int          shard_bits;
+    uint64_t     min_groups;
+    struct shard *shards;
+};
+
+#define SHARD_LOCK_CONF uint8_t _shard_lock_flags=0
+#define SHARD_LOCK(t,s) if ((t)->flags & NK_OA_HTABLE_CONCURRENT) { _shard_lock_flags = spin_lock_irq_save(&(s)->lock); }
+#define SHARD_UNLOCK(t,s) if ((t)->flags & NK_OA_HTABLE_CONCURRENT) { spin_unlock_irq_restore(&(s)->lock, _shard_lock_flags); }
+
+
+static inline uint64_t
+hash (struct nk_oa_htable *t, addr_t key)
+{
+    uint64_t h = t->hash_fn ? t->hash_fn(key) : key;
+
+    // spread weak hashes over all 64 bits
+    h *= 0x9e3779b97f4a7c15UL;
+    return h ^ (h >> 29);
+}
+
+
+static inline int
+keys_eq (struct nk_oa_htable *t, addr_t k1, addr_t k2)
+{
+    return t->eq_fn ? t->eq_fn(k1, k2) : k1 == k2;
+}
+
+
+static inline struct shard *
+shard_of (struct nk_oa_htable *t, uint64_t h)
+{
+    return t->shard_bits ? &t->shards[h >> (64 - t->shard_bits)] : t->shards;
+}
+
+
+static inline v16qi
+group_load (struct table *tab, uint64_t g)
+{
+    v16qi c;
+    memcpy(&c, tab->ctrl + g * GROUP, sizeof(c));
+    return c;
+}
+
+
+// bit i set => control byte i equals b
+static inline uint32_t
+group_match (v16qi c, schar_t b)
+{
+    v16qi splat = { b, b, b, b, b, b, b, b, b, b, b, b, b, b, b, b };
+    return __builtin_ia32_pmovmskb128((v16qi)(c == splat));
+}
+
+
+// bit i set => slot i is empty or deleted (both have the top bit set)
+static inline uint32_t
+group_free (v16qi c)
+{
+    return __builtin_ia32_pmovmskb128(c);
+}
+
+
+static int
+table_alloc (struct table *tab, uint64_t ngroups)
+{
+    memset(tab, 0, sizeof(*tab));
+
+    tab->ctrl = malloc(ngroups * GROUP);
+    tab->slots = malloc(ngroups * GROUP * sizeof(struct slot));
+
+    if (!tab->ctrl || !tab->slots) {
+        free(tab->ctrl);
+        free(tab->slots);
+        tab->ctrl = 0;
+        tab->slots = 0;
+        return -1;
+    }
+
+    memset(tab->ctrl, CTRL_EMPTY, ngroups * GROUP);
+    tab->ngroups = ngroups;
+
+    return 0;
+}
+
+
+static void
+table_free (struct table *tab)
+{
+    if (tab->ngroups) {
+        free(tab->ctrl);
+        free(tab->slots);
+    }
+    memset(tab, 0, sizeof(*tab));
+}
+
+
+// groups are visited in triangular order, which covers every group
+// of a power of two sized table
+static sint64_t
+table_find (struct nk_oa_htable *t, struct table *tab, addr_t key, uint64_t h)
+{
+    uint64_t mask = tab->ngroups - 1;
+    uint64_t g = (h >> 7) & mask;
+    uint64_t i;
+
+    if (!tab->ngroups) {
+        return -1;
+    }
+
+    for (i = 0; i <= mask; i++) {
+        v16qi c = group_load(tab, g);
+        uint32_t m = group_match(c, h & 0x7f);
+
+        while (m) {
+            uint64_t idx = g * GROUP + __builtin_ctz(m);
+            if (keys_eq(t, tab->slots[idx].key, key)) {
+                return idx;
+            }
+            m &= m - 1;
+        }
+
+        if (group_match(c, CTRL_EMPTY)) {
+            return -1;
+        }
+
+        g = (g + i + 1) & mask;
+    }
+
+    return -1;
+}
+
+
+// the caller guarantees that there is room and that key is absent
+static void
+table_place (struct table *tab, addr_t key, addr_t value, uint64_t h)
+{
+    uint64_t mask = tab->ngroups - 1;
+    uint64_t g = (h >> 7) & mask;
+    uint64_t i;
+
+    for (i = 0; i <= mask; i++) {
+        uint32_t m = group_free(group_load(tab, g));
+
+        if (m) {
+            uint64_t idx = g * GROUP + __builtin_ctz(m);
+            if (tab->ctrl[idx] == CTRL_DELETED) {
+                tab->tombs--;
+            }
+            tab->ctrl[idx] = h & 0x7f;
+            tab->slots[idx].key = key;
+            tab->slots[idx].value = value;
+            tab->used++;
+            return;
+        }
+
+        g = (g + i + 1) & mask;
+    }
+
+    panic("oahtable: no room in table\n");
+}
+
+
+static void
+table_erase (struct table *tab, uint64_t idx)
+{
+    uint64_t g = idx / GROUP;
+
+    // a probe that reaches a group with an empty slot stops there, so
+    // only a full group needs a tombstone to keep probes going
+    if (group_match(group_load(tab, g), CTRL_EMPTY)) {
+        tab->ctrl[idx] = CTRL_EMPTY;
+    } else {
+        tab->ctrl[idx] = CTRL_DELETED;
+        tab->tombs++;
+    }
+    tab->used--;
+}
+
+
+static void
+shard_migrate (struct nk_oa_htable *t, struct shard *s, uint64_t groups)
+{
+    while (groups-- && s->old.ngroups) {
+        uint64_t base = s->migrate_next * GROUP;
+        uint64_t i;
+
+        for (i = base; i < base + GROUP; i++) {
+            if (s->old.ctrl[i] >= 0) {
+                table_place(&s->cur, s->old.slots[i].key, s->old.slots[i].value,
+                            hash(t, s->old.slots[i].key));
+                // probes of the old table must still pass through
+                s->old.ctrl[i] = CTRL_DELETED;
+                s->old.used--;
+            }
+        }
+
+        if (++s->migrate_next == s->old.ngroups) {
+            table_free(&s->old);
+            s->migrate_next = 0;
+        }
+    }
+}
+
+
+// make room for one more entry in cur
+static int
+shard_reserve (struct nk_oa_htable *t, struct shard *s)
+{
+    struct table *cur = &s->cur;
+    uint64_t cap = cur->ngroups * GROUP;
+    uint64_t ngroups;
+
+    if (cur->used + cur->tombs + 1 <= cap - cap / 8) {
+        return 0;
+    }
+
+    // a resize is still under way, so finish it first
+    if (s->old.ngroups) {
+        shard_migrate(t, s, s->old.ngroups);
+        if (cur->used + cur->tombs + 1 <= cap - cap / 8) {
+            return 0;
+        }
+    }
+
+    // mostly tombstones => same size, which cleans them out
+    ngroups = cur->used + 1 > cap / 2 ? cur->ngroups * 2 : cur->ngroups;
+
+    s->old = *cur;
+    if (table_alloc(cur, ngroups)) {
+        ERROR("Cannot allocate %lu groups\n", ngroups);
+        *cur = s->old;
+        memset(&s->old, 0, sizeof(s->old));
+        return -1;
+    }
+    s->migrate_next = 0;
+
+    shard_migrate(t, s, MIGRATE_GROUPS);
+
+    return 0;
+}
+
+
+struct nk_oa_htable *
+nk_oa_htable_create (uint64_t min_size,
+                     uint_t (*hash_fn)(addr_t key),
+                     int (*eq_fn)(addr_t key1, addr_t key2),
+                     int flags)
+{
+    struct nk_oa_htable *t = malloc(sizeof(*t));
+    uint64_t nshards, ngroups;
+    uint64_t i;
+
+    if (!t) {
+        ERROR("Cannot allocate table\n");
+        return 0;
+    }
+    memset(t, 0, sizeof(*t));
+
+    t->hash_fn = hash_fn;
+    t->eq_fn = eq_fn;
+    t->flags = flags;
+    t->shard_bits = (flags & NK_OA_HTABLE_CONCURRENT) ? __builtin_ctz(SHARDS) : 0;
+    nshards = 1UL << t->shard_bits;
+
+    // size each shard to hold its part of min_size below the load limit
+    for (ngroups = 1; ngroups * GROUP * nshards * 7 / 8 < min_size; ngroups *= 2) { }
+    t->min_groups = ngroups;
+
+    t->shards = malloc(sizeof(struct shard) * nshards);
+    if (!t->shards) {
+        ERROR("Cannot allocate shards\n");
+        free(t);
+        return 0;
+    }
+    memset(t->shards, 0, sizeof(struct shard) * nshards);
+
+    for (i = 0; i < nshards; i++) {
+        spinlock_init(&t->shards[i].lock);
+        if (table_alloc(&t->shards[i].cur, ngroups)) {
+            ERROR("Cannot allocate initial table\n");
+            nk_oa_htable_destroy(t);
+            return 0;
+        }
+    }
+
+    return t;
+}
+
+
+void
+nk_oa_htable_destroy (struct nk_oa_htable *t)
+{
+    uint64_t i;
+
+    for (i = 0; i < (1UL << t->shard_bits); i++) {
+        table_free(&t->shards[i].cur);
+        table_free(&t->shards[i].old);
+    }
+    free(t->shards);
+    free(t);
+}
+
+
+int
+nk_oa_htable_insert (struct nk_oa_htable *t, addr_t key, addr_t value)
+{
+    SHARD_LOCK_CONF;
+    uint64_t h = hash(t, key);
+    struct shard *s = shard_of(t, h);
+    sint64_t idx;
+    int rc = 0;
+
+    SHARD_LOCK(t, s);
+
+    shard_migrate(t, s, MIGRATE_GROUPS);
+
+    if ((idx = table_find(t, &s->cur, key, h)) >= 0) {
+        s->cur.slots[idx].value = value;
+        goto out;
+    }
+
+    // reserve before touching an entry not yet moved, so that failing
+    // here leaves the old value in place
+    if (shard_reserve(t, s)) {
+        rc = -1;
+        goto out;
+    }
+
+    // finishing a resize may have moved the entry into cur
+    if ((idx = table_find(t, &s->cur, key, h)) >= 0) {
+        s->cur.slots[idx].value = value;
+        goto out;
+    }
+
+    // an entry not yet moved is moved now
+    if ((idx = table_find(t, &s->old, key, h)) >= 0) {
+        table_erase(&s->old, idx);
+    }
+
+    table_place(&s->cur, key, value, h);
+
+ out:
+    SHARD_UNLOCK(t, s);
+    return rc;
+}
+
+
+int
+nk_oa_htable_search (struct nk_oa_htable *t, addr_t key, addr_t *value)
+{
+    SHARD_LOCK_CONF;
+    uint64_t h = hash(t, key);
+    struct shard *s = shard_of(t, h);
+    struct table *tab = &s->cur;
+    sint64_t idx;
+
+    SHARD_LOCK(t, s);
+
+    if ((idx = table_find(t, tab, key, h)) < 0) {
+        tab = &s->old;
+        idx = table_find(t, tab, key, h);
+    }
+
+    if (idx >= 0 && value) {
+        *value = tab->slots[idx].value;
+    }
+
+    SHARD_UNLOCK(t, s);
+
+    return idx >= 0 ? 0 : -1;
+}
+
+
+int
+nk_oa_htable_remove (struct nk_oa_htable *t, addr_t key, addr_t *value)
+{
+    SHARD_LOCK_CONF;
+    uint64_t h = hash(t, key);
+    struct shard *s = shard_of(t, h);
+    struct table *tab = &s->cur;
+    sint64_t idx;
+
+    SHARD_LOCK(t, s);
+
+    shard_migrate(t, s, MIGRATE_GROUPS);
+
+    if ((idx = table_find(t, tab, key, h)) < 0) {
+        tab = &s->old;
+        idx = table_find(t, tab, key, h);
+    }
+
+    if (idx >= 0) {
+        if (value) {
+            *value = tab->slots[idx].value;
+        }
+        table_erase(tab, idx);
+    }
+
+    SHARD_UNLOCK(t, s);
+
+    return idx >= 0 ? 0 : -1;
+}
+
+
+uint64_t
+nk_oa_htable_count (struct nk_oa_htable *t)
+{
+    uint64_t i, n = 0;
+
+    // racy in concurrent mode, as any count would be
+    for (i = 0; i < (1UL << t->shard_bits); i++) {
+        n += t->shards[i].cur.used + t->shards[i].old.used;
+    }
+
+    return n;
+}
+
+
+static int
+table_iterate (struct table *tab, int (*fn)(addr_t key, addr_t value, void *state), void *state)
+{
+    uint64_t i;
+
+    for (i = 0; i < tab->ngroups * GROUP; i++) {
+        if (tab->ctrl[i] >= 0 && fn(tab->slots[i].key, tab->slots[i].value, state)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void
+nk_oa_htable_iterate (struct nk_oa_htable *t,
+                      int (*fn)(addr_t key, addr_t value, void *state),
+                      void *state)
+{
+    SHARD_LOCK_CONF;
+    uint64_t i;
+    int done = 0;
+
+    for (i = 0; !done && i < (1UL << t->shard_bits); i++) {
+        struct shard *s = &t->shards[i];
+        SHARD_LOCK(t, s);
+        done = table_iterate(&s->cur, fn, state) || table_iterate(&s->old, fn, state);
+        SHARD_UNLOCK(t, s);
+    }
+}
+
+
+/***** MICROBENCHMARK ******/
+
+static uint_t
+bench_hash (addr_t key)
+{
+    return nk_hash_long(key, 32);
+}
+
+
+static int
+bench_eq (addr_t k1, addr_t k2)
+{
+    return k1 == k2;
+}
+
+
+// distinct nonzero keys in a scattered order
+static inline addr_t
+bench_key (uint64_t i)
+{
+    return (i + 1) * 0x9e3779b97f4a7c15UL;
+}
+
+
+#define BENCH_PHASES 4
+static const char *bench_phase[BENCH_PHASES] = { "insert", "hit", "miss", "remove" };
+
+
+static void
+bench_chained (uint64_t n, uint64_t *cycles)
+{
+    struct nk_hashtable *h = nk_create_htable(0, bench_hash, bench_eq);
+    uint64_t i, start;
+
+    if (!h) {
+        ERROR("Cannot create chained table\n");
+        return;
+    }
+
+    start = rdtsc();
+    for (i = 0; i < n; i++) {
+        nk_htable_insert(h, bench_key(i), i);
+    }
+    cycles[0] = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = 0; i < n; i++) {
+        nk_htable_search(h, bench_key(i));
+    }
+    cycles[1] = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = n; i < 2 * n; i++) {
+        nk_htable_search(h, bench_key(i));
+    }
+    cycles[2] = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = 0; i < n; i++) {
+        nk_htable_remove(h, bench_key(i), 0);
+    }
+    cycles[3] = rdtsc() - start;
+
+    nk_free_htable(h, 0, 0);
+}
+
+
+static void
+bench_oa (uint64_t n, int flags, uint64_t *cycles)
+{
+    struct nk_oa_htable *t = nk_oa_htable_create(0, bench_hash, bench_eq, flags);
+    uint64_t i, start;
+
+    if (!t) {
+        ERROR("Cannot create open addressing table\n");
+        return;
+    }
+
+    start = rdtsc();
+    for (i = 0; i < n; i++) {
+        nk_oa_htable_insert(t, bench_key(i), i);
+    }
+    cycles[0] = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = 0; i < n; i++) {
+        nk_oa_htable_search(t, bench_key(i), 0);
+    }
+    cycles[1] = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = n; i < 2 * n; i++) {
+        nk_oa_htable_search(t, bench_key(i), 0);
+    }
+    cycles[2] = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = 0; i < n; i++) {
+        nk_oa_htable_remove(t, bench_key(i), 0);
+    }
+    cycles[3] = rdtsc() - start;
+
+    nk_oa_htable_destroy(t);
+}
+
+
+static int
+handle_htbench (char * buf, void * priv)
+{
+    uint64_t n = 100000;
+    uint64_t chained[BENCH_PHASES] = { 0 };
+    uint64_t oa[BENCH_PHASES] = { 0 };
+    uint64_t oac[BENCH_PHASES] = { 0 };
+    int i;
+
+    sscanf(buf, "htbench %lu", &n);
+    if (!n) {
+        n = 1;
+    }
+
+    bench_chained(n, chained);
+    bench_oa(n, 0, oa);
+    bench_oa(n, NK_OA_HTABLE_CONCURRENT, oac);
+
+    nk_vc_printf("%lu keys, cycles per operation\n", n);
+    nk_vc_printf("%-8s %12s %12s %12s\n", "op", "chained", "open", "open-conc");
+    for (i = 0; i < BENCH_PHASES; i++) {
+        nk_vc_printf("%-8s %12lu %12lu %12lu\n", bench_phase[i],
+                     chained[i] / n, oa[i] / n, oac[i] / n);
+    }
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl htbench_impl = {
+    .cmd      = "htbench",
+    .help_str = "htbench [keys]  (chained vs open addressing hash tables)",
+    .handler  = handle_htbench,
+};
+nk_register_shell_cmd(htbench_impl);
@@ -27,6 +27,8 @@
 #include <nautilus/pmc.h>
 #include <nautilus/mm.h>
 #include <nautilus/shell.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/thread.h>
 
 
 /*
@@ -109,6 +111,8 @@ static amd_event_attr_t amd_event_attrs[256] =
     {"Instruction Fetch Stalls",       0x87, 0x00, 0x07},
     {"Mispredicted Branches Retired",  0xc3, 0x00, 0x3f},
     {"Instr. Cache Lines Invalidated", 0x8c, 0x00, 0x07},
+    {"CPU Clocks not Halted",          0x76, 0x00, 0x3f},
+    {"Retired Instructions",           0xc0, 0x00, 0x3f},
 };
 
 
@@ -361,7 +365,7 @@ intel_flags_init (pmc_info_t * pmc)
         PMC_WARN("Insufficient Intel PMC version to support perf counter subsystem\n");
         return;
     } else {
-        cpuid(IA32_PMC_BASE, &ret);
+        cpuid(IA32_PMC_LEAF, &ret);
         pmc->intel_fl = ret.b;
         pmc->valid = 1;
     }
@@ -480,6 +484,7 @@ intel_unbind_ctr (int slot)
 static void
 intel_enable_ctr (perf_event_t * event)
 {
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
     pmc_ctl_intel_t ctl;
 
     PMC_DEBUG("Enabling Intel HW counter %d\n", event->assigned_idx);
@@ -489,6 +494,13 @@ intel_enable_ctr (perf_event_t * event)
     ctl.en = 1;
 
     intel_write_ctl(event->assigned_idx, ctl.val);
+
+    // v2+ also gates each counter in the global control, and sampling
+    // may have cleared it
+    if (pmc->version_id >= 2) {
+        msr_write(IA32_PERF_GLOBAL_CTRL, 
+                  msr_read(IA32_PERF_GLOBAL_CTRL) | (1UL << event->assigned_idx));
+    }
 }
 
 
@@ -507,6 +519,44 @@ intel_disable_ctr (perf_event_t * event)
 }
 
 
+static void
+intel_intr_ctr (perf_event_t * event, int on)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    pmc_ctl_intel_t ctl;
+
+    PMC_DEBUG("%s overflow interrupt for Intel HW counter %d\n", 
+            on ? "Enabling" : "Disabling",
+            event->assigned_idx);
+
+    ctl.val = intel_read_ctl(event->assigned_idx);
+    ctl.intr = !!on;
+    intel_write_ctl(event->assigned_idx, ctl.val);
+
+    // v2+ also gates each counter in the global control
+    if (pmc->version_id >= 2) {
+        uint64_t global = msr_read(IA32_PERF_GLOBAL_CTRL);
+        if (on) {
+            global |= 1UL << event->assigned_idx;
+        } else {
+            global &= ~(1UL << event->assigned_idx);
+        }
+        msr_write(IA32_PERF_GLOBAL_CTRL, global);
+    }
+}
+
+
+static void
+intel_ack_overflow (perf_event_t * event)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+
+    if (pmc->version_id >= 2) {
+        msr_write(IA32_PERF_GLOBAL_OVF_CTRL, 1UL << event->assigned_idx);
+    }
+}
+
+
 static int
 intel_pmc_init (pmc_info_t * pmc)
 {
@@ -538,7 +588,8 @@ amd_get_pmc_msr_count (void)
 static int
 amd_get_pmc_msr_bitwidth (void)
 {
-    return 64;
+    // the counter registers are 64 bits, but only 48 count
+    return 48;
 }
 
 
@@ -658,6 +709,28 @@ amd_disable_ctr (perf_event_t * event)
 }
 
 
+static void
+amd_intr_ctr (perf_event_t * event, int on)
+{
+    pmc_ctl_amd_t ctl;
+
+    PMC_DEBUG("%s overflow interrupt for AMD HW slot %d\n", 
+            on ? "Enabling" : "Disabling",
+            event->assigned_idx);
+
+    ctl.val = amd_read_ctl(event->assigned_idx);
+    ctl.int_enable = !!on;
+    amd_write_ctl(event->assigned_idx, ctl.val);
+}
+
+
+static void
+amd_ack_overflow (perf_event_t * event)
+{
+    // nothing to clear - rewriting the counter is enough
+}
+
+
 static struct pmc_ops amd_ops = {
 	.init        = amd_pmc_init,
 	.read_ctr    = amd_read_ctr,
@@ -667,6 +740,8 @@ static struct pmc_ops amd_ops = {
     .unbind_ctr  = amd_unbind_ctr,
     .enable_ctr  = amd_enable_ctr,
     .disable_ctr = amd_disable_ctr,
+    .intr_ctr    = amd_intr_ctr,
+    .ack_overflow = amd_ack_overflow,
     .version     = amd_get_pmc_version,
     .msr_cnt     = amd_get_pmc_msr_count,
     .msr_width   = amd_get_pmc_msr_bitwidth,
@@ -681,6 +756,8 @@ static struct pmc_ops intel_ops = {
     .unbind_ctr  = intel_unbind_ctr,
     .enable_ctr  = intel_enable_ctr,
     .disable_ctr = intel_disable_ctr,
+    .intr_ctr    = intel_intr_ctr,
+    .ack_overflow = intel_ack_overflow,
     .version     = intel_get_pmc_version,
     .msr_cnt     = intel_get_pmc_msr_count,
     .msr_width   = intel_get_pmc_msr_bitwidth,
@@ -782,6 +859,77 @@ nk_pmc_write (perf_event_t * event, uint64_t val)
 }
 
 
+/*
+ * The counter interrupts when it wraps, so it starts period events
+ * short of that.  Intel sign-extends 32 bit counter writes, which is
+ * why periods are limited to 31 bits.
+ */
+static inline uint64_t
+sample_start_val (pmc_info_t * pmc, uint64_t period)
+{
+    if (period >= (1UL << 31)) {
+        period = (1UL << 31) - 1;
+    }
+
+    if (!period) {
+        period = 1;
+    }
+
+    if (pmc->msr_width >= 64) {
+        return -period;
+    }
+
+    return (-period) & ((1UL << pmc->msr_width) - 1);
+}
+
+
+int
+nk_pmc_sample_arm (perf_event_t * event, uint64_t period)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+
+    if (!pmc || !pmc->valid || !event || !event->bound) {
+        PMC_ERR("Cannot arm event for sampling\n");
+        return -1;
+    }
+
+    // the event was bound on one CPU, so program this CPU's control
+    // register for the same slot
+    if (pmc->ops->bind_ctr(event, event->assigned_idx)) {
+        PMC_ERR("Cannot bind event on this CPU\n");
+        return -1;
+    }
+
+    pmc->ops->write_ctr(event->assigned_idx, sample_start_val(pmc, period));
+    pmc->ops->intr_ctr(event, 1);
+    pmc->ops->enable_ctr(event);
+
+    return 0;
+}
+
+
+void
+nk_pmc_sample_rearm (perf_event_t * event, uint64_t period)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+
+    pmc->ops->write_ctr(event->assigned_idx, sample_start_val(pmc, period));
+    pmc->ops->ack_overflow(event);
+}
+
+
+void
+nk_pmc_sample_disarm (perf_event_t * event)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+
+    pmc->ops->disable_ctr(event);
+    pmc->ops->intr_ctr(event, 0);
+    pmc->ops->ack_overflow(event);
+    pmc->ops->unbind_ctr(event->assigned_idx);
+}
+
+
 /*
  * Note that ID is Nautilus-specific and 
  * has different meaning on Intel and AMD!
@@ -839,6 +987,350 @@ nk_pmc_destroy (perf_event_t * event)
 }
 
 
+/*
+ * Per-thread counters.  Each distinct event counted by some thread
+ * owns one slot system-wide, shared by all the threads counting it.
+ * A thread's counts live in hardware only while it runs - the switch
+ * hook zeroes and enables the slots on the way in and accumulates and
+ * disables them on the way out.
+ */
+#define THREAD_EVENTS_MAX 8
+
+static struct {
+    uint32_t       id;
+    int            refs;
+    perf_event_t * event;
+} thread_events[THREAD_EVENTS_MAX];
+
+static spinlock_t thread_events_lock;
+
+
+static perf_event_t *
+thread_event_get (uint32_t id)
+{
+    perf_event_t * event = NULL;
+    int i, free_idx;
+
+ retry:
+    free_idx = -1;
+
+    spin_lock(&thread_events_lock);
+
+    for (i = 0; i < THREAD_EVENTS_MAX; i++) {
+        if (thread_events[i].refs && thread_events[i].id == id) {
+            if (!thread_events[i].event) {
+                // someone else is creating it
+                spin_unlock(&thread_events_lock);
+                __asm__ __volatile__ ("pause" : : : "memory");
+                goto retry;
+            }
+            thread_events[i].refs++;
+            event = thread_events[i].event;
+            spin_unlock(&thread_events_lock);
+            return event;
+        }
+        if (!thread_events[i].refs && free_idx < 0) {
+            free_idx = i;
+        }
+    }
+
+    if (free_idx < 0) {
+        spin_unlock(&thread_events_lock);
+        PMC_ERR("Too many distinct per-thread events\n");
+        return NULL;
+    }
+
+    // reserve the slot, and create the event without the lock
+    thread_events[free_idx].id    = id;
+    thread_events[free_idx].refs  = 1;
+    thread_events[free_idx].event = NULL;
+
+    spin_unlock(&thread_events_lock);
+
+    event = nk_pmc_create(id);
+    if (event && !event->bound) {
+        nk_pmc_destroy(event);
+        event = NULL;
+    }
+
+    spin_lock(&thread_events_lock);
+    if (event) {
+        thread_events[free_idx].event = event;
+    } else {
+        thread_events[free_idx].refs = 0;
+    }
+    spin_unlock(&thread_events_lock);
+
+    if (!event) {
+        PMC_ERR("No counter slot available for event 0x%02x\n", id);
+    }
+
+    return event;
+}
+
+
+static void
+thread_event_put (perf_event_t * event)
+{
+    int i, last = 0;
+
+    spin_lock(&thread_events_lock);
+
+    for (i = 0; i < THREAD_EVENTS_MAX; i++) {
+        if (thread_events[i].refs && thread_events[i].event == event) {
+            if (!--thread_events[i].refs) {
+                thread_events[i].event = NULL;
+                last = 1;
+            }
+            break;
+        }
+    }
+
+    spin_unlock(&thread_events_lock);
+
+    if (last) {
+        nk_pmc_destroy(event);
+    }
+}
+
+
+// interrupts must be off for both of these
+static void
+thread_pmc_load (struct nk_thread_pmc * tp)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    int i;
+
+    for (i = 0; i < tp->num; i++) {
+        // the slot's control register on this CPU may still hold
+        // another thread's event
+        pmc->ops->bind_ctr(tp->events[i], tp->events[i]->assigned_idx);
+        pmc->ops->write_ctr(tp->events[i]->assigned_idx, 0);
+        pmc->ops->enable_ctr(tp->events[i]);
+    }
+}
+
+
+static void
+thread_pmc_save (struct nk_thread_pmc * tp)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    int i;
+
+    for (i = 0; i < tp->num; i++) {
+        pmc->ops->disable_ctr(tp->events[i]);
+        tp->counts[i] += pmc->ops->read_ctr(tp->events[i]->assigned_idx);
+    }
+}
+
+
+static struct nk_thread_pmc *
+thread_pmc_alloc (uint32_t * event_ids, int num, int flags)
+{
+    struct nk_thread_pmc * tp;
+    int i;
+
+    if (num <= 0 || num > NK_THREAD_PMC_MAX) {
+        PMC_ERR("Can count between 1 and %d events per thread\n", NK_THREAD_PMC_MAX);
+        return NULL;
+    }
+
+    tp = malloc(sizeof(*tp));
+    if (!tp) {
+        PMC_ERR("Could not allocate per-thread counter state\n");
+        return NULL;
+    }
+    memset(tp, 0, sizeof(*tp));
+
+    tp->flags = flags;
+
+    for (i = 0; i < num; i++) {
+        if (!(tp->events[i] = thread_event_get(event_ids[i]))) {
+            for (i--; i >= 0; i--) {
+                thread_event_put(tp->events[i]);
+            }
+            free(tp);
+            return NULL;
+        }
+    }
+
+    tp->num = num;
+
+    return tp;
+}
+
+
+static void
+thread_pmc_free (struct nk_thread_pmc * tp)
+{
+    int i;
+
+    for (i = 0; i < tp->num; i++) {
+        thread_event_put(tp->events[i]);
+    }
+
+    free(tp);
+}
+
+
+int
+nk_thread_pmc_enable (uint32_t * event_ids, int num, int flags)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    nk_thread_t * t = get_cur_thread();
+    struct nk_thread_pmc * tp;
+    uint8_t irq;
+
+    if (!pmc || !pmc->valid) {
+        PMC_WARN("Cannot count per-thread events, PMC system disabled\n");
+        return -1;
+    }
+
+    if (t->pmc) {
+        PMC_ERR("Thread %lu is already counting events\n", t->tid);
+        return -1;
+    }
+
+    if (!(tp = thread_pmc_alloc(event_ids, num, flags))) {
+        return -1;
+    }
+
+    irq = spin_lock_irq_save(&t->pmc_lock);
+    t->pmc = tp;
+    thread_pmc_load(tp);
+    spin_unlock_irq_restore(&t->pmc_lock, irq);
+
+    return 0;
+}
+
+
+int
+nk_thread_pmc_disable (void)
+{
+    nk_thread_t * t = get_cur_thread();
+    struct nk_thread_pmc * tp;
+    uint8_t irq;
+
+    // once it is unhooked under the lock, no reader can still see it
+    irq = spin_lock_irq_save(&t->pmc_lock);
+    tp = t->pmc;
+    if (tp) {
+        thread_pmc_save(tp);
+        t->pmc = NULL;
+    }
+    spin_unlock_irq_restore(&t->pmc_lock, irq);
+
+    if (!tp) {
+        return -1;
+    }
+
+    thread_pmc_free(tp);
+
+    return 0;
+}
+
+
+int
+nk_thread_pmc_read (struct nk_thread * t, uint64_t * counts,
+                    uint32_t * event_ids, const char ** names, int num)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    struct nk_thread_pmc * tp;
+    uint8_t irq;
+    int i;
+
+    irq = spin_lock_irq_save(&t->pmc_lock);
+
+    tp = t->pmc;
+
+    if (!tp) {
+        spin_unlock_irq_restore(&t->pmc_lock, irq);
+        return -1;
+    }
+
+    if (num > tp->num) {
+        num = tp->num;
+    }
+
+    for (i = 0; i < num; i++) {
+        counts[i] = tp->counts[i];
+        // our own running counts are still in the hardware
+        if (t == get_cur_thread()) {
+            counts[i] += pmc->ops->read_ctr(tp->events[i]->assigned_idx);
+        }
+        if (event_ids) {
+            event_ids[i] = tp->events[i]->sw_id;
+        }
+        if (names) {
+            // static strings from the event tables
+            names[i] = tp->events[i]->name;
+        }
+    }
+
+    spin_unlock_irq_restore(&t->pmc_lock, irq);
+
+    return num;
+}
+
+
+// interrupts are off
+void
+nk_thread_pmc_switch (struct nk_thread * from, struct nk_thread * to)
+{
+    if (from->pmc) {
+        spin_lock(&from->pmc_lock);
+        thread_pmc_save(from->pmc);
+        spin_unlock(&from->pmc_lock);
+    }
+
+    if (to->pmc) {
+        thread_pmc_load(to->pmc);
+    }
+}
+
+
+int
+nk_thread_pmc_inherit (struct nk_thread * child, struct nk_thread * parent)
+{
+    struct nk_thread_pmc * ptp = parent->pmc;
+    uint32_t ids[NK_THREAD_PMC_MAX];
+    int i;
+
+    if (!ptp || !(ptp->flags & NK_THREAD_PMC_INHERIT)) {
+        return 0;
+    }
+
+    for (i = 0; i < ptp->num; i++) {
+        ids[i] = ptp->events[i]->sw_id;
+    }
+
+    // the child is not running yet, so its counters are loaded on
+    // its first switch in
+    if (!(child->pmc = thread_pmc_alloc(ids, ptp->num, ptp->flags))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void
+nk_thread_pmc_release (struct nk_thread * t)
+{
+    struct nk_thread_pmc * tp;
+    uint8_t irq;
+
+    irq = spin_lock_irq_save(&t->pmc_lock);
+    tp = t->pmc;
+    t->pmc = NULL;
+    spin_unlock_irq_restore(&t->pmc_lock, irq);
+
+    if (tp) {
+        thread_pmc_free(tp);
+    }
+}
+
+
 int 
 nk_pmc_init (struct naut_info * naut)
 {
@@ -884,6 +1376,8 @@ nk_pmc_init (struct naut_info * naut)
 	}
 	memset(pmc->slots, 0, sizeof(perf_slot_t)*pmc->sw_num_slots);
 
+    spinlock_init(&thread_events_lock);
+
     return 0;
 }
 
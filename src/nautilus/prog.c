@@ -28,6 +28,7 @@
 #include <nautilus/prog.h>
 #include <nautilus/linker.h>
 #include <nautilus/shell.h>
+#include <nautilus/scheduler.h>
 
 #ifndef NAUT_CONFIG_DEBUG_LINKER
 #undef DEBUG_PRINT
@@ -127,17 +128,25 @@ int
 nk_prog_run (struct naut_info * naut)
 {
     void (*func)(int argc, char ** argv);
+    uint64_t start;
 
     if (!have_valid_prog(naut)) {
         nk_vc_printf("No valid program found\n");
         return 0;
     }
 
+    // the program runs in place in its multiboot module, so linking
+    // is the only load cost
+    start = nk_sched_get_realtime();
+
     if (nk_link_prog(naut->sys.linker_info, naut->sys.prog_info) != 0) {
         ERROR_PRINT("Could not link program\n");
         return -1;
     }
 
+    INFO_PRINT("Linked program (%s) in place in %lu ns\n", naut->sys.prog_info->name,
+               nk_sched_get_realtime() - start);
+
     func = naut->sys.prog_info->entry_addr;
 
     DEBUG_PRINT("Running program (%s) at entry address: %p\n", naut->sys.prog_info->name, (void*)func);
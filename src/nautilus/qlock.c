@@ -0,0 +1,411 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/mm.h>
+#include <nautilus/numa.h>
+#include <nautilus/shell.h>
+#include <nautilus/qlock.h>
+
+#define ERROR(fmt, args...) ERROR_PRINT("qlock: " fmt, ##args)
+
+// values passed in qnode->locked
+#define QNODE_WAIT     0
+#define QNODE_GO       1   // you have the local lock (cohort: take the global lock)
+#define QNODE_COHORT   2   // cohort: you have both locks
+
+// per-CPU queue nodes - only touched by their CPU with interrupts off,
+// except for the next and locked fields, which are the MCS protocol
+static struct qnode_pool {
+    struct nk_qnode nodes[NK_QLOCK_NEST];
+    uint32_t        used;  // bitmap
+} __attribute__((aligned(64))) qnode_pool[NAUT_CONFIG_MAX_CPUS];
+
+static spinlock_t stats_lock = 0;
+static LIST_HEAD(stats_list);
+
+#define STATE_LOCK_CONF uint8_t _state_lock_flags
+#define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&stats_lock)
+#define STATE_UNLOCK() spin_unlock_irq_restore(&stats_lock, _state_lock_flags)
+
+
+static inline struct nk_qnode *
+qnode_get (void)
+{
+    struct qnode_pool *p = &qnode_pool[my_cpu_id()];
+    int i;
+
+    for (i = 0; i < NK_QLOCK_NEST; i++) {
+        if (!(p->used & (1U << i))) {
+            p->used |= 1U << i;
+            p->nodes[i].next = 0;
+            p->nodes[i].locked = QNODE_WAIT;
+            return &p->nodes[i];
+        }
+    }
+
+    panic("More than %d queue locks held on cpu %d\n", NK_QLOCK_NEST, my_cpu_id());
+    return 0;
+}
+
+
+static inline void
+qnode_put (struct nk_qnode *n)
+{
+    struct qnode_pool *p = &qnode_pool[my_cpu_id()];
+
+    p->used &= ~(1U << (n - p->nodes));
+}
+
+
+// returns how the lock was passed to us
+static inline uint32_t
+mcs_acquire (struct nk_qnode * volatile *tail, struct nk_qnode *n, uint64_t *spin)
+{
+    struct nk_qnode *pred = __sync_lock_test_and_set(tail, n);
+    uint64_t start;
+    uint32_t v;
+
+    if (!pred) {
+        return QNODE_GO;
+    }
+
+    start = rdtsc();
+    pred->next = n;
+    while (!(v = n->locked)) {
+        __asm__ __volatile__ ("pause" : : : "memory");
+    }
+    *spin += rdtsc() - start;
+
+    return v;
+}
+
+
+static inline void
+mcs_release (struct nk_qnode * volatile *tail, struct nk_qnode *n, uint32_t how)
+{
+    if (!n->next) {
+        if (__sync_bool_compare_and_swap(tail, n, 0)) {
+            return;
+        }
+        // a successor has swapped itself in but not linked yet
+        while (!n->next) {
+            __asm__ __volatile__ ("pause" : : : "memory");
+        }
+    }
+    n->next->locked = how;
+}
+
+
+static inline void
+stats_acquired (struct nk_lock_stats *s, uint64_t spin)
+{
+    if (s) {
+        s->acquisitions++;
+        if (spin) {
+            s->contended++;
+            s->spin_cycles += spin;
+        }
+        s->acquired_at = rdtsc();
+    }
+}
+
+
+static inline void
+stats_release (struct nk_lock_stats *s)
+{
+    if (s) {
+        uint64_t held = rdtsc() - s->acquired_at;
+        s->hold_cycles += held;
+        if (held > s->max_hold) {
+            s->max_hold = held;
+        }
+    }
+}
+
+
+static struct nk_lock_stats *
+stats_create (char *name)
+{
+#ifdef NAUT_CONFIG_LOCK_STATS
+    STATE_LOCK_CONF;
+    struct nk_lock_stats *s;
+
+    if (!name) {
+        return 0;
+    }
+
+    s = malloc(sizeof(*s));
+    if (!s) {
+        ERROR("Cannot allocate statistics for lock %s\n", name);
+        return 0;
+    }
+    memset(s, 0, sizeof(*s));
+    strncpy(s->name, name, NK_LOCK_NAME_LEN);
+    s->name[NK_LOCK_NAME_LEN - 1] = 0;
+
+    STATE_LOCK();
+    list_add_tail(&s->node, &stats_list);
+    STATE_UNLOCK();
+
+    return s;
+#else
+    return 0;
+#endif
+}
+
+
+static void
+stats_destroy (struct nk_lock_stats *s)
+{
+    STATE_LOCK_CONF;
+
+    if (s) {
+        STATE_LOCK();
+        list_del(&s->node);
+        STATE_UNLOCK();
+        free(s);
+    }
+}
+
+
+int
+nk_qlock_init (nk_qlock_t *l, char *name)
+{
+    memset(l, 0, sizeof(*l));
+    l->stats = stats_create(name);
+    return 0;
+}
+
+
+void
+nk_qlock_deinit (nk_qlock_t *l)
+{
+    stats_destroy(l->stats);
+    memset(l, 0, sizeof(*l));
+}
+
+
+uint8_t
+nk_qlock_lock_irq_save (nk_qlock_t *l)
+{
+    uint8_t flags = irq_disable_save();
+    struct nk_qnode *n = qnode_get();
+    uint64_t spin = 0;
+
+    mcs_acquire(&l->tail, n, &spin);
+
+    l->holder = n;
+    stats_acquired(l->stats, spin);
+
+    return flags;
+}
+
+
+int
+nk_qlock_trylock_irq_save (nk_qlock_t *l, uint8_t *flags)
+{
+    struct nk_qnode *n;
+
+    *flags = irq_disable_save();
+
+    if (l->tail) {
+        irq_enable_restore(*flags);
+        return -1;
+    }
+
+    n = qnode_get();
+
+    if (!__sync_bool_compare_and_swap(&l->tail, 0, n)) {
+        qnode_put(n);
+        irq_enable_restore(*flags);
+        return -1;
+    }
+
+    l->holder = n;
+    stats_acquired(l->stats, 0);
+
+    return 0;
+}
+
+
+void
+nk_qlock_unlock_irq_restore (nk_qlock_t *l, uint8_t flags)
+{
+    struct nk_qnode *n = l->holder;
+
+    stats_release(l->stats);
+    mcs_release(&l->tail, n, QNODE_GO);
+    qnode_put(n);
+    irq_enable_restore(flags);
+}
+
+
+static inline struct nk_cohort_local *
+my_local (nk_cohort_lock_t *l)
+{
+    struct cpu *c = per_cpu_get(system)->cpus[my_cpu_id()];
+
+    return &l->local[c->domain ? c->domain->id % NK_COHORT_MAX_DOMAINS : 0];
+}
+
+
+int
+nk_cohort_lock_init (nk_cohort_lock_t *l, char *name)
+{
+    memset(l, 0, sizeof(*l));
+    l->stats = stats_create(name);
+    return 0;
+}
+
+
+void
+nk_cohort_lock_deinit (nk_cohort_lock_t *l)
+{
+    stats_destroy(l->stats);
+    memset(l, 0, sizeof(*l));
+}
+
+
+uint8_t
+nk_cohort_lock_irq_save (nk_cohort_lock_t *l)
+{
+    uint8_t flags = irq_disable_save();
+    struct nk_cohort_local *local = my_local(l);
+    struct nk_qnode *n = qnode_get();
+    uint64_t spin = 0;
+
+    if (mcs_acquire(&local->tail, n, &spin) != QNODE_COHORT) {
+        // first of our cohort - compete with the other domains
+        uint32_t ticket = __sync_fetch_and_add(&l->next_ticket, 1);
+        if (l->now_serving != ticket) {
+            uint64_t start = rdtsc();
+            while (l->now_serving != ticket) {
+                __asm__ __volatile__ ("pause" : : : "memory");
+            }
+            spin += rdtsc() - start;
+        }
+    } else if (l->stats) {
+        l->stats->local_handoffs++;
+    }
+
+    l->holder = n;
+    stats_acquired(l->stats, spin);
+
+    return flags;
+}
+
+
+void
+nk_cohort_unlock_irq_restore (nk_cohort_lock_t *l, uint8_t flags)
+{
+    struct nk_cohort_local *local = my_local(l);
+    struct nk_qnode *n = l->holder;
+
+    stats_release(l->stats);
+
+    if (n->next && local->handoffs < NK_COHORT_HANDOFFS) {
+        // keep the global lock within our domain
+        local->handoffs++;
+        n->next->locked = QNODE_COHORT;
+    } else {
+        local->handoffs = 0;
+        __sync_synchronize();
+        l->now_serving++;
+        mcs_release(&local->tail, n, QNODE_GO);
+    }
+
+    qnode_put(n);
+    irq_enable_restore(flags);
+}
+
+
+void
+nk_lock_stats_dump (void)
+{
+    STATE_LOCK_CONF;
+    struct nk_lock_stats *s;
+
+    nk_vc_printf("%-24s %12s %12s %12s %12s %12s %12s\n",
+                 "lock", "acquires", "contended", "avg-spin", "avg-hold", "max-hold", "local-pass");
+
+    STATE_LOCK();
+    list_for_each_entry(s, &stats_list, node) {
+        nk_vc_printf("%-24s %12lu %12lu %12lu %12lu %12lu %12lu\n",
+                     s->name, s->acquisitions, s->contended,
+                     s->contended ? s->spin_cycles / s->contended : 0,
+                     s->acquisitions ? s->hold_cycles / s->acquisitions : 0,
+                     s->max_hold, s->local_handoffs);
+    }
+    STATE_UNLOCK();
+}
+
+
+// racy with respect to holders, which at worst leaves a stray count
+void
+nk_lock_stats_clear (void)
+{
+    STATE_LOCK_CONF;
+    struct nk_lock_stats *s;
+
+    STATE_LOCK();
+    list_for_each_entry(s, &stats_list, node) {
+        s->acquisitions = 0;
+        s->contended = 0;
+        s->spin_cycles = 0;
+        s->hold_cycles = 0;
+        s->max_hold = 0;
+        s->local_handoffs = 0;
+    }
+    STATE_UNLOCK();
+}
+
+
+static int
+handle_locks (char * buf, void * priv)
+{
+    char what[16];
+
+    if (sscanf(buf, "locks %15s", what) == 1 && !strcmp(what, "clear")) {
+        nk_lock_stats_clear();
+        return 0;
+    }
+
+#ifndef NAUT_CONFIG_LOCK_STATS
+    nk_vc_printf("lock statistics are not compiled in (LOCK_STATS)\n");
+#endif
+
+    nk_lock_stats_dump();
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl locks_impl = {
+    .cmd      = "locks",
+    .help_str = "locks [clear]  (cycles)",
+    .handler  = handle_locks,
+};
+nk_register_shell_cmd(locks_impl);
@@ -0,0 +1,664 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/mm.h>
+#include <nautilus/cpu.h>
+#include <nautilus/irq.h>
+#include <nautilus/smp.h>
+#include <nautilus/pmc.h>
+#include <nautilus/linker.h>
+#include <nautilus/backtrace.h>
+#include <nautilus/shell.h>
+#include <nautilus/sampler.h>
+#include <dev/apic.h>
+
+#define INFO(fmt, args...)  INFO_PRINT("sampler: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("sampler: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("sampler: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_DEBUG_PROFILE
+#undef DEBUG
+#define DEBUG(fmt, args...)
+#endif
+
+#define RING_SIZE  8192   // samples per CPU
+
+struct sample_ring {
+    struct nk_sample *buf;
+    uint64_t          count;     // samples recorded
+    uint64_t          lost;      // samples dropped because the ring was full
+    uint64_t          next_tsc;  // timer mode - when the next sample is due
+} __attribute__((aligned(64)));
+
+static struct {
+    volatile int        active;
+    nk_sample_mode_t    mode;
+    uint64_t            period;       // events, or ns in timer mode
+    uint64_t            period_cycles;
+    uint64_t            cpu_khz;      // timer mode - nonzero while armed
+    perf_event_t       *event;
+    int                 num_cpus;
+    struct sample_ring *rings;
+} sampler;
+
+static char *mode_names[] = { "cycles", "instructions", "llc", "timer" };
+
+
+static void
+record (excp_entry_t *excp)
+{
+    struct nk_regs *r = (struct nk_regs*)((char*)excp - 128);
+    struct sample_ring *ring = &sampler.rings[my_cpu_id()];
+    struct nk_sample *s;
+
+    if (ring->count >= RING_SIZE) {
+        ring->lost++;
+        return;
+    }
+
+    s = &ring->buf[ring->count];
+    s->rip = excp->rip;
+    s->cpu = my_cpu_id();
+    s->depth = nk_backtrace_collect((void**)r->rbp, (void**)s->frames, NK_SAMPLE_DEPTH);
+
+    // the ring is only ever touched by this CPU, so publishing the
+    // sample is just bumping the count
+    ring->count++;
+}
+
+
+static int
+pmi_handler (excp_entry_t *excp, excp_vec_t vec, void *state)
+{
+    struct apic_dev *apic = per_cpu_get(apic);
+
+    if (sampler.active && sampler.mode != NK_SAMPLE_TIMER) {
+        record(excp);
+        nk_pmc_sample_rearm(sampler.event, sampler.period);
+    }
+
+    // delivering the interrupt masked the LVT entry
+    apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_PC_INT_VEC);
+
+    IRQ_HANDLER_END();
+
+    return 0;
+}
+
+
+uint64_t
+nk_sampler_timer_tick (excp_entry_t *excp, uint64_t time_to_next_ns)
+{
+    struct sample_ring *ring;
+    uint64_t now, left_ns;
+
+    if (!sampler.active || sampler.mode != NK_SAMPLE_TIMER) {
+        return time_to_next_ns;
+    }
+
+    ring = &sampler.rings[my_cpu_id()];
+    now = rdtsc();
+
+    // the timer also fires for the scheduler, so only sample when the
+    // period has really elapsed to keep the samples evenly spaced
+    if (now >= ring->next_tsc) {
+        record(excp);
+        ring->next_tsc = now + sampler.period_cycles;
+        left_ns = sampler.period;
+    } else {
+        left_ns = ((ring->next_tsc - now) * 1000000UL) / sampler.cpu_khz;
+    }
+
+    // -1 (infinite) compares as largest
+    return left_ns < time_to_next_ns ? left_ns : time_to_next_ns;
+}
+
+
+static void
+arm_cpu (void *arg)
+{
+    struct apic_dev *apic = per_cpu_get(apic);
+
+    if (sampler.mode == NK_SAMPLE_TIMER) {
+        // get the timer going even if this CPU is idle with no timeout
+        sampler.rings[my_cpu_id()].next_tsc = rdtsc() + sampler.period_cycles;
+        apic_update_oneshot_timer(apic, apic_realtime_to_ticks(apic, sampler.period), IF_EARLIER);
+        return;
+    }
+
+    if (nk_pmc_sample_arm(sampler.event, sampler.period)) {
+        ERROR("Cannot arm counter on cpu %d\n", my_cpu_id());
+        return;
+    }
+
+    apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_PC_INT_VEC);
+}
+
+
+static void
+disarm_cpu (void *arg)
+{
+    struct apic_dev *apic = per_cpu_get(apic);
+
+    if (sampler.mode == NK_SAMPLE_TIMER) {
+        return;
+    }
+
+    apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_LVT_DISABLED | APIC_PC_INT_VEC);
+    nk_pmc_sample_disarm(sampler.event);
+}
+
+
+static int
+all_cpus (nk_xcall_func_t fn)
+{
+    nk_cpu_mask_t mask;
+    int i;
+
+    nk_cpu_mask_zero(&mask);
+    for (i = 0; i < sampler.num_cpus; i++) {
+        nk_cpu_mask_set(&mask, i);
+    }
+
+    return smp_xcall_mask(&mask, fn, 0, 1);
+}
+
+
+static uint32_t
+pmc_event_for (nk_sample_mode_t mode)
+{
+    // AMD has no architectural LLC miss event that is valid on every
+    // family, so use L2 misses there
+    switch (mode) {
+        case NK_SAMPLE_CYCLES:
+            return nk_is_amd() ? AMD_CPU_CLOCKS : INTEL_UNHALTED_CORE_CYCLES;
+        case NK_SAMPLE_INSTRUCTIONS:
+            return nk_is_amd() ? AMD_INSTR_RETIRED : INTEL_INSTR_RETIRED;
+        default:
+            return nk_is_amd() ? AMD_L2_CACHE_MISS : INTEL_LLC_MISS;
+    }
+}
+
+
+// Virtual PMUs sometimes claim counters that never count, so make sure
+// ours moves before we rely on it
+static int
+pmc_counts (perf_event_t *event)
+{
+    pmc_info_t *pmc = nk_get_nautilus_info()->sys.pmc_info;
+    uint64_t before, after;
+    volatile int i;
+
+    if (pmc->ops->bind_ctr(event, event->assigned_idx)) {
+        return 0;
+    }
+    pmc->ops->enable_ctr(event);
+    before = pmc->ops->read_ctr(event->assigned_idx);
+    for (i = 0; i < 100000; i++) { }
+    after = pmc->ops->read_ctr(event->assigned_idx);
+    pmc->ops->disable_ctr(event);
+
+    return before != after;
+}
+
+
+int
+nk_sampler_start (nk_sample_mode_t mode, uint64_t period)
+{
+    struct sys_info *sys = &nk_get_nautilus_info()->sys;
+    pmc_info_t *pmc = sys->pmc_info;
+    int i;
+
+    if (sampler.active) {
+        ERROR("Sampler is already running\n");
+        return -1;
+    }
+
+    if (!sampler.rings) {
+        sampler.num_cpus = sys->num_cpus;
+        sampler.rings = malloc(sizeof(struct sample_ring) * sampler.num_cpus);
+        if (!sampler.rings) {
+            ERROR("Cannot allocate rings\n");
+            return -1;
+        }
+        memset(sampler.rings, 0, sizeof(struct sample_ring) * sampler.num_cpus);
+        for (i = 0; i < sampler.num_cpus; i++) {
+            sampler.rings[i].buf = malloc_specific(sizeof(struct nk_sample) * RING_SIZE, i);
+            if (!sampler.rings[i].buf) {
+                ERROR("Cannot allocate ring for cpu %d\n", i);
+                for (i--; i >= 0; i--) {
+                    free(sampler.rings[i].buf);
+                }
+                free(sampler.rings);
+                sampler.rings = 0;
+                return -1;
+            }
+        }
+    }
+
+    for (i = 0; i < sampler.num_cpus; i++) {
+        sampler.rings[i].count = 0;
+        sampler.rings[i].lost = 0;
+    }
+
+    if (mode != NK_SAMPLE_TIMER) {
+        if (!pmc || !pmc->valid) {
+            INFO("No usable performance counters, falling back to timer sampling\n");
+            mode = NK_SAMPLE_TIMER;
+            period = 0;
+        } else {
+            sampler.event = nk_pmc_create(pmc_event_for(mode));
+            if (!sampler.event || !sampler.event->bound ||
+                (mode != NK_SAMPLE_LLC_MISSES && !pmc_counts(sampler.event))) {
+                INFO("Counter for %s does not count, falling back to timer sampling\n",
+                     mode_names[mode]);
+                if (sampler.event) {
+                    nk_pmc_destroy(sampler.event);
+                    sampler.event = 0;
+                }
+                mode = NK_SAMPLE_TIMER;
+                period = 0;
+            }
+        }
+    }
+
+    if (!period) {
+        switch (mode) {
+            case NK_SAMPLE_CYCLES:       period = 1000000; break;
+            case NK_SAMPLE_INSTRUCTIONS: period = 1000000; break;
+            case NK_SAMPLE_LLC_MISSES:   period = 10000;   break;
+            default:                     period = 1000000; break; // 1 ms
+        }
+    }
+
+    if (mode == NK_SAMPLE_TIMER && !sys->cpus[0]->cpu_khz) {
+        ERROR("Timer sampling needs a calibrated TSC\n");
+        return -1;
+    }
+
+    sampler.mode = mode;
+    sampler.period = period;
+    sampler.cpu_khz = sys->cpus[0]->cpu_khz;
+    sampler.period_cycles = mode == NK_SAMPLE_TIMER ? (period * sampler.cpu_khz) / 1000000UL : 0;
+
+    if (mode != NK_SAMPLE_TIMER) {
+        if (register_int_handler(APIC_PC_INT_VEC, pmi_handler, 0)) {
+            ERROR("Cannot register performance counter interrupt handler\n");
+            nk_pmc_destroy(sampler.event);
+            sampler.event = 0;
+            return -1;
+        }
+    }
+
+    sampler.active = 1;
+
+    if (all_cpus(arm_cpu)) {
+        ERROR("Cannot arm all cpus\n");
+        nk_sampler_stop();
+        return -1;
+    }
+
+    INFO("Sampling %s every %lu%s on %d cpus\n",
+         mode_names[mode], period, mode == NK_SAMPLE_TIMER ? " ns" : "", sampler.num_cpus);
+
+    return mode;
+}
+
+
+int
+nk_sampler_stop (void)
+{
+    uint64_t total = 0, lost = 0;
+    int i;
+
+    if (!sampler.active) {
+        return -1;
+    }
+
+    sampler.active = 0;
+
+    all_cpus(disarm_cpu);
+
+    if (sampler.event) {
+        nk_pmc_destroy(sampler.event);
+        sampler.event = 0;
+    }
+
+    for (i = 0; i < sampler.num_cpus; i++) {
+        total += sampler.rings[i].count;
+        lost += sampler.rings[i].lost;
+    }
+
+    INFO("Stopped with %lu samples (%lu lost)\n", total, lost);
+
+    return 0;
+}
+
+
+//
+// Reporting
+//
+// Samples are attributed to the function containing the address.  A
+// return address points just past the call, so addr-1 is looked up to
+// stay inside the calling function.  Self counts come from the RIP,
+// inclusive counts from every distinct function in the chain, and
+// caller edges from adjacent pairs.
+//
+#define FUNC_TABLE_SIZE 4096
+#define EDGE_TABLE_SIZE 8192
+#define MAX_CHAIN       (NK_SAMPLE_DEPTH + 1)
+
+struct func_stat {
+    uint64_t  start;
+    char     *name;
+    uint64_t  self;
+    uint64_t  incl;
+};
+
+struct edge_stat {
+    uint64_t  caller;
+    uint64_t  callee;
+    uint64_t  count;
+};
+
+#define HASH(x) (((x) * 0x9e3779b97f4a7c15UL) >> 32)
+
+static struct func_stat *
+func_lookup (struct func_stat *tab, uint64_t start, char *name)
+{
+    uint64_t h = HASH(start);
+    int i;
+
+    for (i = 0; i < FUNC_TABLE_SIZE; i++) {
+        struct func_stat *f = &tab[(h + i) % FUNC_TABLE_SIZE];
+        if (f->start == start) {
+            return f;
+        }
+        if (!f->start) {
+            f->start = start;
+            f->name = name;
+            return f;
+        }
+    }
+
+    return 0;
+}
+
+
+static struct edge_stat *
+edge_lookup (struct edge_stat *tab, uint64_t caller, uint64_t callee)
+{
+    uint64_t h = HASH(caller ^ HASH(callee));
+    int i;
+
+    for (i = 0; i < EDGE_TABLE_SIZE; i++) {
+        struct edge_stat *e = &tab[(h + i) % EDGE_TABLE_SIZE];
+        if (e->caller == caller && e->callee == callee) {
+            return e;
+        }
+        if (!e->caller) {
+            e->caller = caller;
+            e->callee = callee;
+            return e;
+        }
+    }
+
+    return 0;
+}
+
+
+// keep the n largest (by self or inclusive) in descending order
+static unsigned
+select_top (struct func_stat *tab, struct func_stat **top, unsigned n, int by_incl)
+{
+    unsigned count = 0, k;
+    int i;
+
+#define KEY(f) (by_incl ? (f)->incl : (f)->self)
+    for (i = 0; i < FUNC_TABLE_SIZE; i++) {
+        if (!tab[i].start || !KEY(&tab[i])) {
+            continue;
+        }
+        if (count == n && KEY(&tab[i]) <= KEY(top[n - 1])) {
+            continue;
+        }
+        k = count < n ? count++ : n - 1;
+        while (k > 0 && KEY(top[k - 1]) < KEY(&tab[i])) {
+            top[k] = top[k - 1];
+            k--;
+        }
+        top[k] = &tab[i];
+    }
+#undef KEY
+
+    return count;
+}
+
+
+void
+nk_sampler_report (int n, int callgraph)
+{
+    struct func_stat *funcs;
+    struct edge_stat *edges;
+    struct func_stat **top;
+    uint64_t total = 0, lost = 0, unknown = 0, dropped = 0;
+    unsigned count, j;
+    int c, i, d;
+
+    if (!sampler.rings) {
+        nk_vc_printf("No samples - use perf record first\n");
+        return;
+    }
+
+    // the rings must not change underneath the report
+    if (sampler.active) {
+        nk_vc_printf("Stopping the sampler first\n");
+        nk_sampler_stop();
+    }
+
+    if (n <= 0) {
+        n = 20;
+    }
+
+    funcs = malloc(sizeof(*funcs) * FUNC_TABLE_SIZE);
+    edges = malloc(sizeof(*edges) * EDGE_TABLE_SIZE);
+    top = malloc(sizeof(*top) * n);
+
+    if (!funcs || !edges || !top) {
+        ERROR("Cannot allocate space for report\n");
+        goto out;
+    }
+
+    memset(funcs, 0, sizeof(*funcs) * FUNC_TABLE_SIZE);
+    memset(edges, 0, sizeof(*edges) * EDGE_TABLE_SIZE);
+
+    for (c = 0; c < sampler.num_cpus; c++) {
+        struct sample_ring *ring = &sampler.rings[c];
+        uint64_t s, num = ring->count;
+
+        lost += ring->lost;
+
+        for (s = 0; s < num; s++) {
+            struct nk_sample *smp = &ring->buf[s];
+            struct func_stat *chain[MAX_CHAIN];
+            int len = 0;
+
+            total++;
+
+            for (d = 0; d <= (int)smp->depth && d < MAX_CHAIN; d++) {
+                uint64_t addr = d ? smp->frames[d - 1] - 1 : smp->rip;
+                uint64_t start;
+                char *name = nk_link_lookup_addr(addr, &start);
+                struct func_stat *f;
+
+                if (!name) {
+                    if (!d) {
+                        unknown++;
+                    }
+                    break;
+                }
+
+                if (!(f = func_lookup(funcs, start, name))) {
+                    dropped++;
+                    break;
+                }
+
+                chain[len++] = f;
+            }
+
+            if (!len) {
+                continue;
+            }
+
+            chain[0]->self++;
+
+            // recursion would otherwise count a function more than once
+            for (i = 0; i < len; i++) {
+                for (d = 0; d < i && chain[d] != chain[i]; d++) { }
+                if (d == i) {
+                    chain[i]->incl++;
+                }
+            }
+
+            for (i = 1; i < len; i++) {
+                struct edge_stat *e = edge_lookup(edges, chain[i]->start, chain[i - 1]->start);
+                if (e) {
+                    e->count++;
+                }
+            }
+        }
+    }
+
+    nk_vc_printf("%lu samples of %s (period %lu%s), %lu lost, %lu outside the kernel\n",
+                 total, mode_names[sampler.mode], sampler.period,
+                 sampler.mode == NK_SAMPLE_TIMER ? " ns" : "", lost, unknown);
+
+    if (!total) {
+        goto out;
+    }
+
+    count = select_top(funcs, top, n, 0);
+
+    nk_vc_printf("%8s %7s %8s %7s  %s\n", "self", "%", "incl", "%", "function");
+    for (j = 0; j < count; j++) {
+        nk_vc_printf("%8lu %6lu%% %8lu %6lu%%  %s\n",
+                     top[j]->self, (top[j]->self * 100) / total,
+                     top[j]->incl, (top[j]->incl * 100) / total,
+                     top[j]->name);
+    }
+
+    if (callgraph) {
+        count = select_top(funcs, top, n, 1);
+
+        nk_vc_printf("\nCall graph (inclusive, with callers):\n");
+        for (j = 0; j < count; j++) {
+            nk_vc_printf("%8lu %6lu%%  %s\n",
+                         top[j]->incl, (top[j]->incl * 100) / total, top[j]->name);
+
+            // up to four hottest callers, largest first
+            for (c = 0; c < 4; c++) {
+                struct edge_stat *best = 0;
+                for (i = 0; i < EDGE_TABLE_SIZE; i++) {
+                    struct edge_stat *e = &edges[i];
+                    if (e->callee == top[j]->start && e->count &&
+                        (!best || e->count > best->count)) {
+                        best = e;
+                    }
+                }
+                if (!best) {
+                    break;
+                }
+                nk_vc_printf("%18lu  <- %s\n", best->count,
+                             func_lookup(funcs, best->caller, 0)->name);
+                // consumed, so the next pass finds the runner up
+                best->count = 0;
+            }
+        }
+    }
+
+    if (dropped) {
+        nk_vc_printf("%lu samples not fully attributed (function table full)\n", dropped);
+    }
+
+ out:
+    free(top);
+    free(edges);
+    free(funcs);
+}
+
+
+static int
+handle_perf (char * buf, void * priv)
+{
+    char what[32], arg[32];
+    uint64_t period = 0;
+    int n, mode;
+
+    n = sscanf(buf, "perf %31s %31s %lu", what, arg, &period);
+
+    if (n >= 1 && !strcmp(what, "record")) {
+        mode = NK_SAMPLE_CYCLES;
+        if (n >= 2) {
+            for (mode = 0; mode <= NK_SAMPLE_TIMER; mode++) {
+                if (!strcmp(arg, mode_names[mode])) {
+                    break;
+                }
+            }
+            if (mode > NK_SAMPLE_TIMER) {
+                nk_vc_printf("unknown event %s\n", arg);
+                return 0;
+            }
+        }
+        if (nk_sampler_start(mode, period) < 0) {
+            nk_vc_printf("cannot start sampling\n");
+        }
+        return 0;
+    }
+
+    if (n >= 1 && !strcmp(what, "stop")) {
+        if (nk_sampler_stop()) {
+            nk_vc_printf("not sampling\n");
+        }
+        return 0;
+    }
+
+    if (n >= 1 && (!strcmp(what, "report") || !strcmp(what, "callgraph"))) {
+        nk_sampler_report(n >= 2 ? atoi(arg) : 0, !strcmp(what, "callgraph"));
+        return 0;
+    }
+
+    nk_vc_printf("perf record [cycles|instructions|llc|timer] [period]\n"
+                 "perf stop | report [n] | callgraph [n]\n");
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl perf_impl = {
+    .cmd      = "perf",
+    .help_str = "perf record [cycles|instructions|llc|timer] [period] | stop | report [n] | callgraph [n]",
+    .handler  = handle_perf,
+};
+nk_register_shell_cmd(perf_impl);
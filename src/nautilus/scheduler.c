@@ -61,6 +61,9 @@
 #include <nautilus/random.h>
 #include <nautilus/backtrace.h>
 #include <nautilus/shell.h>
+#include <nautilus/histogram.h>
+#include <nautilus/pmc.h>
+#include <nautilus/trace.h>
 #include <dev/apic.h>
 #include <dev/gpio.h>
 
@@ -510,6 +513,10 @@ typedef struct nk_sched_thread_state {
     uint64_t miss_time_sum;   // sum of missed time
     uint64_t miss_time_sum2;  // sum of squares of missed time
 
+#ifdef NAUT_CONFIG_PROFILE
+    uint64_t wake_tsc;        // when last awakened, for the wakeup histogram
+#endif
+
     // the thread context itself
     struct nk_thread *thread;
 
@@ -607,6 +614,18 @@ static void print_thread(rt_thread *r, void *priv)
 		     r->miss_count);
 
 	nk_vc_printf(" [%s]", r->thread->aspace ? r->thread->aspace->name : "default");
+
+	{
+	    uint64_t counts[NK_THREAD_PMC_MAX];
+	    const char *names[NK_THREAD_PMC_MAX];
+	    int i, n = nk_thread_pmc_read(t, counts, 0, names, NK_THREAD_PMC_MAX);
+	    if (n > 0) {
+		nk_vc_printf(" pmc:");
+		for (i = 0; i < n; i++) {
+		    nk_vc_printf(" %s=%llu", names[i], counts[i]);
+		}
+	    }
+	}
 	
 	nk_vc_printf("\n");
 
@@ -710,6 +729,14 @@ void nk_sched_dump_cores(int cpu_arg)
     }
 }
 
+void nk_sched_get_tsc_sync(int cpu, uint64_t *sync_cycles, uint64_t *sync_time)
+{
+    struct tsc_info *tsc = &nk_get_nautilus_info()->sys.cpus[cpu]->sched_state->tsc;
+
+    *sync_cycles = tsc->sync_time_cycles;
+    *sync_time = tsc->sync_time;
+}
+
 void nk_sched_dump_time(int cpu_arg)
 {
     int cpu;
@@ -773,10 +800,8 @@ void nk_sched_stop_world()
     }
 
     
-    uint64_t num_cpus = nk_get_num_cpus();
     uint64_t my_cpu_id = my_cpu_id();
     uint64_t stopper = my_cpu_id+1;
-    uint64_t i;
 
 
     
@@ -794,11 +819,10 @@ void nk_sched_stop_world()
     preempt_enable();  // interrupts are still off - scheduler is not going to preempt us
     
     // kick everyone else to get them to stop
-    for (i=0;i<num_cpus;i++) { 
-	if (i!=my_cpu_id) {
-	    nk_sched_kick_cpu(i);
-	}
-    }
+    // a single broadcast IPI rather than one per cpu
+#ifdef NAUT_CONFIG_KICK_SCHEDULE
+    apic_bcast_ipi(per_cpu_get(apic), APIC_NULL_KICK_VEC);
+#endif
 
     // wait for them all to stop
     nk_counting_barrier(&stop_barrier);
@@ -1357,6 +1381,13 @@ static int    _sched_make_runnable(struct nk_thread *thread, int cpu, int admit,
     }
     return -1;
  out_good:
+    if (!admit) {
+	NK_TRACE(NK_TRACE_SCHED, NK_TRACE_EV_WAKEUP, thread->tid, cpu);
+    }
+#ifdef NAUT_CONFIG_PROFILE
+    // admission is a start, not a wakeup
+    t->wake_tsc = admit ? 0 : rdtsc();
+#endif
     if (!have_lock) { 
 	LOCAL_UNLOCK(s);
     }
@@ -2601,6 +2632,20 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	      my_cpu_id());
 
 	rt_n->switch_in_count++;
+
+	NK_TRACE(NK_TRACE_SCHED, NK_TRACE_EV_SWITCH, rt_c->thread->tid, rt_n->thread->tid);
+
+	// only threads that opted in have hardware counters to swap
+	if (rt_c->thread->pmc || rt_n->thread->pmc) {
+	    nk_thread_pmc_switch(rt_c->thread, rt_n->thread);
+	}
+
+#ifdef NAUT_CONFIG_PROFILE
+	if (rt_n->wake_tsc) {
+	    nk_hist_record(nk_hist_wakeup, rdtsc() - rt_n->wake_tsc);
+	    rt_n->wake_tsc = 0;
+	}
+#endif
 	      
 	// we are switching threads, start accounting for the new one
 	rt_n->cur_run_time=0;
@@ -2811,6 +2856,7 @@ int nk_sched_thread_move(struct nk_thread *t, int new_cpu, int block)
 
     // switch its cpu... 
     t->current_cpu = new_cpu;
+    NK_TRACE(NK_TRACE_SCHED, NK_TRACE_EV_MIGRATE, t->tid, ((uint64_t)old_cpu << 32) | new_cpu);
     // we will make it runnable after we drop the lock
     rc = 0;
 
@@ -3762,8 +3808,7 @@ static int _nk_task_wait(struct nk_task *task, void **output, struct nk_task_sta
 	    }
 	    if (t) {
 		// found task; run it and complete it
-		output = t->func(t->input);
-		nk_task_complete(t,output);
+		nk_task_complete(t,t->func(t->input));
 	    }
 	}
     }
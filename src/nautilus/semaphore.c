@@ -79,6 +79,42 @@ struct nk_semaphore {
     int                 prospective_count; // count blocked in timed down
 };
 
+// Uncontended fast paths
+//
+// The count is only ever changed atomically, so an up with no blocked
+// downers, or a down that will not block, can skip the lock and the
+// wait queue entirely.  A down that blocks decrements under the lock
+// and enqueues itself before releasing it, and an up that sees a
+// negative count takes the slow path, so it cannot miss that thread.
+// Timed downers do not decrement, but they advertise themselves in
+// prospective_count before checking the count, and an up checks
+// prospective_count after changing the count.
+
+static inline int fast_up(struct nk_semaphore *s)
+{
+    int old = s->count;
+
+    if (old<0 || !__sync_bool_compare_and_swap(&s->count,old,old+1)) {
+	return 0;
+    }
+    if (__sync_fetch_and_or(&s->prospective_count,0)) {
+	nk_wait_queue_wake_one(s->wait_queue);
+    }
+    return 1;
+}
+
+static inline int fast_down(struct nk_semaphore *s)
+{
+    int old;
+
+    while ((old = s->count)>0) {
+	if (__sync_bool_compare_and_swap(&s->count,old,old-1)) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
 struct nk_semaphore *nk_semaphore_create(char *name,
 					 int init_count,
 					 nk_semaphore_type_t type,
@@ -195,11 +231,14 @@ int nk_semaphore_try_up(struct nk_semaphore *s)
     
     int oldcount;
     int prospectives;
+    if (fast_up(s)) {
+	DEBUG("try up done %s - fast\n",s->name);
+	return 0;
+    }
     if (SEMAPHORE_TRY_LOCK(s)) {
 	return -1;
     }
-    oldcount = s->count;
-    s->count++;
+    oldcount = __sync_fetch_and_add(&s->count,1);
     prospectives = s->prospective_count;
     SEMAPHORE_UNLOCK(s);
     if (oldcount<0 || prospectives) {
@@ -220,10 +259,13 @@ void nk_semaphore_up(struct nk_semaphore *s)
     
     int oldcount;
     int prospectives;
+    if (fast_up(s)) {
+	DEBUG("up done %s - fast\n",s->name);
+	return;
+    }
     SEMAPHORE_LOCK(s);
-    oldcount = s->count;
+    oldcount = __sync_fetch_and_add(&s->count,1);
     prospectives = s->prospective_count;
-    s->count++;
     SEMAPHORE_UNLOCK(s);
     if (oldcount<0 || prospectives) {
 	// we just woke someone up
@@ -235,19 +277,10 @@ void nk_semaphore_up(struct nk_semaphore *s)
 
 int nk_semaphore_try_down(struct nk_semaphore *s)
 {
-    SEMAPHORE_LOCK_CONF;
-
     //DEBUG("try down %s\n",s->name);
     
-    int have=0;
-    if (SEMAPHORE_TRY_LOCK(s)) {
-	return -1;
-    }
-    if (s->count>0) {
-	s->count--;
-	have = 1;
-    }
-    SEMAPHORE_UNLOCK(s);
+    // lock free, so also safe in interrupt context
+    int have=fast_down(s);
     if (have) {
 	//DEBUG("try down %s succeeded\n",s->name);
     } else {
@@ -262,10 +295,14 @@ void nk_semaphore_down(struct nk_semaphore *s)
     SEMAPHORE_LOCK_CONF;
 
     DEBUG("down start %s\n",s->name);
+
+    if (fast_down(s)) {
+	DEBUG("down end %s - fast\n",s->name);
+	return;
+    }
     
     SEMAPHORE_LOCK(s);
-    s->count--;
-    if (s->count>=0) {
+    if (__sync_sub_and_fetch(&s->count,1)>=0) {
 	SEMAPHORE_UNLOCK(s);
 	DEBUG("down end %s - no wait\n",s->name);
 	return;
@@ -346,10 +383,8 @@ int nk_semaphore_down_timeout(struct nk_semaphore *s, uint64_t timeout_ns)
 
 int nk_semaphore_down_timeout(struct nk_semaphore *s, uint64_t timeout_ns)
 {
-    SEMAPHORE_LOCK_CONF;
     uint64_t start = nk_sched_get_realtime();
     uint64_t now = start;
-    int oldval=0;
     
     DEBUG("down timeout=%lu %s start\n",timeout_ns,s->name);
 
@@ -360,14 +395,7 @@ int nk_semaphore_down_timeout(struct nk_semaphore *s, uint64_t timeout_ns)
 	return 1;
     }
     
-    SEMAPHORE_LOCK(s);
-    oldval = s->count;
-    if (oldval>0) {
-	s->count--; // quick completion in this case
-    } 
-    SEMAPHORE_UNLOCK(s);
-
-    if (oldval>0) {
+    if (fast_down(s)) { // quick completion in this case
 	DEBUG("down timeout  %s ends with semaphore acquire\n",s->name);
 	return 0;
     } else {
@@ -37,6 +37,8 @@
 #include <nautilus/mm.h>
 #include <nautilus/fpu.h>
 #include <nautilus/percpu.h>
+#include <nautilus/histogram.h>
+#include <nautilus/trace.h>
 #include <dev/ioapic.h>
 #include <dev/apic.h>
 
@@ -274,11 +276,9 @@ static int xcall_handler(excp_entry_t * e, excp_vec_t v, void *state);
 static int
 smp_xcall_init_queue (struct cpu * core)
 {
-    core->xcall_q = nk_queue_create();
-    if (!core->xcall_q) {
-        ERROR_PRINT("Could not allocate xcall queue on cpu %u\n", core->id);
-        return -1;
-    }
+    core->xcall_mbox = NULL;
+    core->xcall_nowait_next = 0;
+    memset(core->xcall_nowait_pool, 0, sizeof(core->xcall_nowait_pool));
 
     return 0;
 }
@@ -459,10 +459,12 @@ nk_get_num_cpus (void)
 static void
 init_xcall (struct nk_xcall * x, void * arg, nk_xcall_func_t fun, int wait)
 {
+    x->next       = NULL;
     x->data       = arg;
     x->fun        = fun;
     x->xcall_done = 0;
     x->has_waiter = wait;
+    x->remaining  = NULL;
 }
 
 
@@ -483,49 +485,111 @@ mark_xcall_done (struct nk_xcall * x)
 }
 
 
-static int
-xcall_handler (excp_entry_t * e, excp_vec_t v, void *state) 
+/*
+ * No-wait xcalls need a descriptor that outlives the call to
+ * smp_xcall, so each sending cpu has a small pool of them.  The
+ * target releases a slot before invoking the function.
+ */
+static struct nk_xcall *
+get_nowait_xcall (void)
 {
-    nk_queue_t * xcq = per_cpu_get(xcall_q); 
-    struct nk_xcall * x = NULL;
-    nk_queue_entry_t * elm = NULL;
-
-    if (!xcq) {
-        ERROR_PRINT("Badness: no xcall queue on core %u\n", my_cpu_id());
-        goto out_err;
+    struct cpu * me = per_cpu_get(system)->cpus[my_cpu_id()];
+    uint32_t i;
+
+    while (1) {
+        for (i = 0; i < NK_XCALL_NOWAIT_SLOTS; i++) {
+            struct nk_xcall * x = 
+                &me->xcall_nowait_pool[(me->xcall_nowait_next + i) % NK_XCALL_NOWAIT_SLOTS];
+            if (!x->busy && __sync_bool_compare_and_swap(&x->busy, 0, 1)) {
+                me->xcall_nowait_next += i + 1;
+                return x;
+            }
+        }
+        // all our calls are still in flight
+        asm volatile ("pause");
     }
+}
 
-    elm = nk_dequeue_first_atomic(xcq);
-    x = container_of(elm, struct nk_xcall, xcall_node);
-    if (!x) {
-        ERROR_PRINT("No XCALL request found on core %u\n", my_cpu_id());
-        goto out_err;
-    }
 
-    if (x->fun) {
+/*
+ * Push onto the target's mailbox.  Returns nonzero if the mailbox
+ * was empty, in which case the caller must send the IPI.  Otherwise
+ * an IPI is already on its way and the handler will pick this up too.
+ */
+static inline int
+post_xcall (struct cpu * target, struct nk_xcall * x)
+{
+    struct nk_xcall * old;
 
-        // we ack the IPI before calling the handler funciton,
-        // because it may end up blocking (e.g. core barrier)
-        IRQ_HANDLER_END(); 
+#ifdef NAUT_CONFIG_PROFILE
+    x->post_tsc = rdtsc();
+#endif
 
-        x->fun(x->data);
+    do {
+        old = target->xcall_mbox;
+        x->next = old;
+    } while (!__sync_bool_compare_and_swap(&target->xcall_mbox, old, x));
 
-        /* we need to notify the waiter we're done */
-        if (x->has_waiter) {
-            mark_xcall_done(x);
+    return old == NULL;
+}
+
+
+static int
+xcall_handler (excp_entry_t * e, excp_vec_t v, void *state) 
+{
+    struct cpu * me = per_cpu_get(system)->cpus[my_cpu_id()];
+    struct nk_xcall * list, * rev, * x, * next;
+    nk_xcall_func_t fun;
+    void * data;
+
+    // we ack the IPI before calling any handler function,
+    // because it may end up blocking (e.g. core barrier)
+    IRQ_HANDLER_END(); 
+
+    // take everything posted so far, and keep going until the
+    // mailbox stays empty
+    while ((list = __sync_lock_test_and_set(&me->xcall_mbox, NULL))) {
+
+        // mailbox is LIFO; run in the order posted
+        for (rev = NULL; list; list = next) {
+            next = list->next;
+            list->next = rev;
+            rev = list;
         }
 
-    } else {
-        ERROR_PRINT("No XCALL function found on core %u\n", my_cpu_id());
-        goto out_err;
-    }
+        for (x = rev; x; x = next) {
+            next = x->next;
+            fun  = x->fun;
+            data = x->data;
 
+            if (!fun) {
+                ERROR_PRINT("No XCALL function found on core %u\n", my_cpu_id());
+                continue;
+            }
 
-    return 0;
+#ifdef NAUT_CONFIG_PROFILE
+            nk_hist_record(nk_hist_xcall, rdtsc() - x->post_tsc);
+#endif
 
-out_err:
-    IRQ_HANDLER_END();
-    return -1;
+            NK_TRACE(NK_TRACE_XCALL, NK_TRACE_EV_XCALL, fun, data);
+
+            if (!x->has_waiter && !x->remaining) {
+                // no-wait - nobody looks at x after this
+                x->busy = 0;
+                fun(data);
+            } else {
+                fun(data);
+                /* we need to notify the waiter(s) we're done */
+                if (x->remaining) {
+                    __sync_fetch_and_sub(x->remaining, 1);
+                } else {
+                    mark_xcall_done(x);
+                }
+            }
+        }
+    }
+
+    return 0;
 }
 
 
@@ -548,13 +612,12 @@ smp_xcall (cpu_id_t cpu_id,
            uint8_t wait)
 {
     struct sys_info * sys = per_cpu_get(system);
-    nk_queue_t * xcq  = NULL;
     struct nk_xcall x;
     uint8_t flags;
 
     SMP_DEBUG("Initiating SMP XCALL from core %u to core %u\n", my_cpu_id(), cpu_id);
 
-    if (cpu_id > nk_get_num_cpus()) {
+    if (cpu_id >= nk_get_num_cpus()) {
         ERROR_PRINT("Attempt to execute xcall on invalid cpu (%u)\n", cpu_id);
         return -1;
     }
@@ -566,42 +629,107 @@ smp_xcall (cpu_id_t cpu_id,
         irq_enable_restore(flags);
 
     } else {
-        struct nk_xcall * xc = &x;
+        struct nk_xcall * xc = wait ? &x : get_nowait_xcall();
+
+        init_xcall(xc, arg, fun, wait);
 
-        if (!wait) {
-            xc = &(sys->cpus[cpu_id]->xcall_nowait_info);
+        if (post_xcall(sys->cpus[cpu_id], xc)) {
+            struct apic_dev * apic = per_cpu_get(apic);
+            apic_ipi(apic, sys->cpus[cpu_id]->apic->id, IPI_VEC_XCALL);
         }
 
-        init_xcall(xc, arg, fun, wait);
+        if (wait) {
+            wait_xcall(xc);
+        }
 
-        xcq = sys->cpus[cpu_id]->xcall_q;
-        if (!xcq) {
-            ERROR_PRINT("Attempt by cpu %u to initiate xcall on invalid xcall queue (for cpu %u)\n", 
-                        my_cpu_id(),
-                        cpu_id);
-            return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * smp_xcall_mask
+ *
+ * initiate a cross-core call on a set of cpus
+ *
+ * @mask: the cpus to execute the call on
+ * @fun: the function to invoke
+ * @arg: the argument to the function
+ * @wait: block until all the recievers finish executing the function
+ *
+ */
+int
+smp_xcall_mask (nk_cpu_mask_t * mask,
+                nk_xcall_func_t fun,
+                void * arg,
+                uint8_t wait)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct apic_dev * apic = per_cpu_get(apic);
+    uint32_t num_cpus = nk_get_num_cpus();
+    cpu_id_t me = my_cpu_id();
+    volatile uint64_t remaining = 0;
+    struct nk_xcall * nodes = NULL;
+    uint32_t count = 0, k = 0;
+    int bcast;
+    cpu_id_t i;
+    uint8_t flags;
+
+    for (i = 0; i < num_cpus; i++) {
+        if (i != me && nk_cpu_mask_test(mask, i)) {
+            count++;
         }
+    }
 
-        flags = irq_disable_save();
+    SMP_DEBUG("Initiating SMP XCALL from core %u to %u cores\n", me, count);
+
+    // one shorthand IPI reaches everyone else
+    bcast = count > 1 && count == num_cpus - 1;
 
-        if (!nk_queue_empty_atomic(xcq)) {
-            ERROR_PRINT("XCALL queue for core %u is not empty, bailing\n", cpu_id);
-            irq_enable_restore(flags);
+    if (wait && count) {
+        nodes = malloc(count * sizeof(struct nk_xcall));
+        if (!nodes) {
+            ERROR_PRINT("Cannot allocate xcall descriptors for %u cores\n", count);
             return -1;
         }
+        remaining = count;
+    }
 
-        nk_enqueue_entry_atomic(xcq, &(xc->xcall_node));
-
-        irq_enable_restore(flags);
+    for (i = 0; i < num_cpus; i++) {
+        struct nk_xcall * xc;
 
-        struct apic_dev * apic = per_cpu_get(apic);
+        if (i == me || !nk_cpu_mask_test(mask, i)) {
+            continue;
+        }
 
-        apic_ipi(apic, sys->cpus[cpu_id]->apic->id, IPI_VEC_XCALL);
+        xc = wait ? &nodes[k++] : get_nowait_xcall();
 
+        init_xcall(xc, arg, fun, 0);
         if (wait) {
-            wait_xcall(xc);
+            xc->remaining = &remaining;
         }
 
+        if (post_xcall(sys->cpus[i], xc) && !bcast) {
+            apic_ipi(apic, sys->cpus[i]->apic->id, IPI_VEC_XCALL);
+        }
+    }
+
+    if (bcast) {
+        apic_bcast_ipi(apic, IPI_VEC_XCALL);
+    }
+
+    if (nk_cpu_mask_test(mask, me)) {
+        flags = irq_disable_save();
+        fun(arg);
+        irq_enable_restore(flags);
+    }
+
+    if (wait && count) {
+        while (remaining) {
+            asm volatile ("pause");
+        }
+        free(nodes);
     }
 
     return 0;
@@ -37,6 +37,7 @@
 #include <nautilus/list.h>
 #include <nautilus/errno.h>
 #include <nautilus/mm.h>
+#include <nautilus/pmc.h>
 
 #ifdef NAUT_CONFIG_ENABLE_BDWGC
 #include <gc/bdwgc/bdwgc.h>
@@ -280,6 +281,209 @@ thread_setup_init_stack (nk_thread_t * t, nk_thread_fun_t fun, void * arg)
 static void nk_thread_brain_wipe(nk_thread_t *t);
 
 
+#ifdef NAUT_CONFIG_THREAD_CACHE
+//
+// Thread cache
+//
+// A destroyed thread leaves its descriptor and stack in the cache of
+// the CPU it was placed on, binned by stack size class (PAGE_SIZE <<
+// class), and creating a thread for that CPU takes them back without
+// going to the allocator.  Both were allocated for that CPU, so they
+// stay on its NUMA node.  When a CPU's bin is empty, we borrow from
+// another CPU in the same domain before falling back to reanimation
+// and allocation.  Stack sizes are rounded up to their class, so
+// any cached stack of a class fits any request for it.
+//
+#define THREAD_CACHE_CLASSES 10 // 4 KB through 2 MB
+
+struct thread_cache_entry {
+    struct thread_cache_entry *next;
+    void                      *stack;
+};
+
+struct thread_cache {
+    spinlock_t                 lock;
+    struct thread_cache_entry *free[THREAD_CACHE_CLASSES];
+    int                        count[THREAD_CACHE_CLASSES];
+} __attribute__((aligned(64)));
+
+static struct thread_cache thread_caches[NAUT_CONFIG_MAX_CPUS];
+
+// the class whose stacks are at least size bytes, or -1 if none
+static int thread_cache_class(nk_stack_size_t size)
+{
+    int c;
+
+    for (c=0; c<THREAD_CACHE_CLASSES; c++) {
+	if (size <= ((nk_stack_size_t)PAGE_SIZE << c)) {
+	    return c;
+	}
+    }
+    return -1;
+}
+
+static void thread_cache_push(int cpu, int c, void *t, void *stack)
+{
+    struct thread_cache *tc = &thread_caches[cpu];
+    struct thread_cache_entry *e = (struct thread_cache_entry *)t;
+    uint8_t flags = spin_lock_irq_save(&tc->lock);
+
+    e->stack = stack;
+    e->next = tc->free[c];
+    tc->free[c] = e;
+    tc->count[c]++;
+
+    spin_unlock_irq_restore(&tc->lock, flags);
+}
+
+static struct thread_cache_entry *thread_cache_pop(int cpu, int c)
+{
+    struct thread_cache *tc = &thread_caches[cpu];
+    struct thread_cache_entry *e;
+    uint8_t flags;
+
+    if (!tc->free[c]) {
+	return 0;
+    }
+
+    flags = spin_lock_irq_save(&tc->lock);
+    e = tc->free[c];
+    if (e) {
+	tc->free[c] = e->next;
+	tc->count[c]--;
+    }
+    spin_unlock_irq_restore(&tc->lock, flags);
+
+    return e;
+}
+
+// a zeroed descriptor with a stack of the given class size, or null
+static nk_thread_t *thread_cache_get(nk_stack_size_t stack_size, int cpu)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct thread_cache_entry *e;
+    nk_thread_t *t;
+    void *stack;
+    int c = thread_cache_class(stack_size);
+    int i;
+
+    if (c<0) {
+	return 0;
+    }
+
+    e = thread_cache_pop(cpu,c);
+
+    for (i=0; !e && i<sys->num_cpus; i++) {
+	if (i!=cpu && sys->cpus[i]->domain==sys->cpus[cpu]->domain) {
+	    e = thread_cache_pop(i,c);
+	}
+    }
+
+    if (!e) {
+	return 0;
+    }
+
+    stack = e->stack;
+    t = (nk_thread_t *)e;
+    memset(t, 0, sizeof(nk_thread_t));
+    t->stack = stack;
+    t->stack_size = (nk_stack_size_t)PAGE_SIZE << c;
+
+    return t;
+}
+
+// returns 1 if the cache took the thread's memory
+static int thread_cache_put(nk_thread_t *t)
+{
+    int c = thread_cache_class(t->stack_size);
+    int cpu = t->placement_cpu;
+
+    if (c<0 || t->stack_size != ((nk_stack_size_t)PAGE_SIZE << c) ||
+	cpu<0 || cpu>=NAUT_CONFIG_MAX_CPUS ||
+	thread_caches[cpu].count[c] >= NAUT_CONFIG_THREAD_CACHE_DEPTH) {
+	return 0;
+    }
+
+    thread_cache_push(cpu,c,t,t->stack);
+
+    return 1;
+}
+
+int nk_thread_cache_init(void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int i, j;
+
+    // every cache is usable, even if prewarming fails part way
+    for (i=0;i<sys->num_cpus;i++) {
+	spinlock_init(&thread_caches[i].lock);
+    }
+
+    for (i=0;i<sys->num_cpus;i++) {
+	for (j=0;j<NAUT_CONFIG_THREAD_CACHE_PREWARM;j++) {
+	    void *t = malloc_specific(sizeof(nk_thread_t),i);
+	    void *stack = malloc_specific(PAGE_SIZE,i);
+	    if (!t || !stack) {
+		THREAD_ERROR("Failed to pre-allocate thread for cache of CPU %d\n",i);
+		free(t);
+		free(stack);
+		return -1;
+	    }
+	    thread_cache_push(i,0,t,stack);
+	}
+    }
+
+    THREAD_INFO("Thread cache: %d threads pre-allocated per CPU\n",NAUT_CONFIG_THREAD_CACHE_PREWARM);
+
+    return 0;
+}
+
+#else
+
+int nk_thread_cache_init(void)
+{
+    return 0;
+}
+
+#endif
+
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+//
+// The bottom of every stack is filled with a pattern at creation,
+// and a thread whose pattern has changed by the time it is destroyed
+// or reused has run off its stack, corrupting whatever was below it.
+//
+#define THREAD_GUARD_WORDS 32
+#define THREAD_GUARD_MAGIC 0xdeadbeefb000b000ULL
+
+static void stack_guard_set(nk_thread_t *t)
+{
+    uint64_t *g = (uint64_t *)t->stack;
+    int i;
+
+    for (i=0;i<THREAD_GUARD_WORDS;i++) {
+	g[i] = THREAD_GUARD_MAGIC;
+    }
+}
+
+static void stack_guard_check(nk_thread_t *t)
+{
+    uint64_t *g = (uint64_t *)t->stack;
+    int i;
+
+    for (i=0;i<THREAD_GUARD_WORDS;i++) {
+	if (g[i] != THREAD_GUARD_MAGIC) {
+	    THREAD_ERROR("Thread %p (tid=%lu name=%s) overran its stack (%p-%p)\n",
+			 t, t->tid, t->name, t->stack, t->stack+t->stack_size);
+	    return;
+	}
+    }
+}
+#endif
+
+
+
 /****** EXTERNAL THREAD INTERFACE ******/
 
 
@@ -317,7 +521,18 @@ nk_thread_create (nk_thread_fun_t fun,
     int placement_cpu = bound_cpu<0 ? nk_sched_initial_placement() : bound_cpu;
     nk_stack_size_t required_stack_size = stack_size ? stack_size: PAGE_SIZE;
 
-    // First try to get a thread from the scheduler's pools
+#ifdef NAUT_CONFIG_THREAD_CACHE
+    // round up to the cache's size class so the stack can be reused
+    if (thread_cache_class(required_stack_size)>=0) {
+	required_stack_size = (nk_stack_size_t)PAGE_SIZE << thread_cache_class(required_stack_size);
+    }
+
+    // First try the placement CPU's cache, then the scheduler's pools
+    if ((t=thread_cache_get(required_stack_size,placement_cpu))) {
+	THREAD_DEBUG("Thread create from cache for CPU %d\n", placement_cpu);
+    } else
+#endif
+    // Try to get a thread from the scheduler's pools
     if ((t=nk_sched_reanimate(required_stack_size,
 			      placement_cpu))) {
 	// we have succeeded in reanimating a dead thread, so
@@ -358,6 +573,10 @@ nk_thread_create (nk_thread_fun_t fun,
     // we fail, we can safely free the thread the same as we
     // would if we were newly allocating it.  
 
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    stack_guard_set(t);
+#endif
+
     if (_nk_thread_init(t, t->stack, is_detached, bound_cpu, placement_cpu, get_cur_thread()) < 0) {
         THREAD_ERROR("Could not initialize thread\n");
         goto out_err;
@@ -367,6 +586,12 @@ nk_thread_create (nk_thread_fun_t fun,
 
     // a thread joins its creator's address space 
     t->aspace = get_cur_thread()->aspace;
+
+    // and may count its creator's hardware events
+    if (nk_thread_pmc_inherit(t, get_cur_thread())) {
+        THREAD_ERROR("Could not inherit per-thread counters\n");
+        goto out_err;
+    }
     
     t->fun = fun;
     t->input = input;
@@ -397,6 +622,7 @@ out_err:
     if (t->sched_state) { 
 	nk_sched_thread_state_deinit(t);
     }
+    nk_thread_pmc_release(t);
 
 #ifdef NAUT_CONFIG_ENABLE_BDWGC
     if (t->gc_state) {
@@ -570,6 +796,11 @@ void nk_thread_exit (void * retval)
 
     THREAD_DEBUG("TLS exit complete\n");
 
+    /* stop our per-thread counters while we are still on this CPU */
+    if (me->pmc) {
+	nk_thread_pmc_disable();
+    }
+
     // lock out anyone else looking at my wait queue
     // we need to do this before we change our own state
     // so we can avoid racing with someone who is attempting
@@ -656,12 +887,23 @@ nk_thread_destroy (nk_thread_id_t t)
     
     nk_sched_thread_state_deinit(thethread);
 
+    nk_thread_pmc_release(thethread);
+
 #ifdef NAUT_CONFIG_ENABLE_BDWGC
     nk_gc_bdwgc_thread_state_deinit(thethread);
 #endif
 
-    free(thethread->stack);
-    free(thethread);
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    stack_guard_check(thethread);
+#endif
+
+#ifdef NAUT_CONFIG_THREAD_CACHE
+    if (!thread_cache_put(thethread))
+#endif
+    {
+	free(thethread->stack);
+	free(thethread);
+    }
     
     preempt_enable();
 }
@@ -713,6 +955,12 @@ static void nk_thread_brain_wipe(nk_thread_t *t)
     nk_gc_bdwgc_thread_state_deinit(thethread);
 #endif
 
+    nk_thread_pmc_release(thethread);
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    stack_guard_check(thethread);
+#endif
+
     // nothing else is freed
 
     // do only absolutely minimal cleanup so we don't need to zero the whole thing
@@ -0,0 +1,506 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/smp.h>
+#include <nautilus/thread.h>
+#include <nautilus/shell.h>
+#include <nautilus/tlb.h>
+
+#define INFO(fmt, args...)  INFO_PRINT("tlb: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("tlb: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("tlb: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_DEBUG_ASPACES
+#undef DEBUG
+#define DEBUG(fmt, args...)
+#endif
+
+#define CR3_NOFLUSH     (1ULL<<63)
+#define CR3_PCID_MASK   0xfffULL
+
+#define TLB_QUEUE_LEN   64
+#define TLB_ALL         ((addr_t)-1)   // entry meaning the whole context
+
+#define INVPCID_ADDR    0   // one address in one context
+#define INVPCID_CONTEXT 1   // one context
+#define INVPCID_ALL     3   // all contexts, except global translations
+
+struct tlb_entry {
+    uint64_t pcid;
+    addr_t   va;
+};
+
+// Each CPU's pending invalidations.  Initiators append to it and
+// take a ticket; the CPU drains it from the IPI (or while it waits
+// on its own shootdown) and then publishes the last ticket it covered
+struct tlb_queue {
+    spinlock_t        lock;
+    uint32_t          count;
+    int               overflow;    // entries were dropped => flush all
+    int               kicked;      // an IPI is on its way
+    volatile uint64_t posted;      // tickets handed out
+    volatile uint64_t done;        // tickets completed
+
+    struct tlb_entry  e[TLB_QUEUE_LEN];
+
+    // as initiator
+    uint64_t          batches;
+    uint64_t          pages;
+    uint64_t          ipis;
+    uint64_t          flush_cycles;
+    // as target
+    uint64_t          drains;
+    uint64_t          invalidations;
+    uint64_t          full_flushes;
+    uint64_t          drain_cycles;
+} __attribute__((aligned(64)));
+
+static struct tlb_queue queues[NAUT_CONFIG_MAX_CPUS];
+
+static int      have_invpcid;
+static uint32_t threshold = 32;
+
+
+static inline void invpcid(uint64_t type, uint64_t pcid, addr_t va)
+{
+    struct { uint64_t pcid; uint64_t va; } desc = { pcid, va };
+
+    asm volatile ("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
+
+// flush the whole current context
+static inline void flush_current(void)
+{
+    write_cr3(read_cr3() & ~CR3_NOFLUSH);
+}
+
+// Invalidate one entry on this CPU.  Without INVPCID we can only touch
+// the current context, but a CPU not currently in the entry's context
+// will flush it when it switches back in anyway
+static void invalidate(struct tlb_queue *q, uint64_t pcid, addr_t va, int pcide)
+{
+    uint64_t cur = pcide ? read_cr3() & CR3_PCID_MASK : 0;
+
+    if (have_invpcid && pcide) {
+	if (va == TLB_ALL) {
+	    invpcid(INVPCID_CONTEXT, pcid, 0);
+	    q->full_flushes++;
+	} else {
+	    invpcid(INVPCID_ADDR, pcid, va);
+	    q->invalidations++;
+	}
+    } else if (pcid == cur) {
+	if (va == TLB_ALL) {
+	    flush_current();
+	    q->full_flushes++;
+	} else {
+	    invlpg(va);
+	    q->invalidations++;
+	}
+    }
+}
+
+// run with interrupts off.  Invalidations are cheap enough to do
+// under the queue lock, which saves copying the entries out
+static void drain(void)
+{
+    struct tlb_queue *q = &queues[my_cpu_id()];
+    uint64_t start = rdtsc();
+    uint64_t ticket;
+    uint32_t i;
+    int pcide;
+
+    spin_lock(&q->lock);
+
+    q->kicked = 0;
+    ticket = q->posted;
+
+    if (ticket == q->done) {
+	spin_unlock(&q->lock);
+	return;
+    }
+
+    pcide = !!(read_cr4() & CR4_PCIDE);
+
+    if (q->overflow) {
+	if (have_invpcid) {
+	    invpcid(INVPCID_ALL, 0, 0);
+	} else {
+	    flush_current();
+	}
+	q->full_flushes++;
+    } else {
+	for (i=0;i<q->count;i++) {
+	    invalidate(q, q->e[i].pcid, q->e[i].va, pcide);
+	}
+    }
+
+    q->count = 0;
+    q->overflow = 0;
+    q->drains++;
+    q->drain_cycles += rdtsc() - start;
+    q->done = ticket;
+
+    spin_unlock(&q->lock);
+}
+
+static void drain_xcall(void *arg)
+{
+    drain();
+}
+
+// Append the batch to the CPU's queue.  Returns the ticket to wait
+// for, and sets *kick if the CPU needs an IPI to notice
+static uint64_t post(int cpu, nk_tlb_batch_t *b, int full, int *kick)
+{
+    struct tlb_queue *q = &queues[cpu];
+    uint64_t pcid = b->domain->pcid;
+    uint64_t ticket;
+    uint32_t i, n = full ? 1 : b->count;
+
+    spin_lock(&q->lock);
+    if (q->overflow || q->count + n > TLB_QUEUE_LEN) {
+	q->overflow = 1;
+    } else if (full) {
+	q->e[q->count].pcid = pcid;
+	q->e[q->count].va = TLB_ALL;
+	q->count++;
+    } else {
+	for (i=0;i<n;i++) {
+	    q->e[q->count].pcid = pcid;
+	    q->e[q->count].va = b->va[i];
+	    q->count++;
+	}
+    }
+    ticket = ++q->posted;
+    *kick = !q->kicked;
+    q->kicked = 1;
+    spin_unlock(&q->lock);
+
+    return ticket;
+}
+
+
+void nk_tlb_domain_init(nk_tlb_domain_t *d, uint64_t pcid)
+{
+    memset(d,0,sizeof(*d));
+    d->pcid = pcid;
+    // no CPU has this PCID's translations yet, but it may have stale
+    // ones from a previous owner of the PCID
+    memset(d->seen_gen,0xff,sizeof(d->seen_gen));
+}
+
+void nk_tlb_add_thread(nk_tlb_domain_t *d)
+{
+    __sync_fetch_and_add(&d->num_threads, 1);
+}
+
+void nk_tlb_remove_thread(nk_tlb_domain_t *d)
+{
+    __sync_fetch_and_sub(&d->num_threads, 1);
+}
+
+int nk_tlb_switch_to(nk_tlb_domain_t *d)
+{
+    int id = my_cpu_id();
+    uint64_t gen;
+
+    // a flusher either sees us active, or we see its generation
+    __sync_fetch_and_or(&d->active.bits[id/64], 1ULL << (id%64));
+
+    if (!d->pcid) {
+	return 0;
+    }
+
+    gen = d->gen;
+    if (d->seen_gen[id] == gen) {
+	return 1;
+    }
+    d->seen_gen[id] = gen;
+
+    return 0;
+}
+
+void nk_tlb_switch_from(nk_tlb_domain_t *d)
+{
+    int id = my_cpu_id();
+
+    __sync_fetch_and_and(&d->active.bits[id/64], ~(1ULL << (id%64)));
+}
+
+int nk_tlb_batch_flush(nk_tlb_batch_t *b)
+{
+    nk_tlb_domain_t *d = b->domain;
+    struct sys_info *sys = per_cpu_get(system);
+    struct tlb_queue *mq;
+    nk_cpu_mask_t targets, kicks;
+    uint64_t *tickets;
+    uint64_t start = rdtsc();
+    uint32_t i;
+    int me, kick, nkicks = 0, full;
+    uint8_t flags;
+
+    if (!b->count) {
+	return 0;
+    }
+
+    full = b->count > threshold || b->count > NK_TLB_BATCH_MAX;
+
+    // null => wait for each target to catch up with everything posted
+    tickets = (uint64_t *)malloc(sys->num_cpus*sizeof(uint64_t));
+
+    nk_cpu_mask_zero(&targets);
+    nk_cpu_mask_zero(&kicks);
+
+    __sync_fetch_and_add(&d->gen, 1);
+
+    flags = irq_disable_save();
+
+    me = my_cpu_id();
+    mq = &queues[me];
+
+    if (nk_cpu_mask_test(&d->active, me)) {
+	int pcide = !!(read_cr4() & CR4_PCIDE);
+	if (full) {
+	    invalidate(mq, d->pcid, TLB_ALL, pcide);
+	} else {
+	    for (i=0;i<b->count;i++) {
+		invalidate(mq, d->pcid, b->va[i], pcide);
+	    }
+	}
+    }
+
+    for (i=0;i<sys->num_cpus;i++) {
+	if (i!=me && nk_cpu_mask_test(&d->active,i)) {
+	    uint64_t t = post(i, b, full, &kick);
+	    if (tickets) {
+		tickets[i] = t;
+	    }
+	    nk_cpu_mask_set(&targets,i);
+	    if (kick) {
+		nk_cpu_mask_set(&kicks,i);
+		nkicks++;
+	    }
+	}
+    }
+
+    irq_enable_restore(flags);
+
+    if (nkicks) {
+	smp_xcall_mask(&kicks, drain_xcall, 0, 0);
+    }
+
+    // a target may be waiting on us in turn, so keep our own queue moving
+    for (i=0;i<sys->num_cpus;i++) {
+	if (nk_cpu_mask_test(&targets,i)) {
+	    uint64_t t = tickets ? tickets[i] : queues[i].posted;
+	    while (queues[i].done < t) {
+		flags = irq_disable_save();
+		if (mq->posted != mq->done) {
+		    drain();
+		}
+		irq_enable_restore(flags);
+		asm volatile ("pause");
+	    }
+	}
+    }
+
+    free(tickets);
+
+    mq->batches++;
+    mq->pages += b->count;
+    mq->ipis += nkicks;
+    mq->flush_cycles += rdtsc() - start;
+
+    DEBUG("Flushed %u pages (pcid %lu%s) with %d IPIs\n", b->count, d->pcid, full ? ", full" : "", nkicks);
+
+    return 0;
+}
+
+void nk_tlb_set_threshold(uint32_t pages)
+{
+    threshold = pages;
+}
+
+int nk_tlb_init(void)
+{
+    cpuid_ret_t ret;
+    struct cpuid_ext_feat_flags_ebx f;
+    int i;
+
+    for (i=0;i<NAUT_CONFIG_MAX_CPUS;i++) {
+	spinlock_init(&queues[i].lock);
+    }
+
+    cpuid(CPUID_BASIC_INFO, &ret);
+    if (ret.a >= CPUID_EXT_FEATURE_INFO) {
+	cpuid_sub(CPUID_EXT_FEATURE_INFO, 0, &ret);
+	f.val = ret.b;
+	have_invpcid = f.invpcid;
+    }
+
+    INFO("inited (%s, threshold %u pages)\n", have_invpcid ? "invpcid" : "invlpg", threshold);
+
+    return 0;
+}
+
+
+static void stats(int reset)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint32_t i;
+
+    for (i=0;i<sys->num_cpus;i++) {
+	struct tlb_queue *q = &queues[i];
+	if (reset) {
+	    q->batches = q->pages = q->ipis = q->flush_cycles = 0;
+	    q->drains = q->invalidations = q->full_flushes = q->drain_cycles = 0;
+	} else if (q->batches || q->drains) {
+	    nk_vc_printf("cpu %u: %lu batches (%lu pages, %lu IPIs, %lu cycles)"
+			 " %lu drains (%lu invalidations, %lu full, %lu cycles)\n",
+			 i, q->batches, q->pages, q->ipis, q->flush_cycles,
+			 q->drains, q->invalidations, q->full_flushes, q->drain_cycles);
+	}
+    }
+}
+
+
+//
+// Microbenchmark: put every other CPU in a dummy domain, and time
+// batches of various sizes from this one
+//
+struct bench_state {
+    nk_tlb_domain_t   domain;
+    volatile int      ready;
+    volatile int      stop;
+    nk_thread_id_t    tids[NAUT_CONFIG_MAX_CPUS];
+};
+
+static void bench_spin(void *in, void **out)
+{
+    struct bench_state *s = (struct bench_state *)in;
+    uint8_t flags;
+
+    flags = irq_disable_save();
+    nk_tlb_switch_to(&s->domain);
+    irq_enable_restore(flags);
+
+    __sync_fetch_and_add(&s->ready, 1);
+
+    while (!s->stop) {
+	asm volatile ("pause");
+    }
+
+    nk_tlb_switch_from(&s->domain);
+}
+
+static void bench(uint32_t iters)
+{
+    static const uint32_t sizes[] = { 1, 4, 16, 32, 64, 128 };
+    struct sys_info *sys = per_cpu_get(system);
+    struct bench_state *s;
+    struct tlb_queue *q;
+    nk_tlb_batch_t *b;
+    int me = my_cpu_id();
+    uint32_t i, j, k, n = 0;
+
+    s = (struct bench_state *)malloc(sizeof(*s));
+    b = (nk_tlb_batch_t *)malloc(sizeof(*b));
+    if (!s || !b) {
+	nk_vc_printf("Cannot allocate benchmark state\n");
+	free(s);
+	free(b);
+	return;
+    }
+    memset(s,0,sizeof(*s));
+    nk_tlb_domain_init(&s->domain, 0);
+
+    for (i=0;i<sys->num_cpus;i++) {
+	if (i!=me && !nk_thread_start(bench_spin, s, 0, 0, TSTACK_DEFAULT, &s->tids[n], i)) {
+	    n++;
+	}
+    }
+    while (s->ready < n) {
+	nk_yield();
+    }
+
+    nk_vc_printf("tlb shootdown to %u cpus, %u batches per size, threshold %u pages\n", n, iters, threshold);
+
+    q = &queues[me];
+
+    for (k=0;k<sizeof(sizes)/sizeof(sizes[0]);k++) {
+	uint64_t ipis = q->ipis, cycles = q->flush_cycles;
+
+	for (i=0;i<iters;i++) {
+	    nk_tlb_batch_init(b, &s->domain);
+	    for (j=0;j<sizes[k];j++) {
+		// nothing is mapped here, so invalidating it is harmless
+		nk_tlb_batch_add(b, 0xffff800000000000UL + j*PAGE_SIZE_4KB);
+	    }
+	    nk_tlb_batch_flush(b);
+	}
+
+	nk_vc_printf("  %3u pages: %lu cycles/batch, %lu IPIs/batch (x100)\n", sizes[k],
+		     (q->flush_cycles - cycles)/iters, (q->ipis - ipis)*100/iters);
+    }
+
+    s->stop = 1;
+    for (i=0;i<n;i++) {
+	nk_join(s->tids[i], 0);
+    }
+
+    free(b);
+    free(s);
+}
+
+static int handle_tlb(char *buf, void *priv)
+{
+    char what[32];
+    uint32_t arg;
+    int n;
+
+    n = sscanf(buf, "tlb %31s %u", what, &arg);
+
+    if (n >= 1 && !strcmp(what, "reset")) {
+	stats(1);
+    } else if (n == 2 && !strcmp(what, "threshold")) {
+	nk_tlb_set_threshold(arg);
+    } else if (n >= 1 && !strcmp(what, "bench")) {
+	bench(n == 2 ? arg : 1000);
+    } else {
+	stats(0);
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl tlb_impl = {
+    .cmd      = "tlb",
+    .help_str = "tlb [reset | threshold pages | bench [iters]]",
+    .handler  = handle_tlb,
+};
+nk_register_shell_cmd(tlb_impl);
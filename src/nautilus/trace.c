@@ -0,0 +1,458 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2026, agent <agent@local>
+ * Copyright (c) 2026, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: agent <agent@local>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/mm.h>
+#include <nautilus/cpu.h>
+#include <nautilus/smp.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/fs.h>
+#include <nautilus/shell.h>
+#include <nautilus/trace.h>
+
+#define INFO(fmt, args...)  INFO_PRINT("trace: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("trace: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("trace: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_DEBUG_TRACE
+#undef DEBUG
+#define DEBUG(fmt, args...)
+#endif
+
+#define DEFAULT_RECS (1UL << 16)   // 2 MB per CPU
+#define MAX_RECS     (1UL << 32)
+
+struct trace_ring {
+    struct nk_trace_rec *recs;
+    uint64_t             head;     // total records ever written
+} __attribute__((aligned(64)));
+
+volatile uint32_t nk_trace_mask;
+
+static struct trace_ring *rings;
+static int                num_rings;
+static uint64_t           ring_size;   // power of two
+
+static struct {
+    char     *name;
+    char     *cat;
+    uint32_t  mask;
+} events[NK_TRACE_EV_MAX] = {
+    [NK_TRACE_EV_SWITCH]    = { "switch",    "sched", NK_TRACE_SCHED },
+    [NK_TRACE_EV_WAKEUP]    = { "wakeup",    "sched", NK_TRACE_SCHED },
+    [NK_TRACE_EV_MIGRATE]   = { "migrate",   "sched", NK_TRACE_SCHED },
+    [NK_TRACE_EV_MALLOC]    = { "malloc",    "kmem",  NK_TRACE_KMEM },
+    [NK_TRACE_EV_FREE]      = { "free",      "kmem",  NK_TRACE_KMEM },
+    [NK_TRACE_EV_IRQ_ENTER] = { "irq",       "irq",   NK_TRACE_IRQ },
+    [NK_TRACE_EV_IRQ_EXIT]  = { "irq",       "irq",   NK_TRACE_IRQ },
+    [NK_TRACE_EV_XCALL]     = { "xcall",     "xcall", NK_TRACE_XCALL },
+    [NK_TRACE_EV_BLK_DONE]  = { "blk-done",  "dev",   NK_TRACE_DEV },
+    [NK_TRACE_EV_NET_DONE]  = { "net-done",  "dev",   NK_TRACE_DEV },
+};
+
+
+void
+nk_trace_record (uint32_t event, uint64_t a, uint64_t b)
+{
+    struct trace_ring *ring;
+    struct nk_trace_rec *r;
+    struct nk_thread *t;
+    uint8_t flags;
+
+    // with interrupts off, nothing else on this CPU can touch the ring
+    flags = irq_disable_save();
+
+    ring = &rings[my_cpu_id()];
+    r = &ring->recs[ring->head & (ring_size - 1)];
+
+    t = get_cur_thread();
+
+    r->tsc = rdtsc();
+    r->event = event;
+    r->tid = t ? t->tid : 0;
+    r->a = a;
+    r->b = b;
+
+    ring->head++;
+
+    irq_enable_restore(flags);
+}
+
+
+void
+nk_trace_irq_enter (uint64_t vec)
+{
+    NK_TRACE(NK_TRACE_IRQ, NK_TRACE_EV_IRQ_ENTER, vec, 0);
+}
+
+
+void
+nk_trace_irq_exit (uint64_t vec)
+{
+    NK_TRACE(NK_TRACE_IRQ, NK_TRACE_EV_IRQ_EXIT, vec, 0);
+}
+
+
+static void
+rings_free (void)
+{
+    int i;
+
+    for (i = 0; i < num_rings; i++) {
+        free(rings[i].recs);
+    }
+    free(rings);
+    rings = 0;
+    num_rings = 0;
+}
+
+
+static int
+rings_alloc (uint64_t size)
+{
+    int num_cpus = nk_get_nautilus_info()->sys.num_cpus;
+    int i;
+
+    rings = malloc(sizeof(struct trace_ring) * num_cpus);
+    if (!rings) {
+        ERROR("Cannot allocate rings\n");
+        return -1;
+    }
+    memset(rings, 0, sizeof(struct trace_ring) * num_cpus);
+
+    for (i = 0; i < num_cpus; i++) {
+        rings[i].recs = malloc_specific(sizeof(struct nk_trace_rec) * size, i);
+        if (!rings[i].recs) {
+            ERROR("Cannot allocate ring for cpu %d\n", i);
+            num_rings = i;
+            rings_free();
+            return -1;
+        }
+        num_rings++;
+    }
+
+    ring_size = size;
+
+    return 0;
+}
+
+
+int
+nk_trace_start (uint32_t mask, uint64_t recs_per_cpu)
+{
+    if (nk_trace_mask) {
+        ERROR("Trace is already running\n");
+        return -1;
+    }
+
+    if (!recs_per_cpu) {
+        recs_per_cpu = ring_size ? ring_size : DEFAULT_RECS;
+    }
+
+    if (recs_per_cpu > MAX_RECS) {
+        ERROR("Cannot trace into more than %lu records per cpu\n", MAX_RECS);
+        return -1;
+    }
+
+    // clz of zero is undefined, and one record is already a power of two
+    if (recs_per_cpu > 1) {
+        recs_per_cpu = 1UL << (64 - __builtin_clzl(recs_per_cpu - 1));
+    }
+
+    if (rings && recs_per_cpu != ring_size) {
+        rings_free();
+    }
+
+    if (!rings && rings_alloc(recs_per_cpu)) {
+        return -1;
+    }
+
+    INFO("Tracing categories 0x%x into %lu records per cpu\n", mask & NK_TRACE_ALL, ring_size);
+
+    __sync_synchronize();
+
+    nk_trace_mask = mask & NK_TRACE_ALL;
+
+    return 0;
+}
+
+
+static void
+nop (void *arg)
+{
+}
+
+
+int
+nk_trace_stop (void)
+{
+    nk_cpu_mask_t mask;
+    int i;
+
+    if (!nk_trace_mask) {
+        return -1;
+    }
+
+    nk_trace_mask = 0;
+
+    // records are written with interrupts off, so once every CPU has
+    // taken an xcall, none of them is still in the middle of one
+    nk_cpu_mask_zero(&mask);
+    for (i = 0; i < num_rings; i++) {
+        nk_cpu_mask_set(&mask, i);
+    }
+    smp_xcall_mask(&mask, nop, 0, 1);
+
+    return 0;
+}
+
+
+int
+nk_trace_clear (void)
+{
+    int i;
+
+    // the rings' owners may be writing them
+    if (nk_trace_mask) {
+        ERROR("Cannot clear while tracing, stop first\n");
+        return -1;
+    }
+
+    for (i = 0; i < num_rings; i++) {
+        rings[i].head = 0;
+    }
+
+    return 0;
+}
+
+
+//
+// Export
+//
+
+struct sink {
+    nk_fs_fd_t fd;
+    int        first;
+    int        err;
+};
+
+
+static void
+emit (struct sink *s, char *buf)
+{
+    if (s->fd == FS_BAD_FD) {
+        printk("%s", buf);
+    } else if (!s->err && nk_fs_write(s->fd, buf, strlen(buf)) != strlen(buf)) {
+        s->err = 1;
+    }
+}
+
+
+static void
+emit_event (struct sink *s, int cpu, uint64_t ns, struct nk_trace_rec *r)
+{
+    char buf[256];
+    char *ph;
+
+    if (r->event >= NK_TRACE_EV_MAX) {
+        return;
+    }
+
+    ph = r->event == NK_TRACE_EV_IRQ_ENTER ? "B" : r->event == NK_TRACE_EV_IRQ_EXIT ? "E" : "i";
+
+    // Chrome wants microseconds
+    snprintf(buf, sizeof(buf),
+             "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",%s\"ts\":%lu.%03lu,"
+             "\"pid\":0,\"tid\":%d,\"args\":{\"thread\":%u,\"a\":\"0x%lx\",\"b\":\"0x%lx\"}}\n",
+             s->first ? "" : ",",
+             events[r->event].name, events[r->event].cat, ph,
+             *ph == 'i' ? "\"s\":\"t\"," : "",
+             ns / 1000, ns % 1000, cpu, r->tid, r->a, r->b);
+
+    s->first = 0;
+    emit(s, buf);
+}
+
+
+int
+nk_trace_export (char *path)
+{
+    struct sink s = { .fd = FS_BAD_FD, .first = 1, .err = 0 };
+    uint64_t khz = nk_get_nautilus_info()->sys.cpus[0]->cpu_khz;
+    uint64_t total = 0, lost = 0;
+    char buf[128];
+    int cpu;
+
+    if (!rings) {
+        ERROR("Nothing has been traced\n");
+        return -1;
+    }
+
+    nk_trace_stop();
+
+    if (path) {
+        s.fd = nk_fs_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0);
+        if (FS_FD_ERR(s.fd)) {
+            ERROR("Cannot open %s\n", path);
+            return -1;
+        }
+    }
+
+    emit(&s, "{\"traceEvents\":[\n");
+
+    for (cpu = 0; cpu < num_rings; cpu++) {
+        struct trace_ring *ring = &rings[cpu];
+        uint64_t sync_cycles, sync_time;
+        uint64_t i, first;
+
+        snprintf(buf, sizeof(buf),
+                 "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"cpu %d\"}}\n",
+                 s.first ? "" : ",", cpu, cpu);
+        s.first = 0;
+        emit(&s, buf);
+
+        nk_sched_get_tsc_sync(cpu, &sync_cycles, &sync_time);
+
+        first = ring->head > ring_size ? ring->head - ring_size : 0;
+        lost += first;
+
+        for (i = first; i < ring->head; i++) {
+            struct nk_trace_rec *r = &ring->recs[i & (ring_size - 1)];
+            uint64_t ns = sync_time;
+
+            // records from before the TSCs were synchronized are
+            // placed at the synchronization point
+            if (r->tsc > sync_cycles && khz) {
+                uint64_t c = r->tsc - sync_cycles;
+                ns += (c / khz) * 1000000UL + ((c % khz) * 1000000UL) / khz;
+            }
+
+            emit_event(&s, cpu, ns, r);
+            total++;
+        }
+    }
+
+    emit(&s, "],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (s.fd != FS_BAD_FD) {
+        nk_fs_close(s.fd);
+    }
+
+    if (s.err) {
+        ERROR("Write to %s failed\n", path);
+        return -1;
+    }
+
+    INFO("Exported %lu records (%lu overwritten)\n", total, lost);
+
+    return 0;
+}
+
+
+static uint32_t
+parse_mask (char *s)
+{
+    uint32_t mask = 0;
+    char *c;
+
+    for (c = strtok(s, ","); c; c = strtok(0, ",")) {
+        if (!strcmp(c, "all")) {
+            mask |= NK_TRACE_ALL;
+        } else if (!strcmp(c, "sched")) {
+            mask |= NK_TRACE_SCHED;
+        } else if (!strcmp(c, "kmem")) {
+            mask |= NK_TRACE_KMEM;
+        } else if (!strcmp(c, "irq")) {
+            mask |= NK_TRACE_IRQ;
+        } else if (!strcmp(c, "xcall")) {
+            mask |= NK_TRACE_XCALL;
+        } else if (!strcmp(c, "dev")) {
+            mask |= NK_TRACE_DEV;
+        } else {
+            nk_vc_printf("unknown category %s\n", c);
+        }
+    }
+
+    return mask;
+}
+
+
+static int
+handle_trace (char * buf, void * priv)
+{
+    char what[32], arg[80];
+    uint64_t size = 0;
+    int n, i;
+
+    n = sscanf(buf, "trace %31s %79s %lu", what, arg, &size);
+
+    if (n >= 1 && !strcmp(what, "start")) {
+        uint32_t mask = n >= 2 ? parse_mask(arg) : NK_TRACE_ALL;
+        if (!mask || nk_trace_start(mask, size)) {
+            nk_vc_printf("cannot start trace\n");
+        }
+        return 0;
+    }
+
+    if (n >= 1 && !strcmp(what, "stop")) {
+        nk_trace_stop();
+        return 0;
+    }
+
+    if (n >= 1 && !strcmp(what, "clear")) {
+        if (nk_trace_clear()) {
+            nk_vc_printf("trace is running - stop it first\n");
+        }
+        return 0;
+    }
+
+    if (n >= 1 && !strcmp(what, "export")) {
+        if (nk_trace_export(n >= 2 ? arg : 0)) {
+            nk_vc_printf("export failed\n");
+        }
+        return 0;
+    }
+
+    if (n >= 1 && !strcmp(what, "status")) {
+        nk_vc_printf("mask 0x%x, %lu records per cpu\n", nk_trace_mask, ring_size);
+        for (i = 0; i < num_rings; i++) {
+            nk_vc_printf("cpu %d: %lu records\n", i, rings[i].head);
+        }
+        return 0;
+    }
+
+    nk_vc_printf("trace start [all|sched,kmem,irq,xcall,dev] [records]\n"
+                 "trace stop | clear | status | export [path]\n");
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl trace_impl = {
+    .cmd      = "trace",
+    .help_str = "trace start [categories] [records] | stop | clear | status | export [path]",
+    .handler  = handle_trace,
+};
+nk_register_shell_cmd(trace_impl);
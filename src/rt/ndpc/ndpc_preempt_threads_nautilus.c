@@ -34,7 +34,13 @@ static struct global_state {
 int ndpc_init_preempt_threads()
 {
     DEBUG("Init preempt threads\n");
-    nk_barrier_init(&global.barrier,nk_get_num_cpus());
+    if (nk_barrier_init_type(&global.barrier,nk_get_num_cpus(),NK_BARRIER_TREE)) {
+	ERROR("Failed to create tree barrier, using central barrier\n");
+	if (nk_barrier_init(&global.barrier,nk_get_num_cpus())) {
+	    ERROR("Failed to create barrier\n");
+	    return -1;
+	}
+    }
     return 0;
 }
 
@@ -24,6 +24,11 @@
 #include <nautilus/spinlock.h>
 #include <nautilus/scheduler.h>
 #include <nautilus/smp.h>
+#include <nautilus/barrier.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/mutex.h>
+#include <nautilus/numa.h>
+#include <nautilus/shell.h>
 #include <rt/openmp/gomp/gomp.h>
 
 
@@ -37,6 +42,119 @@
 #define INFO(fmt, args...) INFO_PRINT("gomp: " fmt, ##args)
 
 
+// Worksharing loops
+//
+// A team has a small ring of work shares, since nowait loops let
+// threads run ahead into later loops.  ws_seq counts the work shares a
+// thread has entered in its team.  The first thread to reach one claims
+// its slot and initializes it, and the last thread to leave it makes
+// the slot available to the work share a ring's length later.
+// Plain static loops are computed locally and need no work share.
+#define OMP_WS_RING 4
+
+// these match omp_sched_t
+#define OMP_SCHED_STATIC  1
+#define OMP_SCHED_DYNAMIC 2
+#define OMP_SCHED_GUIDED  3
+#define OMP_SCHED_AUTO    4
+
+struct omp_ws {
+    volatile long      next;     // chunk dispenser, alone on its line
+    char               pad0[56];
+    volatile long      ordered;  // start of the chunk that may run ordered
+    char               pad1[56];
+    volatile long      avail;    // seq that may claim the slot, -1 => claimed
+    volatile long      ready;    // seq+1 once initialized
+    volatile int       left;     // threads done with it
+    int                fast;     // fetch-and-add dispensing cannot overflow
+} __attribute__((aligned(64)));
+
+struct omp_loop {
+    struct omp_ws     *ws;       // null for a plain static loop
+    long               seq;      // of the work share
+    long               start;
+    long               end;
+    long               incr;
+    long               chunk;
+    long               n;        // iterations
+    long               trip;     // static: chunks we have taken
+    long               cur_start; // ordered: the chunk we hold
+    long               cur_end;
+    int                sched;
+    int                ordered;
+    int                pending;  // enter the loop when dispatched
+};
+
+
+// Tasks
+//
+// Deferred tasks go on the creating thread's deque in its team, from
+// which idle team members steal, and are run at task scheduling points
+// (taskwait, taskgroup end, barriers).  A thread that is not in a team
+// of more than one runs its tasks immediately, as does a thread whose
+// deque is full.  Dependences are tracked among siblings, in a table
+// in the parent keyed by address.
+#define OMP_DEQUE_SIZE   256  // power of two
+#define OMP_DEP_BUCKETS  64
+
+// GOMP_task / GOMP_taskloop flags
+#define OMP_TASK_FLAG_FINAL     (1 << 1)
+#define OMP_TASK_FLAG_DEPEND    (1 << 3)
+#define OMP_TASK_FLAG_PRIORITY  (1 << 5)
+#define OMP_TASK_FLAG_UP        (1 << 8)
+#define OMP_TASK_FLAG_GRAINSIZE (1 << 9)
+#define OMP_TASK_FLAG_IF        (1 << 10)
+#define OMP_TASK_FLAG_NOGROUP   (1 << 11)
+
+struct omp_taskgroup {
+    volatile long          count;    // unfinished tasks in the group
+    struct omp_taskgroup  *prev;     // enclosing group in the same task
+};
+
+struct omp_dep {
+    void                  *addr;
+    struct omp_task       *last_out;
+    struct omp_task      **readers;  // since last_out
+    int                    num_readers;
+    int                    max_readers;
+    struct omp_dep        *next;
+};
+
+struct omp_task {
+    void                 (*fn)(void *);
+    void                  *data;
+    struct omp_pool       *team;     // null if run immediately
+    struct omp_task       *parent;
+    struct omp_taskgroup  *group;    // the group we count against
+    struct omp_taskgroup  *cur_group; // innermost group open in our body
+    volatile long          children; // unfinished children, for taskwait
+    volatile long          refs;     // ourselves and unfinished children
+    volatile long          npred;    // unfinished predecessors
+    int                    priority;
+    int                    final;
+    int                    implicit;
+    int                    undeferred;
+    int                    lost_groups; // taskgroups we could not allocate
+    spinlock_t             lock;     // protects done and succ
+    int                    done;
+    int                    num_succ;
+    int                    max_succ;
+    struct omp_task      **succ;
+    struct omp_dep       **deps;     // of our children, lazily allocated
+    struct omp_task       *next;     // priority queue
+};
+
+// Chase-Lev work-stealing deque - the owner pushes and pops at the
+// bottom, thieves take from the top
+struct omp_deque {
+    volatile long          top;
+    char                   pad0[56];
+    volatile long          bottom;
+    char                   pad1[56];
+    struct omp_task       *tasks[OMP_DEQUE_SIZE];
+} __attribute__((aligned(64)));
+
+
 // this is hanging off the "input" argument
 // for a nautilus thread and it supplies the metadata
 // that would be usually kept in TLS in a pthread implementation
@@ -55,8 +173,218 @@ struct omp_thread
     int      thread_num;
     void     *cur_single;
     struct omp_thread *team_leader;
-    nk_counting_barrier_t team_barrier;
+    nk_barrier_t      *team_barrier; // of our current team, null if alone
     struct nk_thread  *thread;
+#define OMP_MAX_NEST 8
+    int                depth;     // regions we are currently the master of
+    struct omp_pool   *pools[OMP_MAX_NEST]; // our hot team at each depth
+    struct omp_serial *serial;    // innermost region we are running alone
+    int                sched_kind;  // for schedule(runtime), 0 => static
+    long               sched_chunk;
+    struct omp_ws     *ws_ring;   // our team's work shares, null if alone
+    long               ws_seq;    // work shares we have entered in the team
+    struct omp_loop    loop;      // the loop we are executing
+    struct omp_ws      solo_ws;   // our work share when we are alone
+    struct omp_pool   *task_team; // whose deques we use, null => run tasks now
+    struct omp_task   *cur_task;  // the task we are executing
+    struct omp_task    implicit;  // our implicit task as a worker or initial thread
+    long               red_seq;   // team reductions we have done
+};
+
+
+//
+// Thread placement (OMP_PLACES and OMP_PROC_BIND)
+//
+// A place is a set of CPUs: a single CPU ("threads"), the hardware
+// threads of one core ("cores"), or the CPUs of one NUMA domain
+// ("sockets").  Places are numbered in the order of their first CPU.
+// Team thread i is bound to a place relative to the master's place m,
+// out of P places, in a team of T threads:
+//
+//   close:   m+i when T<=P, otherwise T/P consecutive threads per place
+//   spread:  m+i*P/T, spacing the team evenly over all the places
+//   master:  m for every thread
+//
+// Threads that share a place take its CPUs round-robin, starting at
+// the master's CPU in the master's place.  The result depends only on
+// the policy, the places, the master's CPU, and the team size, so a
+// hot team worker lands on the same CPU region after region, and the
+// memory it first touched stays local to it.  A hot team keeps the
+// master CPU it was built for while the master stays in that place.
+//
+#define OMP_PLACES_THREADS 0
+#define OMP_PLACES_CORES   1
+#define OMP_PLACES_SOCKETS 2
+
+static int omp_places_kind = OMP_PLACES_THREADS;
+static int omp_bind = omp_proc_bind_close;
+static int omp_num_places = 0;  // 0 => not built yet
+static int omp_place_of[NAUT_CONFIG_MAX_CPUS];     // cpu => place
+static int omp_place_start[NAUT_CONFIG_MAX_CPUS+1]; // place => first index in omp_place_cpus
+static int omp_place_cpus[NAUT_CONFIG_MAX_CPUS];   // cpus, grouped by place
+
+static uint64_t place_key(struct cpu *c)
+{
+    switch (omp_places_kind) {
+    case OMP_PLACES_CORES:
+	// no topology => each CPU is its own core
+	return c->coord ? ((uint64_t)c->coord->pkg_id<<32) | c->coord->core_id : c->id;
+    case OMP_PLACES_SOCKETS:
+	return c->domain ? c->domain->id : 0;
+    default:
+	return c->id;
+    }
+}
+
+static void places_build(void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t keys[NAUT_CONFIG_MAX_CPUS];
+    int count[NAUT_CONFIG_MAX_CPUS];
+    int n = sys->num_cpus;
+    int np = 0;
+    int i, j;
+
+    for (i=0;i<n;i++) {
+	uint64_t k = place_key(sys->cpus[i]);
+	for (j=0;j<np && keys[j]!=k;j++) {
+	}
+	if (j==np) {
+	    keys[np] = k;
+	    count[np++] = 0;
+	}
+	omp_place_of[i] = j;
+	count[j]++;
+    }
+
+    omp_place_start[0] = 0;
+    for (j=0;j<np;j++) {
+	omp_place_start[j+1] = omp_place_start[j] + count[j];
+	count[j] = omp_place_start[j];
+    }
+    for (i=0;i<n;i++) {
+	omp_place_cpus[count[omp_place_of[i]]++] = i;
+    }
+
+    omp_num_places = np;
+}
+
+static int place_size(int p)
+{
+    return omp_place_start[p+1] - omp_place_start[p];
+}
+
+// the CPU for thread i of a team of t whose master is on mcpu, or -1
+// if threads are unbound
+static int bind_cpu(int mcpu, int i, int t)
+{
+    int np, m, p, k, first, off;
+
+    if (omp_bind == omp_proc_bind_false) {
+	return -1;
+    }
+
+    if (!omp_num_places) {
+	places_build();
+    }
+
+    np = omp_num_places;
+    m = omp_place_of[mcpu];
+
+    if (omp_bind == omp_proc_bind_master) {
+	p = 0;
+	k = i;
+    } else if (t <= np) {
+	p = omp_bind == omp_proc_bind_spread ? (int)((long)i*np/t) : i;
+	k = 0;
+    } else {
+	// the first thread of place p is the first i with i*np/t == p
+	p = (int)((long)i*np/t);
+	first = (int)(((long)p*t + np - 1)/np);
+	k = i - first;
+    }
+
+    p = (m + p) % np;
+
+    // rotate the master's place so the master's own CPU comes first
+    off = 0;
+    if (p == m) {
+	for (off=0; omp_place_cpus[omp_place_start[p]+off] != mcpu; off++) {
+	}
+    }
+
+    return omp_place_cpus[omp_place_start[p] + (off + k) % place_size(p)];
+}
+
+// A master keeps its workers between parallel regions (a "hot team").
+// Each worker is bound to a CPU by the placement policy and parks on its dispatch word, first
+// spinning, since back-to-back regions are common, and then sleeping
+// on the pool's wait queue.  A master has a separate pool for each
+// region it is nested in, since the outer team's workers are busy.
+#define POOL_SPIN_CYCLES 200000
+
+struct omp_worker {
+    struct omp_thread  o;        // must be first - this is the thread's input
+    volatile uint64_t  dispatch; // bumped by the master to start a region
+    uint64_t           seen;     // last dispatch we started
+    volatile uint64_t  done;     // last dispatch we are completely out of
+    volatile int       quit;
+    volatile int       exited;
+    struct omp_pool   *pool;     // the pool we belong to
+    int                cpu;      // where we are bound, -1 if unbound
+};
+
+// what the master of a region had before it started the region
+struct omp_saved {
+    int                num_threads_in_team;
+    int                thread_num_in_team;
+    int                level;
+    int                num_threads_in_level;
+    int                thread_num;
+    void              *cur_single;
+    struct omp_thread *team_leader;
+    nk_barrier_t      *team_barrier;
+    struct omp_ws     *ws_ring;
+    long               ws_seq;
+    struct omp_loop    loop;
+    struct omp_pool   *task_team;
+    struct omp_task   *cur_task;
+    long               red_seq;
+};
+
+// a thread's contribution to a team reduction, in one of two buffers
+struct omp_red_slot {
+    volatile long      seq;      // reduction whose value is in val
+    char               val[NK_OMP_REDUCE_MAX];
+} __attribute__((aligned(64)));
+
+struct omp_pool {
+    struct omp_ws      ws[OMP_WS_RING];
+    volatile long      ntasks;   // created and not yet finished
+    spinlock_t         prio_lock;
+    struct omp_task   *prio;     // prioritized tasks, highest first
+    struct omp_task    master_task; // the master's implicit task
+    struct omp_deque  *deques[NAUT_CONFIG_MAX_CPUS+1]; // by thread_num_in_team
+    struct omp_red_slot *red[NAUT_CONFIG_MAX_CPUS+1];  // same, two each
+    nk_barrier_t       barrier;  // kept while the team size does not change
+    unsigned           barrier_count;
+    int                active;   // workers dispatched to the current region
+    struct omp_saved   saved;
+    int                num_workers;
+    int                master_cpu; // the binding is relative to this CPU
+    volatile int       sleepers;
+    nk_wait_queue_t   *wait_queue;
+    struct omp_worker *workers[NAUT_CONFIG_MAX_CPUS];
+};
+
+// a region that cannot have a pool (nested too deeply, or out of
+// memory) is run by its master alone, as a team of one
+struct omp_serial {
+    struct omp_ws      ws[OMP_WS_RING];
+    struct omp_task    master_task;
+    struct omp_saved   saved;
+    int                depth;    // the master's depth inside the region
+    struct omp_serial *prev;
 };
 
 
@@ -172,17 +500,58 @@ int omp_get_num_devices(void)
 
 // Returns the number of processors online on that device.
 //
-// WHAT DEVICE - it does not take an argument...
-// 
-// we will give them all of the processors, but we should
-// probably not give them zero, and probably not give them any hw
-// thread that interacts with it...
+// The device is the processor complex, and all of its CPUs are
+// available to OpenMP, spread over omp_get_num_places() places.
 int omp_get_num_procs(void)
 {
-    DEBUG("omp_get_num_procs()=%d GUESS\n", nk_get_num_cpus());
+    DEBUG("omp_get_num_procs()=%d\n", nk_get_num_cpus());
     return nk_get_num_cpus();
 }
 
+// Returns the number of places available.
+int omp_get_num_places(void)
+{
+    if (!omp_num_places) {
+	places_build();
+    }
+    DEBUG("omp_get_num_places()=%d\n", omp_num_places);
+    return omp_num_places;
+}
+
+// Returns the number of processors in the given place.
+int omp_get_place_num_procs(int place_num)
+{
+    if (place_num < 0 || place_num >= omp_get_num_places()) {
+	return 0;
+    }
+    return place_size(place_num);
+}
+
+// Fills ids with the (CPU) ids of the processors in the given place.
+void omp_get_place_proc_ids(int place_num, int *ids)
+{
+    int i;
+
+    for (i=0;i<omp_get_place_num_procs(place_num);i++) {
+	ids[i] = omp_place_cpus[omp_place_start[place_num]+i];
+    }
+}
+
+// Returns the place the calling thread is bound to, or -1 if it is
+// not bound to a place.
+int omp_get_place_num(void)
+{
+    struct nk_thread *t = get_cur_thread();
+
+    if (t->bound_cpu < 0) {
+	return -1;
+    }
+    if (!omp_num_places) {
+	places_build();
+    }
+    return omp_place_of[t->bound_cpu];
+}
+
 
 //   Returns the number of teams in the current team region.
 //
@@ -225,8 +594,8 @@ int omp_get_num_threads(void)
 // omp_proc_bind_close and omp_proc_bind_spread.
 omp_proc_bind_t omp_get_proc_bind(void)
 {
-    DEBUG("omp_get_proc_bind()=false - do not allow thread migration yet\n");
-    return 0;
+    DEBUG("omp_get_proc_bind()=%d\n", omp_bind);
+    return omp_bind;
 }
 
 
@@ -236,9 +605,13 @@ omp_proc_bind_t omp_get_proc_bind(void)
 //  chunk_size, is set to the chunk size.
 void omp_get_schedule(omp_sched_t *kind, int *chunk_size)
 {
-    DEBUG("comp_get_schedule()=sched_static?, chunk_size=1?\n");
-    *kind = 0;
-    *chunk_size = 1 ; //?
+    struct omp_thread *o = (struct omp_thread *) (get_cur_thread()->input);
+    int k = (!o || !o->sched_kind) ? OMP_SCHED_STATIC : o->sched_kind;
+    int c = !o ? 0 : o->sched_chunk;
+
+    DEBUG("omp_get_schedule()=%d, chunk_size=%d\n", k, c);
+    *kind = (omp_sched_t)(long)k;
+    *chunk_size = c;
 }
 
 // Returns the team number of the calling thread.
@@ -299,8 +672,11 @@ int omp_in_parallel(void)
 // what is the "final" abstraction here?   
 int omp_in_final(void)
 {
-    DEBUG("omp_in_final()=0 UNIMPLMENTED\n");
-    return 0;
+    struct omp_thread *o = (struct omp_thread *) (get_cur_thread()->input);
+    int f = o && o->cur_task && o->cur_task->final;
+
+    DEBUG("omp_in_final()=%d\n", f);
+    return f;
 }
 
 // This function returns true if currently running on the host device,
@@ -378,7 +754,22 @@ void omp_set_num_threads(int num_threads)
 // ignored.
 void omp_set_schedule(omp_sched_t kind, int chunk_size)
 {
-    DEBUG("omp_set_schedule(kind=%d, chunk_size=%d) => IGNORED FOR NOW\n", kind, chunk_size);
+    struct omp_thread *o = (struct omp_thread *) (get_cur_thread()->input);
+    int k = (int)(long)kind;
+
+    DEBUG("omp_set_schedule(kind=%d, chunk_size=%d)\n", k, chunk_size);
+
+    if (!o || (o->cookie != OMP_COOKIE)) {
+	ERROR("omp_set_schedule() from thread that is not an OMP thread\n");
+	return;
+    }
+
+    if (k < OMP_SCHED_STATIC || k > OMP_SCHED_AUTO) {
+	ERROR("Unknown schedule kind %d\n", k);
+	return;
+    }
+    o->sched_kind = k;
+    o->sched_chunk = k == OMP_SCHED_AUTO || chunk_size < 0 ? 0 : chunk_size;
 }
 
 
@@ -529,268 +920,1845 @@ double omp_get_wtime(void)
 // https://github.com/rose-compiler/rose-develop/tree/master/src/midend/programTransformation/ompLowering
 //
 
-static void parallel_start_wrapper(void *in, void **out)
-{
-    struct omp_thread *o = (struct omp_thread *)in;
-    char buf[32];
-
-    o->thread = get_cur_thread();
-    
-    o->thread->vc = o->thread->parent->vc;
-
-    snprintf(buf,32,"omp-%d-%d-%d",o->team,o->level,o->thread_num_in_team);
+static void pools_destroy(struct omp_thread *master);
+static void pool_destroy(struct omp_pool *pool);
+static void loop_enter(struct omp_thread *o);
 
-    nk_thread_name(o->thread,buf);
-    
-
-    DEBUG("Launch - thread cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", o->cookie, o->team, o->num_threads_in_team, o->thread_num_in_team, o->level, o->num_threads_in_level, o->f, o->in, o->thread_num, o->thread);
-
-    o->f(o->in);
+static inline void deque_init(struct omp_deque *d)
+{
+    d->top = 0;
+    d->bottom = 0;
+}
 
-    DEBUG("Finish - thread cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", o->cookie, o->team, o->num_threads_in_team, o->thread_num_in_team, o->level, o->num_threads_in_level, o->f, o->in, o->thread_num, o->thread);
+// owner only - fails if full
+static int deque_push(struct omp_deque *d, struct omp_task *t)
+{
+    long b = d->bottom;
 
-    free(o);
+    if (b - d->top >= OMP_DEQUE_SIZE) {
+	return -1;
+    }
+    d->tasks[b & (OMP_DEQUE_SIZE-1)] = t;
+    __asm__ __volatile__ ("" : : : "memory");
+    d->bottom = b+1;
+    return 0;
 }
 
-void GOMP_parallel_start(void (*f)(void*), void *d, unsigned numthreads)
+// owner only
+static struct omp_task *deque_pop(struct omp_deque *d)
 {
-    DEBUG("GOMP_parallel_start(f=%p,d=%p,numthreads=%u)\n", f, d, numthreads);
+    long b = d->bottom - 1;
+    long t;
+    struct omp_task *task;
 
-    struct omp_thread *p = (struct omp_thread*)(get_cur_thread()->input);
+    d->bottom = b;
+    __sync_synchronize();
+    t = d->top;
 
-    
-    if (!p || (p->cookie != OMP_COOKIE)) {
-	ERROR("GOMP_parallel_start() from thread that is not an OMP thread\n");
-	return;
+    if (t > b) {
+	d->bottom = b+1;
+	return 0;
     }
 
-    unsigned i;
+    task = d->tasks[b & (OMP_DEQUE_SIZE-1)];
 
-    if (!numthreads) { 
-	if (p->max_threads_in_team) {
-	    numthreads = p->max_threads_in_team;
-	} else {
-	    numthreads = nk_get_num_cpus();
+    if (t == b) {
+	// last one - race the thieves for it
+	if (!__sync_bool_compare_and_swap(&d->top,t,t+1)) {
+	    task = 0;
 	}
+	d->bottom = b+1;
     }
 
-    // configure myself
-
-    p->num_threads_in_team = numthreads;
-    p->num_threads_in_level = numthreads; // wrong
-    p->thread_num_in_team = 0; // wrong
-    p->thread_num = 0; //wrong?
-    p->team_leader = p;
+    return task;
+}
 
-    nk_counting_barrier_init(&p->team_barrier,p->num_threads_in_team);
+static struct omp_task *deque_steal(struct omp_deque *d)
+{
+    long t = d->top;
+    struct omp_task *task;
 
+    __asm__ __volatile__ ("" : : : "memory");
 
-    for (i=1;i<numthreads;i++) { 
-	struct omp_thread *c = (struct omp_thread *) malloc(sizeof(*c));
-	if (!c) { 
-	    ERROR("Failed to allocate block - running as function\n");
-	    f(d);
-	} else {
-	    memset(c,0,sizeof(*c));
-	    c->cookie=OMP_COOKIE;
-	    c->team = p->team;
-	    c->level = p->level+1;
-	    c->num_threads_in_team = numthreads; // wrong
-	    c->num_threads_in_level = numthreads; // wrong
-	    c->thread_num_in_team = i; // wrong
-	    c->thread_num = i; // wrong
-	    c->f=f;
-	    c->in=d;
-	    c->team_leader = p;
-	    DEBUG("thread %d: cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", i, c->cookie, c->team, c->num_threads_in_team, c->thread_num_in_team, c->level, c->num_threads_in_level, c->f, c->in, c->thread_num, c->thread);
-	    if (nk_thread_start(parallel_start_wrapper,
-				c,0,0,TSTACK_DEFAULT,0,-1)) {
-		DEBUG("failed to launch as thread, running as function\n");
-		free(c);
-		f(d);
-	    }
-	}
+    if (t >= d->bottom) {
+	return 0;
+    }
+    task = d->tasks[t & (OMP_DEQUE_SIZE-1)];
+    if (!__sync_bool_compare_and_swap(&d->top,t,t+1)) {
+	return 0;
     }
+    return task;
 }
 
-void GOMP_parallel_end()
+static void task_reset_implicit(struct omp_task *t)
 {
-    DEBUG("GOMP_parallel_end()\n");
-    nk_join_all_children(0);
-    DEBUG("GOMP_parallel_end() complete\n");
+    memset(t,0,sizeof(*t));
+    t->implicit = 1;
+    t->refs = 1;
 }
 
+static void deps_free(struct omp_task *t);
 
-// this is "any" - we will make it simply be the first thread in the team
-int GOMP_single_start()
+static void task_unref(struct omp_task *t)
 {
-    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
-
-    if (o->thread_num_in_team==0) { 
-	DEBUG("GOMP_single_start() => 1 (first thread in team)\n");
-	return 1;
-    } else {
-	DEBUG("GOMP_single_start() => 0 (not first thread in team)\n");
-	return 0;
+    if (t->implicit) {
+	return;
+    }
+    if (!__sync_sub_and_fetch(&t->refs,1)) {
+	deps_free(t);
+	free(t->succ);
+	free(t);
     }
 }
 
-void GOMP_parallel(void (*f)(void*), void *d, unsigned numthreads, unsigned flags)
+static void prio_push(struct omp_pool *team, struct omp_task *t)
 {
-    DEBUG("GOMP_parallel(f=%p, d=%p, numthreads=%u, flags=%x)\n",
-	  f,d,numthreads,flags);
-    GOMP_parallel_start(f,d,numthreads);
-    f(d);
-    GOMP_parallel_end();
-}
+    struct omp_task **cur;
 
+    spin_lock(&team->prio_lock);
+    for (cur = &team->prio; *cur && (*cur)->priority >= t->priority; cur = &(*cur)->next) { }
+    t->next = *cur;
+    *cur = t;
+    spin_unlock(&team->prio_lock);
+}
 
-// this is "any" - we will make it simply be the first thread in the team
-// other threads wait
-void *GOMP_single_copy_start()
+static struct omp_task *prio_pop(struct omp_pool *team)
 {
-    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+    struct omp_task *t;
 
-    if (o->thread_num_in_team==0) { 
-	o->cur_single=0;
-	DEBUG("GOMP_single_copy_start() => 0 (first thread in team)\n");
+    if (!team->prio) {
 	return 0;
-    } else {
-	DEBUG("GOMP_single_copy_start() [Waiting]\n");
-        nk_counting_barrier(&o->team_leader->team_barrier);
-	DEBUG("GOMP_single_copy_start() [Done]\n");
-        return o->team_leader->cur_single;
     }
+    spin_lock(&team->prio_lock);
+    t = team->prio;
+    if (t) {
+	team->prio = t->next;
+    }
+    spin_unlock(&team->prio_lock);
+    return t;
 }
 
-void GOMP_single_copy_end(void *data)
+static void task_execute(struct omp_thread *o, struct omp_task *t);
+
+// t's predecessors are done - queue it, or run it if we cannot
+static void task_ready(struct omp_thread *o, struct omp_task *t)
 {
-    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
-    DEBUG("GOMP_single_copy_end(%p) (start)\n",data);
-    o->cur_single = data;
-    nk_counting_barrier(&o->team_barrier);
-    DEBUG("GOMP_single_copy_end(%p) (end)\n",data);
-}
-    
-void GOMP_barrier()
-{ 
-    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
-    DEBUG("GOMP_barrier (start)\n");
-    nk_counting_barrier(&o->team_leader->team_barrier);
-    DEBUG("GOMP_barrier (end)\n");
+    if (t->undeferred) {
+	// its creator is waiting to run it
+	return;
+    }
+    if (t->priority > 0) {
+	prio_push(t->team,t);
+	return;
+    }
+    if (o->task_team != t->team ||
+	deque_push(t->team->deques[o->thread_num_in_team],t)) {
+	task_execute(o,t);
+    }
 }
 
+static void task_complete(struct omp_thread *o, struct omp_task *t)
+{
+    struct omp_pool *team = t->team;
+    struct omp_task *parent = t->parent;
+    int i;
+
+    // release our successors
+    spin_lock(&t->lock);
+    t->done = 1;
+    spin_unlock(&t->lock);
+    for (i=0;i<t->num_succ;i++) {
+	if (!__sync_sub_and_fetch(&t->succ[i]->npred,1)) {
+	    task_ready(o,t->succ[i]);
+	}
+    }
 
-static spinlock_t gomp_global_lock=0;
+    if (t->group) {
+	__sync_fetch_and_sub(&t->group->count,1);
+    }
+    __sync_fetch_and_sub(&parent->children,1);
+    if (team) {
+	__sync_fetch_and_sub(&team->ntasks,1);
+    }
 
-void GOMP_critical_start(void)
-{
-    DEBUG("GOMP_critical_start (start)\n");
-    spin_lock(&gomp_global_lock);
-    DEBUG("GOMP_critical_start (end)\n");
+    task_unref(parent);
+    task_unref(t);
 }
 
-void GOMP_critical_end(void)
+static void task_execute(struct omp_thread *o, struct omp_task *t)
 {
-    DEBUG("GOMP_critical_end\n");
-    spin_unlock(&gomp_global_lock);
+    struct omp_task *prev = o->cur_task;
+
+    o->cur_task = t;
+    t->fn(t->data);
+    o->cur_task = prev;
+
+    task_complete(o,t);
 }
 
+// run one queued task of our team, if there is one
+static int task_run_one(struct omp_thread *o)
+{
+    struct omp_pool *team = o->task_team;
+    struct omp_task *t;
+    int me, n, i;
 
-/*
-SYNCBENCH
+    if (!team || !team->ntasks) {
+	return 0;
+    }
 
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:212: undefined reference to `GOMP_loop_ordered_static_start'
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:212: undefined reference to `GOMP_ordered_start'
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:212: undefined reference to `GOMP_ordered_end'
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:214: undefined reference to `GOMP_loop_ordered_static_next'
-/home/pdinda/test/nautilus/src/test/ompbench/syncbench.c:214: undefined reference to `GOMP_loop_end_nowait'
-make: *** [nautilus.bin] Error 1
-*/
+    me = o->thread_num_in_team;
+    n = o->num_threads_in_team;
 
-/*
-   TASKBENCH
-src/built-in.o: In function `testParallelTaskGeneration._omp_fn.0':
-/home/pdinda/test/nautilus/src/test/ompbench/taskbench.c:116: undefined reference to `GOMP_task'
-ence to `GOMP_taskwait'
-*/
+    if (!(t = prio_pop(team)) && !(t = deque_pop(team->deques[me]))) {
+	for (i=1;i<n && !t;i++) {
+	    t = deque_steal(team->deques[(me+i) % n]);
+	}
+    }
 
+    if (!t) {
+	return 0;
+    }
 
-void GOMP_task (void (*fn) (void *), 
-		void *data, 
-		void (*cpyfn) (void *, void *),
-		long arg_size, 
-		long arg_align, 
-		int if_clause,
-		unsigned flags,
-		void **depend, 
-		int priority)
-{
-    struct omp_thread *p = (struct omp_thread*)(get_cur_thread()->input);
-    DEBUG("GOMP_task(fn=%p, data=%p, cpy=%p, arg_size=%ld arg_align=%ld if=%d flags=0x%x depend=%p priority=%d\n",
-	  fn, data, cpyfn, arg_size, arg_align, if_clause, flags, depend, priority);
+    task_execute(o,t);
+    return 1;
+}
 
-    struct omp_thread *c = (struct omp_thread *) malloc(sizeof(*c));
-    if (!c) { 
-	ERROR("Failed to allocate block\n");
-    } else {
-	memset(c,0,sizeof(*c));
-	
-	c->cookie=OMP_COOKIE;
-	c->team = p->team;
-	c->level = p->level+1;
-	c->num_threads_in_team = 1; // wrong
-	c->num_threads_in_level = 1; // wrong
-	c->thread_num_in_team = 0; // wrong
-	c->thread_num = 0; // wrong
-	c->f=fn;
-	c->in=data;
-	c->team_leader = p;
-	
-	DEBUG("thread: cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", c->cookie, c->team, c->num_threads_in_team, c->thread_num_in_team, c->level, c->num_threads_in_level, c->f, c->in, c->thread_num, c->thread);
-	if (nk_thread_start(parallel_start_wrapper,
-			    c,0,0,TSTACK_DEFAULT,0,-1)) {
-	    ERROR("Failed to start thread for task, running as function\n");
-	    fn(data);
+// run tasks until the counter drops to zero
+static void task_wait_for(struct omp_thread *o, volatile long *count)
+{
+    while (*count) {
+	if (!task_run_one(o)) {
+	    __asm__ __volatile__ ("pause" : : : "memory");
 	}
     }
 }
 
-void GOMP_taskwait()
+// Team barrier, which is also a task scheduling point.  Every thread
+// helps until the team has no tasks left before it arrives.  A thread
+// creates tasks only before it arrives, and then works them off
+// itself if no one else does, so when the last thread arrives, all of
+// the team's tasks are done.
+static void team_barrier(struct omp_thread *o)
 {
-    DEBUG("GOMP_taskwait() [begin]\n");
-    nk_join_all_children(0);
-    DEBUG("GOMP_taskwait() [end]\n");
+    if (o->task_team) {
+	task_wait_for(o,&o->task_team->ntasks);
+    }
+    if (o->team_barrier) {
+	nk_barrier_wait_id(o->team_barrier,o->thread_num_in_team);
+    }
 }
 
-/*
-  SCHEDBENCH
-src/built-in.o: In function `testdynamicn._omp_fn.2':
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:118: undefined reference to `GOMP_loop_dynamic_next'
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:118: undefined reference to `GOMP_loop_end'
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:122: undefined reference to `GOMP_loop_dynamic_start'
-src/built-in.o: In function `testguidedn._omp_fn.3':
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:131: undefined reference to `GOMP_loop_guided_next'
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:131: undefined reference to `GOMP_loop_end'
-/home/pdinda/test/nautilus/src/test/ompbench/schedbench.c:135: undefined reference to `GOMP_loop_guided_start'
-make: *** [nautilus.bin] Error 1
-*/
+static int dispatch_check(void *state)
+{
+    struct omp_worker *w = (struct omp_worker *)state;
+    return w->dispatch != w->seen;
+}
 
+static void pool_wait_dispatch(struct omp_worker *w)
+{
+    struct omp_pool *pool = w->pool;
+    uint64_t start = rdtsc();
+
+    while (w->dispatch == w->seen) {
+	if (rdtsc() - start > POOL_SPIN_CYCLES) {
+	    // the master checks sleepers after bumping dispatch, and we
+	    // check dispatch under the queue lock after counting ourselves
+	    __sync_fetch_and_add(&pool->sleepers,1);
+	    nk_wait_queue_sleep_extended(pool->wait_queue, dispatch_check, w);
+	    __sync_fetch_and_add(&pool->sleepers,-1);
+	    start = rdtsc();
+	} else {
+	    __asm__ __volatile__ ("pause" : : : "memory");
+	}
+    }
+    w->seen = w->dispatch;
+}
 
-int nk_openmp_thread_init()
+static void pool_worker(void *in, void **out)
 {
-    struct nk_thread *t = get_cur_thread();
-    
-    DEBUG("nk_openmp_thread_init() of thread %p\n", t);
+    struct omp_worker *w = (struct omp_worker *)in;
+    char buf[32];
 
-    if (t->input) { 
-	DEBUG("Overriding current thread input...\n");
-    }
+    w->o.thread = get_cur_thread();
 
-    struct omp_thread *o = (struct omp_thread *)malloc(sizeof(*o));
+    snprintf(buf,32,"omp-pool-%d",my_cpu_id());
+    nk_thread_name(w->o.thread,buf);
 
-    if (!o) { 
-	ERROR("Cannot allocate space\n");
+    DEBUG("Pool worker %p starting on cpu %d\n", w, my_cpu_id());
+
+    while (1) {
+	pool_wait_dispatch(w);
+
+	if (w->quit) {
+	    break;
+	}
+
+	w->o.thread->vc = w->o.team_leader->thread->vc;
+
+	// combined parallel loops start with the loop already entered
+	if (w->o.loop.pending) {
+	    loop_enter(&w->o);
+	}
+
+	DEBUG("Dispatch - thread cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", w->o.cookie, w->o.team, w->o.num_threads_in_team, w->o.thread_num_in_team, w->o.level, w->o.num_threads_in_level, w->o.f, w->o.in, w->o.thread_num, w->o.thread);
+
+	w->o.f(w->o.in);
+
+	// end of region - the master waits here in GOMP_parallel_end.
+	// Once the team's tasks are done, nothing refers to our
+	// dependence table, and it must be gone before we arrive, since
+	// the master resets our implicit task for the next region
+	if (w->o.task_team) {
+	    task_wait_for(&w->o,&w->o.task_team->ntasks);
+	}
+	deps_free(&w->o.implicit);
+	team_barrier(&w->o);
+
+	// after this the master may rebuild the barrier
+	w->done = w->seen;
+    }
+
+    // our own hot teams for nested regions, if any
+    pools_destroy(&w->o);
+
+    DEBUG("Pool worker %p exiting\n", w);
+
+    w->exited = 1;
+}
+
+// make sure the pool for the master's current depth has at least
+// count workers, bound as threads 1..count of a team of count+1,
+// returning the pool, or null if we cannot have one
+static struct omp_pool *pool_grow(struct omp_thread *master, int count)
+{
+    struct omp_pool *pool = master->pools[master->depth];
+    int mcpu = my_cpu_id();
+    int i;
+
+    if (count > NAUT_CONFIG_MAX_CPUS) { 
+	count = NAUT_CONFIG_MAX_CPUS;
+    }
+
+    // a worker cannot be moved while it is parked, so if the binding
+    // has changed (new policy or places, different team size, or the
+    // master has moved to another place), start over with a fresh pool
+    if (pool && omp_bind != omp_proc_bind_false) {
+	if (!omp_num_places) {
+	    places_build();
+	}
+	// the master is not bound, and may wander within its place
+	if (omp_place_of[pool->master_cpu] == omp_place_of[mcpu]) {
+	    mcpu = pool->master_cpu;
+	}
+	for (i=0;i<count && i<pool->num_workers;i++) {
+	    if (pool->workers[i]->cpu != bind_cpu(mcpu,i+1,count+1)) {
+		DEBUG("Binding changed, rebuilding pool\n");
+		pool_destroy(pool);
+		master->pools[master->depth] = pool = 0;
+		break;
+	    }
+	}
+    }
+
+    if (!pool) {
+	char buf[NK_WAIT_QUEUE_NAME_LEN];
+	pool = (struct omp_pool *) malloc(sizeof(*pool));
+	if (!pool) {
+	    ERROR("Failed to allocate pool\n");
+	    return 0;
+	}
+	memset(pool,0,sizeof(*pool));
+	spinlock_init(&pool->prio_lock);
+	snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"omp-pool-%p-%d",master,master->depth);
+	pool->wait_queue = nk_wait_queue_create(buf);
+	pool->deques[0] = (struct omp_deque *) malloc(sizeof(struct omp_deque));
+	pool->red[0] = (struct omp_red_slot *) malloc(2*sizeof(struct omp_red_slot));
+	if (!pool->wait_queue || !pool->deques[0] || !pool->red[0]) {
+	    ERROR("Failed to allocate pool wait queue, deque, or reduction slots\n");
+	    if (pool->wait_queue) {
+		nk_wait_queue_destroy(pool->wait_queue);
+	    }
+	    free(pool->deques[0]);
+	    free(pool->red[0]);
+	    free(pool);
+	    return 0;
+	}
+	pool->master_cpu = mcpu;
+	master->pools[master->depth] = pool;
+    }
+
+    for (i=pool->num_workers; i<count; i++) {
+	struct omp_worker *w = (struct omp_worker *) malloc(sizeof(*w));
+	struct omp_deque *d = (struct omp_deque *) malloc(sizeof(*d));
+	struct omp_red_slot *r = (struct omp_red_slot *) malloc(2*sizeof(*r));
+	if (!w || !d || !r) {
+	    ERROR("Failed to allocate worker\n");
+	    free(w);
+	    free(d);
+	    free(r);
+	    break;
+	}
+	memset(w,0,sizeof(*w));
+	w->o.cookie = OMP_COOKIE;
+	w->pool = pool;
+	w->cpu = bind_cpu(mcpu,i+1,count+1);
+
+	if (nk_thread_start(pool_worker,w,0,1,TSTACK_DEFAULT,0,w->cpu)) {
+	    ERROR("Failed to launch pool worker\n");
+	    free(w);
+	    free(d);
+	    free(r);
+	    break;
+	}
+	pool->workers[i] = w;
+	pool->deques[i+1] = d;
+	pool->red[i+1] = r;
+	pool->num_workers++;
+    }
+
+    return pool;
+}
+
+static void pool_destroy(struct omp_pool *pool)
+{
+    int i;
+
+    for (i=0;i<pool->num_workers;i++) {
+	pool->workers[i]->quit = 1;
+	pool->workers[i]->dispatch++;
+    }
+    __sync_synchronize();
+    nk_wait_queue_wake_all(pool->wait_queue);
+
+    for (i=0;i<pool->num_workers;i++) {
+	while (!pool->workers[i]->exited) {
+	    nk_yield();
+	}
+	free(pool->workers[i]);
+    }
+
+    for (i=0;i<=pool->num_workers;i++) {
+	free(pool->deques[i]);
+	free(pool->red[i]);
+    }
+
+    if (pool->barrier_count) {
+	nk_barrier_destroy(&pool->barrier);
+    }
+    nk_wait_queue_destroy(pool->wait_queue);
+    free(pool);
+}
+
+static void pools_destroy(struct omp_thread *master)
+{
+    int i;
+
+    for (i=0;i<OMP_MAX_NEST;i++) {
+	if (master->pools[i]) {
+	    pool_destroy(master->pools[i]);
+	    master->pools[i] = 0;
+	}
+    }
+}
+
+static void save_team(struct omp_thread *p, struct omp_saved *s)
+{
+    s->num_threads_in_team = p->num_threads_in_team;
+    s->thread_num_in_team = p->thread_num_in_team;
+    s->level = p->level;
+    s->num_threads_in_level = p->num_threads_in_level;
+    s->thread_num = p->thread_num;
+    s->cur_single = p->cur_single;
+    s->team_leader = p->team_leader;
+    s->team_barrier = p->team_barrier;
+    s->ws_ring = p->ws_ring;
+    s->ws_seq = p->ws_seq;
+    s->loop = p->loop;
+    s->task_team = p->task_team;
+    s->cur_task = p->cur_task;
+    s->red_seq = p->red_seq;
+}
+
+static void restore_team(struct omp_thread *p, struct omp_saved *s)
+{
+    p->num_threads_in_team = s->num_threads_in_team;
+    p->thread_num_in_team = s->thread_num_in_team;
+    p->level = s->level;
+    p->num_threads_in_level = s->num_threads_in_level;
+    p->thread_num = s->thread_num;
+    p->cur_single = s->cur_single;
+    p->team_leader = s->team_leader;
+    p->team_barrier = s->team_barrier;
+    p->ws_ring = s->ws_ring;
+    p->ws_seq = s->ws_seq;
+    p->loop = s->loop;
+    p->task_team = s->task_team;
+    p->cur_task = s->cur_task;
+    p->red_seq = s->red_seq;
+}
+
+// start a region in a team of one, which must not see the enclosing
+// team's thread numbers, work shares, or barrier.  A combined loop is
+// then handed out entirely to the master
+static void parallel_serialize(struct omp_thread *p, struct omp_loop *loop)
+{
+    struct omp_serial *s = (struct omp_serial *) malloc(sizeof(*s));
+    int i;
+
+    if (!s) {
+	panic("gomp: cannot allocate serialized region\n");
+    }
+    memset(s,0,sizeof(*s));
+
+    save_team(p,&s->saved);
+    p->depth++;
+    s->depth = p->depth;
+    s->prev = p->serial;
+    p->serial = s;
+
+    p->num_threads_in_team = 1;
+    p->num_threads_in_level = 1;
+    p->thread_num_in_team = 0;
+    p->thread_num = 0;
+    p->level = s->saved.level+1;
+    p->cur_single = 0;
+    p->team_leader = p;
+    p->team_barrier = 0;
+    p->ws_ring = s->ws;
+    p->ws_seq = 0;
+    p->loop.pending = 0;
+    if (loop) {
+	p->loop = *loop;
+    }
+    p->task_team = 0;
+    p->cur_task = &s->master_task;
+    task_reset_implicit(&s->master_task);
+    p->red_seq = 0;
+
+    for (i=0;i<OMP_WS_RING;i++) {
+	s->ws[i].avail = i;
+    }
+}
+
+// loop, if not null, is a loop the whole team enters before running f
+static int parallel_start(void (*f)(void*), void *d, unsigned numthreads, struct omp_loop *loop)
+{
+    struct omp_thread *p = (struct omp_thread*)(get_cur_thread()->input);
+    struct omp_pool *pool;
+    
+    if (!p || (p->cookie != OMP_COOKIE)) {
+	ERROR("GOMP_parallel_start() from thread that is not an OMP thread\n");
+	return -1;
+    }
+
+    unsigned i;
+
+    if (p->depth >= OMP_MAX_NEST) {
+	ERROR("Parallel regions nested too deeply, serializing\n");
+	parallel_serialize(p,loop);
+	return 0;
+    }
+
+    if (!numthreads) { 
+	if (p->max_threads_in_team) {
+	    numthreads = p->max_threads_in_team;
+	} else {
+	    numthreads = nk_get_num_cpus();
+	}
+    }
+
+    // get the hot team ready, and shrink the team if we could not
+    pool = pool_grow(p,numthreads-1);
+    if (!pool) {
+	ERROR("No pool available, serializing\n");
+	parallel_serialize(p,loop);
+	return 0;
+    }
+    if (pool->num_workers < (int)numthreads-1) {
+	DEBUG("Only %d workers available, shrinking team\n", pool->num_workers);
+	numthreads = pool->num_workers+1;
+    }
+
+    save_team(p,&pool->saved);
+    p->depth++;
+
+    // configure myself
+
+    p->thread = get_cur_thread();
+    p->num_threads_in_team = numthreads;
+    p->num_threads_in_level = numthreads; // wrong
+    p->thread_num_in_team = 0; // wrong
+    p->thread_num = 0; //wrong?
+    p->level = pool->saved.level+1;
+    p->cur_single = 0;
+    p->team_leader = p;
+    p->team_barrier = 0;
+    p->ws_ring = pool->ws;
+    p->ws_seq = 0;
+    p->loop.pending = 0;
+    if (loop) {
+	p->loop = *loop;
+    }
+    p->task_team = numthreads > 1 ? pool : 0;
+    p->cur_task = &pool->master_task;
+    task_reset_implicit(&pool->master_task);
+    pool->active = numthreads-1;
+    pool->ntasks = 0;
+    pool->prio = 0;
+    p->red_seq = 0;
+    for (i=0;i<numthreads;i++) {
+	deque_init(pool->deques[i]);
+	pool->red[i][0].seq = 0;
+	pool->red[i][1].seq = 0;
+    }
+
+    // the previous region's work shares have all been left
+    for (i=0;i<OMP_WS_RING;i++) {
+	pool->ws[i].avail = i;
+	pool->ws[i].ready = 0;
+	pool->ws[i].left = 0;
+    }
+
+    if (numthreads > 1) {
+	// the barrier is kept as long as the team size does not change
+	if (pool->barrier_count != numthreads) {
+	    if (pool->barrier_count) {
+		// workers of the last region may still be leaving it
+		for (i=0;i<pool->barrier_count-1;i++) {
+		    while (pool->workers[i]->done != pool->workers[i]->dispatch) {
+			__asm__ __volatile__ ("pause" : : : "memory");
+		    }
+		}
+		nk_barrier_destroy(&pool->barrier);
+	    }
+	    // the combining tree keeps arrivals of nearby thread numbers local
+	    if (nk_barrier_init_type(&pool->barrier,numthreads,NK_BARRIER_TREE)) {
+		ERROR("Failed to create team barrier, using central barrier\n");
+		nk_barrier_init(&pool->barrier,numthreads);
+	    }
+	    pool->barrier_count = numthreads;
+	}
+	p->team_barrier = &pool->barrier;
+    }
+
+    for (i=1;i<numthreads;i++) { 
+	struct omp_worker *w = pool->workers[i-1];
+	struct omp_thread *c = &w->o;
+
+	c->team = p->team;
+	c->level = p->level;
+	c->num_threads_in_team = numthreads; // wrong
+	c->num_threads_in_level = numthreads; // wrong
+	c->thread_num_in_team = i; // wrong
+	c->thread_num = i; // wrong
+	c->f=f;
+	c->in=d;
+	c->team_leader = p;
+	c->team_barrier = p->team_barrier;
+	c->cur_single = 0;
+	c->ws_ring = pool->ws;
+	c->ws_seq = 0;
+	c->sched_kind = p->sched_kind;
+	c->sched_chunk = p->sched_chunk;
+	c->loop.pending = 0;
+	if (loop) {
+	    c->loop = *loop;
+	}
+	c->task_team = pool;
+	c->cur_task = &c->implicit;
+	c->red_seq = 0;
+	task_reset_implicit(&c->implicit);
+	DEBUG("thread %d: cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", i, c->cookie, c->team, c->num_threads_in_team, c->thread_num_in_team, c->level, c->num_threads_in_level, c->f, c->in, c->thread_num, c->thread);
+
+	__sync_synchronize();
+	w->dispatch++;
+    }
+
+    if (numthreads > 1) { 
+	__sync_synchronize();
+	if (pool->sleepers) {
+	    nk_wait_queue_wake_all(pool->wait_queue);
+	}
+    }
+
+    return 0;
+}
+
+void GOMP_parallel_start(void (*f)(void*), void *d, unsigned numthreads)
+{
+    DEBUG("GOMP_parallel_start(f=%p,d=%p,numthreads=%u)\n", f, d, numthreads);
+    parallel_start(f,d,numthreads,0);
+}
+
+void GOMP_parallel_end()
+{
+    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+    struct omp_pool *pool;
+
+    DEBUG("GOMP_parallel_end()\n");
+
+    if (!o || (o->cookie != OMP_COOKIE)) {
+	ERROR("GOMP_parallel_end() from thread that is not an OMP thread\n");
+	return;
+    }
+
+    o->depth--;
+
+    if (o->serial && o->serial->depth == o->depth+1) {
+	// we ran it alone, so our tasks have already run
+	struct omp_serial *s = o->serial;
+	deps_free(&s->master_task);
+	restore_team(o,&s->saved);
+	o->serial = s->prev;
+	free(s);
+	DEBUG("GOMP_parallel_end() complete (serialized)\n");
+	return;
+    }
+
+    pool = o->depth < OMP_MAX_NEST ? o->pools[o->depth] : 0;
+
+    if (pool) {
+	// the workers arrive here when they finish the region, and
+	// the team's tasks are done once we are all through
+	team_barrier(o);
+	pool->active = 0;
+	deps_free(&pool->master_task);
+	restore_team(o,&pool->saved);
+    }
+    DEBUG("GOMP_parallel_end() complete\n");
+}
+
+
+// this is "any" - we will make it simply be the first thread in the team
+int GOMP_single_start()
+{
+    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+
+    if (o->thread_num_in_team==0) { 
+	DEBUG("GOMP_single_start() => 1 (first thread in team)\n");
+	return 1;
+    } else {
+	DEBUG("GOMP_single_start() => 0 (not first thread in team)\n");
+	return 0;
+    }
+}
+
+void GOMP_parallel(void (*f)(void*), void *d, unsigned numthreads, unsigned flags)
+{
+    DEBUG("GOMP_parallel(f=%p, d=%p, numthreads=%u, flags=%x)\n",
+	  f,d,numthreads,flags);
+    GOMP_parallel_start(f,d,numthreads);
+    f(d);
+    GOMP_parallel_end();
+}
+
+
+// this is "any" - we will make it simply be the first thread in the team
+// other threads wait
+void *GOMP_single_copy_start()
+{
+    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+
+    if (o->thread_num_in_team==0) { 
+	o->cur_single=0;
+	DEBUG("GOMP_single_copy_start() => 0 (first thread in team)\n");
+	return 0;
+    } else {
+	DEBUG("GOMP_single_copy_start() [Waiting]\n");
+        nk_barrier_wait_id(o->team_barrier,o->thread_num_in_team);
+	DEBUG("GOMP_single_copy_start() [Done]\n");
+        return o->team_leader->cur_single;
+    }
+}
+
+void GOMP_single_copy_end(void *data)
+{
+    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+    DEBUG("GOMP_single_copy_end(%p) (start)\n",data);
+    o->cur_single = data;
+    if (o->team_barrier) {
+	nk_barrier_wait_id(o->team_barrier,o->thread_num_in_team);
+    }
+    DEBUG("GOMP_single_copy_end(%p) (end)\n",data);
+}
+    
+void GOMP_barrier()
+{ 
+    struct omp_thread *o = (struct omp_thread*)(get_cur_thread()->input);
+    DEBUG("GOMP_barrier (start)\n");
+    team_barrier(o);
+    DEBUG("GOMP_barrier (end)\n");
+}
+
+
+//
+// Worksharing loops
+//
+// Chunks are handed out in the loop variable's own space: a chunk is
+// [istart, iend) stepping by incr, with iend possibly the loop's end.
+//
+
+static inline struct omp_thread *cur_omp(void)
+{
+    return (struct omp_thread*)(get_cur_thread()->input);
+}
+
+static void loop_setup(struct omp_loop *l, int sched, int ordered, long start, long end, long incr, long chunk)
+{
+    memset(l,0,sizeof(*l));
+
+    if (sched == OMP_SCHED_AUTO) {
+	sched = OMP_SCHED_STATIC;
+    }
+    if (chunk < 0 || (chunk == 0 && sched != OMP_SCHED_STATIC)) {
+	chunk = 1;
+    }
+
+    l->sched = sched;
+    l->ordered = ordered;
+    l->start = start;
+    l->end = end;
+    l->incr = incr;
+    l->chunk = chunk;
+    l->cur_start = l->cur_end = start;
+    l->pending = 1;
+
+    if (incr > 0) {
+	l->n = end > start ? (end - start + incr - 1) / incr : 0;
+    } else {
+	l->n = start > end ? (start - end - incr - 1) / -incr : 0;
+    }
+}
+
+// resolve schedule(runtime), which the team agrees on since the
+// workers inherit the master's setting at dispatch
+static int runtime_sched(struct omp_thread *o, long *chunk)
+{
+    *chunk = o->sched_chunk;
+    return o->sched_kind ? o->sched_kind : OMP_SCHED_STATIC;
+}
+
+static void ws_enter(struct omp_thread *o, struct omp_loop *l)
+{
+    int ring = o->ws_ring ? OMP_WS_RING : 1;
+    struct omp_ws *ws = o->ws_ring ? &o->ws_ring[o->ws_seq % OMP_WS_RING] : &o->solo_ws;
+    long seq = o->ws_seq;
+    long span;
+
+    while (1) {
+	if (ws->ready == seq+1) {
+	    break;
+	}
+	if (ws->avail == seq && __sync_bool_compare_and_swap(&ws->avail,seq,-1)) {
+	    ws->next = l->start;
+	    ws->ordered = l->start;
+	    ws->left = 0;
+	    // fetch-and-add may overshoot end by a chunk per thread
+	    ws->fast = !__builtin_mul_overflow(l->chunk, l->incr, &span) &&
+		       !__builtin_mul_overflow(span, (long)o->num_threads_in_team+1, &span) &&
+		       !__builtin_add_overflow(l->end, span, &span);
+	    __sync_synchronize();
+	    ws->ready = seq+1;
+	    break;
+	}
+	__asm__ __volatile__ ("pause" : : : "memory");
+    }
+
+    DEBUG("Entered work share %ld (ring of %d) for [%ld,%ld) by %ld\n", seq, ring, l->start, l->end, l->incr);
+
+    l->ws = ws;
+    l->seq = seq;
+    o->ws_seq++;
+}
+
+static void ws_leave(struct omp_thread *o, struct omp_loop *l)
+{
+    int ring = o->ws_ring ? OMP_WS_RING : 1;
+
+    if (!l->ws) {
+	return;
+    }
+
+    if (__sync_add_and_fetch(&l->ws->left,1) == o->num_threads_in_team) {
+	l->ws->avail = l->seq + ring;
+    }
+    l->ws = 0;
+}
+
+static void loop_enter(struct omp_thread *o)
+{
+    struct omp_loop *l = &o->loop;
+
+    l->pending = 0;
+    l->ws = 0;
+    if (l->sched != OMP_SCHED_STATIC || l->ordered) {
+	ws_enter(o,l);
+    }
+}
+
+static int static_next(struct omp_thread *o, struct omp_loop *l, long *istart, long *iend)
+{
+    long nth = o->num_threads_in_team;
+    long tid = o->thread_num_in_team;
+    long s, e;
+
+    if (!l->chunk) {
+	// one contiguous block per thread
+	long q = l->n / nth;
+	long t = l->n % nth;
+	if (l->trip++) {
+	    return 0;
+	}
+	if (tid < t) {
+	    q++;
+	    s = q * tid;
+	} else {
+	    s = q * tid + t;
+	}
+	if (!q) {
+	    return 0;
+	}
+	e = s + q;
+    } else {
+	// round robin chunks
+	s = (l->trip * nth + tid) * l->chunk;
+	if (s >= l->n) {
+	    return 0;
+	}
+	e = s + l->chunk < l->n ? s + l->chunk : l->n;
+	l->trip++;
+    }
+
+    *istart = l->start + s * l->incr;
+    *iend = e == l->n ? l->end : l->start + e * l->incr;
+    return 1;
+}
+
+static inline int past_end(struct omp_loop *l, long i)
+{
+    return l->incr > 0 ? i >= l->end : i <= l->end;
+}
+
+// iterations left from i, which is not past the end
+static inline long left_from(struct omp_loop *l, long i)
+{
+    return l->incr > 0 ? (l->end - i + l->incr - 1) / l->incr : (i - l->end - l->incr - 1) / -l->incr;
+}
+
+static int dynamic_next(struct omp_loop *l, long *istart, long *iend)
+{
+    struct omp_ws *ws = l->ws;
+    long s;
+
+    if (ws->fast) {
+	s = __sync_fetch_and_add(&ws->next, l->chunk * l->incr);
+	if (past_end(l,s)) {
+	    return 0;
+	}
+	*istart = s;
+	*iend = left_from(l,s) <= l->chunk ? l->end : s + l->chunk * l->incr;
+	return 1;
+    }
+
+    do {
+	s = ws->next;
+	if (past_end(l,s)) {
+	    return 0;
+	}
+	*iend = left_from(l,s) <= l->chunk ? l->end : s + l->chunk * l->incr;
+    } while (!__sync_bool_compare_and_swap(&ws->next,s,*iend));
+
+    *istart = s;
+    return 1;
+}
+
+static int guided_next(struct omp_thread *o, struct omp_loop *l, long *istart, long *iend)
+{
+    struct omp_ws *ws = l->ws;
+    long nth = o->num_threads_in_team;
+    long s, left, q;
+
+    do {
+	s = ws->next;
+	if (past_end(l,s)) {
+	    return 0;
+	}
+	left = left_from(l,s);
+	q = (left + nth - 1) / nth;
+	if (q < l->chunk) {
+	    q = l->chunk;
+	}
+	*iend = q >= left ? l->end : s + q * l->incr;
+    } while (!__sync_bool_compare_and_swap(&ws->next,s,*iend));
+
+    *istart = s;
+    return 1;
+}
+
+// ordered sections run in chunk order - the thread holding the chunk
+// at the ordered position keeps it until it moves on to another chunk
+static void ordered_release(struct omp_loop *l)
+{
+    if (l->cur_start == l->cur_end) {
+	return;
+    }
+    while (l->ws->ordered != l->cur_start) {
+	__asm__ __volatile__ ("pause" : : : "memory");
+    }
+    l->ws->ordered = l->cur_end;
+    l->cur_start = l->cur_end;
+}
+
+static int loop_next(long *istart, long *iend)
+{
+    struct omp_thread *o = cur_omp();
+    struct omp_loop *l = &o->loop;
+    int rc;
+
+    if (l->ordered) {
+	ordered_release(l);
+    }
+
+    switch (l->sched) {
+    case OMP_SCHED_DYNAMIC:
+	rc = dynamic_next(l,istart,iend);
+	break;
+    case OMP_SCHED_GUIDED:
+	rc = guided_next(o,l,istart,iend);
+	break;
+    default:
+	rc = static_next(o,l,istart,iend);
+	break;
+    }
+
+    if (rc) {
+	l->cur_start = *istart;
+	l->cur_end = *iend;
+    }
+
+    DEBUG("loop_next() => %d [%ld,%ld)\n", rc, rc ? *istart : 0, rc ? *iend : 0);
+
+    return rc;
+}
+
+static int loop_start(int sched, int ordered, long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+    struct omp_thread *o = cur_omp();
+
+    DEBUG("loop_start(sched=%d, ordered=%d, start=%ld, end=%ld, incr=%ld, chunk=%ld)\n",
+	  sched, ordered, start, end, incr, chunk);
+
+    loop_setup(&o->loop,sched,ordered,start,end,incr,chunk);
+    loop_enter(o);
+
+    return loop_next(istart,iend);
+}
+
+int GOMP_loop_static_start(long start, long end, long incr, long chunk_size, long *istart, long *iend)
+{
+    return loop_start(OMP_SCHED_STATIC,0,start,end,incr,chunk_size,istart,iend);
+}
+
+int GOMP_loop_dynamic_start(long start, long end, long incr, long chunk_size, long *istart, long *iend)
+{
+    return loop_start(OMP_SCHED_DYNAMIC,0,start,end,incr,chunk_size,istart,iend);
+}
+
+int GOMP_loop_guided_start(long start, long end, long incr, long chunk_size, long *istart, long *iend)
+{
+    return loop_start(OMP_SCHED_GUIDED,0,start,end,incr,chunk_size,istart,iend);
+}
+
+int GOMP_loop_runtime_start(long start, long end, long incr, long *istart, long *iend)
+{
+    long chunk;
+    int sched = runtime_sched(cur_omp(),&chunk);
+    return loop_start(sched,0,start,end,incr,chunk,istart,iend);
+}
+
+// nonmonotonic loops may hand out chunks in any order, which our
+// dispensers already satisfy
+int GOMP_loop_nonmonotonic_dynamic_start(long start, long end, long incr, long chunk_size, long *istart, long *iend)
+{
+    return GOMP_loop_dynamic_start(start,end,incr,chunk_size,istart,iend);
+}
+
+int GOMP_loop_nonmonotonic_guided_start(long start, long end, long incr, long chunk_size, long *istart, long *iend)
+{
+    return GOMP_loop_guided_start(start,end,incr,chunk_size,istart,iend);
+}
+
+int GOMP_loop_nonmonotonic_runtime_start(long start, long end, long incr, long *istart, long *iend)
+{
+    return GOMP_loop_runtime_start(start,end,incr,istart,iend);
+}
+
+int GOMP_loop_maybe_nonmonotonic_runtime_start(long start, long end, long incr, long *istart, long *iend)
+{
+    return GOMP_loop_runtime_start(start,end,incr,istart,iend);
+}
+
+int GOMP_loop_ordered_static_start(long start, long end, long incr, long chunk_size, long *istart, long *iend)
+{
+    return loop_start(OMP_SCHED_STATIC,1,start,end,incr,chunk_size,istart,iend);
+}
+
+int GOMP_loop_ordered_dynamic_start(long start, long end, long incr, long chunk_size, long *istart, long *iend)
+{
+    return loop_start(OMP_SCHED_DYNAMIC,1,start,end,incr,chunk_size,istart,iend);
+}
+
+int GOMP_loop_ordered_guided_start(long start, long end, long incr, long chunk_size, long *istart, long *iend)
+{
+    return loop_start(OMP_SCHED_GUIDED,1,start,end,incr,chunk_size,istart,iend);
+}
+
+int GOMP_loop_ordered_runtime_start(long start, long end, long incr, long *istart, long *iend)
+{
+    long chunk;
+    int sched = runtime_sched(cur_omp(),&chunk);
+    return loop_start(sched,1,start,end,incr,chunk,istart,iend);
+}
+
+// the loop remembers its schedule, so all of these are the same
+int GOMP_loop_static_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_dynamic_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_guided_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_runtime_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_nonmonotonic_dynamic_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_nonmonotonic_guided_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_nonmonotonic_runtime_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_maybe_nonmonotonic_runtime_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_ordered_static_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_ordered_dynamic_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_ordered_guided_next(long *istart, long *iend) { return loop_next(istart,iend); }
+int GOMP_loop_ordered_runtime_next(long *istart, long *iend) { return loop_next(istart,iend); }
+
+void GOMP_loop_end_nowait(void)
+{
+    struct omp_thread *o = cur_omp();
+
+    DEBUG("GOMP_loop_end_nowait()\n");
+
+    if (o->loop.ordered) {
+	ordered_release(&o->loop);
+    }
+    ws_leave(o,&o->loop);
+}
+
+void GOMP_loop_end(void)
+{
+    DEBUG("GOMP_loop_end()\n");
+    GOMP_loop_end_nowait();
+    GOMP_barrier();
+}
+
+void GOMP_ordered_start(void)
+{
+    struct omp_loop *l = &cur_omp()->loop;
+
+    DEBUG("GOMP_ordered_start()\n");
+
+    if (!l->ordered || !l->ws) {
+	return;
+    }
+    while (l->ws->ordered != l->cur_start) {
+	__asm__ __volatile__ ("pause" : : : "memory");
+    }
+}
+
+void GOMP_ordered_end(void)
+{
+    // we keep the ordered position until we finish our chunk
+    DEBUG("GOMP_ordered_end()\n");
+}
+
+// combined parallel loops - every thread starts inside the loop and
+// goes straight to GOMP_loop_*_next
+static void parallel_loop_start(void (*fn)(void *), void *data, unsigned num_threads,
+				int sched, long start, long end, long incr, long chunk_size)
+{
+    struct omp_loop l;
+
+    DEBUG("parallel_loop_start(fn=%p, data=%p, num_threads=%u, sched=%d, start=%ld, end=%ld, incr=%ld, chunk=%ld)\n",
+	  fn, data, num_threads, sched, start, end, incr, chunk_size);
+
+    loop_setup(&l,sched,0,start,end,incr,chunk_size);
+    if (parallel_start(fn,data,num_threads,&l)) {
+	return;
+    }
+    // the master's team, even a team of one, now has the loop
+    loop_enter(cur_omp());
+}
+
+static void parallel_loop(void (*fn)(void *), void *data, unsigned num_threads,
+			  int sched, long start, long end, long incr, long chunk_size)
+{
+    parallel_loop_start(fn,data,num_threads,sched,start,end,incr,chunk_size);
+    fn(data);
+    GOMP_parallel_end();
+}
+
+void GOMP_parallel_loop_static_start(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, long chunk_size)
+{
+    parallel_loop_start(fn,data,num_threads,OMP_SCHED_STATIC,start,end,incr,chunk_size);
+}
+
+void GOMP_parallel_loop_dynamic_start(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, long chunk_size)
+{
+    parallel_loop_start(fn,data,num_threads,OMP_SCHED_DYNAMIC,start,end,incr,chunk_size);
+}
+
+void GOMP_parallel_loop_guided_start(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, long chunk_size)
+{
+    parallel_loop_start(fn,data,num_threads,OMP_SCHED_GUIDED,start,end,incr,chunk_size);
+}
+
+void GOMP_parallel_loop_runtime_start(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr)
+{
+    long chunk;
+    int sched = runtime_sched(cur_omp(),&chunk);
+    parallel_loop_start(fn,data,num_threads,sched,start,end,incr,chunk);
+}
+
+void GOMP_parallel_loop_static(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, long chunk_size, unsigned flags)
+{
+    parallel_loop(fn,data,num_threads,OMP_SCHED_STATIC,start,end,incr,chunk_size);
+}
+
+void GOMP_parallel_loop_dynamic(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, long chunk_size, unsigned flags)
+{
+    parallel_loop(fn,data,num_threads,OMP_SCHED_DYNAMIC,start,end,incr,chunk_size);
+}
+
+void GOMP_parallel_loop_guided(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, long chunk_size, unsigned flags)
+{
+    parallel_loop(fn,data,num_threads,OMP_SCHED_GUIDED,start,end,incr,chunk_size);
+}
+
+void GOMP_parallel_loop_runtime(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, unsigned flags)
+{
+    long chunk;
+    int sched = runtime_sched(cur_omp(),&chunk);
+    parallel_loop(fn,data,num_threads,sched,start,end,incr,chunk);
+}
+
+void GOMP_parallel_loop_nonmonotonic_dynamic(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, long chunk_size, unsigned flags)
+{
+    parallel_loop(fn,data,num_threads,OMP_SCHED_DYNAMIC,start,end,incr,chunk_size);
+}
+
+void GOMP_parallel_loop_nonmonotonic_guided(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, long chunk_size, unsigned flags)
+{
+    parallel_loop(fn,data,num_threads,OMP_SCHED_GUIDED,start,end,incr,chunk_size);
+}
+
+void GOMP_parallel_loop_nonmonotonic_runtime(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, unsigned flags)
+{
+    GOMP_parallel_loop_runtime(fn,data,num_threads,start,end,incr,flags);
+}
+
+void GOMP_parallel_loop_maybe_nonmonotonic_runtime(void (*fn)(void *), void *data, unsigned num_threads, long start, long end, long incr, unsigned flags)
+{
+    GOMP_parallel_loop_runtime(fn,data,num_threads,start,end,incr,flags);
+}
+
+
+//
+// Critical sections and atomics
+//
+// Each named critical section gets its own adaptive mutex, hung off
+// the pointer the compiler emits for the name.  Unnamed critical
+// sections share one.  GOMP_atomic_start/end (for atomic operations the
+// hardware cannot do) have their own short spinlock, on its own line,
+// so they do not contend with critical sections.
+//
+
+static void *gomp_unnamed_critical = 0;
+
+static spinlock_t gomp_atomic_lock __attribute__((aligned(64))) = 0;
+
+static nk_mutex_t *critical_lock(void **pptr)
+{
+    nk_mutex_t *m = (nk_mutex_t *) *pptr;
+
+    if (__builtin_expect(!!m,1)) {
+	return m;
+    }
+
+    m = (nk_mutex_t *) malloc(sizeof(*m));
+    if (!m || nk_mutex_init(m)) {
+	panic("gomp: cannot allocate critical section lock\n");
+    }
+
+    // the loser of a race to create the lock frees its copy
+    if (!__sync_bool_compare_and_swap(pptr,0,m)) {
+	nk_mutex_deinit(m);
+	free(m);
+	m = (nk_mutex_t *) *pptr;
+    }
+
+    return m;
+}
+
+void GOMP_critical_name_start(void **pptr)
+{
+    DEBUG("GOMP_critical_name_start(%p) (start)\n", pptr);
+    nk_mutex_lock(critical_lock(pptr));
+    DEBUG("GOMP_critical_name_start(%p) (end)\n", pptr);
+}
+
+void GOMP_critical_name_end(void **pptr)
+{
+    DEBUG("GOMP_critical_name_end(%p)\n", pptr);
+    nk_mutex_unlock((nk_mutex_t *) *pptr);
+}
+
+void GOMP_critical_start(void)
+{
+    GOMP_critical_name_start(&gomp_unnamed_critical);
+}
+
+void GOMP_critical_end(void)
+{
+    GOMP_critical_name_end(&gomp_unnamed_critical);
+}
+
+void GOMP_atomic_start(void)
+{
+    spin_lock(&gomp_atomic_lock);
+}
+
+void GOMP_atomic_end(void)
+{
+    spin_unlock(&gomp_atomic_lock);
+}
+
+
+//
+// Team reductions
+//
+// Contributions are combined up a tree over thread numbers whose leaf
+// fan-in is the number of CPUs in a NUMA domain, since the hot team
+// places consecutive thread numbers on consecutive CPUs.  Each thread
+// writes only its own slot, and a parent polls its children's slots,
+// so no line is written by more than one thread.  Slots alternate
+// between two buffers by episode, which keeps a fast thread's next
+// reduction from overwriting a result a slow thread has yet to read.
+//
+
+static unsigned reduce_fanin(void)
+{
+    static unsigned fanin = 0;
+    struct sys_info *sys = per_cpu_get(system);
+    unsigned i, local = 0;
+
+    if (!fanin) {
+	for (i=0;i<sys->num_cpus;i++) {
+	    if (sys->cpus[i]->domain == sys->cpus[0]->domain) {
+		local++;
+	    }
+	}
+	fanin = local < 2 ? 2 : local > 16 ? 16 : local;
+    }
+
+    return fanin;
+}
+
+int nk_openmp_reduce(void *val, unsigned long size, void (*combine)(void *acc, void *in))
+{
+    struct omp_thread *o = cur_omp();
+    struct omp_pool *team = o->task_team;
+    unsigned n = o->num_threads_in_team;
+    unsigned me = o->thread_num_in_team;
+    unsigned fanin, stride, j, c;
+    struct omp_red_slot *slot;
+    long seq;
+    int b;
+
+    if (size > NK_OMP_REDUCE_MAX) {
+	ERROR("Reduction of %lu bytes is too large\n", size);
+	return -1;
+    }
+
+    if (!team || n < 2) {
+	return 0;
+    }
+
+    seq = ++o->red_seq;
+    b = seq & 1;
+    fanin = reduce_fanin();
+
+    slot = &team->red[me][b];
+    memcpy(slot->val,val,size);
+
+    for (stride = 1; stride < n && !(me % (stride*fanin)); stride *= fanin) {
+	for (j=1;j<fanin;j++) {
+	    struct omp_red_slot *child;
+	    c = me + j*stride;
+	    if (c >= n) {
+		break;
+	    }
+	    child = &team->red[c][b];
+	    while (child->seq != seq) {
+		__asm__ __volatile__ ("pause" : : : "memory");
+	    }
+	    combine(slot->val,child->val);
+	}
+    }
+
+    __sync_synchronize();
+    slot->seq = seq;
+
+    slot = &team->red[0][b];
+    while (slot->seq != seq) {
+	__asm__ __volatile__ ("pause" : : : "memory");
+    }
+    memcpy(val,slot->val,size);
+
+    return 0;
+}
+
+static void combine_long(void *acc, void *in)
+{
+    *(long *)acc += *(long *)in;
+}
+
+static void combine_double(void *acc, void *in)
+{
+    *(double *)acc += *(double *)in;
+}
+
+long nk_openmp_reduce_sum_long(long val)
+{
+    nk_openmp_reduce(&val,sizeof(val),combine_long);
+    return val;
+}
+
+double nk_openmp_reduce_sum_double(double val)
+{
+    nk_openmp_reduce(&val,sizeof(val),combine_double);
+    return val;
+}
+
+
+//
+// Dependences
+//
+
+static void dep_edge(struct omp_task *pred, struct omp_task *t)
+{
+    if (!pred || pred == t) {
+	return;
+    }
+
+    spin_lock(&pred->lock);
+    if (!pred->done) {
+	if (pred->num_succ == pred->max_succ) {
+	    int max = pred->max_succ ? 2*pred->max_succ : 4;
+	    struct omp_task **succ = (struct omp_task **) realloc(pred->succ, max*sizeof(*succ));
+	    if (!succ) {
+		spin_unlock(&pred->lock);
+		ERROR("Cannot grow successor list, waiting for predecessor\n");
+		while (!pred->done) {
+		    __asm__ __volatile__ ("pause" : : : "memory");
+		}
+		return;
+	    }
+	    pred->succ = succ;
+	    pred->max_succ = max;
+	}
+	pred->succ[pred->num_succ++] = t;
+	__sync_fetch_and_add(&t->npred,1);
+    }
+    spin_unlock(&pred->lock);
+}
+
+static struct omp_dep *dep_find(struct omp_task *parent, void *addr)
+{
+    struct omp_dep *d;
+    unsigned b = ((addr_t)addr >> 3) % OMP_DEP_BUCKETS;
+
+    if (!parent->deps) {
+	parent->deps = (struct omp_dep **) malloc(OMP_DEP_BUCKETS*sizeof(struct omp_dep *));
+	if (!parent->deps) {
+	    return 0;
+	}
+	memset(parent->deps,0,OMP_DEP_BUCKETS*sizeof(struct omp_dep *));
+    }
+
+    for (d = parent->deps[b]; d; d = d->next) {
+	if (d->addr == addr) {
+	    return d;
+	}
+    }
+
+    d = (struct omp_dep *) malloc(sizeof(*d));
+    if (!d) {
+	return 0;
+    }
+    memset(d,0,sizeof(*d));
+    d->addr = addr;
+    d->next = parent->deps[b];
+    parent->deps[b] = d;
+    return d;
+}
+
+// only the parent adds to its table, so it needs no lock
+static void dep_add(struct omp_task *parent, struct omp_task *t, void *addr, int out)
+{
+    struct omp_dep *d = dep_find(parent,addr);
+    int i;
+
+    if (!d) {
+	ERROR("Cannot track dependence on %p\n", addr);
+	return;
+    }
+
+    dep_edge(d->last_out,t);
+
+    if (out) {
+	for (i=0;i<d->num_readers;i++) {
+	    dep_edge(d->readers[i],t);
+	    task_unref(d->readers[i]);
+	}
+	d->num_readers = 0;
+	if (d->last_out) {
+	    task_unref(d->last_out);
+	}
+	d->last_out = t;
+	__sync_fetch_and_add(&t->refs,1);
+    } else {
+	if (d->num_readers == d->max_readers) {
+	    int max = d->max_readers ? 2*d->max_readers : 4;
+	    struct omp_task **r = (struct omp_task **) realloc(d->readers, max*sizeof(*r));
+	    if (!r) {
+		ERROR("Cannot grow reader list for %p\n", addr);
+		return;
+	    }
+	    d->readers = r;
+	    d->max_readers = max;
+	}
+	d->readers[d->num_readers++] = t;
+	__sync_fetch_and_add(&t->refs,1);
+    }
+}
+
+// depend is either { n, nout, addrs... } or, from newer compilers,
+// { 0, n, nout, nmutexinoutset, nin, addrs... } with depend objects
+// (address, kind) after the plain addresses
+static void deps_register(struct omp_task *parent, struct omp_task *t, void **depend)
+{
+    long n, nout, nin, i;
+    void **addr;
+
+    if (depend[0]) {
+	n = (long)depend[0];
+	nout = (long)depend[1];
+	nin = n - nout;
+	addr = depend + 2;
+    } else {
+	n = (long)depend[1];
+	nout = (long)depend[2] + (long)depend[3];
+	nin = (long)depend[4];
+	addr = depend + 5;
+    }
+
+    for (i=0;i<n;i++) {
+	if (i < nout + nin) {
+	    dep_add(parent,t,addr[i],i < nout);
+	} else {
+	    dep_add(parent,t,((void **)addr[i])[0],1);
+	}
+    }
+}
+
+static void deps_free(struct omp_task *t)
+{
+    struct omp_dep *d, *next;
+    int b, i;
+
+    if (!t->deps) {
+	return;
+    }
+
+    for (b=0;b<OMP_DEP_BUCKETS;b++) {
+	for (d = t->deps[b]; d; d = next) {
+	    next = d->next;
+	    for (i=0;i<d->num_readers;i++) {
+		task_unref(d->readers[i]);
+	    }
+	    if (d->last_out) {
+		task_unref(d->last_out);
+	    }
+	    free(d->readers);
+	    free(d);
+	}
+    }
+    free(t->deps);
+    t->deps = 0;
+}
+
+
+//
+// Task creation
+//
+
+// run a task right now when we are not in a team - everything it
+// creates also runs immediately, so dependences are satisfied by
+// program order and nothing can outlive it
+static void task_run_now(struct omp_thread *o, void (*fn)(void *), void *data,
+			 void (*cpyfn)(void *, void *), long arg_size, long arg_align,
+			 unsigned flags, long *bounds)
+{
+    struct omp_task *parent = o->cur_task;
+    struct omp_task t;
+    void *buf = 0;
+
+    if (cpyfn || bounds) {
+	long align = arg_align > 0 ? arg_align : 1;
+	void *args;
+	buf = malloc(arg_size + align - 1);
+	if (!buf) {
+	    ERROR("Cannot allocate task arguments\n");
+	    return;
+	}
+	args = (void *)(((addr_t)buf + align - 1) & ~(align - 1));
+	if (cpyfn) {
+	    cpyfn(args,data);
+	} else {
+	    memcpy(args,data,arg_size);
+	}
+	data = args;
+	if (bounds) {
+	    ((long *)data)[0] = bounds[0];
+	    ((long *)data)[1] = bounds[1];
+	}
+    }
+
+    task_reset_implicit(&t);
+    t.parent = parent;
+    t.final = (flags & OMP_TASK_FLAG_FINAL) || parent->final;
+
+    o->cur_task = &t;
+    fn(data);
+    o->cur_task = parent;
+
+    free(buf);
+}
+
+static void task_spawn(void (*fn)(void *), void *data, void (*cpyfn)(void *, void *),
+		       long arg_size, long arg_align, int if_clause, unsigned flags,
+		       void **depend, int priority, long *bounds)
+{
+    struct omp_thread *o = cur_omp();
+    struct omp_task *parent = o->cur_task;
+    struct omp_task *t;
+    long align = arg_align > 0 ? arg_align : 1;
+    int undeferred;
+
+    if (!o->task_team) {
+	task_run_now(o,fn,data,cpyfn,arg_size,arg_align,flags,bounds);
+	return;
+    }
+
+    t = (struct omp_task *) malloc(sizeof(*t) + arg_size + align - 1);
+    if (!t) {
+	ERROR("Failed to allocate task\n");
+	return;
+    }
+    memset(t,0,sizeof(*t));
+
+    t->data = (void *)(((addr_t)(t+1) + align - 1) & ~(align - 1));
+    if (cpyfn) {
+	cpyfn(t->data,data);
+    } else if (arg_size) {
+	memcpy(t->data,data,arg_size);
+    }
+    if (bounds) {
+	((long *)t->data)[0] = bounds[0];
+	((long *)t->data)[1] = bounds[1];
+    }
+
+    t->fn = fn;
+    spinlock_init(&t->lock);
+    t->refs = 1;
+    t->npred = 1; // until we have registered our dependences
+    t->final = (flags & OMP_TASK_FLAG_FINAL) || parent->final;
+    t->priority = (flags & OMP_TASK_FLAG_PRIORITY) ? priority : 0;
+
+    t->parent = parent;
+    __sync_fetch_and_add(&parent->refs,1);
+    __sync_fetch_and_add(&parent->children,1);
+    t->group = t->cur_group = parent->cur_group;
+    if (t->group) {
+	__sync_fetch_and_add(&t->group->count,1);
+    }
+    t->team = o->task_team;
+    __sync_fetch_and_add(&t->team->ntasks,1);
+
+    // tasks of a final task are included, and so run immediately
+    undeferred = !if_clause || parent->final;
+    t->undeferred = undeferred;
+
+    if ((flags & OMP_TASK_FLAG_DEPEND) && depend) {
+	deps_register(parent,t,depend);
+    }
+
+    if (undeferred) {
+	if (__sync_sub_and_fetch(&t->npred,1)) {
+	    task_wait_for(o,&t->npred);
+	}
+	task_execute(o,t);
+    } else if (!__sync_sub_and_fetch(&t->npred,1)) {
+	task_ready(o,t);
+    }
+}
+
+void GOMP_task (void (*fn) (void *), 
+		void *data, 
+		void (*cpyfn) (void *, void *),
+		long arg_size, 
+		long arg_align, 
+		int if_clause,
+		unsigned flags,
+		void **depend, 
+		int priority)
+{
+    DEBUG("GOMP_task(fn=%p, data=%p, cpy=%p, arg_size=%ld arg_align=%ld if=%d flags=0x%x depend=%p priority=%d\n",
+	  fn, data, cpyfn, arg_size, arg_align, if_clause, flags, depend, priority);
+
+    task_spawn(fn,data,cpyfn,arg_size,arg_align,if_clause,flags,depend,priority,0);
+}
+
+void GOMP_taskwait()
+{
+    struct omp_thread *o = cur_omp();
+    struct omp_task *t = o->cur_task;
+
+    DEBUG("GOMP_taskwait() [begin]\n");
+    task_wait_for(o,&t->children);
+    // all of our children are done, so none can be a predecessor
+    deps_free(t);
+    DEBUG("GOMP_taskwait() [end]\n");
+}
+
+void GOMP_taskyield()
+{
+    DEBUG("GOMP_taskyield()\n");
+    task_run_one(cur_omp());
+}
+
+void GOMP_taskgroup_start()
+{
+    struct omp_task *t = cur_omp()->cur_task;
+    struct omp_taskgroup *g = (struct omp_taskgroup *) malloc(sizeof(*g));
+
+    DEBUG("GOMP_taskgroup_start()\n");
+
+    if (!g) {
+	// leave the tasks in the enclosing group, if any, and
+	// fall back to waiting for the children at the end
+	ERROR("Failed to allocate taskgroup\n");
+	t->lost_groups++;
+	return;
+    }
+    g->count = 0;
+    g->prev = t->cur_group;
+    t->cur_group = g;
+}
+
+void GOMP_taskgroup_end()
+{
+    struct omp_thread *o = cur_omp();
+    struct omp_task *t = o->cur_task;
+    struct omp_taskgroup *g = t->cur_group;
+
+    DEBUG("GOMP_taskgroup_end()\n");
+
+    if (t->lost_groups) {
+	t->lost_groups--;
+	task_wait_for(o,&t->children);
+	return;
+    }
+    task_wait_for(o,&g->count);
+    t->cur_group = g->prev;
+    free(g);
+}
+
+// the first two longs of data are the task's iteration bounds
+void GOMP_taskloop(void (*fn)(void *), void *data, void (*cpyfn)(void *, void *),
+		   long arg_size, long arg_align, unsigned flags,
+		   unsigned long num_tasks, int priority,
+		   long start, long end, long step)
+{
+    struct omp_thread *o = cur_omp();
+    long n, q, r, i, count;
+    long bounds[2];
+
+    DEBUG("GOMP_taskloop(fn=%p, data=%p, flags=0x%x, num_tasks=%lu, start=%ld, end=%ld, step=%ld)\n",
+	  fn, data, flags, num_tasks, start, end, step);
+
+    if (step > 0) {
+	n = end > start ? (end - start + step - 1) / step : 0;
+    } else {
+	n = start > end ? (start - end - step - 1) / -step : 0;
+    }
+
+    if (!n) {
+	return;
+    }
+
+    if (flags & OMP_TASK_FLAG_GRAINSIZE) {
+	count = num_tasks ? n / (long)num_tasks : n;
+    } else {
+	count = num_tasks ? (long)num_tasks : o->num_threads_in_team;
+    }
+    if (count < 1) {
+	count = 1;
+    }
+    if (count > n) {
+	count = n;
+    }
+    q = n / count;
+    r = n % count;
+
+    if (!(flags & OMP_TASK_FLAG_NOGROUP)) {
+	GOMP_taskgroup_start();
+    }
+
+    bounds[1] = start;
+    for (i=0;i<count;i++) {
+	bounds[0] = bounds[1];
+	bounds[1] = bounds[0] + (q + (i < r)) * step;
+	task_spawn(fn,data,cpyfn,arg_size,arg_align,
+		   !!(flags & OMP_TASK_FLAG_IF),flags & ~OMP_TASK_FLAG_DEPEND,
+		   0,priority,bounds);
+    }
+
+    if (!(flags & OMP_TASK_FLAG_NOGROUP)) {
+	GOMP_taskgroup_end();
+    }
+}
+
+
+
+
+int nk_openmp_thread_init()
+{
+    struct nk_thread *t = get_cur_thread();
+    
+    DEBUG("nk_openmp_thread_init() of thread %p\n", t);
+
+    if (t->input) { 
+	DEBUG("Overriding current thread input...\n");
+    }
+
+    struct omp_thread *o = (struct omp_thread *)malloc(sizeof(*o));
+
+    if (!o) { 
+	ERROR("Cannot allocate space\n");
 	return -1;
     }
 
@@ -810,8 +2778,9 @@ int nk_openmp_thread_init()
     t->input = o;
 
     o->team_leader = o;
-
-    nk_counting_barrier_init(&o->team_barrier,1);
+    o->thread = t;
+    task_reset_implicit(&o->implicit);
+    o->cur_task = &o->implicit;
 
     DEBUG("nk_openmp_init(): cookie=%lx, team=%d, num_threads_in_team=%d, thread_num_in_team=%d, level=%d, num_threads_in_level=%d,f=%p, in=%p, thread_num=%d, thread=%p\n", o->cookie, o->team, o->num_threads_in_team, o->thread_num_in_team, o->level, o->num_threads_in_level, o->f, o->in, o->thread_num, o->thread);
 
@@ -831,15 +2800,59 @@ int nk_openmp_thread_deinit()
 
     t->input = o->in; // restore
 
+    pools_destroy(o);
     free(o);
 
     return 0;
 }
 
 
+static char *places_names[] = { "threads", "cores", "sockets" };
+static char *bind_names[] = { "false", "true", "master", "close", "spread" };
+
+int nk_openmp_set_places(char *places)
+{
+    int i;
+
+    for (i=0;i<sizeof(places_names)/sizeof(places_names[0]);i++) {
+	if (!strcmp(places,places_names[i])) {
+	    omp_places_kind = i;
+	    places_build();
+	    INFO("places=%s (%d places)\n", places, omp_num_places);
+	    return 0;
+	}
+    }
+
+    ERROR("Unknown places %s\n", places);
+    return -1;
+}
+
+int nk_openmp_set_proc_bind(char *bind)
+{
+    int i;
+
+    // primary is the OpenMP 5.1 name for master
+    if (!strcmp(bind,"primary")) {
+	bind = "master";
+    }
+
+    for (i=0;i<sizeof(bind_names)/sizeof(bind_names[0]);i++) {
+	if (!strcmp(bind,bind_names[i])) {
+	    omp_bind = i;
+	    INFO("proc_bind=%s\n", bind);
+	    return 0;
+	}
+    }
+
+    ERROR("Unknown proc_bind %s\n", bind);
+    return -1;
+}
+
 int nk_openmp_init()
 {
-    INFO("init\n");
+    places_build();
+    INFO("init (places=%s (%d), proc_bind=%s)\n", places_names[omp_places_kind],
+	 omp_num_places, bind_names[omp_bind]);
     return 0;
 }
 
@@ -847,3 +2860,37 @@ void nk_openmp_deinit()
 {
     INFO("deinit\n");
 }
+
+
+static int
+handle_ompbind (char * buf, void * priv)
+{
+    char places[16], bind[16];
+    int n, i, j;
+
+    n = sscanf(buf, "ompbind %15s %15s", bind, places);
+
+    if ((n >= 1 && nk_openmp_set_proc_bind(bind)) ||
+	(n >= 2 && nk_openmp_set_places(places))) {
+	nk_vc_printf("ompbind [false|true|master|close|spread] [threads|cores|sockets]\n");
+	return 0;
+    }
+
+    nk_vc_printf("proc_bind=%s places=%s\n", bind_names[omp_bind], places_names[omp_places_kind]);
+    for (i=0;i<omp_get_num_places();i++) {
+	nk_vc_printf("place %d: {", i);
+	for (j=0;j<place_size(i);j++) {
+	    nk_vc_printf("%s%d", j ? "," : "", omp_place_cpus[omp_place_start[i]+j]);
+	}
+	nk_vc_printf("}\n");
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl ompbind_impl = {
+    .cmd      = "ompbind",
+    .help_str = "ompbind [false|true|master|close|spread] [threads|cores|sockets]",
+    .handler  = handle_ompbind,
+};
+nk_register_shell_cmd(ompbind_impl);
@@ -45,6 +45,7 @@
 #include <nautilus/mwait.h>
 #include <nautilus/thread.h>
 #include <nautilus/condvar.h>
+#include <nautilus/mutex.h>
 #include <nautilus/spinlock.h>
 #include <nautilus/percpu.h>
 #include <nautilus/numa.h>
@@ -83,6 +84,7 @@ static struct cv {
 #define THR_LONG_CREATE_LOOPS 8
 #define SPINLOCK_LOOPS        1000
 #define CONDVAR_LOOPS         100
+#define MUTEX_LOOPS           10000
 #define MWAIT_LOOPS           100
 #define BIL                   1000000000
 #define MIL                   1000000
@@ -273,8 +275,12 @@ void time_cvar_bcast (void)
 	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cp);
 #endif
 
+	memset(&cond_time, 0, sizeof(cond_time));
+	cond_time.min = ULLONG_MAX;
+
 	for (i = 0; i < CONDVAR_LOOPS; i++) {
 		uint64_t start = 0;
+		uint64_t last = 0;
 
 		COND_INIT(cont->cvar);
 		MUTEX_INIT(&(cont->lock));
@@ -319,9 +325,17 @@ void time_cvar_bcast (void)
 			}
 
 			PRINT("TRIAL %u RC: %u %llu cycles\n", i, j, core_counters[j] - start);
+			if (core_counters[j] - start > last) {
+				last = core_counters[j] - start;
+			}
 			JOIN_FUNC(t[j], NULL);
 		}
 
+		/* a broadcast is done when its last waiter is awake */
+		cond_time.sum += last;
+		if (last < cond_time.min) cond_time.min = last;
+		if (last > cond_time.max) cond_time.max = last;
+
 		/* clear timing info */
 		memset((void*)core_counters, 0, sizeof(core_counters));
 		memset((void*)core_recvd, 0, sizeof(core_recvd));
@@ -337,6 +351,8 @@ void time_cvar_bcast (void)
 		MUTEX_DEINIT(&(cont->lock));
 	}
 
+	PRINT("BCAST SUMMARY (last waiter awake): avg %llu min %llu max %llu cycles over %u trials\n",
+	      cond_time.sum / CONDVAR_LOOPS, cond_time.min, cond_time.max, CONDVAR_LOOPS);
 }
 
 
@@ -352,6 +368,7 @@ void time_condvar (void) {
     COND_INIT(&c);
 
     memset(&cond_time, 0, sizeof(cond_time));
+    cond_time.min = ULLONG_MAX;
 
     for (j = 0; j < NUM_THREADS; j++) {
 
@@ -382,9 +399,16 @@ void time_condvar (void) {
             uint64_t diff = cond_time.end - cond_time.start;
 
             PRINT("TRIAL %u RC:%u %llu cycles\n", i, j, diff);
+
+            cond_time.sum += diff;
+            if (diff < cond_time.min) cond_time.min = diff;
+            if (diff > cond_time.max) cond_time.max = diff;
         }
     }
 
+    PRINT("CONDVAR SUMMARY (signal to wakeup): avg %llu min %llu max %llu cycles over %u trials\n",
+          cond_time.sum / ((NUM_THREADS - 1) * CONDVAR_LOOPS), cond_time.min, cond_time.max,
+          (NUM_THREADS - 1) * CONDVAR_LOOPS);
 }
 
 void time_spinlock (void);
@@ -568,6 +592,7 @@ time_thread_create (void)
 
     int i;
 	uint64_t start,end;
+	uint64_t min = -1ULL, sum = 0;
 
     for (i = 0; i < THR_CREATE_LOOPS; i++) {
         rdtscll(start);
@@ -588,9 +613,17 @@ time_thread_create (void)
 		DELAY(10000);
 		PRINT("Trial %u %llu \n", i, end-start);
 
+		sum += end-start;
+		if (end-start < min) {
+			min = end-start;
+		}
+
         JOIN_FUNC(t, NULL);
 
     }
+
+	PRINT("THREAD CREATE: %u trials, min %llu avg %llu cycles\n",
+	      THR_CREATE_LOOPS, min, sum/THR_CREATE_LOOPS);
 }
 
 
@@ -1100,6 +1133,92 @@ malloc_test (void)
 
 }
 
+
+/*
+ * Contended lock handoff: every CPU (up to NUM_THREADS) hammers one
+ * lock with a short critical section, first with a spinlock and then
+ * with the adaptive mutex
+ */
+static volatile uint64_t mutex_shared;
+static volatile int mutex_go;
+
+struct mutex_arg {
+    int         use_mutex;
+    spinlock_t  *spin;
+    nk_mutex_t  *mutex;
+};
+
+static FUNC_TYPE
+mutex_hammer FUNC_HDR
+{
+    struct mutex_arg *a = (struct mutex_arg *)in;
+    int i;
+
+    while (!mutex_go) { }
+
+    for (i = 0; i < MUTEX_LOOPS; i++) {
+        if (a->use_mutex) {
+            nk_mutex_lock(a->mutex);
+            mutex_shared++;
+            nk_mutex_unlock(a->mutex);
+        } else {
+            spin_lock(a->spin);
+            mutex_shared++;
+            spin_unlock(a->spin);
+        }
+    }
+    RETURN;
+}
+
+void time_mutex (void);
+void time_mutex (void)
+{
+    THREAD_T t[NUM_THREADS];
+    spinlock_t spin;
+    nk_mutex_t mutex;
+    struct mutex_arg a;
+    int n = nk_get_num_cpus();
+    int i, j;
+
+    if (n > NUM_THREADS) {
+        n = NUM_THREADS;
+    }
+
+    spinlock_init(&spin);
+    if (nk_mutex_init(&mutex)) {
+        PRINT("Cannot create mutex\n");
+        return;
+    }
+
+    a.spin = &spin;
+    a.mutex = &mutex;
+
+    for (j = 0; j < 2; j++) {
+        uint64_t start, end;
+
+        a.use_mutex = j;
+        mutex_shared = 0;
+        mutex_go = 0;
+
+        for (i = 0; i < n; i++) {
+            nk_thread_start(mutex_hammer, &a, NULL, 0, TSTACK_DEFAULT, &t[i], i);
+        }
+
+        rdtscll(start);
+        mutex_go = 1;
+
+        for (i = 0; i < n; i++) {
+            JOIN_FUNC(t[i], NULL);
+        }
+        rdtscll(end);
+
+        PRINT("MUTEX %s: %d threads, %llu cycles per acquire\n",
+              j ? "adaptive" : "spinlock", n, (end - start) / (n * MUTEX_LOOPS));
+    }
+
+    nk_mutex_deinit(&mutex);
+}
+
 #endif
 
 void run_benchmarks(void);
@@ -1143,16 +1262,32 @@ int main () {
     return 0;
 }
 
+#else
+
 static int
 handle_bench (char * buf, void * priv)
 {
-    run_benchmarks();
+    char what[32];
+
+    if (sscanf(buf, "bench %31s", what) != 1) {
+        run_benchmarks();
+    } else if (!strcmp(what, "condvar")) {
+        time_condvar();
+    } else if (!strcmp(what, "bcast")) {
+        time_cvar_bcast();
+    } else if (!strcmp(what, "mutex")) {
+        time_mutex();
+    } else if (!strcmp(what, "create")) {
+        time_thread_create();
+    } else {
+        nk_vc_printf("unknown benchmark %s\n", what);
+    }
     return 0;
 }
 
 static struct shell_cmd_impl bench_impl = {
     .cmd      = "bench",
-    .help_str = "bench",
+    .help_str = "bench [condvar|bcast|mutex|create]",
     .handler  = handle_bench,
 };
 nk_register_shell_cmd(bench_impl);
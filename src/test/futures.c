@@ -51,6 +51,8 @@ static int test_basic()
     int i,j;
     int rc = 0;
     nk_future_t *futures[NUM_FUTURES];
+
+    memset(futures,0,sizeof(futures));
     
     for (i=0;i<NUM_PASSES;i++) {
 	//PRINT("pass %d\n",i);
@@ -87,6 +89,7 @@ static int test_basic()
 		goto out_clean;
 	    }
 	    nk_future_free(futures[j]);
+	    futures[j] = 0;
 	}
 	nk_sched_reap(1); // clean up unconditionally
     }
@@ -102,12 +105,118 @@ static int test_basic()
 
 
 
+static void *add_one(void *result, void *arg)
+{
+    return (void*)((uint64_t)result + 1);
+}
+
+static int test_then()
+{
+    nk_future_t *f, *g, *h, *k;
+    void *ret = 0;
+    int rc = 0;
+
+    f = nk_future_alloc();
+    g = f ? nk_future_then(f, add_one, 0, NK_FUTURE_THEN_INLINE) : 0;
+    h = g ? nk_future_then(g, add_one, 0, NK_FUTURE_THEN_TASK) : 0;
+
+    if (!h) {
+	PRINT("Cannot allocate futures\n");
+	return -1;
+    }
+
+    if (nk_thread_start(test_basic_producer, f, 0, 1, PAGE_SIZE_4KB, NULL, -1)) {
+	PRINT("Failed to launch thread\n");
+	return -1;
+    }
+
+    if (nk_future_wait(h, NK_FUTURE_WAIT_BLOCK, &ret) || ret!=(void*)44) {
+	PRINT("chained future has return value %p\n",ret);
+	rc = -1;
+    }
+
+    // continuing a done future runs the continuation immediately
+    k = nk_future_then(f, add_one, 0, NK_FUTURE_THEN_INLINE);
+    if (!k || nk_future_check(k,&ret) || ret!=(void*)43) {
+	PRINT("continuation of done future has return value %p\n",ret);
+	rc = -1;
+    }
+
+    nk_future_free(f);
+    nk_future_free(g);
+    nk_future_free(h);
+    if (k) {
+	nk_future_free(k);
+    }
+
+    return rc;
+}
+
+#define NUM_JOINED 16
+
+static int test_when()
+{
+    nk_future_t *futures[NUM_JOINED];
+    nk_future_t *all, *any;
+    void *ret;
+    int j, rc = 0;
+
+    for (j=0;j<NUM_JOINED;j++) {
+	if (!(futures[j] = nk_future_alloc())) {
+	    PRINT("Cannot allocate future\n");
+	    return -1;
+	}
+    }
+
+    all = nk_future_when_all(NUM_JOINED, futures);
+    any = nk_future_when_any(NUM_JOINED, futures);
+
+    if (!all || !any) {
+	PRINT("Cannot combine futures\n");
+	return -1;
+    }
+
+    for (j=0;j<NUM_JOINED;j++) {
+	if (nk_thread_start(test_basic_producer, futures[j], 0, 1, PAGE_SIZE_4KB, NULL, -1)) {
+	    PRINT("Failed to launch thread %d\n", j);
+	    nk_future_finish(futures[j], (void*)42);
+	}
+    }
+
+    if (nk_future_wait(any, NK_FUTURE_WAIT_BLOCK, &ret) || (uint64_t)ret >= NUM_JOINED) {
+	PRINT("when_any has return value %p\n",ret);
+	rc = -1;
+    }
+
+    if (nk_future_wait(all, NK_FUTURE_WAIT_BLOCK, &ret)) {
+	PRINT("when_all failed\n");
+	rc = -1;
+    }
+
+    for (j=0;j<NUM_JOINED;j++) {
+	if (nk_future_check(futures[j],&ret) || ret!=(void*)42) {
+	    PRINT("future %d not done after when_all\n", j);
+	    rc = -1;
+	}
+	nk_future_free(futures[j]);
+    }
+
+    nk_future_free(all);
+    nk_future_free(any);
+
+    return rc;
+}
+
 static int test_futures()
 {
     int basic = test_basic();
+    int then = test_then();
+    int when = test_when();
     
     nk_vc_printf("Basic future test: %s\n", basic ? "FAIL" : "PASS");
-    return basic;
+    nk_vc_printf("Continuation test: %s\n", then ? "FAIL" : "PASS");
+    nk_vc_printf("Combinator test: %s\n", when ? "FAIL" : "PASS");
+    return basic || then || when;
 }
 
 
@@ -28,12 +28,10 @@ int test_ompbench()
     taskbench_main(1, args);
 
 
-#if 0
     args[0]="schedbench";
     schedbench_main(1, args);
     args[0]="syncbench";
     syncbench_main(1, args);
-#endif
 
     nk_openmp_thread_deinit();
 